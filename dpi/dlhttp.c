@@ -0,0 +1,919 @@
+/*
+ * File: dlhttp.c
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Native HTTP fetcher for the downloads dpi.
+ *
+ * Plain http:// URLs are fetched over non-blocking sockets multiplexed
+ * with poll(). An interrupted transfer is resumed with a Range request,
+ * and a large file may be fetched as several byte ranges in parallel.
+ * Every range but the first goes to a "<target>.part-<start>-<end>" file
+ * next to the target, so what's left to do can always be found on disk;
+ * the parts are appended to the target once all of them are complete.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "../dlib/dlib.h"
+#include "dlhttp.h"
+
+#define DL_MAX_SEGMENTS   8
+#define DL_SEGMENT_MIN    (1024 * 1024) /* don't split into smaller ranges */
+#define DL_MAX_RETRIES    5
+#define DL_RETRY_DELAY    1             /* seconds */
+#define DL_MAX_REDIRECTS  10
+#define DL_MAX_HEADER     (64 * 1024)
+#define DL_BUF_SIZE       (64 * 1024)
+#define DL_READS_PER_TURN 16            /* let the other ranges have a go */
+
+/* Exit codes, as wget's */
+#define DL_ERR_GENERIC    1
+#define DL_ERR_FILE       3
+#define DL_ERR_NETWORK    4
+#define DL_ERR_SERVER     8
+
+typedef enum {
+   SEG_IDLE,            /* waiting to (re)connect */
+   SEG_CONNECTING,
+   SEG_SENDING,
+   SEG_HEADER,
+   SEG_BODY,
+   SEG_DONE,
+   SEG_DROPPED          /* to be freed */
+} DlSegState_t;
+
+typedef struct {
+   char *host;
+   int port;
+   char *hostport;      /* for the Host header */
+   char *path;          /* path and query */
+} DlUrl_t;
+
+/* A byte range being fetched over its own connection */
+typedef struct {
+   DlSegState_t state;
+   int sock;
+   Dstr *buf;           /* request being sent, then the response header */
+   int sent;
+   off_t start, end;    /* [start, end); end < 0 while unknown */
+   off_t pos;           /* next byte to get */
+   int file_fd;
+   char *part;          /* part file name; NULL when writing to the target */
+   int retries;
+   int addr_idx;
+   time_t retry_at;
+} DlSeg_t;
+
+typedef struct {
+   DlUrl_t url;
+   struct addrinfo *addrs;
+   int n_addrs;
+   const char *target;
+   int segments;
+   int log_fd;
+   Dlist *segs;         /* the first one writes to the target */
+   off_t total;         /* file size, or -1 */
+   int ranges;          /* does the server honour Range? */
+   int started;         /* the first answer has been checked */
+   int status;          /* 0 or DL_ERR_* */
+   char *location;      /* redirected there */
+} Dl_t;
+
+/*
+ * Report progress, wget style.
+ */
+static void Dlhttp_log(Dl_t *dl, const char *format, ...)
+{
+   char buf[1024];
+   va_list argp;
+   int n;
+
+   if (dl->log_fd < 0)
+      return;
+   va_start(argp, format);
+   n = vsnprintf(buf, sizeof(buf), format, argp);
+   va_end(argp);
+   if (n > 0 && write(dl->log_fd, buf, MIN(n, (int)sizeof(buf) - 1)) < 0)
+      dl->log_fd = -1;
+}
+
+/*
+ * Split an http URL. Return: 0 on success, -1 if we can't handle it.
+ */
+static int Dlhttp_url_parse(const char *str, DlUrl_t *u)
+{
+   const char *auth, *auth_end, *host_end, *p;
+   char *query;
+
+   memset(u, 0, sizeof(*u));
+   if (dStrnAsciiCasecmp(str, "http://", 7))
+      return -1;
+   auth = str + 7;
+   auth_end = auth + strcspn(auth, "/?#");
+   /* user:password@ is left to wget */
+   if (memchr(auth, '@', auth_end - auth))
+      return -1;
+
+   if (*auth == '[') {
+      if (!(host_end = memchr(auth, ']', auth_end - auth)))
+         return -1;
+      u->host = dStrndup(auth + 1, host_end - auth - 1);
+      p = host_end + 1;
+   } else {
+      host_end = memchr(auth, ':', auth_end - auth);
+      p = host_end ? host_end : auth_end;
+      u->host = dStrndup(auth, p - auth);
+   }
+   u->port = (p < auth_end && *p == ':') ? strtol(p + 1, NULL, 10) : 80;
+   u->hostport = dStrndup(auth, auth_end - auth);
+
+   query = dStrndup(auth_end, strcspn(auth_end, "#"));
+   u->path = (*query == '/') ? dStrdup(query) : dStrconcat("/", query, NULL);
+   dFree(query);
+
+   return (*u->host && u->port > 0 && u->port <= 65535) ? 0 : -1;
+}
+
+static void Dlhttp_url_free(DlUrl_t *u)
+{
+   dFree(u->host);
+   dFree(u->hostport);
+   dFree(u->path);
+}
+
+/*
+ * Return the absolute URL for a Location header received from 'u'.
+ */
+static char *Dlhttp_url_resolve(const DlUrl_t *u, const char *loc)
+{
+   char *dir, *ret;
+   size_t scheme_len = strspn(loc, "abcdefghijklmnopqrstuvwxyz"
+                                   "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+.-");
+
+   if (scheme_len && loc[scheme_len] == ':')
+      return dStrdup(loc);
+   if (loc[0] == '/' && loc[1] == '/')
+      return dStrconcat("http:", loc, NULL);
+   if (loc[0] == '/')
+      return dStrconcat("http://", u->hostport, loc, NULL);
+
+   /* relative to the current directory */
+   dir = dStrndup(u->path, strcspn(u->path, "?"));
+   *(strrchr(dir, '/') + 1) = '\0';
+   ret = dStrconcat("http://", u->hostport, dir, loc, NULL);
+   dFree(dir);
+   return ret;
+}
+
+/*
+ * Return the "Cookie:" header line for 'u' from ~/.dillo/cookies.txt
+ * (as wget's --load-cookies would), or NULL.
+ */
+static char *Dlhttp_cookies(const DlUrl_t *u)
+{
+   char line[4096], *filename, *ret = NULL;
+   Dstr *ds = dStr_new("");
+   time_t now = time(NULL);
+   FILE *f;
+
+   filename = dStrconcat(dGethomedir(), "/.dillo/cookies.txt", NULL);
+   if ((f = fopen(filename, "r"))) {
+      while (fgets(line, sizeof(line), f)) {
+         char *p = line, *domain, *subdomains, *path, *secure, *expiry, *name;
+         size_t dlen, hlen = strlen(u->host);
+
+         dStrstrip(line);
+         if (!line[0] || line[0] == '#')
+            continue;
+         domain = dStrsep(&p, "\t");
+         subdomains = dStrsep(&p, "\t");
+         path = dStrsep(&p, "\t");
+         secure = dStrsep(&p, "\t");
+         expiry = dStrsep(&p, "\t");
+         name = dStrsep(&p, "\t");
+         if (!p || secure[0] == 'T' || strtol(expiry, NULL, 10) < now ||
+             strncmp(u->path, path, strlen(path)))
+            continue;
+
+         if (*domain == '.')
+            domain++;
+         dlen = strlen(domain);
+         if (dStrAsciiCasecmp(u->host, domain) &&
+             (subdomains[0] == 'F' || hlen <= dlen ||
+              u->host[hlen - dlen - 1] != '.' ||
+              dStrAsciiCasecmp(u->host + hlen - dlen, domain)))
+            continue;
+
+         dStr_sprintfa(ds, "%s%s=%s", ds->len ? "; " : "", name, p);
+      }
+      fclose(f);
+   }
+   if (ds->len)
+      ret = dStrconcat("Cookie: ", ds->str, "\r\n", NULL);
+   dStr_free(ds, 1);
+   dFree(filename);
+   return ret;
+}
+
+static DlSeg_t *Dlhttp_seg_new(off_t start, off_t end)
+{
+   DlSeg_t *s = dNew0(DlSeg_t, 1);
+
+   s->state = SEG_IDLE;
+   s->sock = -1;
+   s->file_fd = -1;
+   s->buf = dStr_new("");
+   s->start = s->pos = start;
+   s->end = end;
+   return s;
+}
+
+static void Dlhttp_seg_close(DlSeg_t *s)
+{
+   if (s->sock >= 0) {
+      dClose(s->sock);
+      s->sock = -1;
+   }
+}
+
+static void Dlhttp_seg_free(DlSeg_t *s)
+{
+   Dlhttp_seg_close(s);
+   if (s->file_fd >= 0)
+      dClose(s->file_fd);
+   dStr_free(s->buf, 1);
+   dFree(s->part);
+   dFree(s);
+}
+
+static int Dlhttp_seg_cmp(const void *v1, const void *v2)
+{
+   const DlSeg_t *s1 = v1, *s2 = v2;
+
+   return (s1->start > s2->start) - (s1->start < s2->start);
+}
+
+/*
+ * Find the part files of an earlier, segmented attempt on 'target', and
+ * add a range for each to 'segs' (if not NULL).
+ * Return: their sizes, plus that of 'target', in bytes.
+ */
+static off_t Dlhttp_parts_scan(const char *target, Dlist *segs)
+{
+   const char *p = strrchr(target, '/'), *base = p ? p + 1 : target;
+   char *dir = p ? dStrndup(target, p - target + 1) : dStrdup("./");
+   size_t blen = strlen(base);
+   off_t size = 0;
+   struct dirent *e;
+   struct stat st;
+   DIR *d;
+
+   if (stat(target, &st) == 0)
+      size += st.st_size;
+
+   if ((d = opendir(dir))) {
+      while ((e = readdir(d))) {
+         long long start, end;
+         char *part;
+         int n = 0;
+
+         if (strncmp(e->d_name, base, blen) ||
+             sscanf(e->d_name + blen, ".part-%lld-%lld%n",
+                    &start, &end, &n) != 2 ||
+             e->d_name[blen + n] != '\0' || start < 0 || start >= end)
+            continue;
+
+         part = dStrconcat(dir, e->d_name, NULL);
+         if (stat(part, &st) == 0) {
+            size += st.st_size;
+            if (segs) {
+               DlSeg_t *s = Dlhttp_seg_new(start, end);
+
+               s->part = part;
+               s->pos = start + MIN(st.st_size, end - start);
+               dList_insert_sorted(segs, s, Dlhttp_seg_cmp);
+               part = NULL;
+            }
+         }
+         dFree(part);
+      }
+      closedir(d);
+   }
+   dFree(dir);
+   return size;
+}
+
+off_t a_Dlhttp_downloaded(const char *target)
+{
+   return Dlhttp_parts_scan(target, NULL);
+}
+
+/*
+ * Open the file that 's' writes to.
+ */
+static int Dlhttp_seg_open(Dl_t *dl, DlSeg_t *s, int flags)
+{
+   const char *name = s->part ? s->part : dl->target;
+
+   if ((s->file_fd = open(name, O_WRONLY | O_CREAT | flags, 0666)) < 0) {
+      Dlhttp_log(dl, "Cannot write to '%s' (%s).\n", name, dStrerror(errno));
+      dl->status = DL_ERR_FILE;
+      return -1;
+   }
+   return 0;
+}
+
+/*
+ * Forget about the part files and start over from the first byte.
+ */
+static void Dlhttp_start_over(Dl_t *dl, DlSeg_t *head)
+{
+   DlSeg_t *s;
+   int i;
+
+   for (i = 1; (s = dList_nth_data(dl->segs, i)); i++) {
+      if (s->state != SEG_DROPPED) {
+         Dlhttp_seg_close(s);
+         unlink(s->part);
+         s->state = SEG_DROPPED;
+      }
+   }
+   if (ftruncate(head->file_fd, 0) < 0)
+      dl->status = DL_ERR_FILE;
+   head->pos = head->start = 0;
+   head->end = -1;
+}
+
+/*
+ * Fetch the rest of the file in several ranges, if it's worth it.
+ */
+static void Dlhttp_split(Dl_t *dl, DlSeg_t *head)
+{
+   off_t rest = dl->total - head->pos, start, end;
+   int i, n;
+
+   if (!dl->ranges || dl->total < 0 || dList_length(dl->segs) > 1)
+      return;
+   n = MIN(MIN(dl->segments, DL_MAX_SEGMENTS), rest / DL_SEGMENT_MIN);
+   if (n < 2)
+      return;
+
+   head->end = head->pos + rest / n;
+   for (i = 1; i < n && !dl->status; i++) {
+      DlSeg_t *s;
+      char part[48];
+
+      start = head->pos + rest * i / n;
+      end = (i + 1 < n) ? head->pos + rest * (i + 1) / n : dl->total;
+      snprintf(part, sizeof(part), ".part-%lld-%lld",
+               (long long)start, (long long)end);
+      s = Dlhttp_seg_new(start, end);
+      s->part = dStrconcat(dl->target, part, NULL);
+      dList_append(dl->segs, s);
+      Dlhttp_seg_open(dl, s, O_TRUNC);
+   }
+   Dlhttp_log(dl, "Fetching it in %d parallel ranges.\n", n);
+}
+
+/*
+ * The connection for 's' broke. Try again later if we can.
+ */
+static void Dlhttp_seg_fail(Dl_t *dl, DlSeg_t *s, const char *why)
+{
+   Dlhttp_seg_close(s);
+   Dlhttp_log(dl, "%s at byte %lld.\n", why, (long long)s->pos);
+
+   if (s->retries++ >= DL_MAX_RETRIES) {
+      dl->status = DL_ERR_NETWORK;
+      return;
+   }
+   /* A server that can't resume answers 200, and we start over then */
+   s->state = SEG_IDLE;
+   s->addr_idx++;
+   s->retry_at = time(NULL) + DL_RETRY_DELAY;
+   Dlhttp_log(dl, "Retrying in %d s.\n", DL_RETRY_DELAY);
+}
+
+static void Dlhttp_seg_done(DlSeg_t *s)
+{
+   Dlhttp_seg_close(s);
+   s->end = s->pos;
+   s->state = SEG_DONE;
+}
+
+/*
+ * Start the request for what's missing of 's'.
+ */
+static void Dlhttp_seg_connect(Dl_t *dl, DlSeg_t *s)
+{
+   struct addrinfo *ai = dl->addrs;
+   char *cookies;
+   int i;
+
+   for (i = s->addr_idx % dl->n_addrs; i > 0; i--)
+      ai = ai->ai_next;
+
+   if ((s->sock = socket(ai->ai_family, ai->ai_socktype,
+                         ai->ai_protocol)) < 0) {
+      Dlhttp_seg_fail(dl, s, dStrerror(errno));
+      return;
+   }
+   fcntl(s->sock, F_SETFL, O_NONBLOCK | fcntl(s->sock, F_GETFL));
+   fcntl(s->sock, F_SETFD, FD_CLOEXEC | fcntl(s->sock, F_GETFD));
+   if (connect(s->sock, ai->ai_addr, ai->ai_addrlen) < 0 &&
+       errno != EINPROGRESS) {
+      Dlhttp_seg_fail(dl, s, dStrerror(errno));
+      return;
+   }
+   if (s == dList_nth_data(dl->segs, 0))
+      Dlhttp_log(dl, "Connecting to %s:%d...\n", dl->url.host, dl->url.port);
+
+   /* HTTP/1.0 keeps chunked encoding away */
+   dStr_sprintf(s->buf, "GET %s HTTP/1.0\r\n"
+                        "Host: %s\r\n"
+                        "User-Agent: Dillo-downloads\r\n"
+                        "Accept: */*\r\n"
+                        "Connection: close\r\n",
+                dl->url.path, dl->url.hostport);
+   if (s->end >= 0)
+      dStr_sprintfa(s->buf, "Range: bytes=%lld-%lld\r\n",
+                    (long long)s->pos, (long long)s->end - 1);
+   else if (s->pos > 0)
+      dStr_sprintfa(s->buf, "Range: bytes=%lld-\r\n", (long long)s->pos);
+   if ((cookies = Dlhttp_cookies(&dl->url))) {
+      dStr_append(s->buf, cookies);
+      dFree(cookies);
+   }
+   dStr_append(s->buf, "\r\n");
+   s->sent = 0;
+   s->state = SEG_CONNECTING;
+}
+
+/*
+ * Return the value of header field 'name' in 'hdr', or NULL.
+ */
+static char *Dlhttp_header_get(const char *hdr, const char *name)
+{
+   size_t len = strlen(name);
+   const char *p;
+
+   for (p = strchr(hdr, '\n'); p; p = strchr(p, '\n')) {
+      p++;
+      if (!dStrnAsciiCasecmp(p, name, len) && p[len] == ':') {
+         p += len + 1;
+         p += strspn(p, " \t");
+         return dStrndup(p, strcspn(p, "\r\n"));
+      }
+   }
+   return NULL;
+}
+
+/*
+ * Check the answer to the request of 's'.
+ * Return: 0 to go on with the body, -1 to stop.
+ */
+static int Dlhttp_seg_header(Dl_t *dl, DlSeg_t *s, const char *hdr)
+{
+   int status = 0, head = (s == dList_nth_data(dl->segs, 0));
+   long long a = -1, b = -1, total = -1;
+   char *val;
+
+   sscanf(hdr, "HTTP/%*d.%*d %d", &status);
+   if (head && !dl->started)
+      Dlhttp_log(dl, "HTTP request sent, awaiting response... %.*s\n",
+                 (int)strcspn(hdr + strcspn(hdr, " ") + 1, "\r\n"),
+                 hdr + strcspn(hdr, " ") + 1);
+
+   if ((val = Dlhttp_header_get(hdr, "Accept-Ranges"))) {
+      if (strstr(val, "bytes"))
+         dl->ranges = 1;
+      dFree(val);
+   }
+
+   if (status >= 300 && status < 400 &&
+       (val = Dlhttp_header_get(hdr, "Location"))) {
+      if (head && !dl->started) {
+         dl->location = val;
+         Dlhttp_log(dl, "Location: %s [following]\n", val);
+      } else {
+         Dlhttp_log(dl, "Unexpected redirection to %s.\n", val);
+         dl->status = DL_ERR_SERVER;
+         dFree(val);
+      }
+      return -1;
+
+   } else if (status == 206) {
+      if ((val = Dlhttp_header_get(hdr, "Content-Range")))
+         sscanf(val, "bytes %lld-%lld/%lld", &a, &b, &total);
+      if (a != s->pos || b < a) {
+         Dlhttp_log(dl, "Bad Content-Range: %s\n", val ? val : "(none)");
+         dFree(val);
+         dl->status = DL_ERR_SERVER;
+         return -1;
+      }
+      dFree(val);
+      dl->ranges = 1;
+      if (total >= 0 && dl->total < 0)
+         dl->total = total;
+      if (s->end < 0)
+         s->end = b + 1;
+
+   } else if (status == 200) {
+      if (!head) {
+         Dlhttp_log(dl, "The server ignored a range request.\n");
+         dl->status = DL_ERR_SERVER;
+         return -1;
+      }
+      if (s->pos > 0 || dList_length(dl->segs) > 1) {
+         Dlhttp_log(dl, "The server can't resume; starting over.\n");
+         dl->ranges = 0;
+         Dlhttp_start_over(dl, s);
+      }
+      if ((val = Dlhttp_header_get(hdr, "Content-Length"))) {
+         dl->total = strtoll(val, NULL, 10);
+         s->end = dl->total;
+         dFree(val);
+      }
+
+   } else if (status == 416 && head && !dl->started && s->pos > 0 &&
+              dList_length(dl->segs) == 1) {
+      /* We asked for what follows the end of the file: it's all here */
+      Dlhttp_log(dl, "The file is already fully retrieved.\n");
+      dl->total = s->pos;
+      dl->started = 1;
+      Dlhttp_seg_done(s);
+      return -1;
+
+   } else {
+      Dlhttp_log(dl, "ERROR %d.\n", status);
+      dl->status = DL_ERR_SERVER;
+      return -1;
+   }
+
+   if (head && !dl->started) {
+      dl->started = 1;
+      if (dl->total < 0)
+         Dlhttp_log(dl, "Length: unspecified\n");
+      else
+         Dlhttp_log(dl, "Length: %lld (%lld remaining)\n",
+                    (long long)dl->total, (long long)(dl->total - s->pos));
+      Dlhttp_split(dl, s);
+   }
+   if (s->end >= 0 && s->pos >= s->end) {
+      Dlhttp_seg_done(s);
+      return -1;
+   }
+   return 0;
+}
+
+/*
+ * Store body bytes for 's'.
+ */
+static void Dlhttp_seg_data(Dl_t *dl, DlSeg_t *s, const char *buf, off_t len)
+{
+   off_t base = s->part ? s->start : 0;
+   ssize_t n;
+
+   if (s->end >= 0 && len > s->end - s->pos)
+      len = s->end - s->pos;
+   while (len > 0) {
+      if ((n = pwrite(s->file_fd, buf, len, s->pos - base)) < 0) {
+         if (errno == EINTR)
+            continue;
+         Dlhttp_log(dl, "Write error (%s).\n", dStrerror(errno));
+         dl->status = DL_ERR_FILE;
+         return;
+      }
+      s->pos += n;
+      buf += n;
+      len -= n;
+   }
+   if (s->end >= 0 && s->pos >= s->end)
+      Dlhttp_seg_done(s);
+}
+
+/*
+ * The server closed the connection of 's'.
+ */
+static void Dlhttp_seg_eof(Dl_t *dl, DlSeg_t *s)
+{
+   if (s->state == SEG_BODY && s->end < 0) {
+      /* length unknown: that was it */
+      Dlhttp_seg_done(s);
+      dl->total = s->pos;
+   } else {
+      Dlhttp_seg_fail(dl, s, s->state == SEG_HEADER ? "No answer"
+                                                    : "Connection closed");
+   }
+}
+
+/*
+ * Receive what arrived for 's'.
+ */
+static void Dlhttp_seg_read(Dl_t *dl, DlSeg_t *s)
+{
+   char buf[DL_BUF_SIZE], *end;
+   int i, hlen;
+   ssize_t n;
+
+   for (i = 0; i < DL_READS_PER_TURN && !dl->status &&
+        (s->state == SEG_HEADER || s->state == SEG_BODY); i++) {
+      if ((n = recv(s->sock, buf, sizeof(buf), 0)) < 0) {
+         if (errno == EINTR)
+            continue;
+         if (errno != EAGAIN && errno != EWOULDBLOCK)
+            Dlhttp_seg_fail(dl, s, dStrerror(errno));
+         break;
+      } else if (n == 0) {
+         Dlhttp_seg_eof(dl, s);
+         break;
+      } else if (s->state == SEG_BODY) {
+         Dlhttp_seg_data(dl, s, buf, n);
+         continue;
+      }
+
+      dStr_append_l(s->buf, buf, n);
+      if ((end = strstr(s->buf->str, "\r\n\r\n"))) {
+         hlen = end + 4 - s->buf->str;
+      } else if ((end = strstr(s->buf->str, "\n\n"))) {
+         hlen = end + 2 - s->buf->str;
+      } else {
+         if (s->buf->len > DL_MAX_HEADER)
+            Dlhttp_seg_fail(dl, s, "Bad answer");
+         continue;
+      }
+      end[0] = '\0';
+      if (Dlhttp_seg_header(dl, s, s->buf->str) == 0) {
+         s->state = SEG_BODY;
+         Dlhttp_seg_data(dl, s, s->buf->str + hlen, s->buf->len - hlen);
+      } else if (s->state != SEG_DONE && s->state != SEG_IDLE) {
+         Dlhttp_seg_close(s);
+         if (s->state != SEG_DROPPED)
+            s->state = SEG_IDLE;
+      }
+      dStr_truncate(s->buf, 0);
+   }
+}
+
+/*
+ * Handle poll() events for 's'.
+ */
+static void Dlhttp_seg_io(Dl_t *dl, DlSeg_t *s)
+{
+   int err = 0;
+   socklen_t len = sizeof(err);
+   ssize_t n;
+
+   if (s->state == SEG_CONNECTING) {
+      if (getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+         err = errno;
+      if (err) {
+         Dlhttp_seg_fail(dl, s, dStrerror(err));
+         return;
+      }
+      s->state = SEG_SENDING;
+   }
+   if (s->state == SEG_SENDING) {
+      n = send(s->sock, s->buf->str + s->sent, s->buf->len - s->sent,
+               MSG_NOSIGNAL);
+      if (n < 0) {
+         if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)
+            Dlhttp_seg_fail(dl, s, dStrerror(errno));
+      } else if ((s->sent += n) == s->buf->len) {
+         dStr_truncate(s->buf, 0);
+         s->state = SEG_HEADER;
+      }
+   } else if (s->state == SEG_HEADER || s->state == SEG_BODY) {
+      Dlhttp_seg_read(dl, s);
+   }
+}
+
+/*
+ * Append the part files to the target, in order.
+ */
+static void Dlhttp_parts_join(Dl_t *dl)
+{
+   DlSeg_t *head = dList_nth_data(dl->segs, 0), *s;
+   char buf[DL_BUF_SIZE];
+   off_t pos = head->end;
+   ssize_t n;
+   int i, fd;
+
+   for (i = 1; !dl->status && (s = dList_nth_data(dl->segs, i)); i++) {
+      if (s->state == SEG_DROPPED)
+         continue;
+      if (s->start != pos || (fd = open(s->part, O_RDONLY)) < 0) {
+         Dlhttp_log(dl, "Cannot join '%s'.\n", s->part);
+         dl->status = DL_ERR_FILE;
+         break;
+      }
+      while (pos < s->end &&
+             (n = read(fd, buf, MIN((off_t)sizeof(buf), s->end - pos))) > 0) {
+         if (pwrite(head->file_fd, buf, n, pos) != n) {
+            dl->status = DL_ERR_FILE;
+            break;
+         }
+         pos += n;
+      }
+      dClose(fd);
+      if (pos != s->end) {
+         Dlhttp_log(dl, "Cannot join '%s'.\n", s->part);
+         dl->status = DL_ERR_FILE;
+      } else {
+         unlink(s->part);
+      }
+   }
+}
+
+/*
+ * Drive all the ranges until the file is complete or something fails.
+ */
+static void Dlhttp_run(Dl_t *dl)
+{
+   struct pollfd fds[DL_MAX_SEGMENTS];
+   DlSeg_t *polled[DL_MAX_SEGMENTS], *s;
+   int i, n, pending;
+
+   while (!dl->status && !dl->location) {
+      time_t now = time(NULL);
+
+      /* free what was dropped, and connect what's due */
+      for (i = 0; (s = dList_nth_data(dl->segs, i)); i++) {
+         if (s->state == SEG_DROPPED) {
+            dList_remove(dl->segs, s);
+            Dlhttp_seg_free(s);
+            i--;
+         }
+      }
+      for (i = n = pending = 0;
+           !dl->status && (s = dList_nth_data(dl->segs, i)); i++) {
+         if (s->state == SEG_DONE)
+            continue;
+         pending++;
+         /* The others wait until the first answer is known to be right */
+         if (s->state == SEG_IDLE && s->retry_at <= now &&
+             (i == 0 || dl->started))
+            Dlhttp_seg_connect(dl, s);
+         if (s->state != SEG_IDLE && n < DL_MAX_SEGMENTS) {
+            fds[n].fd = s->sock;
+            fds[n].events = (s->state == SEG_CONNECTING ||
+                             s->state == SEG_SENDING) ? POLLOUT : POLLIN;
+            fds[n].revents = 0;
+            polled[n++] = s;
+         }
+      }
+      if (!pending || dl->status)
+         break;
+
+      if (poll(fds, n, 1000) < 0 && errno != EINTR) {
+         dl->status = DL_ERR_GENERIC;
+         break;
+      }
+      for (i = 0; i < n && !dl->status && !dl->location; i++)
+         if (fds[i].revents && polled[i]->state != SEG_DROPPED)
+            Dlhttp_seg_io(dl, polled[i]);
+   }
+   if (!dl->status && !dl->location) {
+      Dlhttp_parts_join(dl);
+      if (!dl->status)
+         Dlhttp_log(dl, "'%s' saved [%lld]\n", dl->target,
+                    (long long)a_Dlhttp_downloaded(dl->target));
+   }
+}
+
+/*
+ * Set up the ranges that are left of an earlier attempt.
+ */
+static void Dlhttp_init_segs(Dl_t *dl)
+{
+   DlSeg_t *head = Dlhttp_seg_new(0, -1), *first;
+   struct stat st;
+   int n;
+
+   dl->segs = dList_new(DL_MAX_SEGMENTS);
+   Dlhttp_parts_scan(dl->target, dl->segs);
+   if ((n = dList_length(dl->segs)) > 0) {
+      first = dList_nth_data(dl->segs, 0);
+      head->end = first->start;
+      dl->total = ((DlSeg_t *)dList_nth_data(dl->segs, n - 1))->end;
+      dl->ranges = 1;
+   }
+   dList_prepend(dl->segs, head);
+   if (Dlhttp_seg_open(dl, head, 0) < 0)
+      return;
+   if (fstat(head->file_fd, &st) == 0) {
+      head->pos = (head->end >= 0) ? MIN(st.st_size, head->end) : st.st_size;
+      if (head->pos > 0)
+         Dlhttp_log(dl, "Resuming at byte %lld.\n", (long long)head->pos);
+   }
+
+   for (n = 0; (first = dList_nth_data(dl->segs, n)); n++) {
+      if (first->part && Dlhttp_seg_open(dl, first, 0) < 0)
+         return;
+      if (first->end >= 0 && first->pos >= first->end)
+         first->state = SEG_DONE;
+   }
+   if (head->state == SEG_DONE) {
+      /* nothing left to ask for the first range; go on with the others */
+      dl->started = 1;
+      Dlhttp_log(dl, "Length: %lld (%lld remaining)\n", (long long)dl->total,
+                 (long long)(dl->total - a_Dlhttp_downloaded(dl->target)));
+   }
+}
+
+static void Dlhttp_free(Dl_t *dl)
+{
+   DlSeg_t *s;
+
+   while ((s = dList_nth_data(dl->segs, 0))) {
+      dList_remove_fast(dl->segs, s);
+      Dlhttp_seg_free(s);
+   }
+   dList_free(dl->segs);
+   if (dl->addrs)
+      freeaddrinfo(dl->addrs);
+   Dlhttp_url_free(&dl->url);
+}
+
+int a_Dlhttp_supported(const char *url)
+{
+   DlUrl_t u;
+   int ret = (Dlhttp_url_parse(url, &u) == 0 &&
+              !getenv("http_proxy") && !getenv("HTTP_PROXY"));
+
+   Dlhttp_url_free(&u);
+   return ret;
+}
+
+int a_Dlhttp_fetch(const char *url, const char *target, int segments,
+                   int log_fd)
+{
+   char port[16], *cur = dStrdup(url), *next;
+   struct addrinfo hints, *ai;
+   int i, ret = DL_ERR_SERVER, err;
+   Dl_t dl;
+
+   for (i = 0; i <= DL_MAX_REDIRECTS; i++) {
+      memset(&dl, 0, sizeof(dl));
+      dl.target = target;
+      dl.segments = segments;
+      dl.log_fd = log_fd;
+      dl.total = -1;
+      if (Dlhttp_url_parse(cur, &dl.url) < 0) {
+         Dlhttp_url_free(&dl.url);
+         ret = DLHTTP_UNSUPPORTED;
+         break;
+      }
+
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_UNSPEC;
+      hints.ai_socktype = SOCK_STREAM;
+      snprintf(port, sizeof(port), "%d", dl.url.port);
+      Dlhttp_log(&dl, "Resolving %s...\n", dl.url.host);
+      if ((err = getaddrinfo(dl.url.host, port, &hints, &dl.addrs))) {
+         Dlhttp_log(&dl, "Cannot resolve %s (%s).\n", dl.url.host,
+                    gai_strerror(err));
+         dl.addrs = NULL;
+         dl.segs = dList_new(1);
+         Dlhttp_free(&dl);
+         ret = DL_ERR_NETWORK;
+         break;
+      }
+      for (ai = dl.addrs; ai; ai = ai->ai_next)
+         dl.n_addrs++;
+
+      Dlhttp_init_segs(&dl);
+      if (!dl.status)
+         Dlhttp_run(&dl);
+      ret = dl.status;
+      next = dl.location ? Dlhttp_url_resolve(&dl.url, dl.location) : NULL;
+      dFree(dl.location);
+      Dlhttp_free(&dl);
+      if (!next)
+         break;
+      dFree(cur);
+      cur = next;
+      ret = DL_ERR_SERVER; /* in case there are too many redirections */
+   }
+   dFree(cur);
+   return ret;
+}
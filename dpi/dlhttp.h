@@ -0,0 +1,51 @@
+/*
+ * File: dlhttp.h
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+/*
+ * Native HTTP fetcher for the downloads dpi.
+ */
+
+#ifndef __DLHTTP_H__
+#define __DLHTTP_H__
+
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* a_Dlhttp_fetch() can't handle this URL (another program has to) */
+#define DLHTTP_UNSUPPORTED -1
+
+/*
+ * Can a_Dlhttp_fetch() try this URL?
+ * (plain http, and no proxy configured in the environment)
+ */
+int a_Dlhttp_supported(const char *url);
+
+/*
+ * Download 'url' into 'target', resuming whatever a previous attempt left
+ * on disk. If the server honours ranges and the file is large, up to
+ * 'segments' ranges are fetched in parallel. Progress messages go to
+ * 'log_fd' (if not -1).
+ * Return: 0 on success, DLHTTP_UNSUPPORTED, or a positive error code.
+ */
+int a_Dlhttp_fetch(const char *url, const char *target, int segments,
+                   int log_fd);
+
+/*
+ * How many bytes of 'target' are on disk, counting unfinished ranges.
+ */
+off_t a_Dlhttp_downloaded(const char *target);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* __DLHTTP_H__ */
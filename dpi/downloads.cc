@@ -42,6 +42,7 @@
 #include <FL/Fl_Button.H>
 
 #include "dpiutil.h"
+#include "dlhttp.h"
 #include "../dpip/dpip.h"
 
 /*
@@ -50,6 +51,11 @@
 #define _MSG(...)
 #define MSG(...)  printf("[downloads dpi]: " __VA_ARGS__)
 
+/*
+ * How many ranges of a large file to fetch in parallel (for plain http)
+ */
+#define DL_SEGMENTS 4
+
 /*
  * Class declarations
  */
@@ -98,6 +104,8 @@ class DLItem {
    int LogPipe[2];
    char *shortname, *fullname;
    char *target_dir;
+   char *url;
+   bool native;            // fetched with a_Dlhttp_fetch() instead of wget
    size_t log_len, log_max;
    int log_state;
    char *log_text;
@@ -282,7 +290,6 @@ static void prButton_scb(Fl_Widget *, void *cb_data)
 
 DLItem::DLItem(const char *full_filename, const char *url)
 {
-   struct stat ss;
    const char *p;
    char *esc_url;
 
@@ -299,6 +306,8 @@ DLItem::DLItem(const char *full_filename, const char *url)
    shortname = (p) ? dStrdup(p + 1) : dStrdup("??");
    p = strrchr(full_filename, '/');
    target_dir= p ? dStrndup(full_filename,p-full_filename+1) : dStrdup("??");
+   this->url = dStrdup(url);
+   native = a_Dlhttp_supported(url);
 
    log_len = 0;
    log_max = 0;
@@ -321,8 +330,7 @@ DLItem::DLItem(const char *full_filename, const char *url)
    dl_argv = new char*[8];
    int i = 0;
    dl_argv[i++] = (char*)"wget";
-   if (stat(fullname, &ss) == 0)
-      init_bytesize = (int)ss.st_size;
+   init_bytesize = (int)a_Dlhttp_downloaded(fullname);
    dl_argv[i++] = (char*)"-c";
    dl_argv[i++] = (char*)"--load-cookies";
    dl_argv[i++] = dStrconcat(dGethomedir(), "/.dillo/cookies.txt", NULL);
@@ -426,6 +434,7 @@ DLItem::~DLItem()
    free(shortname);
    dFree(fullname);
    dFree(target_dir);
+   dFree(url);
    free(log_text);
    int idx = (strcmp(dl_argv[1], "-c")) ? 2 : 3;
    dFree(dl_argv[idx]);
@@ -465,6 +474,12 @@ void DLItem::child_init()
    dup2(LogPipe[1], 2); // stderr
    // set the locale to C for log parsing
    setenv("LC_ALL", "C", 1);
+   if (native) {
+      // Resumes and splits large files by itself; its log reads like wget's
+      int st = a_Dlhttp_fetch(url, fullname, DL_SEGMENTS, 2);
+      if (st != DLHTTP_UNSUPPORTED)
+         _exit(st);
+   }
    // start wget
    execvp(dl_argv[0], dl_argv);
 }
@@ -686,7 +701,6 @@ static void secs2timestr(int et, char *str)
  */
 void DLItem::update()
 {
-   struct stat ss;
    time_t curr_time;
    float csec, tsec, rate, _rate = 0;
    char str[64];
@@ -695,12 +709,8 @@ void DLItem::update()
    if (updates_done())
       return;
 
-   /* Update curr_size */
-   if (stat(fullname, &ss) == -1) {
-      MSG("stat, %s\n", dStrerror(errno));
-      return;
-   }
-   update_size((int)ss.st_size);
+   /* Update curr_size (with the unfinished ranges too) */
+   update_size((int)a_Dlhttp_downloaded(fullname));
 
    /* Get current time */
    time(&curr_time);
@@ -24,6 +24,10 @@
 #include <FL/fl_draw.H>
 #include <math.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #define IMAGE_MAX_AREA (6000 * 6000)
 
 #define MAX_WIDTH 0x8000
@@ -40,6 +44,8 @@ const enum ScaleMode { SIMPLE, BEAUTIFUL, BEAUTIFUL_GAMMA }
 Vector <FltkImgbuf::GammaCorrectionTable> *FltkImgbuf::gammaCorrectionTables
    = new Vector <FltkImgbuf::GammaCorrectionTable> (true, 2);
 
+FltkImgbuf::UpscaleMode FltkImgbuf::upscaleMode = FltkImgbuf::UPSCALE_SIMPLE;
+
 uchar *FltkImgbuf::findGammaCorrectionTable (double gamma)
 {
    // Since the number of possible keys is low, a linear search is
@@ -125,6 +131,9 @@ void FltkImgbuf::init (Type type, int width, int height, double gamma,
       this->width = width;
       this->height = height;
       this->gamma = gamma;
+      this->bilinear = root && root->rawdata &&
+                       upscaleMode == UPSCALE_BILINEAR &&
+                       width >= root->width && height >= root->height;
 
       DBG_OBJ_SET_NUM ("width", width);
       DBG_OBJ_SET_NUM ("height", height);
@@ -159,9 +168,15 @@ void FltkImgbuf::init (Type type, int width, int height, double gamma,
 
       if (!isRoot()) {
          // Scaling
-         for (int row = 0; row < root->height; row++) {
-            if (root->copiedRows->get (row))
-               scaleRow (row, root->rawdata + row*root->width*root->bpp);
+         if (root->rawdata == NULL)
+            scaleFromLargest ();
+         else if (bilinear)
+            scaleRowsBilinear (0, height);
+         else {
+            for (int row = 0; row < root->height; row++) {
+               if (root->copiedRows->get (row))
+                  scaleRow (row, root->rawdata + row*root->width*root->bpp);
+            }
          }
       }
    }
@@ -208,7 +223,11 @@ void FltkImgbuf::setCMap (int *colors, int num_colors)
 inline void FltkImgbuf::scaleRow (int row, const core::byte *data)
 {
    if (row < root->height) {
-      if (scaleMode == SIMPLE)
+      if (bilinear) {
+         int sr1, sr2;
+         bilinearRowRange (row, &sr1, &sr2);
+         scaleRowsBilinear (sr1, sr2);
+      } else if (scaleMode == SIMPLE)
          scaleRowSimple (row, data);
       else
          scaleRowBeautiful (row, data);
@@ -292,6 +311,73 @@ inline void FltkImgbuf::scaleRowBeautiful (int row, const core::byte *data)
    }
 }
 
+/**
+ * Add a row of bytes to 32 bit accumulators.
+ */
+static inline void addRow (unsigned int *acc, const core::byte *row, int len)
+{
+   int i = 0;
+
+#ifdef __SSE2__
+   const __m128i zero = _mm_setzero_si128 ();
+
+   for (; i + 16 <= len; i += 16) {
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (row + i));
+      __m128i lo = _mm_unpacklo_epi8 (b, zero);
+      __m128i hi = _mm_unpackhi_epi8 (b, zero);
+      __m128i *a = (__m128i *) (acc + i);
+
+      _mm_storeu_si128 (a, _mm_add_epi32 (_mm_loadu_si128 (a),
+                                          _mm_unpacklo_epi16 (lo, zero)));
+      _mm_storeu_si128 (a + 1, _mm_add_epi32 (_mm_loadu_si128 (a + 1),
+                                              _mm_unpackhi_epi16 (lo, zero)));
+      _mm_storeu_si128 (a + 2, _mm_add_epi32 (_mm_loadu_si128 (a + 2),
+                                              _mm_unpacklo_epi16 (hi, zero)));
+      _mm_storeu_si128 (a + 3, _mm_add_epi32 (_mm_loadu_si128 (a + 3),
+                                              _mm_unpackhi_epi16 (hi, zero)));
+   }
+#endif
+
+   for (; i < len; i++)
+      acc[i] += row[i];
+}
+
+/**
+ * Average the column sums in "acc" over the source columns of each
+ * destination column, and store the result in "dest".
+ *
+ * The division is done as a multiplication with a reciprocal, which is
+ * exact for divisors below 4096 (the sums are at most 255 * n).
+ */
+template <int bpp> static inline void sumColumns (const unsigned int *acc,
+                                                  const int *xo1,
+                                                  const int *xo2,
+                                                  int destWidth, int rows,
+                                                  core::byte *dest)
+{
+   unsigned long long recip = 0;
+   int recipW = 0;
+
+   for (int x = 0; x < destWidth; x++, dest += bpp) {
+      const unsigned int *pa = acc + xo1[x] * bpp, *end = acc + xo2[x] * bpp;
+      unsigned int v[4] = { 0, 0, 0, 0 };
+      int w = xo2[x] - xo1[x];
+
+      for (; pa < end; pa += bpp)
+         for (int i = 0; i < bpp; i++)
+            v[i] += pa[i];
+
+      if (w != recipW) {
+         // Columns mostly alternate between two widths.
+         unsigned long long n = (unsigned long long) w * rows;
+         recip = (n < 4096) ? (1ULL << 32) / n + 1 : 0;
+         recipW = w;
+      }
+      for (int i = 0; i < bpp; i++)
+         dest[i] = recip ? (v[i] * recip) >> 32 : v[i] / (w * rows);
+   }
+}
+
 /**
  * General method to scale an image buffer. Used to scale single lines
  * in scaleRowBeautiful.
@@ -303,59 +389,280 @@ inline void FltkImgbuf::scaleRowBeautiful (int row, const core::byte *data)
  * average of all pixel values. This is pretty fast and leads to
  * rather good results.
  *
- * Nothing special (like interpolation) is done when scaling up.
+ * The average is taken in two passes: the source rows of a destination
+ * row are first summed up column by column, then the column sums are
+ * added up horizontally, using a table of the source columns of each
+ * destination column. A destination row that maps to the same source
+ * rows as the one above is simply copied.
+ *
+ * Nothing special (like interpolation) is done when scaling up; that is
+ * left to scaleRowsBilinear().
  *
  * If scaleMode is set to BEAUTIFUL_GAMMA, gamma correction is
  * considered, see <http://www.4p8.com/eric.brasseur/gamma.html>.
- *
- * TODO Could be optimized as in scaleRowSimple: when the destination
- * image is larger, calculate only one row/column, and copy it to the
- * other rows/columns.
  */
-inline void FltkImgbuf::scaleBuffer (const core::byte *src, int srcWidth,
-                                     int srcHeight, core::byte *dest,
-                                     int destWidth, int destHeight, int bpp,
-                                     double gamma)
+void FltkImgbuf::scaleBuffer (const core::byte *src, int srcWidth,
+                              int srcHeight, core::byte *dest,
+                              int destWidth, int destHeight, int bpp,
+                              double gamma)
 {
-   uchar *gammaMap1, *gammaMap2;
-
-   if (scaleMode == BEAUTIFUL_GAMMA) {
+   uchar *gammaMap1 = NULL, *gammaMap2 = NULL;
+   int srcLen = srcWidth * bpp, destLen = destWidth * bpp;
+   int *xo1 = new int[destWidth], *xo2 = new int[destWidth];
+   unsigned int *acc = new unsigned int[srcLen];
+   core::byte *linear = NULL;
+   int prevYo1 = -1, prevYo2 = -1;
+
+   // The tables are the identity for a gamma of 1.
+   if (scaleMode == BEAUTIFUL_GAMMA && gamma != 1) {
       gammaMap1 = findGammaCorrectionTable (gamma);
       gammaMap2 = findGammaCorrectionTable (1 / gamma);
+      linear = new core::byte[srcLen];
    }
 
-   for(int x = 0; x < destWidth; x++)
-      for(int y = 0; y < destHeight; y++) {
-         int xo1 = x * srcWidth / destWidth;
-         int xo2 = lout::misc::max ((x + 1) * srcWidth / destWidth, xo1 + 1);
-         int yo1 = y * srcHeight / destHeight;
-         int yo2 = lout::misc::max ((y + 1) * srcHeight / destHeight, yo1 + 1);
-         int n = (xo2 - xo1) * (yo2 - yo1);
-
-         int v[bpp];
-         for(int i = 0; i < bpp; i++)
-            v[i] = 0;
-
-         for(int xo = xo1; xo < xo2; xo++)
-            for(int yo = yo1; yo < yo2; yo++) {
-               const core::byte *ps = src + bpp * (yo * srcWidth + xo);
-               for(int i = 0; i < bpp; i++)
-                  v[i] +=
-                     (scaleMode == BEAUTIFUL_GAMMA ? gammaMap2[ps[i]] : ps[i]);
-            }
+   for (int x = 0; x < destWidth; x++) {
+      xo1[x] = x * srcWidth / destWidth;
+      xo2[x] = lout::misc::max ((x + 1) * srcWidth / destWidth, xo1[x] + 1);
+   }
+
+   for (int y = 0; y < destHeight; y++) {
+      int yo1 = y * srcHeight / destHeight;
+      int yo2 = lout::misc::max ((y + 1) * srcHeight / destHeight, yo1 + 1);
+      core::byte *pd = dest + y * destLen;
+
+      if (yo1 == prevYo1 && yo2 == prevYo2) {
+         memcpy (pd, pd - destLen, destLen);
+         continue;
+      }
+      prevYo1 = yo1;
+      prevYo2 = yo2;
+
+      memset (acc, 0, srcLen * sizeof (unsigned int));
+      for (int yo = yo1; yo < yo2; yo++) {
+         const core::byte *ps = src + yo * srcLen;
+
+         if (gammaMap2) {
+            for (int i = 0; i < srcLen; i++)
+               linear[i] = gammaMap2[ps[i]];
+            ps = linear;
+         }
+         addRow (acc, ps, srcLen);
+      }
+
+      switch (bpp) {
+      case 1:
+         sumColumns<1> (acc, xo1, xo2, destWidth, yo2 - yo1, pd);
+         break;
+      case 3:
+         sumColumns<3> (acc, xo1, xo2, destWidth, yo2 - yo1, pd);
+         break;
+      default:
+         sumColumns<4> (acc, xo1, xo2, destWidth, yo2 - yo1, pd);
+         break;
+      }
+
+      if (gammaMap1) {
+         for (int i = 0; i < destLen; i++)
+            pd[i] = gammaMap1[pd[i]];
+      }
+   }
+
+   delete[] xo1;
+   delete[] xo2;
+   delete[] acc;
+   delete[] linear;
+}
+
+/**
+ * Blend two rows interpolated by scaleRowsBilinear(): "fy" is the weight
+ * of "h1", in 1/128.
+ */
+static inline void blendRows (const short *h0, const short *h1, int fy,
+                              core::byte *dest, int len)
+{
+   int i = 0;
+
+#ifdef __SSE2__
+   // Pairs of (h0, h1) times (128 - fy, fy), in 32 bits
+   const __m128i w = _mm_set1_epi32 ((fy << 16) | (128 - fy));
+   const __m128i half = _mm_set1_epi32 (1 << 13);
+
+   for (; i + 8 <= len; i += 8) {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) (h0 + i));
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (h1 + i));
+      __m128i lo = _mm_madd_epi16 (_mm_unpacklo_epi16 (a, b), w);
+      __m128i hi = _mm_madd_epi16 (_mm_unpackhi_epi16 (a, b), w);
+
+      lo = _mm_srai_epi32 (_mm_add_epi32 (lo, half), 14);
+      hi = _mm_srai_epi32 (_mm_add_epi32 (hi, half), 14);
+      lo = _mm_packs_epi32 (lo, hi);
+      _mm_storel_epi64 ((__m128i *) (dest + i), _mm_packus_epi16 (lo, lo));
+   }
+#endif
+
+   for (; i < len; i++)
+      dest[i] = (h0[i] * (128 - fy) + h1[i] * fy + (1 << 13)) >> 14;
+}
+
+/**
+ * Find the root rows "y0" and "y1" between which the scaled row "yScaled"
+ * lies, and the weight of "y1", in 1/128.
+ *
+ * Pixel centers are aligned, so that the borders don't get more than
+ * half a scaled pixel of a single color.
+ */
+void FltkImgbuf::bilinearY (int yScaled, int *y0, int *y1, int *fy)
+{
+   long long pos =
+      (2LL * yScaled + 1) * root->height * 64 / height - 64;
+
+   if (pos < 0)
+      pos = 0;
+   *y0 = pos >> 7;
+   *fy = pos & 127;
+   if (*y0 >= root->height - 1) {
+      *y0 = root->height - 1;
+      *fy = 0;
+   }
+   *y1 = *fy ? *y0 + 1 : *y0;
+}
 
-         core::byte *pd = dest + bpp * (y * destWidth + x);
-         for(int i = 0; i < bpp; i++)
-            pd[i] =
-               scaleMode == BEAUTIFUL_GAMMA ? gammaMap1[v[i] / n] : v[i] / n;
+/**
+ * Return the first scaled row whose "y0" (see bilinearY) is not above
+ * the root row "ySrc".
+ */
+int FltkImgbuf::bilinearFirstRow (int ySrc)
+{
+   int lo = 0, hi = height;
+
+   while (lo < hi) {
+      int mid = (lo + hi) / 2, y0, y1, fy;
+
+      bilinearY (mid, &y0, &y1, &fy);
+      if (y0 < ySrc)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+   return lo;
+}
+
+/**
+ * The scaled rows [sr1, sr2) depend on the root row "ySrc".
+ */
+void FltkImgbuf::bilinearRowRange (int ySrc, int *sr1, int *sr2)
+{
+   *sr1 = bilinearFirstRow (ySrc - 1);
+   *sr2 = bilinearFirstRow (ySrc + 1);
+}
+
+/**
+ * Interpolate the scaled rows [sr1, sr2) whose root rows are all there.
+ *
+ * Each root row is interpolated horizontally only once, into 16 bits,
+ * and the scaled rows are blended from two of those.
+ */
+void FltkImgbuf::scaleRowsBilinear (int sr1, int sr2)
+{
+   int len = width * bpp;
+   int *xo = new int[width];
+   int *fx = new int[width];
+   short *h[2] = { new short[len], new short[len] };
+   int hy[2] = { -1, -1 };
+
+   for (int x = 0; x < width; x++) {
+      long long pos = (2LL * x + 1) * root->width * 64 / width - 64;
+
+      if (pos < 0)
+         pos = 0;
+      xo[x] = pos >> 7;
+      fx[x] = pos & 127;
+      if (xo[x] >= root->width - 1) {
+         xo[x] = root->width - 1;
+         fx[x] = 0;
       }
+   }
+
+   for (int sr = sr1; sr < sr2; sr++) {
+      int y[2], fy;
+      short *hrow[2];
+
+      bilinearY (sr, &y[0], &y[1], &fy);
+      if (!root->copiedRows->get (y[0]) || !root->copiedRows->get (y[1]))
+         continue;
+
+      for (int k = 0; k < 2; k++) {
+         int slot;
+
+         if (hy[0] == y[k])
+            slot = 0;
+         else if (hy[1] == y[k])
+            slot = 1;
+         else {
+            // Keep the row that the other end may still need.
+            slot = (k == 1 && hy[0] == y[0]) ? 1 : 0;
+            hy[slot] = y[k];
+
+            const core::byte *ps =
+               root->rawdata + y[k] * root->width * bpp;
+            short *ph = h[slot];
+
+            for (int x = 0; x < width; x++) {
+               const core::byte *p0 = ps + xo[x] * bpp;
+               const core::byte *p1 = fx[x] ? p0 + bpp : p0;
+
+               for (int i = 0; i < bpp; i++)
+                  *ph++ = p0[i] * (128 - fx[x]) + p1[i] * fx[x];
+            }
+         }
+         hrow[k] = h[slot];
+      }
+
+      blendRows (hrow[0], hrow[1], fy, rawdata + sr * len, len);
+      copiedRows->set (sr, true);
+   }
+
+   DBG_IF_RTFL {
+      lout::misc::StringBuffer sb;
+      copiedRows->intoStringBuffer (&sb);
+      DBG_OBJ_SET_SYM ("copiedRows", sb.getChars ());
+   }
+
+   delete[] xo;
+   delete[] fx;
+   delete[] h[0];
+   delete[] h[1];
+}
+
+/**
+ * \brief Fill a new scaled buffer from the largest of the other scaled
+ *    buffers, when the root buffer has no pixels anymore (see
+ *    dw::fltk::FltkImgbuf::freeRootData).
+ */
+void FltkImgbuf::scaleFromLargest ()
+{
+   FltkImgbuf *src = NULL;
+
+   for (Iterator <FltkImgbuf> it = root->scaledBuffers->iterator();
+        it.hasNext(); ) {
+      FltkImgbuf *sb = it.getNext ();
+      if (src == NULL || sb->width * sb->height > src->width * src->height)
+         src = sb;
+   }
+
+   if (src) {
+      scaleBuffer (src->rawdata, src->width, src->height, rawdata, width,
+                   height, bpp, gamma);
+      for (int sr = 0; sr < height; sr++)
+         copiedRows->set (sr, true);
+   }
 }
 
 void FltkImgbuf::copyRow (int row, const core::byte *data)
 {
    assert (isRoot());
 
-   if (row < height) {
+   if (row < height && rawdata) {
       // Flag the row done and copy its data.
       copiedRows->set (row, true);
 
@@ -407,7 +714,7 @@ core::Imgbuf* FltkImgbuf::getScaledBuf (int width, int height)
       return getScaledBuf (width, MAX_HEIGHT);
    }
 
-   if (width == this->width && height == this->height) {
+   if (width == this->width && height == this->height && rawdata) {
       ref ();
       return this;
    }
@@ -423,7 +730,7 @@ core::Imgbuf* FltkImgbuf::getScaledBuf (int width, int height)
    // Check for excessive image sizes which would cause crashes due to
    // too big allocations for the image buffer. In this case we return
    // a pointer to the unscaled image buffer.
-   if (excessiveImageDimensions (width, height)) {
+   if (excessiveImageDimensions (width, height) && rawdata) {
       MSG("FltkImgbuf::getScaledBuf: suspicious image size request %d x %d\n",
            width, height);
       ref ();
@@ -455,8 +762,14 @@ void FltkImgbuf::getRowArea (int row, dw::core::Rectangle *area)
          area->x = area->y = area->width = area->height = 0;
       else {
          // scaled buffer
-         int sr1 = scaledY (row);
-         int sr2 = scaledY (row + 1);
+         int sr1, sr2;
+
+         if (bilinear)
+            bilinearRowRange (row, &sr1, &sr2);
+         else {
+            sr1 = scaledY (row);
+            sr2 = scaledY (row + 1);
+         }
 
          area->x = 0;
          area->y = sr1;
@@ -489,6 +802,9 @@ void FltkImgbuf::copyTo (Imgbuf *dest, int xDestRoot, int yDestRoot,
    FltkImgbuf *fDest = (FltkImgbuf*)dest;
    assert (bpp == fDest->bpp);
 
+   if (rawdata == NULL)
+      return;
+
    int xSrc2 = lout::misc::min (xSrc + widthSrc, fDest->width - xDestRoot);
    int ySrc2 = lout::misc::min (ySrc + heightSrc, fDest->height - yDestRoot);
 
@@ -562,6 +878,19 @@ bool FltkImgbuf::isReferred ()
       (scaledBuffers != NULL && !scaledBuffers->isEmpty ());
 }
 
+bool FltkImgbuf::freeRootData ()
+{
+   if (!isRoot () || rawdata == NULL || refCount != 1 ||
+       scaledBuffers->isEmpty ())
+      return false;
+
+   _MSG("FltkImgbuf[root %p]: freeing %d x %d, %d scaled buffers left\n",
+        this, width, height, scaledBuffers->size ());
+   delete[] rawdata;
+   rawdata = NULL;
+   return true;
+}
+
 
 int FltkImgbuf::scaledY(int ySrc)
 {
@@ -591,7 +920,7 @@ void FltkImgbuf::draw (Fl_Widget *target, int xRoot, int yRoot,
         "        this->width=%d this->height=%d\n",
         xRoot, x, yRoot, y, width, height, this->width, this->height);
 
-   if (x > this->width || y > this->height) {
+   if (x > this->width || y > this->height || rawdata == NULL) {
       return;
    }
 
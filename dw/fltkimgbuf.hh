@@ -10,6 +10,15 @@ namespace fltk {
 
 class FltkImgbuf: public core::Imgbuf
 {
+public:
+   /**
+    * \brief How scaled buffers larger than the image are filled.
+    */
+   enum UpscaleMode {
+      UPSCALE_SIMPLE,   ///< Repeat the pixels.
+      UPSCALE_BILINEAR  ///< Interpolate between neighbouring pixels.
+   };
+
 private:
    class GammaCorrectionTable: public lout::object::Object
    {
@@ -26,6 +35,7 @@ private:
    int width, height;
    Type type;
    double gamma;
+   bool bilinear;       // scaled up, with UPSCALE_BILINEAR
 
 //{
    int bpp;
@@ -39,6 +49,8 @@ private:
    static lout::container::typed::Vector <GammaCorrectionTable>
       *gammaCorrectionTables;
 
+   static UpscaleMode upscaleMode;
+
    static uchar *findGammaCorrectionTable (double gamma);
    static bool excessiveImageDimensions (int width, int height);
 
@@ -47,6 +59,11 @@ private:
    void init (Type type, int width, int height, double gamma, FltkImgbuf *root);
    int scaledY(int ySrc);
    int backscaledY(int yScaled);
+   void bilinearY (int yScaled, int *y0, int *y1, int *fy);
+   int bilinearFirstRow (int ySrc);
+   void bilinearRowRange (int ySrc, int *sr1, int *sr2);
+   void scaleRowsBilinear (int sr1, int sr2);
+   void scaleFromLargest ();
    int isRoot() { return (root == NULL); }
    void detachScaledBuf (FltkImgbuf *scaledBuf);
 
@@ -57,15 +74,16 @@ public:
    FltkImgbuf (Type type, int width, int height, double gamma);
 
    static void freeall ();
+   static void setUpscaleMode (UpscaleMode mode) { upscaleMode = mode; }
 
    void setCMap (int *colors, int num_colors);
    inline void scaleRow (int row, const core::byte *data);
    inline void scaleRowSimple (int row, const core::byte *data);
    inline void scaleRowBeautiful (int row, const core::byte *data);
-   inline static void scaleBuffer (const core::byte *src, int srcWidth,
-                                   int srcHeight, core::byte *dest,
-                                   int destWidth, int destHeight, int bpp,
-                                   double gamma);
+   static void scaleBuffer (const core::byte *src, int srcWidth,
+                            int srcHeight, core::byte *dest,
+                            int destWidth, int destHeight, int bpp,
+                            double gamma);
 
    void newScan ();
    void copyRow (int row, const core::byte *data);
@@ -82,6 +100,7 @@ public:
    bool lastReference ();
    void setDeleteOnUnref (bool deleteOnUnref);
    bool isReferred ();
+   bool freeRootData ();
 
    void draw (Fl_Widget *target, int xRoot, int yRoot,
               int x, int y, int width, int height);
@@ -132,6 +132,13 @@ namespace core {
  * since a scaled buffer is left. After calling dw::core::Imgbuf::unref for
  * the scaled buffer, it is deleted, and after it, the root buffer.
  *
+ * Once the image is complete, and the only reference to the root buffer is
+ * the one held by the image cache, the pixels of the root buffer are not
+ * needed to display the image anymore. The cache may then free them with
+ * dw::core::Imgbuf::freeRootData, keeping only the scaled buffers. Should a
+ * new size be asked for afterwards, the scaled buffer is made from the
+ * largest scaled buffer left.
+ *
  * <h3>Drawing</h3>
  *
  * dw::core::Imgbuf provides no methods for drawing, instead, this is
@@ -225,6 +232,14 @@ public:
     * \todo Comment
     */
    virtual bool isReferred () = 0;
+
+   /**
+    * \brief Free the pixels of the root buffer, if nothing but the scaled
+    *    buffers (and the single reference of the caller) uses it.
+    *
+    * Returns whether the memory was freed.
+    */
+   virtual bool freeRootData () = 0;
 };
 
 } // namespace core
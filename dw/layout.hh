@@ -286,6 +286,15 @@ public:
    inline int getHeightViewport ()  { return viewportHeight; }
    inline int getScrollPosX ()  { return scrollX; }
    inline int getScrollPosY ()  { return scrollY; }
+   inline int getHeightCanvas () { return canvasAscent + canvasDescent; }
+   /**
+    * \brief Has the canvas already grown past the bottom of the viewport?
+    *
+    * Then what is added from now on starts out of view.
+    */
+   inline bool isPastViewport () {
+      return viewportHeight > 0 &&
+         getHeightCanvas () > scrollY + viewportHeight; }
 
    /* public */
 
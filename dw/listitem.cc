@@ -64,6 +64,19 @@ void ListItem::initWithText (const char *text, core::style::Style *style)
       updateValue ();
 }
 
+/**
+ * \brief Restyle like dw::Textblock, and take a bullet or number, which
+ *    may have become wider, into account for the aligned list items.
+ */
+void ListItem::restyle (core::style::StyleMap *map)
+{
+   AlignedTextblock::restyle (map);
+   if (hasListitemValue && words->size () > 0 &&
+       words->getRef(0)->style->listStylePosition ==
+       core::style::LIST_STYLE_POSITION_OUTSIDE)
+      updateValue ();
+}
+
 int ListItem::getValue ()
 {
    if (words->size () == 0)
@@ -22,6 +22,7 @@ public:
 
    void initWithWidget (core::Widget *widget, core::style::Style *style);
    void initWithText (const char *text, core::style::Style *style);
+   void restyle (core::style::StyleMap *map);
 };
 
 } // namespace dw
@@ -59,6 +59,7 @@ void StyleAttrs::initValues ()
    x_lang[0] = x_lang[1] = 0;
    x_img = -1;
    x_tooltip = NULL;
+   x_origin = 0;
    textDecoration = TEXT_DECORATION_NONE;
    textAlign = TEXT_ALIGN_LEFT;
    textAlignChar = '.';
@@ -103,6 +104,7 @@ void StyleAttrs::initValues ()
 void StyleAttrs::resetValues ()
 {
    x_img = -1;
+   x_origin = 0;
 
    valign = VALIGN_BASELINE;
    textAlignChar = '.';
@@ -140,15 +142,117 @@ void StyleAttrs::resetValues ()
  * It is mainly for optimizing style changes where only colors etc change
  * (where false would be returned), in some cases it may return true, although
  * a size change does not actually happen (e.g. when in a certain
- * context a particular attribute is ignored).
- *
- * \todo Should for CSS implemented properly. Currently, size changes are
- * not needed, so always false is returned. See also
+ * context a particular attribute is ignored). See also
  * dw::core::Widget::setStyle.
  */
 bool StyleAttrs::sizeDiffs (StyleAttrs *otherStyle)
 {
-   return false;
+   StyleAttrs attrs = *otherStyle;
+
+   // Take over everything which is only drawn, and compare the rest.
+   attrs.textDecoration = textDecoration;
+   attrs.color = color;
+   attrs.backgroundColor = backgroundColor;
+   attrs.backgroundImage = backgroundImage;
+   attrs.backgroundRepeat = backgroundRepeat;
+   attrs.backgroundAttachment = backgroundAttachment;
+   attrs.backgroundPositionX = backgroundPositionX;
+   attrs.backgroundPositionY = backgroundPositionY;
+   attrs.borderColor = borderColor;
+   attrs.borderStyle = borderStyle;
+   attrs.cursor = cursor;
+   attrs.x_link = x_link;
+   attrs.x_img = x_img;
+   attrs.x_tooltip = x_tooltip;
+   attrs.x_origin = x_origin;
+
+   return !equals (&attrs);
+}
+
+/**
+ * \brief For a style derived from \em oldBase, take over the changes
+ *    from \em oldBase to \em newBase.
+ *
+ * All attributes which are still the same as in \em oldBase are set to
+ * the values of \em newBase, those which have been changed for this
+ * style are kept.
+ */
+void StyleAttrs::rebase (StyleAttrs *oldBase, StyleAttrs *newBase)
+{
+#define REBASE(attr) \
+   if (attr == oldBase->attr) \
+      attr = newBase->attr
+
+   REBASE (font);
+   REBASE (textDecoration);
+   REBASE (color);
+   REBASE (backgroundColor);
+   REBASE (backgroundImage);
+   REBASE (backgroundRepeat);
+   REBASE (backgroundAttachment);
+   REBASE (backgroundPositionX);
+   REBASE (backgroundPositionY);
+   REBASE (textAlign);
+   REBASE (valign);
+   REBASE (textAlignChar);
+   REBASE (textTransform);
+   REBASE (vloat);
+   REBASE (clear);
+   REBASE (overflow);
+   REBASE (position);
+   REBASE (top);
+   REBASE (bottom);
+   REBASE (left);
+   REBASE (right);
+   REBASE (hBorderSpacing);
+   REBASE (vBorderSpacing);
+   REBASE (wordSpacing);
+   REBASE (width);
+   REBASE (height);
+   REBASE (minWidth);
+   REBASE (maxWidth);
+   REBASE (minHeight);
+   REBASE (maxHeight);
+   REBASE (lineHeight);
+   REBASE (textIndent);
+   REBASE (margin.top);
+   REBASE (margin.right);
+   REBASE (margin.bottom);
+   REBASE (margin.left);
+   REBASE (borderWidth.top);
+   REBASE (borderWidth.right);
+   REBASE (borderWidth.bottom);
+   REBASE (borderWidth.left);
+   REBASE (padding.top);
+   REBASE (padding.right);
+   REBASE (padding.bottom);
+   REBASE (padding.left);
+   REBASE (borderCollapse);
+   REBASE (borderColor.top);
+   REBASE (borderColor.right);
+   REBASE (borderColor.bottom);
+   REBASE (borderColor.left);
+   REBASE (borderStyle.top);
+   REBASE (borderStyle.right);
+   REBASE (borderStyle.bottom);
+   REBASE (borderStyle.left);
+   REBASE (display);
+   REBASE (whiteSpace);
+   REBASE (listStylePosition);
+   REBASE (listStyleType);
+   REBASE (cursor);
+   REBASE (zIndex);
+   REBASE (x_link);
+   REBASE (x_img);
+   REBASE (x_tooltip);
+   REBASE (x_origin);
+
+#undef REBASE
+
+   if (x_lang[0] == oldBase->x_lang[0] && x_lang[1] == oldBase->x_lang[1]) {
+      x_lang[0] = newBase->x_lang[0];
+      x_lang[1] = newBase->x_lang[1];
+   }
 }
 
 bool StyleAttrs::equals (object::Object *other) {
@@ -209,7 +313,8 @@ bool StyleAttrs::equals (object::Object *other) {
        x_lang[0] == otherAttrs->x_lang[0] &&
        x_lang[1] == otherAttrs->x_lang[1] &&
        x_img == otherAttrs->x_img &&
-       x_tooltip == otherAttrs->x_tooltip);
+       x_tooltip == otherAttrs->x_tooltip &&
+       x_origin == otherAttrs->x_origin);
 }
 
 int StyleAttrs::hashValue () {
@@ -266,7 +371,8 @@ int StyleAttrs::hashValue () {
       x_link +
       x_lang[0] + x_lang[1] +
       x_img +
-      (intptr_t) x_tooltip;
+      (intptr_t) x_tooltip +
+      x_origin;
 }
 
 int Style::totalRef = 0;
@@ -390,6 +496,7 @@ void Style::copyAttrs (StyleAttrs *attrs)
    x_lang[1] = attrs->x_lang[1];
    x_img = attrs->x_img;
    x_tooltip = attrs->x_tooltip;
+   x_origin = attrs->x_origin;
 }
 
 // ----------------------------------------------------------------------
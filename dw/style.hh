@@ -575,11 +575,15 @@ public:
                       set), or x_lang contains the RFC 1766 country
                       code in lower case letters. (Only two letters
                       allowed, currently.) */
+   int x_origin; /* 0, or, while a document may still be restyled, tells
+                    which element a style (or a style derived from it)
+                    belongs to (see dillo's StyleEngine). */
 
    void initValues ();
    void resetValues ();
 
    bool sizeDiffs (StyleAttrs *otherStyleAttrs);
+   void rebase (StyleAttrs *oldBase, StyleAttrs *newBase);
 
    inline void setBorderColor(Color *val) {
       borderColor.top = borderColor.right = borderColor.bottom
@@ -642,6 +646,22 @@ public:
 };
 
 
+/**
+ * \brief Tells dw::core::Widget::restyle, which styles are replaced.
+ */
+class StyleMap
+{
+public:
+   virtual ~StyleMap () { }
+
+   /**
+    * \brief Return the style replacing \em style (not referred), or NULL,
+    *    when \em style is kept.
+    */
+   virtual Style *map (Style *style) = 0;
+};
+
+
 /**
  * \sa dw::core::style
  */
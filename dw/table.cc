@@ -599,6 +599,38 @@ void Table::addRow (core::style::Style *style)
    rowClosed = false;
 }
 
+/**
+ * \brief Restyle like dw::core::Widget, and also replace the row styles,
+ *    which the cells take their background color from.
+ */
+void Table::restyle (core::style::StyleMap *map)
+{
+   bool changed = false;
+
+   for (int row = 0; row < rowStyle->size (); row++) {
+      core::style::Style *style;
+
+      if (rowStyle->get (row) && (style = map->map (rowStyle->get (row)))) {
+         style->ref ();
+         rowStyle->get(row)->unref ();
+         rowStyle->set (row, style);
+         changed = true;
+
+         for (int col = 0; col < numCols; col++) {
+            int n = row * numCols + col;
+            if (childDefined (n))
+               children->get(n)->cell.widget->setBgColor
+                  (style->backgroundColor);
+         }
+      }
+   }
+
+   Widget::restyle (map);
+
+   if (changed)
+      queueDraw ();
+}
+
 AlignedTableCell *Table::getCellRef ()
 {
    core::Widget *child;
@@ -508,6 +508,7 @@ public:
    void addCell (Widget *widget, int colspan, int rowspan);
    void addRow (core::style::Style *style);
    AlignedTableCell *getCellRef ();
+   void restyle (core::style::StyleMap *map);
 };
 
 } // namespace dw
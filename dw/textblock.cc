@@ -3013,6 +3013,77 @@ void Textblock::changeWordStyle (int from, int to, core::style::Style *style,
 {
 }
 
+/**
+ * \brief Replace the styles of the words, and of all widgets below, see
+ *    dw::core::Widget::restyle.
+ *
+ * Words whose size may have changed are measured again, and the whole
+ * textblock is rewrapped then.
+ */
+void Textblock::restyle (core::style::StyleMap *map)
+{
+   bool changed = false, sizeChanged = false;
+
+   for (int i = 0; i < words->size (); i++) {
+      Word *word = words->getRef (i);
+      core::style::Style *style = map->map (word->style);
+      core::style::Style *spaceStyle = map->map (word->spaceStyle);
+
+      if (style == NULL && spaceStyle == NULL)
+         continue;
+
+      changed = true;
+      removeWordImgRenderer (i);
+      removeSpaceImgRenderer (i);
+
+      if (style) {
+         if (word->style->sizeDiffs (style)) {
+            sizeChanged = true;
+            if (word->content.type == core::Content::TEXT) {
+               calcTextSize (word->content.text, strlen (word->content.text),
+                             style, &word->size,
+                             word->flags & Word::WORD_START,
+                             word->flags & Word::WORD_END);
+               if (word->hyphenWidth > 0)
+                  word->hyphenWidth =
+                     layout->textWidth (style->font, hyphenDrawChar,
+                                        strlen (hyphenDrawChar));
+            } else if (word->content.type == core::Content::BREAK &&
+                       word->size.ascent + word->size.descent > 0) {
+               word->size.ascent = style->font->ascent;
+               word->size.descent = style->font->descent;
+            }
+            DBG_SET_WORD_SIZE (i);
+         }
+         style->ref ();
+         word->style->unref ();
+         word->style = style;
+      }
+
+      if (spaceStyle) {
+         if (word->spaceStyle->sizeDiffs (spaceStyle)) {
+            sizeChanged = true;
+            if (word->content.space)
+               word->origSpace = word->effSpace =
+                  spaceStyle->font->spaceWidth + spaceStyle->wordSpacing;
+         }
+         spaceStyle->ref ();
+         word->spaceStyle->unref ();
+         word->spaceStyle = spaceStyle;
+      }
+
+      setWordImgRenderer (i);
+      setSpaceImgRenderer (i);
+   }
+
+   Widget::restyle (map);
+
+   if (sizeChanged)
+      queueResize (makeParentRefInFlow (0), true);
+   else if (changed)
+      queueDraw ();
+}
+
 void Textblock::queueDrawRange (int index1, int index2)
 {
    DBG_OBJ_ENTER ("draw", 0, "queueDrawRange", "%d, %d", index1, index2);
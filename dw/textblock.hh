@@ -898,6 +898,7 @@ public:
    void changeLinkColor (int link, int newColor);
    void changeWordStyle (int from, int to, core::style::Style *style,
                          bool includeFirstSpace, bool includeLastSpace);
+   void restyle (core::style::StyleMap *map);
   
    void updateReference (int ref);
    void widgetRefSizeChanged (int externalIndex);
@@ -1310,6 +1310,29 @@ void Widget::setStyle (style::Style *style)
       DBG_OBJ_SET_SYM ("style.background-color", "transparent");
 }
 
+/**
+ * \brief Replace the styles of this widget and all widgets below, as told
+ *    by \em map.
+ *
+ * Widgets which keep styles besides their own (e.g. those of words)
+ * have to override this, and call the method of the base class.
+ */
+void Widget::restyle (style::StyleMap *map)
+{
+   style::Style *newStyle;
+
+   if (style && (newStyle = map->map (style)))
+      setStyle (newStyle);
+
+   Iterator *it =
+      iterator ((Content::Type)
+                (Content::WIDGET_IN_FLOW | Content::WIDGET_OOF_CONT), false);
+   while (it->next ())
+      it->getContent()->widget->restyle (map);
+
+   it->unref ();
+}
+
 /**
  * \brief Set the background "behind" the widget, if it is not the
  *    background of the parent widget, e.g. the background of a table
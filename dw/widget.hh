@@ -538,6 +538,7 @@ public:
    void leaveNotify (EventCrossing *event);
 
    virtual void setStyle (style::Style *style);
+   virtual void restyle (style::StyleMap *map);
    void setBgColor (style::Color *bgColor);
    style::Color *getBgColor ();
 
@@ -13,9 +13,14 @@
  * Dillo's event driven IO engine
  */
 
+#include <config.h>
+
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>            /* readv */
+#endif
 #include "../msg.h"
 #include "../chain.h"
 #include "../klist.h"
@@ -31,6 +36,18 @@
 #define IO_StopWr   2
 #define IO_StopRdWr (IO_StopRd | IO_StopWr)
 
+/*
+ * IO buffers are recycled through a pool with a free list for each size
+ * class (IOBufLen times 1, 4, 16 and 64), since every connection needs
+ * one and a busy page opens many.
+ */
+#define IO_POOL_CLASSES 4
+#define IO_POOL_DEPTH   8
+#define IO_CLASS_SIZE(c) (IOBufLen << (2 * (c)))
+
+/* Largest amount asked for by a single read */
+#define IOMaxChunk IO_CLASS_SIZE(IO_POOL_CLASSES - 1)
+
 
 typedef struct {
    int Key;               /* Primary Key (for klist) */
@@ -38,6 +55,7 @@ typedef struct {
    int FD;                /* Current File Descriptor */
    int Status;            /* nonzero upon IO failure */
    Dstr *Buf;             /* Internal buffer */
+   int ChunkLen;          /* Read size; grows while reads come back full */
 
    void *Info;            /* CCC Info structure for this IO */
 } IOData_t;
@@ -48,6 +66,8 @@ typedef struct {
  */
 static Klist_t *ValidIOs = NULL; /* Active IOs list. It holds pointers to
                                   * IOData_t structures. */
+static Dstr *IO_pool[IO_POOL_CLASSES][IO_POOL_DEPTH];
+static int IO_pool_len[IO_POOL_CLASSES];
 
 /*
  *  Forward declarations
@@ -58,6 +78,48 @@ void a_IO_ccc(int Op, int Branch, int Dir, ChainLink *Info,
 
 /* IO API  - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+/*
+ * Get an empty buffer with room for at least 'size' bytes from the pool.
+ */
+static Dstr *IO_buf_get(int size)
+{
+   int c;
+
+   for (c = 0; c < IO_POOL_CLASSES - 1 && IO_CLASS_SIZE(c) < size; c++) ;
+   for ( ; c < IO_POOL_CLASSES; c++)
+      if (IO_pool_len[c] > 0)
+         return IO_pool[c][--IO_pool_len[c]];
+   return dStr_sized_new(MAX(size, IOBufLen));
+}
+
+/*
+ * Give a buffer back to the pool (or free it if it doesn't fit).
+ */
+static void IO_buf_put(Dstr *buf)
+{
+   int c;
+
+   for (c = IO_POOL_CLASSES - 1; c >= 0 && buf->sz < IO_CLASS_SIZE(c); c--) ;
+   if (c >= 0 && buf->sz <= 2 * IOMaxChunk &&
+       IO_pool_len[c] < IO_POOL_DEPTH) {
+      dStr_truncate(buf, 0);
+      IO_pool[c][IO_pool_len[c]++] = buf;
+   } else {
+      dStr_free(buf, 1);
+   }
+}
+
+/*
+ * Make room for 'room' more bytes (plus the terminating NUL) in 'buf'.
+ */
+static void IO_buf_reserve(Dstr *buf, int room)
+{
+   if (buf->sz - buf->len <= room) {
+      buf->sz = MAX(2 * buf->sz, buf->len + room + 1);
+      buf->str = dRealloc(buf->str, buf->sz);
+   }
+}
+
 /*
  * Return a new, initialized, 'io' struct
  */
@@ -67,7 +129,8 @@ static IOData_t *IO_new(int op)
    io->Op = op;
    io->FD = -1;
    io->Key = 0;
-   io->Buf = dStr_sized_new(IOBufLen);
+   io->Buf = IO_buf_get(IOBufLen);
+   io->ChunkLen = IOBufLen;
 
    return io;
 }
@@ -111,7 +174,7 @@ static IOData_t *IO_get(int Key)
  */
 static void IO_free(IOData_t *io)
 {
-   dStr_free(io->Buf, 1);
+   IO_buf_put(io->Buf);
    dFree(io);
 }
 
@@ -151,12 +214,55 @@ static void IO_close_fd(IOData_t *io, int CloseCode)
    _MSG(" end IO close (%d) <=====\n", io->FD);
 }
 
+/*
+ * Read up to io->ChunkLen bytes, appending them to io->Buf.
+ * Plain sockets use readv() with a spill buffer after the reserved room,
+ * which tells whether the chunk size should grow.
+ */
+static ssize_t IO_read_chunk(IOData_t *io, void *conn)
+{
+   ssize_t St;
+
+   IO_buf_reserve(io->Buf, io->ChunkLen);
+   if (conn) {
+      St = a_Tls_read(conn, io->Buf->str + io->Buf->len, io->ChunkLen);
+      if (St == io->ChunkLen && io->ChunkLen < IOMaxChunk)
+         io->ChunkLen *= 2;
+   } else {
+#ifdef HAVE_SYS_UIO_H
+      static char Spill[IOBufLen];
+      struct iovec iov[2];
+
+      iov[0].iov_base = io->Buf->str + io->Buf->len;
+      iov[0].iov_len = io->ChunkLen;
+      iov[1].iov_base = Spill;
+      iov[1].iov_len = sizeof(Spill);
+      St = readv(io->FD, iov, 2);
+      if (St > io->ChunkLen) {
+         io->Buf->len += io->ChunkLen;
+         dStr_append_l(io->Buf, Spill, St - io->ChunkLen);
+         if (io->ChunkLen < IOMaxChunk)
+            io->ChunkLen *= 2;
+         return St;
+      }
+#else
+      St = read(io->FD, io->Buf->str + io->Buf->len, io->ChunkLen);
+      if (St == io->ChunkLen && io->ChunkLen < IOMaxChunk)
+         io->ChunkLen *= 2;
+#endif
+   }
+   if (St > 0) {
+      io->Buf->len += St;
+      io->Buf->str[io->Buf->len] = 0;
+   }
+   return St;
+}
+
 /*
  * Read data from a file descriptor into a specific buffer
  */
 static bool_t IO_read(IOData_t *io)
 {
-   char Buf[IOBufLen];
    ssize_t St;
    bool_t ret = FALSE;
    int io_key = io->Key;
@@ -169,10 +275,8 @@ static bool_t IO_read(IOData_t *io)
    io->Status = 0;
 
    while (1) {
-      St = conn ? a_Tls_read(conn, Buf, IOBufLen)
-                : read(io->FD, Buf, IOBufLen);
+      St = IO_read_chunk(io, conn);
       if (St > 0) {
-         dStr_append_l(io->Buf, Buf, St);
          continue;
       } else if (St < 0) {
          if (errno == EINTR) {
@@ -343,7 +447,10 @@ static void IO_submit(IOData_t *r_io)
    fcntl(r_io->FD, F_SETFD, FD_CLOEXEC | fcntl(r_io->FD, F_GETFD));
 
    if (r_io->Op == IORead) {
-      a_IOwatch_add_fd(r_io->FD, DIO_READ,
+      /* IO_read() drains plain sockets; TLS may stop short of EAGAIN */
+      int when = a_Tls_connection(r_io->FD) ? DIO_READ : DIO_READ | DIO_EDGE;
+
+      a_IOwatch_add_fd(r_io->FD, when,
                        IO_fd_read_cb, INT2VOIDP(r_io->Key));
 
    } else if (r_io->Op == IOWrite) {
@@ -352,6 +459,19 @@ static void IO_submit(IOData_t *r_io)
    }
 }
 
+/*
+ * Deallocate the IO buffer pool
+ * (Call this one at exit time)
+ */
+void a_IO_freeall(void)
+{
+   int c;
+
+   for (c = 0; c < IO_POOL_CLASSES; c++)
+      while (IO_pool_len[c] > 0)
+         dStr_free(IO_pool[c][--IO_pool_len[c]], 1);
+}
+
 /*
  * CCC function for the IO module
  * ( Data1 = IOData_t* ; Data2 = NULL )
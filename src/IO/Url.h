@@ -17,9 +17,13 @@ int a_Http_init(void);
 int a_Http_proxy_auth(void);
 void a_Http_set_proxy_passwd(const char *str);
 void a_Http_connect_done(int fd, bool_t success);
+void a_Http_get_connect_stats(long *attempts, long *connects, long *fallbacks,
+                              long *total_msec, long *max_msec);
+void a_Http_get_pipeline_stats(long *requests, long *requeued);
 
 void a_Http_ccc (int Op, int Branch, int Dir, ChainLink *Info,
                  void *Data1, void *Data2);
+void a_IO_freeall(void);
 void a_IO_ccc   (int Op, int Branch, int Dir, ChainLink *Info,
                  void *Data1, void *Data2);
 void a_Dpi_ccc  (int Op, int Branch, int Dir, ChainLink *Info,
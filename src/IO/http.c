@@ -23,6 +23,7 @@
 #include <fcntl.h>
 #include <assert.h>
 #include <sys/socket.h>         /* for lots of socket stuff */
+#include <sys/time.h>           /* for gettimeofday */
 #include <netinet/in.h>         /* for ntohl and stuff */
 #include <arpa/inet.h>          /* for inet_ntop */
 
@@ -34,10 +35,13 @@
 #include "../klist.h"
 #include "../dns.h"
 #include "../web.hh"
+#include "../cache.h"
+#include "../decode.h"
 #include "../cookies.h"
 #include "../auth.h"
 #include "../prefs.h"
 #include "../misc.h"
+#include "../timeout.hh"
 
 #include "../uicmd.hh"
 
@@ -55,6 +59,28 @@ static const int HTTP_SOCKET_QUEUED      = 0x2;
 static const int HTTP_SOCKET_TO_BE_FREED = 0x4;
 static const int HTTP_SOCKET_TLS         = 0x8;
 static const int HTTP_SOCKET_IOWATCH_ACTIVE = 0x10;
+static const int HTTP_SOCKET_ATTEMPT_TIMER = 0x20;
+static const int HTTP_SOCKET_PIPELINED   = 0x40;
+static const int HTTP_SOCKET_PIPELINE_BROKEN = 0x80;
+
+/* Request priorities for the connection scheduler (lower goes first) */
+enum {
+   HTTP_PRIO_DOCUMENT,
+   HTTP_PRIO_STYLESHEET,
+   HTTP_PRIO_IMAGE,
+   HTTP_PRIO_IMAGE_OFFSCREEN,
+   HTTP_PRIO_DOWNLOAD
+};
+
+/* Milliseconds to wait for a connection attempt before racing the next
+ * address against it (the RFC 8305 recommended value). */
+#define HTTP_CONNECT_ATTEMPT_DELAY 250
+
+/* A connect() in progress to one of the resolved addresses */
+typedef struct {
+   int fd;
+   int addr_idx;           /* index into addr_list */
+} ConnAttempt_t;
 
 /* 'web' is just a reference (no need to deallocate it here). */
 typedef struct {
@@ -63,11 +89,19 @@ typedef struct {
    DilloWeb *web;          /* reference to client's web structure */
    DilloUrl *url;
    Dlist *addr_list;       /* Holds the DNS answer */
-   int addr_list_idx;
+   int addr_list_idx;      /* Next address to try */
+   Dlist *attempts;        /* Connection attempts in progress */
+   struct timeval connect_start;
+   struct timeval next_attempt; /* When to start racing the next address */
    ChainLink *Info;        /* Used for CCC asynchronous operations */
    char *connected_to;     /* Used for per-server connection limit */
    uint_t connect_port;
    Dstr *https_proxy_reply;
+   ChainLink *InfoRecv;    /* Receiving branch, once it has the FD */
+   BrowserWindow *bw;      /* Requesting window, for fair scheduling */
+   int priority;           /* HTTP_PRIO_* */
+   Dlist *pipeline;        /* Sockets whose queries went out after ours */
+   int pipeline_owner;     /* If PIPELINED, key of the socket ahead of us */
 } SocketData_t;
 
 /* Data structures and functions to queue sockets that need to be
@@ -80,14 +114,10 @@ typedef struct {
 
   int active_conns;
   int running_the_queue;
+  bool_t no_pipelining;   /* it lost pipelined requests once */
   Dlist *queue;
 } Server_t;
 
-typedef struct {
-   int fd;
-   int skey;
-} FdMapEntry_t;
-
 static void Http_socket_enqueue(Server_t *srv, SocketData_t* sock);
 static Server_t *Http_server_get(const char *host, uint_t port, bool_t https);
 static void Http_server_remove(Server_t *srv);
@@ -95,6 +125,10 @@ static void Http_connect_socket(ChainLink *Info);
 static char *Http_get_connect_str(const DilloUrl *url);
 static void Http_send_query(SocketData_t *S);
 static void Http_socket_free(int SKey);
+static void Http_connect_socket_cb(int fd, void *data);
+static void Http_connect_attempt_timeout(void *data);
+static void Http_connect_attempts_free(SocketData_t *S);
+static void Http_pipeline_requeue(SocketData_t *S);
 
 /*
  * Local data
@@ -106,10 +140,32 @@ static char *HTTP_Proxy_Auth_base64 = NULL;
 static char *HTTP_Language_hdr = NULL;
 static Dlist *servers;
 
-/* TODO: If fd_map will stick around in its present form (FDs and SocketData_t)
- * then consider whether having both this and ValidSocks is necessary.
- */
-static Dlist *fd_map;
+/* Connection setup statistics, reported on exit */
+static struct {
+   long attempts;          /* connect() calls */
+   long connects;          /* successful connections */
+   long fallbacks;         /* won by other than the first address */
+   long total_msec, max_msec;
+} ConnectStats;
+
+/* Open connections per browser window */
+typedef struct {
+   BrowserWindow *bw;
+   int conns;
+} BwConns_t;
+
+static Dlist *bw_conns = NULL;
+static int active_conns_total = 0;
+
+/* Pipelining statistics, reported on exit */
+static struct {
+   long requests;          /* queries sent before the previous answer */
+   long requeued;          /* ...that had to be sent again */
+} PipelineStats;
+
+/* Socket keys indexed by fd (0 for none; keys start at 1) */
+static int *fd_map = NULL;
+static int fd_map_size = 0;
 
 /*
  * Initialize proxy vars and Accept-Language header
@@ -135,7 +191,7 @@ int a_Http_init(void)
  */
 
    servers = dList_new(5);
-   fd_map = dList_new(20);
+   bw_conns = dList_new(4);
 
    return 0;
 }
@@ -170,41 +226,39 @@ static int Http_sock_new(void)
    return a_Klist_insert(&ValidSocks, S);
 }
 
-/*
- * Compare by FD.
- */
-static int Http_fd_map_cmp(const void *v1, const void *v2)
-{
-   int fd = VOIDP2INT(v2);
-   const FdMapEntry_t *e = v1;
-
-   return (fd != e->fd);
-}
-
 static void Http_fd_map_add_entry(SocketData_t *sd)
 {
-   FdMapEntry_t *e = dNew0(FdMapEntry_t, 1);
-   e->fd = sd->SockFD;
-   e->skey = VOIDP2INT(sd->Info->LocalKey);
+   int fd = sd->SockFD;
 
-   if (dList_find_custom(fd_map, INT2VOIDP(e->fd), Http_fd_map_cmp)) {
-      MSG_ERR("FD ENTRY ALREADY FOUND FOR %d\n", e->fd);
+   if (fd >= fd_map_size) {
+      int old_size = fd_map_size;
+
+      fd_map_size = MAX(fd_map_size * 2, MAX(fd + 1, 64));
+      fd_map = dRealloc(fd_map, fd_map_size * sizeof(int));
+      memset(fd_map + old_size, 0, (fd_map_size - old_size) * sizeof(int));
+   }
+   if (fd_map[fd]) {
+      MSG_ERR("FD ENTRY ALREADY FOUND FOR %d\n", fd);
       assert(0);
    }
+   fd_map[fd] = VOIDP2INT(sd->Info->LocalKey);
+}
 
-   dList_append(fd_map, e);
+/*
+ * Return the socket key mapped to 'fd', or 0.
+ */
+static int Http_fd_map_get(int fd)
+{
+   return (fd >= 0 && fd < fd_map_size) ? fd_map[fd] : 0;
 }
 
 /*
- * Remove and free entry from fd_map.
+ * Remove entry from fd_map.
  */
 static void Http_fd_map_remove_entry(int fd)
 {
-   void *data = dList_find_custom(fd_map, INT2VOIDP(fd), Http_fd_map_cmp);
-
-   if (data) {
-      dList_remove_fast(fd_map, data);
-      dFree(data);
+   if (Http_fd_map_get(fd)) {
+      fd_map[fd] = 0;
    } else {
       MSG("FD ENTRY NOT FOUND FOR %d\n", fd);
    }
@@ -213,10 +267,9 @@ static void Http_fd_map_remove_entry(int fd)
 void a_Http_connect_done(int fd, bool_t success)
 {
    SocketData_t *sd;
-   FdMapEntry_t *fme = dList_find_custom(fd_map, INT2VOIDP(fd),
-                                            Http_fd_map_cmp);
+   int skey = Http_fd_map_get(fd);
 
-   if (fme && (sd = a_Klist_get_data(ValidSocks, fme->skey))) {
+   if (skey && (sd = a_Klist_get_data(ValidSocks, skey))) {
       ChainLink *info = sd->Info;
       bool_t valid_web = a_Web_valid(sd->web);
 
@@ -233,7 +286,40 @@ void a_Http_connect_done(int fd, bool_t success)
          dFree(info);
       }
    } else {
-      MSG("**** but no luck with fme %p or sd\n", fme);
+      MSG("**** but no luck with skey %d or sd\n", skey);
+   }
+}
+
+/*
+ * Return the number of connections open for 'bw'.
+ */
+static int Http_bw_conns(BrowserWindow *bw)
+{
+   BwConns_t *bc;
+   int i;
+
+   for (i = 0; (bc = dList_nth_data(bw_conns, i)); i++)
+      if (bc->bw == bw)
+         return bc->conns;
+   return 0;
+}
+
+static void Http_bw_conns_add(BrowserWindow *bw, int n)
+{
+   BwConns_t *bc;
+   int i;
+
+   for (i = 0; (bc = dList_nth_data(bw_conns, i)); i++)
+      if (bc->bw == bw)
+         break;
+   if (!bc) {
+      bc = dNew0(BwConns_t, 1);
+      bc->bw = bw;
+      dList_append(bw_conns, bc);
+   }
+   if ((bc->conns += n) <= 0) {
+      dList_remove_fast(bw_conns, bc);
+      dFree(bc);
    }
 }
 
@@ -242,9 +328,90 @@ static void Http_socket_activate(Server_t *srv, SocketData_t *sd)
    dList_remove(srv->queue, sd);
    sd->flags &= ~HTTP_SOCKET_QUEUED;
    srv->active_conns++;
+   active_conns_total++;
+   Http_bw_conns_add(sd->bw, 1);
    sd->connected_to = srv->host;
 }
 
+/*
+ * The connection of 'sd' no longer counts against the limits.
+ */
+static void Http_socket_deactivate(Server_t *srv, SocketData_t *sd)
+{
+   srv->active_conns--;
+   active_conns_total--;
+   Http_bw_conns_add(sd->bw, -1);
+   sd->connected_to = NULL;
+}
+
+/*
+ * Choose the socket in 'srv's queue that should connect next, if the
+ * server is below its connection limit: one of the best priority there,
+ * favouring the window with fewer connections open so that a busy tab
+ * doesn't hold the others up. The queue is kept sorted by priority.
+ */
+static SocketData_t *Http_queue_pick(Server_t *srv)
+{
+   SocketData_t *sd, *best = NULL;
+   int i, conns, best_conns = 0;
+
+   if (srv->active_conns >= prefs.http_max_conns)
+      return NULL;
+
+   for (i = 0; (sd = dList_nth_data(srv->queue, i)); i++) {
+      if (best && sd->priority > best->priority)
+         break;
+      if ((sd->flags & HTTP_SOCKET_TO_BE_FREED) || !a_Web_valid(sd->web) ||
+          ((sd->flags & HTTP_SOCKET_TLS) &&
+           a_Tls_connect_ready(sd->url) != TLS_CONNECT_READY))
+         continue;
+      conns = Http_bw_conns(sd->bw);
+      if (!best || conns < best_conns) {
+         best = sd;
+         best_conns = conns;
+      }
+   }
+   return best;
+}
+
+/*
+ * Connect queued sockets, across all servers and best priority first,
+ * while the global and per server connection limits allow it.
+ */
+static void Http_connect_scheduled(void)
+{
+   Server_t *srv, *best_srv;
+   SocketData_t *sd, *best;
+   int i;
+
+   while (prefs.http_max_total_conns <= 0 ||
+          active_conns_total < prefs.http_max_total_conns) {
+      best = NULL;
+      best_srv = NULL;
+      for (i = 0; (srv = dList_nth_data(servers, i)); i++) {
+         if ((sd = Http_queue_pick(srv)) &&
+             (!best || sd->priority < best->priority ||
+              (sd->priority == best->priority &&
+               Http_bw_conns(sd->bw) < Http_bw_conns(best->bw)))) {
+            best = sd;
+            best_srv = srv;
+         }
+      }
+      if (!best)
+         break;
+
+      best_srv->running_the_queue++;
+      Http_socket_activate(best_srv, best);
+      Http_connect_socket(best->Info);
+      if (--best_srv->running_the_queue == 0 &&
+          best_srv->active_conns == 0 && dList_length(best_srv->queue) == 0)
+         Http_server_remove(best_srv);
+   }
+}
+
+/*
+ * Drop the dead entries in 'srv's queue and run the scheduler.
+ */
 static void Http_connect_queued_sockets(Server_t *srv)
 {
    SocketData_t *sd;
@@ -252,39 +419,28 @@ static void Http_connect_queued_sockets(Server_t *srv)
 
    srv->running_the_queue++;
 
-   for (i = 0;
-        (i < dList_length(srv->queue) &&
-         srv->active_conns < prefs.http_max_conns);
-        i++) {
-      sd = dList_nth_data(srv->queue, i);
-
+   for (i = 0; (sd = dList_nth_data(srv->queue, i)); i++) {
+      if (!(sd->flags & HTTP_SOCKET_TO_BE_FREED) &&
+          (!a_Web_valid(sd->web) ||
+           ((sd->flags & HTTP_SOCKET_TLS) &&
+            a_Tls_connect_ready(sd->url) == TLS_CONNECT_NEVER))) {
+         /* leaves it in the queue, to be freed */
+         Http_socket_free(VOIDP2INT(sd->Info->LocalKey));
+      }
       if (sd->flags & HTTP_SOCKET_TO_BE_FREED) {
          dList_remove(srv->queue, sd);
          dFree(sd);
          i--;
-      } else {
-         int connect_ready = TLS_CONNECT_READY;
-
-         if (sd->flags & HTTP_SOCKET_TLS)
-            connect_ready = a_Tls_connect_ready(sd->url);
-
-         if (connect_ready == TLS_CONNECT_NEVER || !a_Web_valid(sd->web)) {
-            int SKey = VOIDP2INT(sd->Info->LocalKey);
-
-            Http_socket_free(SKey);
-         } else if (connect_ready == TLS_CONNECT_READY) {
-            i--;
-            Http_socket_activate(srv, sd);
-            Http_connect_socket(sd->Info);
-         }
       }
    }
 
+   Http_connect_scheduled();
+
    _MSG("Queue http%s://%s:%u len %d\n", srv->https ? "s" : "", srv->host,
         srv->port, dList_length(srv->queue));
 
    if (--srv->running_the_queue == 0) {
-      if (srv->active_conns == 0)
+      if (srv->active_conns == 0 && dList_length(srv->queue) == 0)
          Http_server_remove(srv);
    }
 }
@@ -304,7 +460,23 @@ static void Http_socket_free(int SKey)
          a_IOwatch_remove_fd(S->SockFD, -1);
          dClose(S->SockFD);
       }
+      if (S->attempts)
+         Http_connect_attempts_free(S);
+      if (S->pipeline)
+         Http_pipeline_requeue(S);
+      if (S->flags & HTTP_SOCKET_PIPELINED) {
+         SocketData_t *owner = a_Klist_get_data(ValidSocks,S->pipeline_owner);
+
+         /* Its answer will still arrive; the connection can't be handed
+          * on past it. */
+         if (owner) {
+            dList_remove(owner->pipeline, S);
+            owner->flags |= HTTP_SOCKET_PIPELINE_BROKEN;
+         }
+      }
       dStr_free(S->https_proxy_reply, 1);
+      a_Dns_addr_list_free(S->addr_list);
+      S->addr_list = NULL;
 
       if (S->flags & HTTP_SOCKET_QUEUED) {
          S->flags |= HTTP_SOCKET_TO_BE_FREED;
@@ -318,7 +490,7 @@ static void Http_socket_free(int SKey)
 
             Server_t *srv = Http_server_get(S->connected_to, S->connect_port,
                                             (S->flags & HTTP_SOCKET_TLS));
-            srv->active_conns--;
+            Http_socket_deactivate(srv, S);
             Http_connect_queued_sockets(srv);
          }
          a_Url_free(S->url);
@@ -382,10 +554,12 @@ static Dstr *Http_make_content_type(const DilloUrl *url)
 static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
 {
    char *ptr, *cookies, *referer, *auth;
+   const char *etag, *last_modified;
    const DilloUrl *url = web->url;
    Dstr *query      = dStr_new(""),
         *request_uri = dStr_new(""),
-        *proxy_auth = dStr_new("");
+        *proxy_auth = dStr_new(""),
+        *conditional = dStr_new("");
 
    /* BUG: dillo doesn't actually understand application/xml yet */
    const char *accept_hdr_value =
@@ -396,6 +570,9 @@ static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
    const char *connection_hdr_val =
       (prefs.http_persistent_conns == TRUE) ? "keep-alive" : "close";
 
+   const char *accept_enc = a_Decode_content_encodings(
+      !dStrAsciiCasecmp(URL_SCHEME(url), "https"));
+
    if (use_proxy) {
       dStr_sprintfa(request_uri, "%s%s",
                     URL_STR(url),
@@ -425,7 +602,7 @@ static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
          "User-Agent: %s\r\n"
          "Accept: %s\r\n"
          "%s" /* language */
-         "Accept-Encoding: gzip, deflate\r\n"
+         "Accept-Encoding: %s\r\n"
          "%s" /* auth */
          "DNT: 1\r\n"
          "%s" /* proxy auth */
@@ -436,12 +613,20 @@ static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
          "%s" /* cookies */
          "\r\n",
          request_uri->str, URL_AUTHORITY(url), prefs.http_user_agent,
-         accept_hdr_value, HTTP_Language_hdr, auth ? auth : "",
+         accept_hdr_value, HTTP_Language_hdr, accept_enc, auth ? auth : "",
          proxy_auth->str, referer, connection_hdr_val, content_type->str,
          (long)URL_DATA(url)->len, cookies);
       dStr_append_l(query, URL_DATA(url)->str, URL_DATA(url)->len);
       dStr_free(content_type, TRUE);
    } else {
+      if (a_Cache_get_validators(url, &etag, &last_modified)) {
+         /* revalidate the cached copy */
+         if (etag)
+            dStr_sprintfa(conditional, "If-None-Match: %s\r\n", etag);
+         if (last_modified)
+            dStr_sprintfa(conditional, "If-Modified-Since: %s\r\n",
+                          last_modified);
+      }
       dStr_sprintfa(
          query,
          "GET %s HTTP/1.1\r\n"
@@ -449,21 +634,22 @@ static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
          "User-Agent: %s\r\n"
          "Accept: %s\r\n"
          "%s" /* language */
-         "Accept-Encoding: gzip, deflate\r\n"
+         "Accept-Encoding: %s\r\n"
          "%s" /* auth */
          "DNT: 1\r\n"
          "%s" /* proxy auth */
          "%s" /* referer */
          "Connection: %s\r\n"
          "%s" /* cache control */
+         "%s" /* conditional */
          "%s" /* cookies */
          "\r\n",
          request_uri->str, URL_AUTHORITY(url), prefs.http_user_agent,
-         accept_hdr_value, HTTP_Language_hdr, auth ? auth : "",
+         accept_hdr_value, HTTP_Language_hdr, accept_enc, auth ? auth : "",
          proxy_auth->str, referer, connection_hdr_val,
          (URL_FLAGS(url) & URL_E2EQuery) ?
             "Pragma: no-cache\r\nCache-Control: no-cache\r\n" : "",
-         cookies);
+         conditional->str, cookies);
    }
    dFree(referer);
    dFree(cookies);
@@ -471,6 +657,7 @@ static Dstr *Http_make_query_str(DilloWeb *web, bool_t use_proxy)
 
    dStr_free(request_uri, TRUE);
    dStr_free(proxy_auth, TRUE);
+   dStr_free(conditional, TRUE);
    _MSG("Query: {%s}\n", dStr_printable(query, 8192));
    return query;
 }
@@ -522,74 +709,168 @@ static void Http_connect_tls(ChainLink *info)
 }
 
 /*
- * connect() couldn't complete before, but now it's ready, so let's try again.
+ * Milliseconds elapsed between 't0' and 't1'.
  */
-static void Http_connect_socket_cb(int fd, void *data)
+static long Http_msec_diff(const struct timeval *t0, const struct timeval *t1)
 {
-   int SKey = VOIDP2INT(data);
-   SocketData_t *S = a_Klist_get_data(ValidSocks, SKey);
+   return (t1->tv_sec - t0->tv_sec) * 1000L +
+          (t1->tv_usec - t0->tv_usec) / 1000L;
+}
 
-   if (S) {
-      int ret, connect_ret;
-      uint_t connect_ret_size = sizeof(connect_ret);
+/*
+ * Reorder the DNS answer so that address families alternate, keeping the
+ * resolver's preference within each family (RFC 8305, section 4).
+ */
+static void Http_addr_list_interleave(Dlist *addr_list)
+{
+   int i, j, n = dList_length(addr_list);
 
-      a_IOwatch_remove_fd(fd, -1); 
-      S->flags &= ~HTTP_SOCKET_IOWATCH_ACTIVE;
+   for (i = 1; i < n; i++) {
+      DilloHost *prev = dList_nth_data(addr_list, i - 1);
 
-      ret = getsockopt(S->SockFD, SOL_SOCKET, SO_ERROR, &connect_ret,
-                       &connect_ret_size);
+      if (((DilloHost *)dList_nth_data(addr_list, i))->af != prev->af)
+         continue;
+      for (j = i + 1; j < n; j++) {
+         DilloHost *dh = dList_nth_data(addr_list, j);
 
-      if (ret < 0 || connect_ret != 0) {
-         if (ret < 0) {
-            MSG("Http_connect_socket_cb getsockopt ERROR: %s.\n",
-                dStrerror(errno));
-         } else {
-            MSG("Http_connect_socket_cb connect ERROR: %s.\n",
-                dStrerror(connect_ret));
+         if (dh->af != prev->af) {
+            dList_remove(addr_list, dh);
+            dList_insert_pos(addr_list, dh, i);
+            break;
          }
-         MSG("Http_connect_socket() will try another IP address.\n");
-         S->addr_list_idx++;
-         Http_connect_socket(S->Info);
-      } else if (S->flags & HTTP_SOCKET_TLS) {
-         Http_connect_tls(S->Info);
-      } else {
-         a_Http_connect_done(S->SockFD, TRUE);
       }
+      if (j == n)
+         break;   /* only one family left */
    }
 }
 
 /*
- * This function is called after the DNS succeeds in solving a hostname.
- * Task: Finish socket setup and start connecting the socket.
+ * Stop watching and close every connection attempt of 'S'.
  */
-static void Http_connect_socket(ChainLink *Info)
+static void Http_connect_attempts_free(SocketData_t *S)
+{
+   ConnAttempt_t *a;
+
+   while ((a = dList_nth_data(S->attempts, 0))) {
+      dList_remove_fast(S->attempts, a);
+      a_IOwatch_remove_fd(a->fd, -1);
+      dClose(a->fd);
+      dFree(a);
+   }
+   dList_free(S->attempts);
+   S->attempts = NULL;
+}
+
+/*
+ * Find the connection attempt on 'fd' and remove it from 'S'.
+ */
+static ConnAttempt_t *Http_connect_attempt_take(SocketData_t *S, int fd)
+{
+   int i;
+   ConnAttempt_t *a;
+
+   for (i = 0; (a = dList_nth_data(S->attempts, i)); i++) {
+      if (a->fd == fd) {
+         dList_remove_fast(S->attempts, a);
+         return a;
+      }
+   }
+   return NULL;
+}
+
+/*
+ * None of the addresses could be connected to.
+ */
+static void Http_connect_failed(SocketData_t *S)
+{
+   ChainLink *info = S->Info;
+
+   MSG("Http_connect_socket ran out of IP addrs to try.\n");
+   MSG_BW(S->web, 1, "Could not establish connection.");
+   Http_socket_free(VOIDP2INT(info->LocalKey)); /* free S */
+   a_Chain_bfcb(OpAbort, info, NULL, "Both");
+   dFree(info);
+}
+
+/*
+ * The attempt 'a' connected first: abandon the others and carry on with it.
+ */
+static void Http_connect_won(SocketData_t *S, ConnAttempt_t *a)
+{
+   struct timeval now;
+   long msec;
+
+   Http_connect_attempts_free(S);
+   S->SockFD = a->fd;
+   Http_fd_map_add_entry(S);
+
+   gettimeofday(&now, NULL);
+   msec = Http_msec_diff(&S->connect_start, &now);
+   ConnectStats.connects++;
+   ConnectStats.total_msec += msec;
+   if (msec > ConnectStats.max_msec)
+      ConnectStats.max_msec = msec;
+   if (a->addr_idx > 0)
+      ConnectStats.fallbacks++;
+   _MSG("Connected to address #%d of %d in %ld ms\n", a->addr_idx + 1,
+        dList_length(S->addr_list), msec);
+   dFree(a);
+
+   if (S->flags & HTTP_SOCKET_TLS) {
+      Http_connect_tls(S->Info);
+   } else {
+      a_Http_connect_done(S->SockFD, TRUE);
+   }
+}
+
+/*
+ * Arrange for the next connection attempt to start after the attempt delay
+ * unless it has been started for another reason by then.
+ */
+static void Http_connect_attempt_schedule(SocketData_t *S)
+{
+   long usec;
+
+   gettimeofday(&S->next_attempt, NULL);
+   usec = S->next_attempt.tv_usec + HTTP_CONNECT_ATTEMPT_DELAY * 1000L;
+   S->next_attempt.tv_sec += usec / 1000000L;
+   S->next_attempt.tv_usec = usec % 1000000L;
+
+   if (!(S->flags & HTTP_SOCKET_ATTEMPT_TIMER)) {
+      S->flags |= HTTP_SOCKET_ATTEMPT_TIMER;
+      a_Timeout_add(HTTP_CONNECT_ATTEMPT_DELAY / 1000.0,
+                    Http_connect_attempt_timeout, S->Info->LocalKey);
+   }
+}
+
+/*
+ * Start connecting to the next usable address of 'S'.
+ * Note: 'S' may have been freed on return.
+ */
+static void Http_connect_next_attempt(SocketData_t *S)
 {
    DilloHost *dh;
-   SocketData_t *S = a_Klist_get_data(ValidSocks, VOIDP2INT(Info->LocalKey));
 
-   for (; (dh = dList_nth_data(S->addr_list, S->addr_list_idx));
-        S->addr_list_idx++) {
+   while ((dh = dList_nth_data(S->addr_list, S->addr_list_idx))) {
 #ifdef ENABLE_IPV6
       struct sockaddr_in6 name;
 #else
       struct sockaddr_in name;
 #endif
       socklen_t socket_len = 0;
+      ConnAttempt_t *a;
+      int fd;
 
-      if (S->addr_list_idx > 0 && S->SockFD >= 0) {
-         /* clean up the previous one that failed */
-         Http_fd_map_remove_entry(S->SockFD);
-         dClose(S->SockFD);
-      }
-      if ((S->SockFD = socket(dh->af, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+      S->addr_list_idx++;
+      if ((fd = socket(dh->af, SOCK_STREAM, IPPROTO_TCP)) < 0) {
          MSG("Http_connect_socket socket() ERROR: %s\n", dStrerror(errno));
          continue;
       }
-      Http_fd_map_add_entry(S);
+      ConnectStats.attempts++;
 
       /* set NONBLOCKING and close on exec. */
-      fcntl(S->SockFD, F_SETFL, O_NONBLOCK | fcntl(S->SockFD, F_GETFL));
-      fcntl(S->SockFD, F_SETFD, FD_CLOEXEC | fcntl(S->SockFD, F_GETFD));
+      fcntl(fd, F_SETFL, O_NONBLOCK | fcntl(fd, F_GETFL));
+      fcntl(fd, F_SETFD, FD_CLOEXEC | fcntl(fd, F_GETFD));
 
       /* Some OSes require this...  */
       memset(&name, 0, sizeof(name));
@@ -625,34 +906,118 @@ static void Http_connect_socket(ChainLink *Info)
       } /* switch */
       MSG_BW(S->web, 1, "Contacting host...");
 
-      if (connect(S->SockFD, (struct sockaddr *)&name, socket_len) == 0) {
+      a = dNew(ConnAttempt_t, 1);
+      a->fd = fd;
+      a->addr_idx = S->addr_list_idx - 1;
+      if (connect(fd, (struct sockaddr *)&name, socket_len) == 0) {
          /* probably never succeeds immediately on any system */
-         if (S->flags & HTTP_SOCKET_TLS) {
-            Http_connect_tls(Info);
-            break;
-         } else {
-            a_Http_connect_done(S->SockFD, TRUE);
-            break;
-         }
+         Http_connect_won(S, a);
+         return;
+      } else if (errno == EINPROGRESS) {
+         dList_append(S->attempts, a);
+         a_IOwatch_add_fd(fd, DIO_WRITE, Http_connect_socket_cb,
+                          S->Info->LocalKey);
+         if (S->addr_list_idx < dList_length(S->addr_list))
+            Http_connect_attempt_schedule(S);
+         return;
       } else {
-         if (errno == EINPROGRESS) {
-            a_IOwatch_add_fd(S->SockFD, DIO_WRITE, Http_connect_socket_cb,
-                             Info->LocalKey);
-            S->flags |= HTTP_SOCKET_IOWATCH_ACTIVE;
-            break;
+         MSG("Http_connect_socket connect ERROR: %s\n", dStrerror(errno));
+         MSG("We will try another IP address.\n");
+         dClose(fd);
+         dFree(a);
+      }
+   }
+
+   if (dList_length(S->attempts) == 0)
+      Http_connect_failed(S);
+}
+
+/*
+ * The attempt delay has passed: if no address has answered yet, start
+ * racing the next one.
+ */
+static void Http_connect_attempt_timeout(void *data)
+{
+   SocketData_t *S = a_Klist_get_data(ValidSocks, VOIDP2INT(data));
+
+   if (S && S->attempts) {
+      struct timeval now;
+      long msec;
+
+      S->flags &= ~HTTP_SOCKET_ATTEMPT_TIMER;
+      gettimeofday(&now, NULL);
+      msec = Http_msec_diff(&now, &S->next_attempt);
+      if (msec > 0) {
+         /* another attempt started meanwhile; wait for its delay */
+         S->flags |= HTTP_SOCKET_ATTEMPT_TIMER;
+         a_Timeout_add(msec / 1000.0, Http_connect_attempt_timeout, data);
+      } else if (S->addr_list_idx < dList_length(S->addr_list)) {
+         Http_connect_next_attempt(S);
+      }
+   } else if (S) {
+      S->flags &= ~HTTP_SOCKET_ATTEMPT_TIMER;
+   }
+   a_Timeout_remove();
+}
+
+/*
+ * connect() couldn't complete before, but now one attempt is ready.
+ */
+static void Http_connect_socket_cb(int fd, void *data)
+{
+   int SKey = VOIDP2INT(data);
+   SocketData_t *S = a_Klist_get_data(ValidSocks, SKey);
+   ConnAttempt_t *a;
+
+   if (S && (a = Http_connect_attempt_take(S, fd))) {
+      int ret, connect_ret;
+      uint_t connect_ret_size = sizeof(connect_ret);
+
+      a_IOwatch_remove_fd(fd, -1);
+
+      ret = getsockopt(fd, SOL_SOCKET, SO_ERROR, &connect_ret,
+                       &connect_ret_size);
+
+      if (ret < 0 || connect_ret != 0) {
+         if (ret < 0) {
+            MSG("Http_connect_socket_cb getsockopt ERROR: %s.\n",
+                dStrerror(errno));
          } else {
-            MSG("Http_connect_socket connect ERROR: %s\n", dStrerror(errno));
-            MSG("We will try another IP address.\n");
+            MSG("Http_connect_socket_cb connect ERROR: %s.\n",
+                dStrerror(connect_ret));
          }
+         dClose(fd);
+         dFree(a);
+         /* Don't wait for the attempt delay after a failure */
+         if (S->addr_list_idx < dList_length(S->addr_list)) {
+            MSG("Http_connect_socket() will try another IP address.\n");
+            Http_connect_next_attempt(S);
+         } else if (dList_length(S->attempts) == 0) {
+            Http_connect_failed(S);
+         }
+      } else {
+         Http_connect_won(S, a);
       }
-   } /* for */
-
-   if (S->addr_list_idx >= dList_length(S->addr_list) ) {
-      MSG("Http_connect_socket ran out of IP addrs to try.\n");
-      a_Http_connect_done(S->SockFD, FALSE);
    }
 }
 
+/*
+ * This function is called after the DNS succeeds in solving a hostname.
+ * Task: Finish socket setup and start connecting the socket.
+ *
+ * The addresses are raced in the Happy Eyeballs way (RFC 8305): a new
+ * attempt starts every HTTP_CONNECT_ATTEMPT_DELAY ms, or as soon as the
+ * previous one fails, and the first one to connect is kept.
+ */
+static void Http_connect_socket(ChainLink *Info)
+{
+   SocketData_t *S = a_Klist_get_data(ValidSocks, VOIDP2INT(Info->LocalKey));
+
+   gettimeofday(&S->connect_start, NULL);
+   S->attempts = dList_new(4);
+   Http_connect_next_attempt(S);
+}
+
 /*
  * Test proxy settings and check the no_proxy domains list
  * Return value: whether to use proxy or not.
@@ -745,8 +1110,9 @@ static void Http_dns_cb(int Status, Dlist *addr_list, void *data)
          if (Status == 0 && addr_list) {
 
             /* Successful DNS answer; save the IP */
-            S->addr_list = addr_list;
+            S->addr_list = a_Dns_addr_list_dup(addr_list);
             S->addr_list_idx = 0;
+            Http_addr_list_interleave(S->addr_list);
             clean_up = FALSE;
             srv = Http_server_get(host, S->connect_port,
                                  (S->flags & HTTP_SOCKET_TLS));
@@ -767,6 +1133,22 @@ static void Http_dns_cb(int Status, Dlist *addr_list, void *data)
    }
 }
 
+/*
+ * Where does a request for 'web' go in the connection queues?
+ * Images that the page didn't expect to be in view wait for the rest.
+ */
+static int Http_socket_priority(DilloWeb *web)
+{
+   if (web->flags & WEB_Download)
+      return HTTP_PRIO_DOWNLOAD;
+   if (web->flags & WEB_Image)
+      return (web->flags & WEB_Offscreen) ? HTTP_PRIO_IMAGE_OFFSCREEN
+                                          : HTTP_PRIO_IMAGE;
+   if (web->flags & WEB_Stylesheet)
+      return HTTP_PRIO_STYLESHEET;
+   return HTTP_PRIO_DOCUMENT;
+}
+
 /*
  * Asynchronously create a new http connection for 'Url'
  * We'll set some socket parameters; the rest will be set later
@@ -785,6 +1167,8 @@ static int Http_get(ChainLink *Info, void *Data1)
    S->web = Data1;
    /* Reference Info data */
    S->Info = Info;
+   S->bw = S->web->bw;
+   S->priority = Http_socket_priority(S->web);
 
    /* Proxy support */
    if (Http_must_use_proxy(URL_HOST(S->web->url))) {
@@ -833,10 +1217,134 @@ static bool_t Http_socket_reuse_compatible(SocketData_t *old,
 }
 
 /*
- * If any entry in the socket data queue can reuse our connection, set it up
- * and send off a new query.
+ * Is 'S' a request that may go out before the previous one is answered?
+ */
+static bool_t Http_socket_pipelineable(SocketData_t *S)
+{
+   /* Only idempotent requests, and not through proxies that may not
+    * know how to keep the answers in order. */
+   return !(URL_FLAGS(S->url) & URL_Post) &&
+          !(S->flags & HTTP_SOCKET_USE_PROXY);
+}
+
+/*
+ * Send the queries of compatible queued sockets over the connection that
+ * 'S' is waiting an answer on, up to prefs.http_pipeline_depth in flight.
+ * This is only done after the server has kept the connection open for a
+ * complete answer.
+ */
+static void Http_pipeline_fill(Server_t *srv, SocketData_t *S)
+{
+   SocketData_t *P;
+   Dstr *queries, *query;
+   DataBuf *dbuf;
+   int i, SKey = VOIDP2INT(S->Info->LocalKey);
+
+   if (prefs.http_pipeline_depth < 2 || srv->no_pipelining ||
+       !Http_socket_pipelineable(S))
+      return;
+
+   queries = dStr_new("");
+   for (i = 0; i < dList_length(srv->queue) &&
+        1 + dList_length(S->pipeline) < prefs.http_pipeline_depth; i++) {
+      P = dList_nth_data(srv->queue, i);
+
+      if (!(P->flags & HTTP_SOCKET_TO_BE_FREED) &&
+          Http_socket_pipelineable(P) &&
+          Http_socket_reuse_compatible(S, P)) {
+         dList_remove(srv->queue, P);
+         i--;
+         P->flags &= ~HTTP_SOCKET_QUEUED;
+         P->flags |= HTTP_SOCKET_PIPELINED;
+         P->pipeline_owner = SKey;
+         if (!S->pipeline)
+            S->pipeline = dList_new(4);
+         dList_append(S->pipeline, P);
+
+         query = Http_make_query_str(P->web, FALSE);
+         dStr_append_l(queries, query->str, query->len);
+         dStr_free(query, 1);
+         MSG_BW(P->web, 1, "Sending query (pipelined)...");
+         PipelineStats.requests++;
+      }
+   }
+   if (queries->len) {
+      /* All of them go out through the writer of 'S' */
+      dbuf = a_Chain_dbuf_new(queries->str, queries->len, 0);
+      a_Chain_bcb(OpSend, S->Info, dbuf, NULL);
+      dFree(dbuf);
+   }
+   dStr_free(queries, 1);
+}
+
+/*
+ * The connection is going away with queries pipelined on it unanswered.
+ * Queue their sockets again, to be sent over a new connection.
  */
-static void Http_socket_reuse(int SKey)
+static void Http_pipeline_requeue(SocketData_t *S)
+{
+   Server_t *srv = Http_server_get(S->connected_to, S->connect_port,
+                                   (S->flags & HTTP_SOCKET_TLS));
+   SocketData_t *P;
+
+   while ((P = dList_nth_data(S->pipeline, 0))) {
+      dList_remove(S->pipeline, P);
+      P->flags &= ~HTTP_SOCKET_PIPELINED;
+      Http_socket_enqueue(srv, P);
+      PipelineStats.requeued++;
+   }
+   dList_free(S->pipeline);
+   S->pipeline = NULL;
+}
+
+/*
+ * Hand the connection on to the first socket in 'old_sd's pipeline.
+ * Its query was sent already; 'rest' is the beginning of its answer.
+ */
+static void Http_pipeline_advance(Server_t *srv, SocketData_t *old_sd,
+                                  Dstr *rest)
+{
+   SocketData_t *P, *new_sd = dList_nth_data(old_sd->pipeline, 0);
+   int i, NKey = VOIDP2INT(new_sd->Info->LocalKey);
+
+   dList_remove(old_sd->pipeline, new_sd);
+   if (dList_length(old_sd->pipeline) > 0) {
+      new_sd->pipeline = old_sd->pipeline;
+   } else {
+      dList_free(old_sd->pipeline);
+   }
+   old_sd->pipeline = NULL;
+   for (i = 0; (P = dList_nth_data(new_sd->pipeline, i)); i++)
+      P->pipeline_owner = NKey;
+   new_sd->flags &= ~HTTP_SOCKET_PIPELINED;
+   new_sd->SockFD = old_sd->SockFD;
+
+   Http_socket_deactivate(srv, old_sd);
+   Http_socket_free(VOIDP2INT(old_sd->Info->LocalKey));
+
+   _MSG("Pipelined fd %d for %s\n", new_sd->SockFD, URL_STR(new_sd->url));
+   Http_socket_activate(srv, new_sd);
+   Http_fd_map_add_entry(new_sd);
+   a_Chain_bfcb(OpSend, new_sd->Info, &new_sd->SockFD, "FD");
+   Http_pipeline_fill(srv, new_sd);
+
+   /* Processing 'rest' may complete this answer and free new_sd */
+   if (rest->len && (new_sd = a_Klist_get_data(ValidSocks, NKey)) &&
+       new_sd->InfoRecv) {
+      DataBuf *dbuf = a_Chain_dbuf_new(rest->str, rest->len, 0);
+
+      a_Chain_fcb(OpSend, new_sd->InfoRecv, dbuf, "send_page_2eof");
+      dFree(dbuf);
+   }
+}
+
+/*
+ * The answer on our connection is complete. Pass the connection on to the
+ * next pipelined query, or to any entry in the socket data queue that can
+ * reuse it (setting it up and sending off a new query).
+ * 'rest' holds whatever the server sent past the answer.
+ */
+static void Http_socket_reuse(int SKey, Dstr *rest)
 {
    SocketData_t *new_sd, *old_sd = a_Klist_get_data(ValidSocks, SKey);
 
@@ -846,24 +1354,42 @@ static void Http_socket_reuse(int SKey)
                                       (old_sd->flags & HTTP_SOCKET_TLS));
       int i, n = dList_length(srv->queue);
 
-      for (i = 0; i < n; i++) {
-         new_sd = dList_nth_data(srv->queue, i);
+      if (old_sd->pipeline) {
+         /* (a broken pipeline may be empty: an answer is still due) */
+         new_sd = dList_nth_data(old_sd->pipeline, 0);
+         if (!(old_sd->flags & HTTP_SOCKET_PIPELINE_BROKEN) && new_sd &&
+             a_Web_valid(new_sd->web)) {
+            Http_pipeline_advance(srv, old_sd, rest);
+            return;
+         }
+         /* Closing the connection requeues the rest of the pipeline */
+      } else if (rest->len) {
+         /* Out of step with the server: don't reuse the connection */
+         _MSG("Http: %d unexpected bytes after the answer for %s\n",
+              rest->len, URL_STR(old_sd->url));
+      } else {
+         for (i = 0; i < n; i++) {
+            new_sd = dList_nth_data(srv->queue, i);
 
-         if (!(new_sd->flags & HTTP_SOCKET_TO_BE_FREED) &&
-             Http_socket_reuse_compatible(old_sd, new_sd)) {
-            const bool_t success = TRUE;
+            if (!(new_sd->flags & HTTP_SOCKET_TO_BE_FREED) &&
+                Http_socket_reuse_compatible(old_sd, new_sd)) {
+               const bool_t success = TRUE;
+               int NKey = VOIDP2INT(new_sd->Info->LocalKey);
 
-            new_sd->SockFD = old_sd->SockFD;
+               new_sd->SockFD = old_sd->SockFD;
 
-            old_sd->connected_to = NULL;
-            srv->active_conns--;
-            Http_socket_free(SKey);
+               Http_socket_deactivate(srv, old_sd);
+               Http_socket_free(SKey);
 
-            _MSG("Reusing fd %d for %s\n",new_sd->SockFD,URL_STR(new_sd->url));
-            Http_socket_activate(srv, new_sd);
-            Http_fd_map_add_entry(new_sd);
-            a_Http_connect_done(new_sd->SockFD, success);
-            return;
+               _MSG("Reusing fd %d for %s\n",
+                    new_sd->SockFD, URL_STR(new_sd->url));
+               Http_socket_activate(srv, new_sd);
+               Http_fd_map_add_entry(new_sd);
+               a_Http_connect_done(new_sd->SockFD, success);
+               if ((new_sd = a_Klist_get_data(ValidSocks, NKey)))
+                  Http_pipeline_fill(srv, new_sd);
+               return;
+            }
          }
       }
       dClose(old_sd->SockFD);
@@ -972,6 +1498,14 @@ void a_Http_ccc(int Op, int Branch, int Dir, ChainLink *Info,
                Http_socket_free(SKey);
                a_Chain_bfcb(OpAbort, Info, NULL, "Both");
             } else {
+               if (sd->pipeline) {
+                  MSG("Http: %s closed the connection with pipelined "
+                      "requests pending; not pipelining to it anymore.\n",
+                      URL_HOST(sd->url));
+                  Http_server_get(sd->connected_to, sd->connect_port,
+                                  (sd->flags & HTTP_SOCKET_TLS))
+                     ->no_pipelining = TRUE;
+               }
                Http_socket_free(SKey);
                a_Chain_fcb(OpEnd, Info, NULL, NULL);
             }
@@ -1002,13 +1536,21 @@ void a_Http_ccc(int Op, int Branch, int Dir, ChainLink *Info,
             if (Data2) {
                if (!strcmp(Data2, "FD")) {
                   int fd = *(int*)Data1;
-                  FdMapEntry_t *fme = dList_find_custom(fd_map, INT2VOIDP(fd),
-                                                        Http_fd_map_cmp);
-                  Info->LocalKey = INT2VOIDP(fme->skey);
+                  Info->LocalKey = INT2VOIDP(Http_fd_map_get(fd));
+                  if ((sd = a_Klist_get_data(ValidSocks,
+                                             VOIDP2INT(Info->LocalKey))))
+                     sd->InfoRecv = Info;
                   a_Chain_bcb(OpSend, Info, Data1, Data2);
                } else if (!strcmp(Data2, "reply_complete")) {
+                  /* Data1 = dbuf with what followed the answer, or NULL.
+                   * It lives in the IO buffer that OpEnd frees. */
+                  Dstr *rest = dStr_new("");
+
+                  if ((dbuf = Data1))
+                     dStr_append_l(rest, dbuf->Buf, dbuf->Size);
                   a_Chain_bfcb(OpEnd, Info, NULL, NULL);
-                  Http_socket_reuse(SKey);
+                  Http_socket_reuse(SKey, rest);
+                  dStr_free(rest, 1);
                   dFree(Info);
                }
             }
@@ -1027,23 +1569,20 @@ void a_Http_ccc(int Op, int Branch, int Dir, ChainLink *Info,
 }
 
 /*
- * Add socket data to the queue. Pages/stylesheets/etc. have higher priority
- * than images.
+ * Add socket data to the queue, after those of the same or better priority.
  */
 static void Http_socket_enqueue(Server_t *srv, SocketData_t* sock)
 {
-   sock->flags |= HTTP_SOCKET_QUEUED;
+   int i, n = dList_length(srv->queue);
 
-   if ((sock->web->flags & WEB_Image) == 0) {
-      int i, n = dList_length(srv->queue);
+   sock->flags |= HTTP_SOCKET_QUEUED;
 
-      for (i = 0; i < n; i++) {
-         SocketData_t *curr = dList_nth_data(srv->queue, i);
+   for (i = 0; i < n; i++) {
+      SocketData_t *curr = dList_nth_data(srv->queue, i);
 
-         if (a_Web_valid(curr->web) && (curr->web->flags & WEB_Image)) {
-            dList_insert_pos(srv->queue, sock, i);
-            return;
-         }
+      if (curr->priority > sock->priority) {
+         dList_insert_pos(srv->queue, sock, i);
+         return;
       }
    }
    dList_append(srv->queue, sock);
@@ -1105,14 +1644,46 @@ static void Http_servers_remove_all()
 
 static void Http_fd_map_remove_all()
 {
-   FdMapEntry_t *fme;
-   int i, n = dList_length(fd_map);
+   dFree(fd_map);
+   fd_map = NULL;
+   fd_map_size = 0;
+}
 
-   for (i = 0; i < n; i++) {
-      fme = (FdMapEntry_t *) dList_nth_data(fd_map, i);
-      dFree(fme);
+static void Http_bw_conns_remove_all()
+{
+   BwConns_t *bc;
+
+   while ((bc = dList_nth_data(bw_conns, 0))) {
+      dList_remove_fast(bw_conns, bc);
+      dFree(bc);
    }
-   dList_free(fd_map);
+   dList_free(bw_conns);
+   bw_conns = NULL;
+}
+
+/*
+ * Get the connection setup statistics: connect() calls, connections made,
+ * connections won by other than the first address, and the total and
+ * longest time taken to connect (in ms).
+ */
+void a_Http_get_connect_stats(long *attempts, long *connects, long *fallbacks,
+                              long *total_msec, long *max_msec)
+{
+   *attempts = ConnectStats.attempts;
+   *connects = ConnectStats.connects;
+   *fallbacks = ConnectStats.fallbacks;
+   *total_msec = ConnectStats.total_msec;
+   *max_msec = ConnectStats.max_msec;
+}
+
+/*
+ * Get the pipelining statistics: queries sent before the previous answer
+ * arrived, and how many of them had to be sent again.
+ */
+void a_Http_get_pipeline_stats(long *requests, long *requeued)
+{
+   *requests = PipelineStats.requests;
+   *requeued = PipelineStats.requeued;
 }
 
 /*
@@ -1121,8 +1692,17 @@ static void Http_fd_map_remove_all()
  */
 void a_Http_freeall(void)
 {
+   MSG("Http: %ld connections, %ld attempts, %ld fallbacks, "
+       "connect time avg %ld ms max %ld ms\n", ConnectStats.connects,
+       ConnectStats.attempts, ConnectStats.fallbacks,
+       ConnectStats.connects ?
+       ConnectStats.total_msec / ConnectStats.connects : 0,
+       ConnectStats.max_msec);
+   MSG("Http: %ld pipelined requests, %ld requeued\n",
+       PipelineStats.requests, PipelineStats.requeued);
    Http_servers_remove_all();
    Http_fd_map_remove_all();
+   Http_bw_conns_remove_all();
    a_Klist_free(&ValidSocks);
    a_Url_free(HTTP_Proxy);
    dFree(HTTP_Proxy_Auth_base64);
@@ -10,18 +10,202 @@
  */
 
 // Simple ADT for watching file descriptor activity
+//
+// Where epoll is available, every watched FD goes into a single epoll set
+// and only the epoll FD is handed to FLTK, so a wakeup costs the same no
+// matter how many connections are open (select() scans them all, and
+// can't go past FD_SETSIZE). FDs that epoll refuses (regular files) are
+// still handed to FLTK.
+
+#include <config.h>
 
 #include <FL/Fl.H>
 #include "iowatch.hh"
 
+#ifdef HAVE_SYS_EPOLL_H
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../msg.h"
+
+#define IOWATCH_MAX_EVENTS 64
+
+enum { IOW_READ, IOW_WRITE, IOW_EXCEPT, IOW_N };
+
+static const int IOwatch_when[IOW_N] = { DIO_READ, DIO_WRITE, DIO_EXCEPT };
+
+typedef struct {
+   int when;                  // DIO_* events being watched
+   int edge;                  // DIO_* events that asked for DIO_EDGE
+   int registered;            // in the epoll set
+   int fltk;                  // DIO_* events watched by FLTK instead
+   uint32_t gen;              // bumped when the last watch goes away
+   CbFunction_t cb[IOW_N];
+   void *data[IOW_N];
+} IOwatch_t;
+
+static int epoll_fd = -1;
+static bool epoll_failed = false;
+static IOwatch_t *watches = NULL;
+static int watches_size = 0;
+
+//
+// Dispatch the ready events of the epoll set
+//
+static void IOwatch_epoll_cb(int, void *)
+{
+   struct epoll_event ev[IOWATCH_MAX_EVENTS];
+   int i, j, n;
+
+   n = epoll_wait(epoll_fd, ev, IOWATCH_MAX_EVENTS, 0);
+   for (i = 0; i < n; i++) {
+      int fd = (int)(ev[i].data.u64 & 0xffffffff), fired = 0;
+
+      // A callback may have closed this FD, and the number may have been
+      // reused by a new one already: its events are not for it.
+      if (fd >= watches_size || watches[fd].gen != ev[i].data.u64 >> 32)
+         continue;
+
+      // Like select(), report errors and hangups to every watcher
+      if (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+         fired |= DIO_READ;
+      if (ev[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+         fired |= DIO_WRITE;
+      if (ev[i].events & EPOLLPRI)
+         fired |= DIO_EXCEPT;
+
+      // A callback may remove or replace any watch, so check each time
+      for (j = 0; j < IOW_N; j++) {
+         if ((fired & IOwatch_when[j]) && fd < watches_size &&
+             (watches[fd].when & IOwatch_when[j]))
+            watches[fd].cb[j](fd, watches[fd].data[j]);
+      }
+   }
+   // More than IOWATCH_MAX_EVENTS ready ones keep epoll_fd readable,
+   // so FLTK calls back for the rest.
+}
+
+//
+// Create the epoll set and hook it into FLTK's loop
+//
+static bool IOwatch_epoll_init()
+{
+   if (epoll_fd == -1 && !epoll_failed) {
+      if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+         MSG_ERR("IOwatch: epoll_create1: %s\n", strerror(errno));
+         epoll_failed = true;
+      } else {
+         Fl::add_fd(epoll_fd, FL_READ, IOwatch_epoll_cb, NULL);
+      }
+   }
+   return !epoll_failed;
+}
+
+//
+// Bring the epoll registration of 'fd' in line with its watches
+// Return: false if epoll can't watch this kind of FD.
+//
+static bool IOwatch_epoll_update(int fd)
+{
+   IOwatch_t *w = &watches[fd];
+   struct epoll_event ev;
+   int st;
+
+   if (w->when == 0) {
+      if (w->registered) {
+         // The FD may already be closed, which drops it from the set
+         epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+         w->registered = 0;
+      }
+      w->gen++;
+      return true;
+   }
+
+   memset(&ev, 0, sizeof(ev));
+   ev.data.u64 = (uint64_t)w->gen << 32 | (uint32_t)fd;
+   ev.events = ((w->when & DIO_READ) ? EPOLLIN : 0) |
+               ((w->when & DIO_WRITE) ? EPOLLOUT : 0) |
+               ((w->when & DIO_EXCEPT) ? EPOLLPRI : 0);
+   // Edge triggering only when every watcher drains the FD
+   if (w->edge == w->when)
+      ev.events |= EPOLLET;
+
+   st = epoll_ctl(epoll_fd, w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  fd, &ev);
+   if (st < 0) {
+      // A closed and reused FD can leave 'registered' out of date
+      if (errno == ENOENT)
+         st = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+      else if (errno == EEXIST)
+         st = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+   }
+   if (st < 0) {
+      w->registered = 0;
+      if (errno == EPERM)
+         return false;
+      MSG_ERR("IOwatch: epoll_ctl(%d): %s\n", fd, strerror(errno));
+   } else {
+      w->registered = 1;
+   }
+   return true;
+}
+
+#endif /* HAVE_SYS_EPOLL_H */
+
 //
 // Hook a Callback for a certain activities in a FD
 //
 void a_IOwatch_add_fd(int fd, int when, Fl_FD_Handler Callback,
                       void *usr_data = 0)
 {
-   if (fd >= 0)
-      Fl::add_fd(fd, when, Callback, usr_data);
+   if (fd < 0)
+      return;
+
+#ifdef HAVE_SYS_EPOLL_H
+   if (IOwatch_epoll_init()) {
+      int i;
+
+      if (fd >= watches_size) {
+         int old_size = watches_size;
+
+         watches_size = (fd + 1 > 2 * watches_size) ? fd + 1 : 2*watches_size;
+         watches = (IOwatch_t *) realloc(watches,
+                                         watches_size * sizeof(IOwatch_t));
+         memset(watches + old_size, 0,
+                (watches_size - old_size) * sizeof(IOwatch_t));
+      }
+      if (!watches[fd].fltk) {
+         for (i = 0; i < IOW_N; i++) {
+            if (when & IOwatch_when[i]) {
+               watches[fd].when |= IOwatch_when[i];
+               if (when & DIO_EDGE)
+                  watches[fd].edge |= IOwatch_when[i];
+               else
+                  watches[fd].edge &= ~IOwatch_when[i];
+               watches[fd].cb[i] = Callback;
+               watches[fd].data[i] = usr_data;
+            }
+         }
+         if (IOwatch_epoll_update(fd))
+            return;
+         // Not for epoll (a regular file): FLTK's select() takes all of
+         // this FD's watches (it reports such a FD ready at once)
+         for (i = 0; i < IOW_N; i++)
+            if (watches[fd].when & IOwatch_when[i])
+               Fl::add_fd(fd, IOwatch_when[i], watches[fd].cb[i],
+                          watches[fd].data[i]);
+         watches[fd].fltk = watches[fd].when;
+         watches[fd].when = watches[fd].edge = 0;
+         return;
+      }
+      watches[fd].fltk |= when & (DIO_READ | DIO_WRITE | DIO_EXCEPT);
+   }
+#endif
+   Fl::add_fd(fd, when & ~DIO_EDGE, Callback, usr_data);
 }
 
 //
@@ -29,7 +213,21 @@ void a_IOwatch_add_fd(int fd, int when, Fl_FD_Handler Callback,
 //
 void a_IOwatch_remove_fd(int fd, int when)
 {
-   if (fd >= 0)
-      Fl::remove_fd(fd, when);
-}
+   if (fd < 0)
+      return;
 
+#ifdef HAVE_SYS_EPOLL_H
+   if (epoll_fd >= 0) {
+      if (fd < watches_size && watches[fd].when) {
+         watches[fd].when &= ~when;
+         watches[fd].edge &= ~when;
+         IOwatch_epoll_update(fd);
+      } else if (fd < watches_size && watches[fd].fltk) {
+         watches[fd].fltk &= ~when;
+         Fl::remove_fd(fd, when);
+      }
+      return;
+   }
+#endif
+   Fl::remove_fd(fd, when);
+}
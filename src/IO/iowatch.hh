@@ -7,6 +7,9 @@
 #define DIO_READ    1
 #define DIO_WRITE   4
 #define DIO_EXCEPT  8
+/* The callback drains the FD (reads/writes until EAGAIN), so it only
+ * needs to hear about new activity (edge-triggered, where supported) */
+#define DIO_EDGE    0x100
 
 typedef void (*CbFunction_t)(int fd, void *data);
 
@@ -34,6 +34,11 @@ void a_Tls_init()
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include "../../dlib/dlib.h"
 #include "../dialog.hh"
@@ -50,6 +55,7 @@ void a_Tls_init()
 #include <mbedtls/oid.h>
 #include <mbedtls/x509.h>
 #include <mbedtls/net.h>    /* net_send, net_recv */
+#include <mbedtls/version.h>
 
 #define CERT_STATUS_NONE 0
 #define CERT_STATUS_RECEIVING 1
@@ -57,10 +63,17 @@ void a_Tls_init()
 #define CERT_STATUS_BAD 3
 #define CERT_STATUS_USER_ACCEPTED 4
 
+/* mbedtls_ssl_session_save() and _load() appeared in mbed TLS 2.19 */
+#if MBEDTLS_VERSION_NUMBER >= 0x02130000
+#define TLS_SESSION_PERSIST
+#endif
+
 typedef struct {
    char *hostname;
    int port;
    int cert_status;
+   mbedtls_ssl_session *session;  /* to resume, or NULL */
+   time_t session_time;           /* when it was negotiated */
 } Server_t;
 
 typedef struct {
@@ -81,6 +94,8 @@ typedef struct {
    DilloUrl *url;
    mbedtls_ssl_context *ssl;
    bool_t connecting;
+   bool_t resuming;        /* a cached session was offered */
+   struct timeval hs_start;
 } Conn_t;
 
 /* List of active TLS connections */
@@ -96,7 +111,14 @@ static Dlist *servers;
 static Dlist *cert_authorities;
 static Dlist *fd_map;
 
+/* Handshake statistics, reported on exit */
+static struct {
+   int full, resumed;
+   long full_msec, resumed_msec;
+} HandshakeStats;
+
 static void Tls_handshake_cb(int fd, void *vconnkey);
+static void Tls_sessions_load(void);
 
 /*
  * Compare by FD.
@@ -169,6 +191,7 @@ static Conn_t *Tls_conn_new(int fd, const DilloUrl *url,
    conn->url = a_Url_dup(url);
    conn->ssl = ssl;
    conn->connecting = TRUE;
+   gettimeofday(&conn->hs_start, NULL);
    return conn;
 }
 
@@ -413,6 +436,9 @@ void a_Tls_init(void)
    cert_authorities = dList_new(12);
 
    Tls_load_certificates();
+
+   if (prefs.tls_session_cache_disk && prefs.tls_session_ttl > 0)
+      Tls_sessions_load();
 }
 
 /*
@@ -465,7 +491,7 @@ int a_Tls_connect_ready(const DilloUrl *url)
       if (s->cert_status == CERT_STATUS_NONE)
          s->cert_status = CERT_STATUS_RECEIVING;
    } else {
-      s = dNew(Server_t, 1);
+      s = dNew0(Server_t, 1);
 
       s->hostname = dStrdup(URL_HOST(url));
       s->port = URL_PORT(url);
@@ -813,6 +839,49 @@ void a_Tls_reset_server_state(const DilloUrl *url)
    }
 }
 
+/*
+ * Forget the session kept for resuming connections to 'srv'.
+ */
+static void Tls_server_drop_session(Server_t *srv)
+{
+   if (srv->session) {
+      mbedtls_ssl_session_free(srv->session);
+      dFree(srv->session);
+      srv->session = NULL;
+   }
+}
+
+/*
+ * Keep the session of a newly negotiated connection for resuming later ones.
+ */
+static void Tls_server_save_session(Server_t *srv, mbedtls_ssl_context *ssl)
+{
+   mbedtls_ssl_session *session = dNew(mbedtls_ssl_session, 1);
+
+   mbedtls_ssl_session_init(session);
+   if (mbedtls_ssl_get_session(ssl, session) == 0) {
+      Tls_server_drop_session(srv);
+      srv->session = session;
+      srv->session_time = time(NULL);
+   } else {
+      mbedtls_ssl_session_free(session);
+      dFree(session);
+   }
+}
+
+/*
+ * Did the server accept the session we offered?
+ * (it echoes the session ID back only when resuming)
+ */
+static bool_t Tls_session_resumed(Conn_t *conn, Server_t *srv)
+{
+   const mbedtls_ssl_session *cur = conn->ssl->session;
+
+   return conn->resuming && srv->session && cur &&
+          cur->id_len > 0 && cur->id_len == srv->session->id_len &&
+          !memcmp(cur->id, srv->session->id, cur->id_len);
+}
+
 /*
  * Close an open TLS connection.
  */
@@ -950,6 +1019,22 @@ static void Tls_handshake(int fd, int connkey)
       } else if (ret == 0) {
          Server_t *srv = dList_find_sorted(servers, conn->url,
                                            Tls_servers_by_url_cmp);
+         bool_t resumed = Tls_session_resumed(conn, srv);
+         struct timeval now;
+         long msec;
+
+         gettimeofday(&now, NULL);
+         msec = (now.tv_sec - conn->hs_start.tv_sec) * 1000L +
+                (now.tv_usec - conn->hs_start.tv_usec) / 1000L;
+         if (resumed) {
+            HandshakeStats.resumed++;
+            HandshakeStats.resumed_msec += msec;
+         } else {
+            HandshakeStats.full++;
+            HandshakeStats.full_msec += msec;
+         }
+         _MSG("TLS: %s handshake with %s in %ld ms\n",
+              resumed ? "resumed" : "full", URL_AUTHORITY(conn->url), msec);
 
          if (srv->cert_status == CERT_STATUS_RECEIVING) {
             /* Making first connection with the server. Show cipher used. */
@@ -965,6 +1050,10 @@ static void Tls_handshake(int fd, int connkey)
          if (srv->cert_status == CERT_STATUS_USER_ACCEPTED ||
              (Tls_examine_certificate(conn->ssl, srv) != -1)) {
             failed = FALSE;
+            if (!resumed && prefs.tls_session_ttl > 0)
+               Tls_server_save_session(srv, conn->ssl);
+         } else {
+            Tls_server_drop_session(srv);
          }
       } else if (ret == MBEDTLS_ERR_NET_SEND_FAILED) {
          MSG("mbedtls_ssl_handshake() send failed. Server may not be accepting"
@@ -1003,6 +1092,13 @@ static void Tls_handshake(int fd, int connkey)
    if (!ongoing) {
       if (a_Klist_get_data(conn_list, connkey)) {
          conn->connecting = FALSE;
+         if (failed && conn->resuming) {
+            /* don't offer that session again */
+            Server_t *srv = dList_find_sorted(servers, conn->url,
+                                              Tls_servers_by_url_cmp);
+            if (srv)
+               Tls_server_drop_session(srv);
+         }
          if (failed) {
             Tls_close_by_key(connkey);
          }
@@ -1025,6 +1121,7 @@ static void Tls_handshake_cb(int fd, void *vconnkey)
 void a_Tls_connect(int fd, const DilloUrl *url)
 {
    mbedtls_ssl_context *ssl = dNew0(mbedtls_ssl_context, 1);
+   Conn_t *conn = NULL;
    bool_t success = TRUE;
    int connkey = -1;
    int ret;
@@ -1043,7 +1140,7 @@ void a_Tls_connect(int fd, const DilloUrl *url)
 
    /* assign TLS connection to this file descriptor */
    if (success) {
-      Conn_t *conn = Tls_conn_new(fd, url, ssl);
+      conn = Tls_conn_new(fd, url, ssl);
       connkey = Tls_make_conn_key(conn);
       mbedtls_ssl_set_bio(ssl, &conn->fd, mbedtls_net_send, mbedtls_net_recv,
                           NULL);
@@ -1054,6 +1151,17 @@ void a_Tls_connect(int fd, const DilloUrl *url)
       success = FALSE;
    }
 
+   if (success && prefs.tls_session_ttl > 0) {
+      Server_t *srv = dList_find_sorted(servers, url, Tls_servers_by_url_cmp);
+
+      if (srv && srv->session) {
+         if (time(NULL) - srv->session_time > prefs.tls_session_ttl)
+            Tls_server_drop_session(srv);
+         else if (mbedtls_ssl_set_session(ssl, srv->session) == 0)
+            conn->resuming = TRUE;
+      }
+   }
+
    if (!success) {
       a_Tls_reset_server_state(url);
       a_Http_connect_done(fd, success);
@@ -1110,6 +1218,130 @@ void a_Tls_close_by_fd(int fd)
    }
 }
 
+#ifdef TLS_SESSION_PERSIST
+
+/*
+ * Read the sessions saved by an earlier run from ~/.dillo/tls_sessions.
+ * Each line is: <host> <port> <time> <session in hex>
+ */
+static void Tls_sessions_load(void)
+{
+   char *filename = dStrconcat(dGethomedir(), "/.dillo/tls_sessions", NULL);
+   FILE *fp = fopen(filename, "r");
+   char *line, *p, *host, *port, *stamp, *hex;
+   time_t now = time(NULL);
+   int loaded = 0;
+
+   dFree(filename);
+   if (!fp)
+      return;
+
+   while ((line = dGetline(fp))) {
+      p = line;
+      host = dStrsep(&p, " ");
+      port = dStrsep(&p, " ");
+      stamp = dStrsep(&p, " ");
+      hex = dStrsep(&p, " \n");
+
+      if (host && port && stamp && hex && *hex &&
+          now - (time_t)strtol(stamp, NULL, 10) <= prefs.tls_session_ttl) {
+         size_t i, len = strlen(hex) / 2;
+         unsigned char *buf = dNew(unsigned char, len);
+         mbedtls_ssl_session *session = dNew(mbedtls_ssl_session, 1);
+
+         for (i = 0; i < len; i++) {
+            char byte[3] = {hex[2 * i], hex[2 * i + 1], 0};
+            buf[i] = (unsigned char)strtol(byte, NULL, 16);
+         }
+         mbedtls_ssl_session_init(session);
+         if (mbedtls_ssl_session_load(session, buf, len) == 0) {
+            Server_t *s = dNew0(Server_t, 1);
+
+            s->hostname = dStrdup(host);
+            s->port = strtol(port, NULL, 10);
+            s->cert_status = CERT_STATUS_NONE;
+            s->session = session;
+            s->session_time = (time_t)strtol(stamp, NULL, 10);
+            if (dList_find_sorted(servers, s, Tls_servers_cmp)) {
+               Tls_server_drop_session(s);
+               dFree(s->hostname);
+               dFree(s);
+            } else {
+               dList_insert_sorted(servers, s, Tls_servers_cmp);
+               loaded++;
+            }
+         } else {
+            mbedtls_ssl_session_free(session);
+            dFree(session);
+         }
+         dFree(buf);
+      }
+      dFree(line);
+   }
+   fclose(fp);
+   _MSG("TLS: loaded %d sessions\n", loaded);
+}
+
+/*
+ * Write the sessions still within their TTL to ~/.dillo/tls_sessions.
+ * The file is only readable by the user, since it holds session secrets.
+ */
+static void Tls_sessions_save(void)
+{
+   char *filename = dStrconcat(dGethomedir(), "/.dillo/tls_sessions", NULL);
+   int i, fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+   time_t now = time(NULL);
+   FILE *fp;
+
+   if (fd < 0 || !(fp = fdopen(fd, "w"))) {
+      MSG("TLS: could not save sessions to %s: %s\n", filename,
+          dStrerror(errno));
+      if (fd >= 0)
+         close(fd);
+      dFree(filename);
+      return;
+   }
+   dFree(filename);
+   /* open() leaves the mode of an existing file alone */
+   fchmod(fd, 0600);
+
+   for (i = 0; i < dList_length(servers); i++) {
+      Server_t *s = dList_nth_data(servers, i);
+      unsigned char *buf;
+      size_t j, len = 0;
+
+      if (!s->session || s->cert_status == CERT_STATUS_BAD ||
+          now - s->session_time > prefs.tls_session_ttl)
+         continue;
+      if (mbedtls_ssl_session_save(s->session, NULL, 0, &len) !=
+          MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL)
+         continue;
+      buf = dNew(unsigned char, len);
+      if (mbedtls_ssl_session_save(s->session, buf, len, &len) == 0) {
+         fprintf(fp, "%s %d %ld ", s->hostname, s->port,
+                 (long)s->session_time);
+         for (j = 0; j < len; j++)
+            fprintf(fp, "%02x", buf[j]);
+         fputc('\n', fp);
+      }
+      dFree(buf);
+   }
+   fclose(fp);
+}
+
+#else
+
+static void Tls_sessions_load(void)
+{
+   MSG("TLS: keeping sessions on disk needs mbed TLS 2.19 or later.\n");
+}
+
+static void Tls_sessions_save(void)
+{
+}
+
+#endif /* TLS_SESSION_PERSIST */
+
 static void Tls_cert_authorities_print_summary()
 {
    const int ca_len = dList_length(cert_authorities);
@@ -1180,6 +1412,7 @@ static void Tls_servers_freeall()
 
       for (i = 0; i < n; i++) {
          s = (Server_t *) dList_nth_data(servers, i);
+         Tls_server_drop_session(s);
          dFree(s->hostname);
          dFree(s);
       }
@@ -1201,6 +1434,19 @@ static void Tls_fd_map_remove_all()
    }
 }
 
+/*
+ * Get the handshake statistics: how many full and resumed handshakes were
+ * made, and the total time they took (in ms).
+ */
+void a_Tls_get_handshake_stats(int *full, long *full_msec,
+                               int *resumed, long *resumed_msec)
+{
+   *full = HandshakeStats.full;
+   *full_msec = HandshakeStats.full_msec;
+   *resumed = HandshakeStats.resumed;
+   *resumed_msec = HandshakeStats.resumed_msec;
+}
+
 /*
  * Clean up
  */
@@ -1208,7 +1454,14 @@ void a_Tls_freeall(void)
 {
    if (prefs.show_msg)
       Tls_cert_authorities_print_summary();
-
+   MSG("TLS: %d full handshakes (avg %ld ms), %d resumed (avg %ld ms)\n",
+       HandshakeStats.full, HandshakeStats.full ?
+       HandshakeStats.full_msec / HandshakeStats.full : 0,
+       HandshakeStats.resumed, HandshakeStats.resumed ?
+       HandshakeStats.resumed_msec / HandshakeStats.resumed : 0);
+
+   if (prefs.tls_session_cache_disk && prefs.tls_session_ttl > 0)
+      Tls_sessions_save();
    Tls_fd_map_remove_all();
    Tls_cert_authorities_freeall();
    Tls_servers_freeall();
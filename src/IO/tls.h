@@ -25,6 +25,8 @@ void a_Tls_connect(int fd, const DilloUrl *url);
 void *a_Tls_connection(int fd);
 
 void a_Tls_freeall();
+void a_Tls_get_handshake_stats(int *full, long *full_msec,
+                               int *resumed, long *resumed_msec);
 
 void a_Tls_close_by_fd(int fd);
 int a_Tls_read(void *conn, void *buf, size_t len);
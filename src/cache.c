@@ -14,10 +14,18 @@
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <dirent.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "msg.h"
 #include "IO/Url.h"
@@ -34,17 +42,20 @@
 #include "domain.h"
 #include "timeout.hh"
 #include "uicmd.hh"
+#include "md5.h"
 
 /* Maximum initial size for the automatically-growing data buffer */
 #define MAX_INIT_BUF  1024*1024
 /* Maximum filesize for a URL, before offering a download */
 #define HUGE_FILESIZE 15*1024*1024
+/* Upper bound for heuristic freshness lifetimes (from Last-Modified) */
+#define MAX_HEURISTIC_LIFETIME 24*60*60
 
 /*
  *  Local data types
  */
 
-typedef struct {
+typedef struct CacheEntry {
    const DilloUrl *Url;      /* Cached Url. Url is used as a primary Key */
    char *TypeDet;            /* MIME type string (detected from data) */
    char *TypeHdr;            /* MIME type string as from the HTTP Header */
@@ -53,8 +64,10 @@ typedef struct {
    Dstr *Header;             /* HTTP header */
    const DilloUrl *Location; /* New URI for redirects */
    Dlist *Auth;              /* Authentication fields */
-   Dstr *Data;               /* Pointer to raw data */
+   Dstr *Data;               /* Pointer to raw data (NULL if only UTF8Data
+                              * is kept, see Cache_entry_drop_raw()) */
    Dstr *UTF8Data;           /* Data after charset translation */
+   char *Charset;            /* Charset CharsetDecoder translates from */
    int DataRefcount;         /* Reference count */
    DecodeTransfer *TransferDecoder;  /* Transfer decoder (e.g., chunked) */
    Decode *ContentDecoder;   /* Data decoder (e.g., gzip) */
@@ -62,16 +75,45 @@ typedef struct {
    int ExpectedSize;         /* Goal size of the HTTP transfer (0 if unknown)*/
    int TransferSize;         /* Actual length of the HTTP transfer */
    uint_t Flags;             /* See Flag Defines in cache.h */
+   int Size;                 /* Bytes accounted against prefs.cache_max_size */
+   uint_t LastUse;           /* Value of CacheUseClock when last used (LRU) */
+   char *ETag;               /* Validator from the ETag header */
+   char *LastModified;       /* Validator from the Last-Modified header */
+   time_t Expires;           /* End of freshness lifetime (0 if unknown) */
+   struct CacheEntry *Stale; /* Old entry kept aside while revalidating */
+   size_t MapSize;           /* Length of the mmap()ed area holding Data->str
+                              * (0 if Data is an ordinary Dstr) */
+   uint_t Hash;              /* a_Url_hash(Url) */
+   struct CacheEntry *Next;  /* Next entry in the same CachedURLs bucket */
+   Dlist *Clients;           /* This entry's clients (also in ClientQueue) */
 } CacheEntry_t;
 
+/*
+ * A response stored in the disk cache. Its body lives in a file named
+ * after 'Key', with a trailing NUL byte (so a mapped body is a C string).
+ */
+typedef struct {
+   char *Url;                /* URL string, used as the search key */
+   char Key[33];             /* Hex MD5 digest of Url */
+   int Size;                 /* Body size (without the trailing NUL) */
+   time_t Expires;           /* As in CacheEntry_t */
+   time_t LastUse;           /* Last time it was stored or loaded */
+   char *ETag;
+   char *LastModified;
+   char *Type;               /* Content-Type from the HTTP header */
+} CacheDiskEntry_t;
+
 
 /*
  *  Local data
  */
-/* A sorted list for cached data. Holds pointers to CacheEntry_t structs */
-static Dlist *CachedURLs;
+/* A hash table for cached data, keyed by a_Url_hash(). Each bucket is a
+ * chain of CacheEntry_t structs, linked through their 'Next' field */
+static CacheEntry_t **CachedURLs;
+static uint_t CachedURLsSize;     /* Number of buckets (a power of two) */
+static uint_t CachedURLsCount;    /* Number of entries */
 
-/* A list for cache clients.
+/* A list for cache clients, sorted by key.
  * Although implemented as a list, we'll call it ClientQueue  --Jcid */
 static Dlist *ClientQueue;
 
@@ -80,35 +122,36 @@ static Dlist *ClientQueue;
 static Dlist *DelayedQueue;
 static uint_t DelayedQueueIdleId = 0;
 
+/* Scratch space between the transfer and content decoders */
+static Dstr *DecodeBuf;
+
+/* Memory budget bookkeeping (see Cache_trim()) */
+static int CacheSize = 0;             /* Sum of the entries' 'Size' */
+static uint_t CacheUseClock = 0;      /* Increases with every entry use */
+static bool_t CacheTrimPending = FALSE;
+
+/* Statistics, to help choosing a sensible cache_max_size */
+static uint_t CacheHits = 0, CacheMisses = 0, CacheEvictions = 0;
+
+/* The disk cache: a sorted list of CacheDiskEntry_t, and where it lives */
+static Dlist *DiskURLs = NULL;
+static char *DiskDir = NULL;
+static long long DiskSize = 0;        /* Sum of the entries' 'Size' */
+
 
 /*
  *  Forward declarations
  */
+static CacheEntry_t *Cache_entry_search(const DilloUrl *Url);
 static CacheEntry_t *Cache_process_queue(CacheEntry_t *entry);
 static void Cache_delayed_process_queue(CacheEntry_t *entry);
 static void Cache_auth_entry(CacheEntry_t *entry, BrowserWindow *bw);
 static void Cache_entry_inject(const DilloUrl *Url, Dstr *data_ds);
-
-/*
- * Determine if two cache entries are equal (used by CachedURLs)
- */
-static int Cache_entry_cmp(const void *v1, const void *v2)
-{
-   const CacheEntry_t *d1 = v1, *d2 = v2;
-
-   return a_Url_cmp(d1->Url, d2->Url);
-}
-
-/*
- * Determine if two cache entries are equal, using a URL as key.
- */
-static int Cache_entry_by_url_cmp(const void *v1, const void *v2)
-{
-   const DilloUrl *u1 = ((CacheEntry_t*)v1)->Url;
-   const DilloUrl *u2 = v2;
-
-   return a_Url_cmp(u1, u2);
-}
+static void Cache_trim_schedule(void);
+static void Cache_disk_init(void);
+static CacheEntry_t *Cache_disk_load(const DilloUrl *Url);
+static void Cache_disk_store(CacheEntry_t *entry);
+static void Cache_disk_freeall(void);
 
 /*
  * Initialize cache data
@@ -117,7 +160,13 @@ void a_Cache_init(void)
 {
    ClientQueue = dList_new(32);
    DelayedQueue = dList_new(32);
-   CachedURLs = dList_new(256);
+   DecodeBuf = dStr_sized_new(8*1024);
+   CachedURLsSize = 256;
+   CachedURLsCount = 0;
+   CachedURLs = dNew0(CacheEntry_t *, CachedURLsSize);
+
+   if (prefs.cache_disk)
+      Cache_disk_init();
 
    /* inject the splash screen in the cache */
    {
@@ -132,11 +181,19 @@ void a_Cache_init(void)
 /* Client operations ------------------------------------------------------ */
 
 /*
- * Add a client to ClientQueue.
+ * Compare function for keeping ClientQueue sorted
+ */
+static int Cache_client_cmp(const void *v1, const void *v2)
+{
+   return ((CacheClient_t *)v1)->Key - ((CacheClient_t *)v2)->Key;
+}
+
+/*
+ * Add a client to ClientQueue, and to its entry's client list.
  *  - Every client-field is just a reference (except 'Web').
  *  - Return a unique number for identifying the client.
  */
-static int Cache_client_enqueue(const DilloUrl *Url, DilloWeb *Web,
+static int Cache_client_enqueue(CacheEntry_t *entry, DilloWeb *Web,
                                  CA_Callback_t Callback, void *CbData)
 {
    static int ClientKey = 0; /* Provide a primary key for each client */
@@ -149,7 +206,7 @@ static int Cache_client_enqueue(const DilloUrl *Url, DilloWeb *Web,
 
    NewClient = dNew(CacheClient_t, 1);
    NewClient->Key = ClientKey;
-   NewClient->Url = Url;
+   NewClient->Url = entry->Url;
    NewClient->Version = 0;
    NewClient->Buf = NULL;
    NewClient->BufSize = 0;
@@ -157,7 +214,9 @@ static int Cache_client_enqueue(const DilloUrl *Url, DilloWeb *Web,
    NewClient->CbData = CbData;
    NewClient->Web    = Web;
 
-   dList_append(ClientQueue, NewClient);
+   /* keys grow, so this is almost always an append */
+   dList_insert_sorted(ClientQueue, NewClient, Cache_client_cmp);
+   dList_append(entry->Clients, NewClient);
 
    return ClientKey;
 }
@@ -170,12 +229,25 @@ static int Cache_client_by_key_cmp(const void *client, const void *key)
    return ((CacheClient_t *)client)->Key - VOIDP2INT(key);
 }
 
+/*
+ * Find a client by its key
+ */
+static CacheClient_t *Cache_client_search(int Key)
+{
+   return dList_find_sorted(ClientQueue, INT2VOIDP(Key),
+                            Cache_client_by_key_cmp);
+}
+
 /*
  * Remove a client from the queue
  */
 static void Cache_client_dequeue(CacheClient_t *Client)
 {
+   CacheEntry_t *entry;
+
    if (Client) {
+      if ((entry = Cache_entry_search(Client->Url)))
+         dList_remove(entry->Clients, Client);
       dList_remove(ClientQueue, Client);
       a_Web_free(Client->Web);
       dFree(Client);
@@ -200,6 +272,7 @@ static void Cache_entry_init(CacheEntry_t *NewEntry, const DilloUrl *Url)
    NewEntry->Auth = NULL;
    NewEntry->Data = dStr_sized_new(8*1024);
    NewEntry->UTF8Data = NULL;
+   NewEntry->Charset = NULL;
    NewEntry->DataRefcount = 0;
    NewEntry->TransferDecoder = NULL;
    NewEntry->ContentDecoder = NULL;
@@ -207,6 +280,16 @@ static void Cache_entry_init(CacheEntry_t *NewEntry, const DilloUrl *Url)
    NewEntry->ExpectedSize = 0;
    NewEntry->TransferSize = 0;
    NewEntry->Flags = CA_IsEmpty | CA_InProgress | CA_KeepAlive;
+   NewEntry->Size = 0;
+   NewEntry->LastUse = ++CacheUseClock;
+   NewEntry->ETag = NULL;
+   NewEntry->LastModified = NULL;
+   NewEntry->Expires = 0;
+   NewEntry->Stale = NULL;
+   NewEntry->MapSize = 0;
+   NewEntry->Hash = a_Url_hash(NewEntry->Url);
+   NewEntry->Next = NULL;
+   NewEntry->Clients = dList_new(4);
 }
 
 /*
@@ -215,7 +298,75 @@ static void Cache_entry_init(CacheEntry_t *NewEntry, const DilloUrl *Url)
  */
 static CacheEntry_t *Cache_entry_search(const DilloUrl *Url)
 {
-   return dList_find_sorted(CachedURLs, Url, Cache_entry_by_url_cmp);
+   uint_t hash = a_Url_hash(Url);
+   CacheEntry_t *entry = CachedURLs[hash & (CachedURLsSize - 1)];
+
+   while (entry && (entry->Hash != hash || a_Url_cmp(entry->Url, Url)))
+      entry = entry->Next;
+   return entry;
+}
+
+/*
+ * Double the number of buckets in CachedURLs.
+ */
+static void Cache_hash_grow(void)
+{
+   uint_t i, newSize = 2 * CachedURLsSize;
+   CacheEntry_t **buckets = dNew0(CacheEntry_t *, newSize), *entry, *next;
+
+   for (i = 0; i < CachedURLsSize; i++) {
+      for (entry = CachedURLs[i]; entry; entry = next) {
+         next = entry->Next;
+         entry->Next = buckets[entry->Hash & (newSize - 1)];
+         buckets[entry->Hash & (newSize - 1)] = entry;
+      }
+   }
+   dFree(CachedURLs);
+   CachedURLs = buckets;
+   CachedURLsSize = newSize;
+}
+
+/*
+ * Insert an entry in CachedURLs.
+ */
+static void Cache_hash_insert(CacheEntry_t *entry)
+{
+   CacheEntry_t **bucket;
+
+   if (++CachedURLsCount > CachedURLsSize)
+      Cache_hash_grow();
+   bucket = &CachedURLs[entry->Hash & (CachedURLsSize - 1)];
+   entry->Next = *bucket;
+   *bucket = entry;
+}
+
+/*
+ * Remove an entry from CachedURLs (the entry itself is not freed).
+ */
+static void Cache_hash_remove(CacheEntry_t *entry)
+{
+   CacheEntry_t **link = &CachedURLs[entry->Hash & (CachedURLsSize - 1)];
+
+   for ( ; *link; link = &(*link)->Next) {
+      if (*link == entry) {
+         *link = entry->Next;
+         entry->Next = NULL;
+         CachedURLsCount--;
+         break;
+      }
+   }
+}
+
+/*
+ * Search 'Url' in memory and, failing that, in the disk cache.
+ */
+static CacheEntry_t *Cache_entry_search_or_load(const DilloUrl *Url)
+{
+   CacheEntry_t *entry = Cache_entry_search(Url);
+
+   if (!entry && DiskURLs)
+      entry = Cache_disk_load(Url);
+   return entry;
 }
 
 /*
@@ -251,15 +402,31 @@ static CacheEntry_t *Cache_entry_add(const DilloUrl *Url)
 
    if ((old_entry = Cache_entry_search(Url))) {
       MSG_WARN("Cache_entry_add, leaking an entry.\n");
-      dList_remove(CachedURLs, old_entry);
+      CacheSize -= old_entry->Size;
+      Cache_hash_remove(old_entry);
    }
 
    new_entry = dNew(CacheEntry_t, 1);
    Cache_entry_init(new_entry, Url);  /* Set safe values */
-   dList_insert_sorted(CachedURLs, new_entry, Cache_entry_cmp);
+   Cache_hash_insert(new_entry);
    return new_entry;
 }
 
+/*
+ * Update the memory accounted for an entry (and the cache total).
+ * Only the data kept for the entry's whole lifetime is counted: either
+ * Data, or UTF8Data when Data was dropped. (Otherwise UTF8Data is freed as
+ * soon as the entry is no longer referenced)
+ */
+static void Cache_entry_account(CacheEntry_t *entry)
+{
+   CacheSize -= entry->Size;
+   entry->Size = (int)sizeof(CacheEntry_t) + entry->Header->sz +
+                 (entry->MapSize ? 0 :
+                  entry->Data ? entry->Data->sz : entry->UTF8Data->sz);
+   CacheSize += entry->Size;
+}
+
 /*
  * Inject full page content directly into the cache.
  * Used for "about:splash". May be used for "about:cache" too.
@@ -277,6 +444,7 @@ static void Cache_entry_inject(const DilloUrl *Url, Dstr *data_ds)
    dStr_append_l(entry->Data, data_ds->str, data_ds->len);
    dStr_fit(entry->Data);
    entry->ExpectedSize = entry->TransferSize = entry->Data->len;
+   Cache_entry_account(entry);
 }
 
 /*
@@ -291,6 +459,21 @@ static void Cache_auth_free(Dlist *auth)
    dList_free(auth);
 }
 
+/*
+ * Free an entry's raw data (it may be a mapped disk cache file).
+ */
+static void Cache_entry_data_free(CacheEntry_t *entry)
+{
+   if (entry->Data && entry->MapSize) {
+      munmap(entry->Data->str, entry->MapSize);
+      dStr_free(entry->Data, 0);
+   } else {
+      dStr_free(entry->Data, 1);
+   }
+   entry->Data = NULL;
+   entry->MapSize = 0;
+}
+
 /*
  *  Free the components of a CacheEntry_t struct.
  */
@@ -304,14 +487,20 @@ static void Cache_entry_free(CacheEntry_t *entry)
    dStr_free(entry->Header, TRUE);
    a_Url_free((DilloUrl *)entry->Location);
    Cache_auth_free(entry->Auth);
-   dStr_free(entry->Data, 1);
+   Cache_entry_data_free(entry);
    dStr_free(entry->UTF8Data, 1);
+   dFree(entry->Charset);
    if (entry->CharsetDecoder)
       a_Decode_free(entry->CharsetDecoder);
    if (entry->TransferDecoder)
       a_Decode_transfer_free(entry->TransferDecoder);
    if (entry->ContentDecoder)
       a_Decode_free(entry->ContentDecoder);
+   dFree(entry->ETag);
+   dFree(entry->LastModified);
+   if (entry->Stale)
+      Cache_entry_free(entry->Stale);
+   dList_free(entry->Clients);
    dFree(entry);
 }
 
@@ -322,7 +511,6 @@ static void Cache_entry_free(CacheEntry_t *entry)
  */
 static void Cache_entry_remove(CacheEntry_t *entry, DilloUrl *url)
 {
-   int i;
    CacheClient_t *Client;
 
    if (!entry && !(entry = Cache_entry_search(url)))
@@ -331,12 +519,8 @@ static void Cache_entry_remove(CacheEntry_t *entry, DilloUrl *url)
       return;
 
    /* remove all clients for this entry */
-   for (i = 0; (Client = dList_nth_data(ClientQueue, i)); ++i) {
-      if (Client->Url == entry->Url) {
-         a_Cache_stop_client(Client->Key);
-         --i;
-      }
-   }
+   while ((Client = dList_nth_data(entry->Clients, 0)))
+      a_Cache_stop_client(Client->Key);
 
    /* remove from DelayedQueue */
    dList_remove(DelayedQueue, entry);
@@ -345,7 +529,8 @@ static void Cache_entry_remove(CacheEntry_t *entry, DilloUrl *url)
    a_Dicache_invalidate_entry(entry->Url);
 
    /* remove from cache */
-   dList_remove(CachedURLs, entry);
+   CacheSize -= entry->Size;
+   Cache_hash_remove(entry);
    Cache_entry_free(entry);
 }
 
@@ -357,6 +542,56 @@ void a_Cache_entry_remove_by_url(DilloUrl *url)
    Cache_entry_remove(NULL, url);
 }
 
+/*
+ * Can this entry be revalidated with a conditional request?
+ */
+static bool_t Cache_entry_has_validators(CacheEntry_t *entry)
+{
+   return (!(entry->Flags & (CA_InProgress | CA_InternalUrl)) &&
+           (entry->ETag || entry->LastModified) &&
+           (!dStrAsciiCasecmp(URL_SCHEME(entry->Url), "http") ||
+            !dStrAsciiCasecmp(URL_SCHEME(entry->Url), "https")));
+}
+
+/*
+ * Mark the entry as stale when its freshness lifetime is over.
+ * Only entries that can be revalidated are marked; the rest are kept
+ * until an explicit reload, as usual.
+ */
+static void Cache_entry_check_freshness(CacheEntry_t *entry)
+{
+   if (entry->Expires && !(entry->Flags & CA_Stale) &&
+       time(NULL) >= entry->Expires && Cache_entry_has_validators(entry)) {
+      _MSG("Cache: %s is stale\n", URL_STR_(entry->Url));
+      entry->Flags |= CA_Stale;
+   }
+}
+
+/*
+ * Replace an entry with a new, empty one, keeping the old one aside.
+ * If the server answers "304 Not Modified", Cache_parse_header() will
+ * bring the old data back; otherwise the old entry is dropped.
+ */
+static CacheEntry_t *Cache_entry_revalidate(CacheEntry_t *old_entry)
+{
+   CacheClient_t *Client;
+   CacheEntry_t *entry;
+
+   _MSG("Cache: revalidating %s\n", URL_STR_(old_entry->Url));
+
+   while ((Client = dList_nth_data(old_entry->Clients, 0)))
+      a_Cache_stop_client(Client->Key);
+   dList_remove(DelayedQueue, old_entry);
+   a_Dicache_invalidate_entry(old_entry->Url);
+   CacheSize -= old_entry->Size;
+   old_entry->Size = 0;
+   Cache_hash_remove(old_entry);
+
+   entry = Cache_entry_add(old_entry->Url);
+   entry->Stale = old_entry;
+   return entry;
+}
+
 /* Misc. operations ------------------------------------------------------- */
 
 /*
@@ -378,21 +613,34 @@ int a_Cache_open_url(void *web, CA_Callback_t Call, void *CbData)
    DilloWeb *Web = web;
    DilloUrl *Url = Web->url;
 
-   if (URL_FLAGS(Url) & URL_E2EQuery) {
+   if ((entry = Cache_entry_search_or_load(Url)) &&
+       entry->DataRefcount == 0 &&
+       (entry->Flags & CA_Stale ||
+        (URL_FLAGS(Url) & URL_E2EQuery && Cache_entry_has_validators(entry)))) {
+      /* keep the current entry aside while a conditional query is sent
+       * (not while somebody holds its data: a 304 would move it, and
+       * anything else would free it) */
+      entry = Cache_entry_revalidate(entry);
+   } else if (URL_FLAGS(Url) & URL_E2EQuery) {
       /* remove current entry */
-      Cache_entry_remove(NULL, Url);
+      Cache_entry_remove(entry, Url);
+      entry = Cache_entry_search(Url);
    }
 
-   if ((entry = Cache_entry_search(Url))) {
+   if (entry && !entry->Stale) {
       /* URL is cached: feed our client with cached data */
-      ClientKey = Cache_client_enqueue(entry->Url, Web, Call, CbData);
+      CacheHits++;
+      entry->LastUse = ++CacheUseClock;
+      ClientKey = Cache_client_enqueue(entry, Web, Call, CbData);
       Cache_delayed_process_queue(entry);
 
    } else {
-      /* URL not cached: create an entry, send our client to the queue,
-       * and open a new connection */
-      entry = Cache_entry_add(Url);
-      ClientKey = Cache_client_enqueue(entry->Url, Web, Call, CbData);
+      /* URL not cached (or being revalidated): create an entry if needed,
+       * send our client to the queue, and open a new connection */
+      CacheMisses++;
+      if (!entry)
+         entry = Cache_entry_add(Url);
+      ClientKey = Cache_client_enqueue(entry, Web, Call, CbData);
    }
 
    return ClientKey;
@@ -403,10 +651,25 @@ int a_Cache_open_url(void *web, CA_Callback_t Call, void *CbData)
  */
 uint_t a_Cache_get_flags(const DilloUrl *url)
 {
-   CacheEntry_t *entry = Cache_entry_search(url);
+   CacheEntry_t *entry = Cache_entry_search_or_load(url);
+
+   if (entry)
+      Cache_entry_check_freshness(entry);
    return (entry ? entry->Flags : 0);
 }
 
+/*
+ * Send the data of an entry to its clients again, from the main cycle.
+ * (the dicache does it when rows decoded in another thread come in)
+ */
+void a_Cache_resend(const DilloUrl *Url)
+{
+   CacheEntry_t *entry = Cache_entry_search(Url);
+
+   if (entry && dList_length(entry->Clients) > 0)
+      Cache_delayed_process_queue(entry);
+}
+
 /*
  * Get cache entry status (following redirections).
  */
@@ -416,6 +679,64 @@ uint_t a_Cache_get_flags_with_redirection(const DilloUrl *url)
    return (entry ? entry->Flags : 0);
 }
 
+/*
+ * Get the entry's raw data, rebuilding it from UTF8Data if it was dropped.
+ */
+static Dstr *Cache_raw_data(CacheEntry_t *entry)
+{
+   Decode *encoder;
+
+   if (!entry->Data) {
+      entry->Data = dStr_sized_new(entry->UTF8Data->len);
+      if ((encoder = a_Decode_charset_encode_init(entry->Charset))) {
+         a_Decode_process(encoder, entry->UTF8Data->str,
+                          entry->UTF8Data->len, entry->Data);
+         a_Decode_free(encoder);
+      }
+      dStr_fit(entry->Data);
+      Cache_entry_account(entry);
+      _MSG("Cache: rebuilt raw data for %s\n", URL_STR_(entry->Url));
+   }
+   return entry->Data;
+}
+
+/*
+ * Keep only UTF8Data for a finished entry that nobody references, if
+ * Data can be rebuilt from it byte for byte (checked only once).
+ * Return: TRUE if Data was dropped.
+ */
+static bool_t Cache_entry_drop_raw(CacheEntry_t *entry)
+{
+   Decode *encoder;
+   Dstr *raw;
+   bool_t exact = FALSE;
+
+   if (!prefs.cache_single_copy || !entry->Data || !entry->UTF8Data ||
+       entry->MapSize || entry->Flags & (CA_InProgress | CA_KeepRaw))
+      return FALSE;
+
+   if (!(entry->Flags & CA_Reencodable)) {
+      if ((encoder = a_Decode_charset_encode_init(entry->Charset))) {
+         raw = dStr_sized_new(entry->Data->len);
+         a_Decode_process(encoder, entry->UTF8Data->str,
+                          entry->UTF8Data->len, raw);
+         exact = (raw->len == entry->Data->len &&
+                  !dStr_cmp(raw, entry->Data));
+         dStr_free(raw, 1);
+         a_Decode_free(encoder);
+      }
+      entry->Flags |= (exact) ? CA_Reencodable : CA_KeepRaw;
+      if (!exact)
+         return FALSE;
+   }
+   dStr_fit(entry->UTF8Data);
+   dStr_free(entry->Data, 1);
+   entry->Data = NULL;
+   Cache_entry_account(entry);
+   _MSG("Cache: kept only UTF8Data for %s\n", URL_STR_(entry->Url));
+   return TRUE;
+}
+
 /*
  * Reference the cache data.
  */
@@ -424,12 +745,12 @@ static void Cache_ref_data(CacheEntry_t *entry)
    if (entry) {
       entry->DataRefcount++;
       _MSG("DataRefcount++: %d\n", entry->DataRefcount);
-      if (entry->CharsetDecoder &&
+      if (entry->CharsetDecoder && entry->Data &&
           (!entry->UTF8Data || entry->DataRefcount == 1)) {
          dStr_free(entry->UTF8Data, 1);
-         entry->UTF8Data = a_Decode_process(entry->CharsetDecoder,
-                                            entry->Data->str,
-                                            entry->Data->len);
+         entry->UTF8Data = dStr_sized_new(entry->Data->len);
+         a_Decode_process(entry->CharsetDecoder, entry->Data->str,
+                          entry->Data->len, entry->UTF8Data);
       }
    }
 }
@@ -445,8 +766,11 @@ static void Cache_unref_data(CacheEntry_t *entry)
 
       if (entry->CharsetDecoder) {
          if (entry->DataRefcount == 0) {
-            dStr_free(entry->UTF8Data, 1);
-            entry->UTF8Data = NULL;
+            /* (once Data was dropped, UTF8Data is all there is) */
+            if (entry->Data && !Cache_entry_drop_raw(entry)) {
+               dStr_free(entry->UTF8Data, 1);
+               entry->UTF8Data = NULL;
+            }
          } else if (entry->DataRefcount < 0) {
             MSG_ERR("Cache_unref_data: negative refcount\n");
             entry->DataRefcount = 0;
@@ -523,9 +847,15 @@ const char *a_Cache_set_content_type(const DilloUrl *url, const char *ctype,
             entry->TypeNorm = dStrdup(entry->TypeDet);
          }
          if (charset) {
-            if (entry->CharsetDecoder)
+            if (entry->CharsetDecoder) {
+               /* the new decoder works from the raw data */
+               Cache_raw_data(entry);
                a_Decode_free(entry->CharsetDecoder);
+            }
             entry->CharsetDecoder = a_Decode_charset_init(charset);
+            dFree(entry->Charset);
+            entry->Charset = dStrdup(charset);
+            entry->Flags &= ~(CA_Reencodable | CA_KeepRaw);
             curr = Cache_current_content_type(entry);
 
             /* Invalidate UTF8Data */
@@ -538,6 +868,24 @@ const char *a_Cache_set_content_type(const DilloUrl *url, const char *ctype,
    return curr;
 }
 
+/*
+ * Get the validators to make the query for 'Url' a conditional one.
+ * The strings belong to the cache (don't free them).
+ * Return: TRUE if there is at least one validator.
+ */
+bool_t a_Cache_get_validators(const DilloUrl *Url, const char **ETag,
+                              const char **LastModified)
+{
+   CacheEntry_t *entry = Cache_entry_search(Url);
+
+   *ETag = *LastModified = NULL;
+   if (entry && entry->Stale) {
+      *ETag = entry->Stale->ETag;
+      *LastModified = entry->Stale->LastModified;
+   }
+   return (*ETag || *LastModified);
+}
+
 /*
  * Get the pointer to the URL document, and its size, from the cache entry.
  * Return: 1 cached, 0 not cached.
@@ -547,6 +895,7 @@ int a_Cache_get_buf(const DilloUrl *Url, char **PBuf, int *BufSize)
    CacheEntry_t *entry = Cache_entry_search_with_redirect(Url);
    if (entry) {
       Dstr *data;
+      entry->LastUse = ++CacheUseClock;
       Cache_ref_data(entry);
       data = Cache_data(entry);
       *PBuf = data->str;
@@ -646,6 +995,181 @@ static Dlist *Cache_parse_multiple_fields(const char *header,
    return fields;
 }
 
+/*
+ * Parse an HTTP-date (IMF-fixdate, RFC 850 or asctime() format).
+ * Return: the time, or -1 on error.
+ */
+static time_t Cache_parse_date(const char *date)
+{
+   static const char *const months[] =
+      { "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+   char mon[4];
+   const char *comma;
+   int d, m, y, hh, mm, ss, n;
+   long days;
+
+   if ((comma = strchr(date, ','))) {
+      /* "Sun, 06 Nov 1994 08:49:37 GMT" or "Sunday, 06-Nov-94 08:49:37 GMT" */
+      n = sscanf(comma + 1, " %d%*[ -]%3s%*[ -]%d %d:%d:%d",
+                 &d, mon, &y, &hh, &mm, &ss);
+   } else {
+      /* "Sun Nov  6 08:49:37 1994" */
+      n = sscanf(date, "%*s %3s %d %d:%d:%d %d", mon, &d, &hh, &mm, &ss, &y);
+   }
+   if (n != 6)
+      return -1;
+   for (m = 0; m < 12 && dStrAsciiCasecmp(mon, months[m]); m++) ;
+   if (m == 12 || d < 1 || d > 31 || hh > 23 || mm > 59 || ss > 60)
+      return -1;
+   if (y < 100)
+      y += (y < 70) ? 2000 : 1900;
+   if (y < 1970)
+      return -1;
+
+   /* days since the epoch (March-based year, so that Feb 29 comes last) */
+   if (m < 2) {
+      y--;
+      m += 12;
+   }
+   days = 365L * y + y / 4 - y / 100 + y / 400 + (153 * (m - 2) + 2) / 5 +
+          d - 719469L;
+   return (time_t)(days * 86400L + hh * 3600L + mm * 60L + ss);
+}
+
+/*
+ * Compute the end of the entry's freshness lifetime (RFC 7234, section 4.2).
+ * Without explicit information, a heuristic based on Last-Modified is used;
+ * if that's missing too, 'Expires' stays at zero (no expiration).
+ */
+static void Cache_parse_freshness(CacheEntry_t *entry, const char *header)
+{
+   time_t now = time(NULL), date = -1, expires, last_modified;
+   long lifetime = -1, age = 0;
+   Dlist *directives;
+   char *field, *tok, *p;
+   int i;
+
+   if ((field = Cache_parse_field(header, "Date"))) {
+      date = Cache_parse_date(field);
+      dFree(field);
+   }
+   if (date == -1 || date > now)
+      date = now;
+
+   if ((directives = Cache_parse_multiple_fields(header, "Cache-Control"))) {
+      for (i = 0; (field = dList_nth_data(directives, i)); ++i) {
+         for (p = field; (tok = dStrsep(&p, ",")); ) {
+            tok = dStrstrip(tok);
+            if (!dStrAsciiCasecmp(tok, "no-cache") ||
+                !dStrAsciiCasecmp(tok, "no-store")) {
+               lifetime = 0;
+               if (!dStrAsciiCasecmp(tok, "no-store"))
+                  entry->Flags |= CA_NoStore;
+            } else if (!dStrnAsciiCasecmp(tok, "max-age=", 8) &&
+                       lifetime != 0) {
+               lifetime = MAX(strtol(tok + 8, NULL, 10), 0);
+            }
+         }
+         dFree(field);
+      }
+      dList_free(directives);
+   }
+
+   if (lifetime == -1 && (field = Cache_parse_field(header, "Expires"))) {
+      /* invalid dates (e.g. "0") mean "already expired" */
+      expires = Cache_parse_date(field);
+      lifetime = (expires > date) ? (long)(expires - date) : 0;
+      dFree(field);
+   }
+
+   if (lifetime == -1 && entry->LastModified &&
+       (last_modified = Cache_parse_date(entry->LastModified)) != -1 &&
+       last_modified < date) {
+      lifetime = MIN((long)(date - last_modified) / 10,
+                     MAX_HEURISTIC_LIFETIME);
+   }
+
+   if (lifetime == -1) {
+      entry->Expires = 0;
+   } else {
+      if ((field = Cache_parse_field(header, "Age"))) {
+         age = MAX(strtol(field, NULL, 10), 0);
+         dFree(field);
+      }
+      age = MAX(age, (long)(now - date));
+      entry->Expires = now + MAX(lifetime - age, 0);
+   }
+   _MSG("Cache: %s fresh for %ld s\n", URL_STR_(entry->Url),
+        entry->Expires ? (long)(entry->Expires - now) : -1L);
+}
+
+/*
+ * The server answered "304 Not Modified" to a conditional query:
+ * bring back the data from the entry that was being revalidated.
+ */
+static void Cache_entry_restore_stale(CacheEntry_t *entry)
+{
+   CacheEntry_t *old = entry->Stale;
+   const uint_t kept = CA_GotContentType | CA_IsEmpty | CA_NotFound |
+                       CA_HugeFile | CA_Reencodable | CA_KeepRaw;
+
+   _MSG("Cache: %s not modified\n", URL_STR_(entry->Url));
+
+   Cache_entry_data_free(entry);
+   entry->Data = old->Data;
+   entry->MapSize = old->MapSize;
+   old->Data = NULL;
+   old->MapSize = 0;
+   dStr_free(entry->UTF8Data, 1);
+   entry->UTF8Data = NULL;
+   if (!entry->Data) {
+      /* UTF8Data is all there is */
+      entry->UTF8Data = old->UTF8Data;
+      old->UTF8Data = NULL;
+   }
+
+   dFree(entry->TypeDet);
+   dFree(entry->TypeHdr);
+   dFree(entry->TypeMeta);
+   dFree(entry->TypeNorm);
+   entry->TypeDet = old->TypeDet;
+   entry->TypeHdr = old->TypeHdr;
+   entry->TypeMeta = old->TypeMeta;
+   entry->TypeNorm = old->TypeNorm;
+   old->TypeDet = old->TypeHdr = old->TypeMeta = old->TypeNorm = NULL;
+
+   if (entry->CharsetDecoder)
+      a_Decode_free(entry->CharsetDecoder);
+   entry->CharsetDecoder = old->CharsetDecoder;
+   old->CharsetDecoder = NULL;
+   dFree(entry->Charset);
+   entry->Charset = old->Charset;
+   old->Charset = NULL;
+   if (!entry->Data) {
+      /* the old entry had dropped its raw data; the rest of the cache
+       * expects entry->Data to be there while a message is in progress */
+      Cache_raw_data(entry);
+   }
+
+   /* a 304 may update the validators */
+   if (!entry->ETag) {
+      entry->ETag = old->ETag;
+      old->ETag = NULL;
+   }
+   if (!entry->LastModified) {
+      entry->LastModified = old->LastModified;
+      old->LastModified = NULL;
+   }
+
+   /* no message body follows a 304 */
+   entry->Flags = (entry->Flags & ~kept) | (old->Flags & kept) | CA_GotLength;
+   entry->ExpectedSize = 0;
+
+   entry->Stale = NULL;
+   Cache_entry_free(old);
+}
+
 /*
  * Scan, allocate, and set things according to header info.
  * (This function needs the whole header to work)
@@ -661,6 +1185,7 @@ static void Cache_parse_header(CacheEntry_t *entry)
    Dlist *warnings;
    void *data;
    int i;
+   bool_t not_modified = FALSE;
 
    _MSG("Cache_parse_header\n");
 
@@ -695,6 +1220,8 @@ static void Cache_parse_header(CacheEntry_t *entry)
                entry->Flags |= CA_TempRedirect;   /* 302 Temporary Redirect */
          }
          dFree(location_str);
+      } else if (strncmp(header + 9, "304", 3) == 0) {
+         not_modified = TRUE;
       } else if (strncmp(header + 9, "401", 3) == 0) {
          entry->Auth =
             Cache_parse_multiple_fields(header, "WWW-Authenticate");
@@ -759,19 +1286,17 @@ static void Cache_parse_header(CacheEntry_t *entry)
    if ((Cookies = Cache_parse_multiple_fields(header, "Set-Cookie"))) {
       CacheClient_t *client;
 
-      for (i = 0; (client = dList_nth_data(ClientQueue, i)); ++i) {
-         if (client->Url == entry->Url) {
-            DilloWeb *web = client->Web;
+      for (i = 0; (client = dList_nth_data(entry->Clients, i)); ++i) {
+         DilloWeb *web = client->Web;
 
-            if (!web->requester ||
-                a_Url_same_organization(entry->Url, web->requester)) {
-               /* If cookies are third party, don't even consider them. */
-               char *server_date = Cache_parse_field(header, "Date");
+         if (!web->requester ||
+             a_Url_same_organization(entry->Url, web->requester)) {
+            /* If cookies are third party, don't even consider them. */
+            char *server_date = Cache_parse_field(header, "Date");
 
-               a_Cookies_set(Cookies, entry->Url, server_date);
-               dFree(server_date);
-               break;
-            }
+            a_Cookies_set(Cookies, entry->Url, server_date);
+            dFree(server_date);
+            break;
          }
       }
       for (i = 0; (data = dList_nth_data(Cookies, i)); ++i)
@@ -807,6 +1332,20 @@ static void Cache_parse_header(CacheEntry_t *entry)
       _MSG("TypeMeta {%s}\n", entry->TypeMeta);
       dFree(Type);
    }
+
+   /* Validators and freshness */
+   entry->ETag = Cache_parse_field(header, "ETag");
+   entry->LastModified = Cache_parse_field(header, "Last-Modified");
+   if (entry->Stale) {
+      if (not_modified) {
+         Cache_entry_restore_stale(entry);
+      } else {
+         Cache_entry_free(entry->Stale);
+         entry->Stale = NULL;
+      }
+   }
+   Cache_parse_freshness(entry, header);
+
    Cache_ref_data(entry);
 }
 
@@ -870,13 +1409,18 @@ static void Cache_finish_msg(CacheEntry_t *entry)
       a_Decode_free(entry->ContentDecoder);
       entry->ContentDecoder = NULL;
    }
-   dStr_fit(entry->Data);                /* fit buffer size! */
+   if (!entry->MapSize)
+      dStr_fit(entry->Data);             /* fit buffer size! */
+   Cache_entry_account(entry);
+   if (DiskURLs)
+      Cache_disk_store(entry);
 
    if ((entry = Cache_process_queue(entry))) {
       if (entry->Flags & CA_GotHeader) {
          Cache_unref_data(entry);
       }
    }
+   Cache_trim_schedule();
 }
 
 /*
@@ -886,16 +1430,21 @@ static void Cache_finish_msg(CacheEntry_t *entry)
  * This function gets called whenever the IO has new data.
  *  'Op' is the operation to perform
  *  'VPtr' is a (void) pointer to the IO control structure
+ *  'used' (if not NULL) gets how many bytes of 'buf' belong to this message;
+ *         once a persistent connection's response is done, the rest is
+ *         the beginning of the next one.
  */
 bool_t a_Cache_process_dbuf(int Op, const char *buf, size_t buf_size,
-                            const DilloUrl *Url)
+                            const DilloUrl *Url, size_t *used)
 {
-   int offset, len;
+   int offset, len, data_len;
    const char *str;
-   Dstr *dstr1, *dstr2, *dstr3;
    bool_t done = FALSE;
    CacheEntry_t *entry = Cache_entry_search(Url);
 
+   if (used)
+      *used = buf_size;
+
    /* Assert a valid entry (not aborted) */
    dReturn_val_if_fail (entry != NULL, FALSE);
 
@@ -916,29 +1465,38 @@ bool_t a_Cache_process_dbuf(int Op, const char *buf, size_t buf_size,
       if (entry->Flags & CA_GotHeader) {
          str = buf + offset;
          len = buf_size - offset;
-         entry->TransferSize += len;
-         dstr1 = dstr2 = dstr3 = NULL;
+         if ((entry->Flags & CA_KeepAlive) && (entry->Flags & CA_GotLength) &&
+             !entry->TransferDecoder) {
+            /* Bytes past Content-Length belong to the next response */
+            len = MIN(len, MAX(entry->ExpectedSize - entry->TransferSize, 0));
+         }
+         data_len = entry->Data->len;
 
-         /* Decode arrived data (<= 3 stages) */
+         /* Decode arrived data (<= 3 stages) straight into the entry.
+          * Only chunked and compressed data goes through DecodeBuf. */
          if (entry->TransferDecoder) {
-            dstr1 = a_Decode_transfer_process(entry->TransferDecoder, str,len);
+            dStr_truncate(DecodeBuf, 0);
+            len = a_Decode_transfer_process(entry->TransferDecoder, str, len,
+                                            entry->ContentDecoder ? DecodeBuf
+                                                                 : entry->Data);
             done = a_Decode_transfer_finished(entry->TransferDecoder);
-            str = dstr1->str;
-            len = dstr1->len;
          }
-         if (entry->ContentDecoder) {
-            dstr2 = a_Decode_process(entry->ContentDecoder, str, len);
-            str = dstr2->str;
-            len = dstr2->len;
+         entry->TransferSize += len;
+         if (used)
+            *used = offset + len;
+         if (entry->TransferDecoder) {
+            str = DecodeBuf->str;
+            len = DecodeBuf->len;
          }
-         dStr_append_l(entry->Data, str, len);
+         if (entry->ContentDecoder)
+            a_Decode_process(entry->ContentDecoder, str, len, entry->Data);
+         else if (!entry->TransferDecoder)
+            dStr_append_l(entry->Data, str, len);
          if (entry->CharsetDecoder && entry->UTF8Data) {
-            dstr3 = a_Decode_process(entry->CharsetDecoder, str, len);
-            dStr_append_l(entry->UTF8Data, dstr3->str, dstr3->len);
+            a_Decode_process(entry->CharsetDecoder,
+                             entry->Data->str + data_len,
+                             entry->Data->len - data_len, entry->UTF8Data);
          }
-         dStr_free(dstr1, 1);
-         dStr_free(dstr2, 1);
-         dStr_free(dstr3, 1);
 
          if (entry->Data->len)
             entry->Flags &= ~CA_IsEmpty;
@@ -965,17 +1523,13 @@ bool_t a_Cache_process_dbuf(int Op, const char *buf, size_t buf_size,
          MSG("Premature close for %s\n", URL_STR(entry->Url));
          Cache_finish_msg(entry);
       } else {
-         int i;
          CacheClient_t *Client;
 
-         for (i = 0; (Client = dList_nth_data(ClientQueue, i)); ++i) {
-            if (Client->Url == entry->Url) {
-               DilloWeb *web = (DilloWeb *)Client->Web;
+         while ((Client = dList_nth_data(entry->Clients, 0))) {
+            DilloWeb *web = (DilloWeb *)Client->Web;
 
-               a_Bw_remove_client(web->bw, Client->Key);
-               Cache_client_dequeue(Client);
-               --i; /* Keep the index value in the next iteration */
-            }
+            a_Bw_remove_client(web->bw, Client->Key);
+            Cache_client_dequeue(Client);
          }
       }
    }
@@ -1010,7 +1564,7 @@ static int Cache_redirect(CacheEntry_t *entry, int Flags, BrowserWindow *bw)
 
    if ((entry->Flags & CA_Redirect && entry->Location) &&
        (entry->Flags & CA_ForceRedirect || entry->Flags & CA_TempRedirect ||
-        !entry->Data->len || entry->Data->len < 1024)) {
+        Cache_data(entry)->len < 1024)) {
 
       _MSG(">>>> Redirect from: %s\n to %s <<<<\n",
            URL_STR_(entry->Url), URL_STR_(entry->Location));
@@ -1025,7 +1579,7 @@ static int Cache_redirect(CacheEntry_t *entry, int Flags, BrowserWindow *bw)
          a_Url_free(NewUrl);
       } else {
          /* Sub entity redirection (most probably an image) */
-         if (!entry->Data->len) {
+         if (!Cache_data(entry)->len) {
             _MSG(">>>> Image redirection without entity-content <<<<\n");
          } else {
             _MSG(">>>> Image redirection with entity-content <<<<\n");
@@ -1184,8 +1738,8 @@ static CacheEntry_t *Cache_process_queue(CacheEntry_t *entry)
    if (!(entry->Flags & CA_GotHeader))
       return entry;
    if (!(entry->Flags & CA_GotContentType)) {
-      st = a_Misc_get_content_type_from_data(
-              entry->Data->str, entry->Data->len, &Type);
+      data = Cache_raw_data(entry);
+      st = a_Misc_get_content_type_from_data(data->str, data->len, &Type);
       _MSG("Cache: detected Content-Type '%s'\n", Type);
       if (st == 0 || !(entry->Flags & CA_InProgress)) {
          if (a_Misc_content_type_check(entry->TypeHdr, Type) < 0) {
@@ -1200,122 +1754,120 @@ static CacheEntry_t *Cache_process_queue(CacheEntry_t *entry)
    }
 
    Busy = TRUE;
-   for (i = 0; (Client = dList_nth_data(ClientQueue, i)); ++i) {
-      if (Client->Url == entry->Url) {
-         ClientWeb = Client->Web;    /* It was a (void*) */
-         Client_bw = ClientWeb->bw;  /* 'bw' in a local var */
-
-         if (ClientWeb->flags & WEB_RootUrl) {
-            if (!(entry->Flags & CA_MsgErased)) {
-               /* clear the "expecting for reply..." message */
-               a_UIcmd_set_msg(Client_bw, "");
-               entry->Flags |= CA_MsgErased;
-            }
-            if (TypeMismatch) {
-               a_UIcmd_set_msg(Client_bw,"HTTP warning: Content-Type '%s' "
-                               "doesn't match the real data.", entry->TypeHdr);
-               OfferDownload = TRUE;
-            }
-            if (entry->Flags & CA_Redirect) {
-               if (!Client->Callback) {
-                  Client->Callback = Cache_null_client;
-                  Client_bw->redirect_level++;
-               }
-            } else {
-               Client_bw->redirect_level = 0;
-            }
-            if (entry->Flags & CA_HugeFile) {
-               a_UIcmd_set_msg(Client_bw, "Huge file! (%d MB)",
-                               entry->ExpectedSize / (1024*1024));
-               AbortEntry = OfferDownload = TRUE;
+   for (i = 0; (Client = dList_nth_data(entry->Clients, i)); ++i) {
+      ClientWeb = Client->Web;    /* It was a (void*) */
+      Client_bw = ClientWeb->bw;  /* 'bw' in a local var */
+
+      if (ClientWeb->flags & WEB_RootUrl) {
+         if (!(entry->Flags & CA_MsgErased)) {
+            /* clear the "expecting for reply..." message */
+            a_UIcmd_set_msg(Client_bw, "");
+            entry->Flags |= CA_MsgErased;
+         }
+         if (TypeMismatch) {
+            a_UIcmd_set_msg(Client_bw,"HTTP warning: Content-Type '%s' "
+                            "doesn't match the real data.", entry->TypeHdr);
+            OfferDownload = TRUE;
+         }
+         if (entry->Flags & CA_Redirect) {
+            if (!Client->Callback) {
+               Client->Callback = Cache_null_client;
+               Client_bw->redirect_level++;
             }
          } else {
-            /* For non root URLs, ignore redirections and 404 answers */
-            if (entry->Flags & CA_Redirect || entry->Flags & CA_NotFound)
-               Client->Callback = Cache_null_client;
+            Client_bw->redirect_level = 0;
          }
-
-         /* Set the client function */
-         if (!Client->Callback) {
+         if (entry->Flags & CA_HugeFile) {
+            a_UIcmd_set_msg(Client_bw, "Huge file! (%d MB)",
+                            entry->ExpectedSize / (1024*1024));
+            AbortEntry = OfferDownload = TRUE;
+         }
+      } else {
+         /* For non root URLs, ignore redirections and 404 answers */
+         if (entry->Flags & CA_Redirect || entry->Flags & CA_NotFound)
             Client->Callback = Cache_null_client;
+      }
 
-            if (entry->Location && !(entry->Flags & CA_Redirect)) {
-               /* Not following redirection, so don't display page body. */
+      /* Set the client function */
+      if (!Client->Callback) {
+         Client->Callback = Cache_null_client;
+
+         if (entry->Location && !(entry->Flags & CA_Redirect)) {
+            /* Not following redirection, so don't display page body. */
+         } else {
+            if (TypeMismatch) {
+               AbortEntry = TRUE;
             } else {
-               if (TypeMismatch) {
-                  AbortEntry = TRUE;
-               } else {
-                  const char *curr_type = Cache_current_content_type(entry);
-                  st = a_Web_dispatch_by_type(curr_type, ClientWeb,
-                                              &Client->Callback,
-                                              &Client->CbData);
-                  if (st == -1) {
-                     /* MIME type is not viewable */
-                     if (ClientWeb->flags & WEB_RootUrl) {
-                        MSG("Content-Type '%s' not viewable.\n", curr_type);
-                        /* prepare a download offer... */
-                        AbortEntry = OfferDownload = TRUE;
-                     } else {
-                        /* TODO: Resource Type not handled.
-                         * Not aborted to avoid multiple connections on the
-                         * same resource. A better idea is to abort the
-                         * connection and to keep a failed-resource flag in
-                         * the cache entry. */
-                     }
+               const char *curr_type = Cache_current_content_type(entry);
+               st = a_Web_dispatch_by_type(curr_type, ClientWeb,
+                                           &Client->Callback,
+                                           &Client->CbData);
+               if (st == -1) {
+                  /* MIME type is not viewable */
+                  if (ClientWeb->flags & WEB_RootUrl) {
+                     MSG("Content-Type '%s' not viewable.\n", curr_type);
+                     /* prepare a download offer... */
+                     AbortEntry = OfferDownload = TRUE;
+                  } else {
+                     /* TODO: Resource Type not handled.
+                      * Not aborted to avoid multiple connections on the
+                      * same resource. A better idea is to abort the
+                      * connection and to keep a failed-resource flag in
+                      * the cache entry. */
                   }
                }
-               if (AbortEntry) {
-                  if (ClientWeb->flags & WEB_RootUrl)
-                     a_Nav_cancel_expect_if_eq(Client_bw, Client->Url);
-                  a_Bw_remove_client(Client_bw, Client->Key);
-                  Cache_client_dequeue(Client);
-                  --i; /* Keep the index value in the next iteration */
-                  continue;
-               }
+            }
+            if (AbortEntry) {
+               if (ClientWeb->flags & WEB_RootUrl)
+                  a_Nav_cancel_expect_if_eq(Client_bw, Client->Url);
+               a_Bw_remove_client(Client_bw, Client->Key);
+               Cache_client_dequeue(Client);
+               --i; /* Keep the index value in the next iteration */
+               continue;
             }
          }
+      }
 
-         /* Send data to our client */
-         if (ClientWeb->flags & WEB_Download) {
-            /* for download, always provide original data, not translated */
-            data = entry->Data;
-         } else {
-            data = Cache_data(entry);
-         }
-         if ((Client->BufSize = data->len) > 0) {
-            Client->Buf = data->str;
-            (Client->Callback)(CA_Send, Client);
-            if (ClientWeb->flags & WEB_RootUrl) {
-               /* show size of page received */
-               a_UIcmd_set_page_prog(Client_bw, entry->Data->len, 1);
-            }
+      /* Send data to our client */
+      if (ClientWeb->flags & WEB_Download) {
+         /* for download, always provide original data, not translated */
+         data = Cache_raw_data(entry);
+      } else {
+         data = Cache_data(entry);
+      }
+      if ((Client->BufSize = data->len) > 0) {
+         Client->Buf = data->str;
+         (Client->Callback)(CA_Send, Client);
+         if (ClientWeb->flags & WEB_RootUrl) {
+            /* show size of page received */
+            a_UIcmd_set_page_prog(Client_bw, data->len, 1);
          }
+      }
 
-         /* Remove client when done */
-         if (!(entry->Flags & CA_InProgress)) {
-            /* Copy flags to a local var */
-            int flags = ClientWeb->flags;
+      /* Remove client when done */
+      if (!(entry->Flags & CA_InProgress)) {
+         /* Copy flags to a local var */
+         int flags = ClientWeb->flags;
 
-            if (ClientWeb->flags & WEB_RootUrl && entry->Location &&
-                !(entry->Flags & CA_Redirect)) {
-               Cache_provide_redirection_blocked_page(entry, Client);
-            }
-            /* We finished sending data, let the client know */
-            (Client->Callback)(CA_Close, Client);
-            if (ClientWeb->flags & WEB_RootUrl) {
-               if (entry->Flags & CA_Aborted) {
-                  a_UIcmd_set_msg(Client_bw, "ERROR: Connection closed early, "
-                                             "read not complete.");
-               }
-               a_UIcmd_set_page_prog(Client_bw, 0, 0);
+         if (ClientWeb->flags & WEB_RootUrl && entry->Location &&
+             !(entry->Flags & CA_Redirect)) {
+            Cache_provide_redirection_blocked_page(entry, Client);
+         }
+         /* We finished sending data, let the client know */
+         (Client->Callback)(CA_Close, Client);
+         if (ClientWeb->flags & WEB_RootUrl) {
+            if (entry->Flags & CA_Aborted) {
+               a_UIcmd_set_msg(Client_bw, "ERROR: Connection closed early, "
+                                          "read not complete.");
             }
-            Cache_client_dequeue(Client);
-            --i; /* Keep the index value in the next iteration */
-
-            /* we assert just one redirect call */
-            if (entry->Flags & CA_Redirect)
-               Cache_redirect(entry, flags, Client_bw);
+            a_UIcmd_set_page_prog(Client_bw, 0, 0);
          }
+         Cache_client_dequeue(Client);
+         --i; /* Keep the index value in the next iteration */
+
+         /* we assert just one redirect call */
+         if (entry->Flags & CA_Redirect)
+            Cache_redirect(entry, flags, Client_bw);
       }
    } /* for */
 
@@ -1383,6 +1935,84 @@ static void Cache_delayed_process_queue(CacheEntry_t *entry)
    }
 }
 
+/*
+ * Can this entry be dropped from memory without anybody noticing?
+ * (i.e., it's complete, nobody holds its data and it has no clients)
+ */
+static bool_t Cache_entry_is_evictable(CacheEntry_t *entry)
+{
+   return !(entry->Flags & (CA_InternalUrl | CA_InProgress) ||
+            entry->DataRefcount > 0 || dList_length(entry->Clients) > 0 ||
+            dList_find(DelayedQueue, entry));
+}
+
+/*
+ * Compare function for sorting entries from least to most recently used.
+ */
+static int Cache_entry_by_use_cmp(const void *v1, const void *v2)
+{
+   const CacheEntry_t *e1 = v1, *e2 = v2;
+
+   return (e1->LastUse < e2->LastUse) ? -1 : (e1->LastUse > e2->LastUse);
+}
+
+/*
+ * Evict least recently used entries until the cache fits in its budget.
+ */
+static void Cache_trim(void)
+{
+   uint_t b;
+   int i;
+   Dlist *victims;
+   CacheEntry_t *entry;
+
+   if (prefs.cache_max_size <= 0 || CacheSize <= prefs.cache_max_size)
+      return;
+
+   victims = dList_new(64);
+   for (b = 0; b < CachedURLsSize; b++)
+      for (entry = CachedURLs[b]; entry; entry = entry->Next)
+         if (Cache_entry_is_evictable(entry))
+            dList_append(victims, entry);
+   dList_sort(victims, Cache_entry_by_use_cmp);
+
+   for (i = 0; CacheSize > prefs.cache_max_size &&
+               (entry = dList_nth_data(victims, i)); ++i) {
+      _MSG("Cache_trim: evicting %s (%d bytes)\n", URL_STR_(entry->Url),
+           entry->Size);
+      Cache_entry_remove(entry, NULL);
+      CacheEvictions++;
+   }
+   dList_free(victims);
+   _MSG("Cache_trim: %d bytes in use, budget is %d\n",
+        CacheSize, prefs.cache_max_size);
+}
+
+/*
+ * Callback function for Cache_trim_schedule.
+ */
+static void Cache_trim_callback(void *data)
+{
+   (void) data;
+   CacheTrimPending = FALSE;
+   Cache_trim();
+   a_Timeout_remove();
+}
+
+/*
+ * Set a call to Cache_trim from the main cycle if we're over budget.
+ * (Evicting right away could remove entries while the client queue is
+ * being walked)
+ */
+static void Cache_trim_schedule(void)
+{
+   if (prefs.cache_max_size > 0 && CacheSize > prefs.cache_max_size &&
+       !CacheTrimPending) {
+      CacheTrimPending = TRUE;
+      a_Timeout_add(0.0, Cache_trim_callback, NULL);
+   }
+}
+
 /*
  * Last Client for this entry?
  * Return: Client if true, NULL otherwise
@@ -1390,18 +2020,14 @@ static void Cache_delayed_process_queue(CacheEntry_t *entry)
  */
 CacheClient_t *a_Cache_client_get_if_unique(int Key)
 {
-   int i, n = 0;
-   CacheClient_t *Client, *iClient;
+   CacheClient_t *Client;
+   CacheEntry_t *entry;
 
-   if ((Client = dList_find_custom(ClientQueue, INT2VOIDP(Key),
-                                   Cache_client_by_key_cmp))) {
-      for (i = 0; (iClient = dList_nth_data(ClientQueue, i)); ++i) {
-         if (iClient->Url == Client->Url) {
-            ++n;
-         }
-      }
-   }
-   return (n == 1) ? Client : NULL;
+   if ((Client = Cache_client_search(Key)) &&
+       (entry = Cache_entry_search(Client->Url)) &&
+       dList_length(entry->Clients) == 1)
+      return Client;
+   return NULL;
 }
 
 /*
@@ -1415,8 +2041,7 @@ void a_Cache_stop_client(int Key)
    DICacheEntry *DicEntry;
 
    /* The client can be in both queues at the same time */
-   if ((Client = dList_find_custom(ClientQueue, INT2VOIDP(Key),
-                                   Cache_client_by_key_cmp))) {
+   if ((Client = Cache_client_search(Key))) {
       /* Dicache */
       if ((DicEntry = a_Dicache_get_entry(Client->Url, Client->Version)))
          a_Dicache_unref(Client->Url, Client->Version);
@@ -1428,29 +2053,580 @@ void a_Cache_stop_client(int Key)
       /* Main queue */
       Cache_client_dequeue(Client);
 
-   } else {
+   } else if (!a_Dicache_stop_client(Key)) {
+      /* (the dicache may still hold it, waiting for a decoder thread) */
       _MSG("WARNING: Cache_stop_client, nonexistent client\n");
    }
 }
 
 
+/* Disk cache ------------------------------------------------------------- */
+
+/*
+ * Compare function for the sorted DiskURLs list.
+ */
+static int Cache_disk_entry_cmp(const void *v1, const void *v2)
+{
+   const CacheDiskEntry_t *d1 = v1, *d2 = v2;
+
+   return strcmp(d1->Url, d2->Url);
+}
+
+/*
+ * Compare function for searching DiskURLs with a URL string.
+ */
+static int Cache_disk_entry_by_url_cmp(const void *v1, const void *v2)
+{
+   return strcmp(((CacheDiskEntry_t *)v1)->Url, (const char *)v2);
+}
+
+/*
+ * Compare function for sorting DiskURLs by key.
+ */
+static int Cache_disk_entry_key_cmp(const void *v1, const void *v2)
+{
+   const CacheDiskEntry_t *d1 = v1, *d2 = v2;
+
+   return strcmp(d1->Key, d2->Key);
+}
+
+/*
+ * Compare function for searching DiskURLs (sorted by key) with a key.
+ */
+static int Cache_disk_entry_by_key_cmp(const void *v1, const void *v2)
+{
+   return strcmp(((CacheDiskEntry_t *)v1)->Key, (const char *)v2);
+}
+
+/*
+ * Compare function for sorting from most to least recently used.
+ */
+static int Cache_disk_entry_by_use_cmp(const void *v1, const void *v2)
+{
+   const CacheDiskEntry_t *d1 = v1, *d2 = v2;
+
+   return (d1->LastUse > d2->LastUse) ? -1 : (d1->LastUse < d2->LastUse);
+}
+
+static void Cache_disk_entry_free(CacheDiskEntry_t *de)
+{
+   dFree(de->Url);
+   dFree(de->ETag);
+   dFree(de->LastModified);
+   dFree(de->Type);
+   dFree(de);
+}
+
+/*
+ * Make the file name for a body, from its key.
+ */
+static char *Cache_disk_filename(const char *key, const char *suffix)
+{
+   return dStrconcat(DiskDir, "/", key, suffix, NULL);
+}
+
+/*
+ * Lock the disk cache against other dillo processes sharing it.
+ * Return: the descriptor to pass to Cache_disk_unlock(), or -1 if the lock
+ * file can't be opened (then we go on without the lock).
+ */
+static int Cache_disk_lock(void)
+{
+   struct flock lck;
+   char *filename = Cache_disk_filename("lock", "");
+   int fd = open(filename, O_RDWR | O_CREAT, 0600);
+
+   if (fd == -1) {
+      MSG_WARN("Cache: can't open %s: %s\n", filename, dStrerror(errno));
+   } else {
+      lck.l_start = 0; /* start at beginning of file */
+      lck.l_len = 0;   /* lock entire file */
+      lck.l_type = F_WRLCK;
+      lck.l_whence = SEEK_SET;
+      while (fcntl(fd, F_SETLKW, &lck) == -1 && errno == EINTR) ;
+   }
+   dFree(filename);
+   return fd;
+}
+
+static void Cache_disk_unlock(int fd)
+{
+   if (fd != -1)
+      dClose(fd);  /* releases the lock */
+}
+
+/*
+ * Write an index line for a disk entry.
+ * Fields are tab-separated; absent strings are written as "-".
+ */
+static void Cache_disk_write_index_line(FILE *fp, CacheDiskEntry_t *de)
+{
+   fprintf(fp, "%s\t%d\t%ld\t%ld\t%s\t%s\t%s\t%s\n", de->Key, de->Size,
+           (long)de->Expires, (long)de->LastUse,
+           de->ETag ? de->ETag : "-",
+           de->LastModified ? de->LastModified : "-",
+           de->Type ? de->Type : "-", de->Url);
+}
+
+/*
+ * Append a line to the index (the caller holds the lock). Later lines for
+ * the same URL override earlier ones, and a line with a size of 0 removes
+ * the URL; the index is compacted at exit.
+ */
+static void Cache_disk_append_index(CacheDiskEntry_t *de)
+{
+   FILE *fp;
+   char *filename = Cache_disk_filename("index", "");
+
+   if ((fp = fopen(filename, "a"))) {
+      Cache_disk_write_index_line(fp, de);
+      fclose(fp);
+   } else {
+      MSG_WARN("Cache: can't write %s: %s\n", filename, dStrerror(errno));
+   }
+   dFree(filename);
+}
+
+/*
+ * Remove a disk entry, and its body file.
+ */
+static void Cache_disk_entry_remove(CacheDiskEntry_t *de)
+{
+   char *filename = Cache_disk_filename(de->Key, "");
+   int lock = Cache_disk_lock();
+
+   unlink(filename);
+   DiskSize -= de->Size;
+   de->Size = 0;
+   de->LastUse = time(NULL);
+   Cache_disk_append_index(de);
+   Cache_disk_unlock(lock);
+   dFree(filename);
+   dList_remove(DiskURLs, de);
+   Cache_disk_entry_free(de);
+}
+
+/*
+ * Parse an index line. Return a new disk entry, or NULL if invalid.
+ */
+static CacheDiskEntry_t *Cache_disk_parse_index_line(char *line)
+{
+   char *field[8], *p = line;
+   CacheDiskEntry_t *de;
+   int i;
+
+   for (i = 0; i < 8 && (field[i] = dStrsep(&p, "\t\n")); i++) ;
+   if (i < 8 || strlen(field[0]) != 32 || !*field[7])
+      return NULL;
+
+   de = dNew0(CacheDiskEntry_t, 1);
+   memcpy(de->Key, field[0], 33);
+   de->Size = strtol(field[1], NULL, 10);
+   de->Expires = (time_t) strtol(field[2], NULL, 10);
+   de->LastUse = (time_t) strtol(field[3], NULL, 10);
+   de->ETag = strcmp(field[4], "-") ? dStrdup(field[4]) : NULL;
+   de->LastModified = strcmp(field[5], "-") ? dStrdup(field[5]) : NULL;
+   de->Type = strcmp(field[6], "-") ? dStrdup(field[6]) : NULL;
+   de->Url = dStrdup(field[7]);
+   return de;
+}
+
+/*
+ * Read the index into 'list', a sorted list like DiskURLs.
+ */
+static void Cache_disk_read_index(Dlist *list)
+{
+   FILE *fp;
+   char *filename, *line;
+   CacheDiskEntry_t *de, *old;
+
+   filename = Cache_disk_filename("index", "");
+   if ((fp = fopen(filename, "r"))) {
+      while ((line = dGetline(fp))) {
+         if ((de = Cache_disk_parse_index_line(line))) {
+            if ((old = dList_find_sorted(list, de->Url,
+                                         Cache_disk_entry_by_url_cmp))) {
+               dList_remove(list, old);
+               Cache_disk_entry_free(old);
+            }
+            if (de->Size > 0)
+               dList_insert_sorted(list, de, Cache_disk_entry_cmp);
+            else
+               Cache_disk_entry_free(de);
+         }
+         dFree(line);
+      }
+      fclose(fp);
+   }
+   dFree(filename);
+}
+
+/*
+ * Create the disk cache directory and read its index.
+ */
+static void Cache_disk_init(void)
+{
+   CacheDiskEntry_t *de;
+   int i;
+
+   DiskDir = dStrconcat(dGethomedir(), "/.dillo/cache", NULL);
+   if (mkdir(DiskDir, 0700) < 0 && errno != EEXIST) {
+      MSG_WARN("Cache: can't create %s: %s\n", DiskDir, dStrerror(errno));
+      dFree(DiskDir);
+      DiskDir = NULL;
+      return;
+   }
+   DiskURLs = dList_new(256);
+   Cache_disk_read_index(DiskURLs);
+   DiskSize = 0;
+   for (i = 0; (de = dList_nth_data(DiskURLs, i)); ++i)
+      DiskSize += de->Size;
+   _MSG("Cache: %d entries in the disk cache\n", dList_length(DiskURLs));
+}
+
+/*
+ * Create a cache entry for 'Url' from the disk cache, if it's there.
+ * The body is mapped into memory, not read.
+ */
+static CacheEntry_t *Cache_disk_load(const DilloUrl *Url)
+{
+   CacheDiskEntry_t *de;
+   CacheEntry_t *entry;
+   struct stat sb;
+   char *filename;
+   void *map;
+   int fd;
+
+   if (!(de = dList_find_sorted(DiskURLs, URL_STR(Url),
+                                Cache_disk_entry_by_url_cmp)))
+      return NULL;
+
+   if ((de->Expires && time(NULL) >= de->Expires &&
+        !de->ETag && !de->LastModified) || de->Size <= 0) {
+      /* useless: can't be revalidated */
+      Cache_disk_entry_remove(de);
+      return NULL;
+   }
+
+   filename = Cache_disk_filename(de->Key, "");
+   fd = open(filename, O_RDONLY);
+   dFree(filename);
+   map = MAP_FAILED;
+   if (fd != -1) {
+      if (fstat(fd, &sb) == 0 && sb.st_size == (off_t)de->Size + 1)
+         map = mmap(NULL, de->Size + 1, PROT_READ, MAP_PRIVATE, fd, 0);
+      dClose(fd);
+   }
+   if (map == MAP_FAILED) {
+      MSG("Cache: dropping bad disk entry for %s\n", de->Url);
+      Cache_disk_entry_remove(de);
+      return NULL;
+   }
+
+   entry = Cache_entry_add(Url);
+   dStr_free(entry->Data, 1);
+   entry->Data = dNew(Dstr, 1);
+   entry->Data->str = map;
+   entry->Data->len = de->Size;
+   entry->Data->sz = de->Size + 1;
+   entry->MapSize = de->Size + 1;
+   entry->ExpectedSize = entry->TransferSize = de->Size;
+   entry->Flags = CA_GotHeader | CA_GotLength | CA_KeepAlive;
+   entry->ETag = dStrdup(de->ETag);
+   entry->LastModified = dStrdup(de->LastModified);
+   entry->Expires = de->Expires;
+   if (de->Type)
+      a_Cache_set_content_type(entry->Url, de->Type, "http");
+   Cache_entry_account(entry);
+
+   de->LastUse = time(NULL);
+   _MSG("Cache: %s loaded from disk\n", de->Url);
+   return entry;
+}
+
+/*
+ * Drop the least recently used disk entries, but 'keep', while the disk
+ * cache is over cache_disk_max_size.
+ */
+static void Cache_disk_trim(CacheDiskEntry_t *keep)
+{
+   CacheDiskEntry_t *de, *lru;
+   int i;
+
+   while (prefs.cache_disk_max_size > 0 &&
+          DiskSize > prefs.cache_disk_max_size) {
+      lru = NULL;
+      for (i = 0; (de = dList_nth_data(DiskURLs, i)); ++i)
+         if (de != keep && (!lru || de->LastUse < lru->LastUse))
+            lru = de;
+      if (!lru)
+         break;
+      Cache_disk_entry_remove(lru);
+   }
+}
+
+/*
+ * Save a complete entry in the disk cache (if it is worth it).
+ */
+static void Cache_disk_store(CacheEntry_t *entry)
+{
+   const char *hdr = entry->Header->str, *url_str = URL_STR(entry->Url);
+   bool_t not_modified;
+   CacheDiskEntry_t *de;
+   md5_state_t state;
+   md5_byte_t digest[16];
+   char *filename, *tmpname;
+   FILE *fp;
+   int i, ok, lock;
+
+   if (entry->Flags & (CA_Aborted | CA_Redirect | CA_NotFound | CA_HugeFile |
+                       CA_InternalUrl | CA_NoStore) ||
+       entry->Auth || entry->Header->len < 12 ||
+       Cache_data(entry)->len == 0 ||
+       URL_FLAGS(entry->Url) & URL_Post ||
+       (dStrAsciiCasecmp(URL_SCHEME(entry->Url), "http") &&
+        dStrAsciiCasecmp(URL_SCHEME(entry->Url), "https")))
+      return;
+   if (strpbrk(url_str, "\t\n") ||
+       (entry->ETag && strchr(entry->ETag, '\t')) ||
+       (entry->LastModified && strchr(entry->LastModified, '\t')) ||
+       (entry->TypeHdr && strchr(entry->TypeHdr, '\t')))
+      return;  /* can't be written in the index */
+   if (!entry->ETag && !entry->LastModified &&
+       (!entry->Expires || entry->Expires <= time(NULL)))
+      return;  /* would be useless after a restart */
+
+   not_modified = !strncmp(hdr + 9, "304", 3);
+   if (strncmp(hdr + 9, "200", 3) && !not_modified)
+      return;
+
+   if (!(de = dList_find_sorted(DiskURLs, url_str,
+                                Cache_disk_entry_by_url_cmp))) {
+      de = dNew0(CacheDiskEntry_t, 1);
+      de->Url = dStrdup(url_str);
+      md5_init(&state);
+      md5_append(&state, (const md5_byte_t *)url_str, strlen(url_str));
+      md5_finish(&state, digest);
+      for (i = 0; i < 16; i++)
+         snprintf(de->Key + 2 * i, 3, "%02x", digest[i]);
+      dList_insert_sorted(DiskURLs, de, Cache_disk_entry_cmp);
+      not_modified = FALSE;
+   }
+
+   Cache_raw_data(entry);
+   lock = -1;
+   if (!not_modified || de->Size != entry->Data->len) {
+      /* write the body (the trailing NUL included) */
+      filename = Cache_disk_filename(de->Key, "");
+      tmpname = Cache_disk_filename(de->Key, ".tmp");
+      ok = 0;
+      if ((fp = fopen(tmpname, "w"))) {
+         ok = (fwrite(entry->Data->str, entry->Data->len + 1, 1, fp) == 1);
+         ok = (fclose(fp) == 0) && ok;
+      }
+      /* the body and its index line go in together, or compaction in
+       * another process could take the body for an orphan */
+      if (ok)
+         lock = Cache_disk_lock();
+      if (!ok || rename(tmpname, filename) < 0) {
+         MSG_WARN("Cache: can't write %s: %s\n", filename, dStrerror(errno));
+         Cache_disk_unlock(lock);
+         unlink(tmpname);
+         dFree(filename);
+         dFree(tmpname);
+         Cache_disk_entry_remove(de);
+         return;
+      }
+      dFree(filename);
+      dFree(tmpname);
+      DiskSize += entry->Data->len - de->Size;
+      de->Size = entry->Data->len;
+   } else {
+      lock = Cache_disk_lock();
+   }
+
+   dFree(de->ETag);
+   dFree(de->LastModified);
+   dFree(de->Type);
+   de->ETag = dStrdup(entry->ETag);
+   de->LastModified = dStrdup(entry->LastModified);
+   de->Type = dStrdup(entry->TypeHdr);
+   de->Expires = entry->Expires;
+   de->LastUse = time(NULL);
+   Cache_disk_append_index(de);
+   Cache_disk_unlock(lock);
+   _MSG("Cache: %s stored on disk\n", url_str);
+
+   Cache_disk_trim(de);
+}
+
+/*
+ * Merge what other dillo processes have added to the index since we read
+ * it into DiskURLs (for a URL in both, the most recent use wins).
+ */
+static void Cache_disk_merge_index(void)
+{
+   Dlist *ondisk = dList_new(256);
+   CacheDiskEntry_t *od, *de;
+
+   Cache_disk_read_index(ondisk);
+   while ((od = dList_nth_data(ondisk, 0))) {
+      dList_remove_fast(ondisk, od);
+      de = dList_find_sorted(DiskURLs, od->Url, Cache_disk_entry_by_url_cmp);
+      if (de && de->LastUse >= od->LastUse) {
+         Cache_disk_entry_free(od);
+      } else {
+         if (de) {
+            dList_remove(DiskURLs, de);
+            Cache_disk_entry_free(de);
+         }
+         dList_insert_sorted(DiskURLs, od, Cache_disk_entry_cmp);
+      }
+   }
+   dList_free(ondisk);
+}
+
+/*
+ * Return: a sorted list with the names of the files in the cache directory
+ * that look like bodies.
+ */
+static Dlist *Cache_disk_list_bodies(void)
+{
+   Dlist *bodies = dList_new(256);
+   DIR *dir;
+   struct dirent *dent;
+
+   if ((dir = opendir(DiskDir))) {
+      while ((dent = readdir(dir))) {
+         if (strlen(dent->d_name) == 32 &&
+             strspn(dent->d_name, "0123456789abcdef") == 32)
+            dList_append(bodies, dStrdup(dent->d_name));
+      }
+      closedir(dir);
+   }
+   dList_sort(bodies, (dCompareFunc)strcmp);
+   return bodies;
+}
+
+/*
+ * Keep the most recently used entries that fit in cache_disk_max_size,
+ * write a compacted index, and free the disk cache list.
+ * This is done with the disk cache locked, and with the entries that other
+ * dillo processes added meanwhile, so that none of them is lost.
+ */
+static void Cache_disk_freeall(void)
+{
+   FILE *fp;
+   char *filename, *tmpname;
+   CacheDiskEntry_t *de;
+   Dlist *bodies;
+   char *body;
+   long long total = 0;
+   int i, lock, ok = 0;
+
+   lock = Cache_disk_lock();
+   Cache_disk_merge_index();
+   bodies = Cache_disk_list_bodies();
+   dList_sort(DiskURLs, Cache_disk_entry_by_use_cmp);
+
+   filename = Cache_disk_filename("index", "");
+   tmpname = Cache_disk_filename("index", ".tmp");
+   if ((fp = fopen(tmpname, "w"))) {
+      for (i = 0; (de = dList_nth_data(DiskURLs, i)); ++i) {
+         if (!dList_find_sorted(bodies, de->Key, (dCompareFunc)strcmp)) {
+            /* removed by another process */
+            dList_remove(DiskURLs, de);
+            Cache_disk_entry_free(de);
+            --i;
+            continue;
+         }
+         total += de->Size;
+         if (prefs.cache_disk_max_size > 0 &&
+             total > prefs.cache_disk_max_size) {
+            /* its body goes with the orphans below */
+            dList_remove(DiskURLs, de);
+            Cache_disk_entry_free(de);
+            --i;
+         } else {
+            Cache_disk_write_index_line(fp, de);
+         }
+      }
+      ok = (fclose(fp) == 0 && rename(tmpname, filename) == 0);
+      if (!ok)
+         MSG_WARN("Cache: can't write %s: %s\n", filename, dStrerror(errno));
+   }
+   dFree(filename);
+   dFree(tmpname);
+
+   /* delete the bodies that are not in the index (left behind by removed
+    * entries, or by a crash) */
+   dList_sort(DiskURLs, Cache_disk_entry_key_cmp);
+   while ((body = dList_nth_data(bodies, 0))) {
+      dList_remove_fast(bodies, body);
+      if (ok && !dList_find_sorted(DiskURLs, body,
+                                   Cache_disk_entry_by_key_cmp)) {
+         filename = Cache_disk_filename(body, "");
+         unlink(filename);
+         dFree(filename);
+      }
+      dFree(body);
+   }
+   dList_free(bodies);
+   Cache_disk_unlock(lock);
+
+   while ((de = dList_nth_data(DiskURLs, 0))) {
+      dList_remove_fast(DiskURLs, de);
+      Cache_disk_entry_free(de);
+   }
+   dList_free(DiskURLs);
+   DiskURLs = NULL;
+   DiskSize = 0;
+   dFree(DiskDir);
+   DiskDir = NULL;
+}
+
+/*
+ * Get the statistics for sizing cache_max_size: hits, misses, evicted
+ * entries, and the bytes the entries take now.
+ */
+void a_Cache_get_stats(uint_t *hits, uint_t *misses, uint_t *evictions,
+                       int *size)
+{
+   *hits = CacheHits;
+   *misses = CacheMisses;
+   *evictions = CacheEvictions;
+   *size = CacheSize;
+}
+
 /*
  * Memory deallocator (only called at exit time)
  */
 void a_Cache_freeall(void)
 {
    CacheClient_t *Client;
-   void *data;
+   CacheEntry_t *entry;
+   uint_t i;
+
+   MSG("Cache: %u hits, %u misses, %u evictions, %d bytes in use.\n",
+       CacheHits, CacheMisses, CacheEvictions, CacheSize);
 
    /* free the client queue */
    while ((Client = dList_nth_data(ClientQueue, 0)))
       Cache_client_dequeue(Client);
+   dList_free(ClientQueue);
+   dList_free(DelayedQueue);
 
    /* Remove every cache entry */
-   while ((data = dList_nth_data(CachedURLs, 0))) {
-      dList_remove_fast(CachedURLs, data);
-      Cache_entry_free(data);
+   for (i = 0; i < CachedURLsSize; i++) {
+      while ((entry = CachedURLs[i])) {
+         CachedURLs[i] = entry->Next;
+         Cache_entry_free(entry);
+      }
    }
-   /* Remove the cache list */
-   dList_free(CachedURLs);
+   /* Remove the hash table */
+   dFree(CachedURLs);
+   dStr_free(DecodeBuf, 1);
+
+   if (DiskURLs)
+      Cache_disk_freeall();
 }
@@ -34,6 +34,10 @@ extern "C" {
 #define CA_HugeFile     0x1000  /* URL content is too big */
 #define CA_IsEmpty      0x2000  /* True until a byte of content arrives */
 #define CA_KeepAlive    0x4000
+#define CA_Stale        0x8000  /* Freshness lifetime is over; revalidate */
+#define CA_NoStore     0x10000  /* Never write this one to the disk cache */
+#define CA_Reencodable 0x20000  /* Data can be rebuilt exactly from UTF8Data */
+#define CA_KeepRaw     0x40000  /* Data can't be rebuilt from UTF8Data */
 
 typedef struct CacheClient CacheClient_t;
 
@@ -68,10 +72,15 @@ const char *a_Cache_set_content_type(const DilloUrl *url, const char *ctype,
                                      const char *from);
 uint_t a_Cache_get_flags(const DilloUrl *url);
 uint_t a_Cache_get_flags_with_redirection(const DilloUrl *url);
+void a_Cache_resend(const DilloUrl *Url);
+bool_t a_Cache_get_validators(const DilloUrl *Url, const char **ETag,
+                              const char **LastModified);
 bool_t a_Cache_process_dbuf(int Op, const char *buf, size_t buf_size,
-                          const DilloUrl *Url);
+                            const DilloUrl *Url, size_t *used);
 int a_Cache_download_enabled(const DilloUrl *url);
 void a_Cache_entry_remove_by_url(DilloUrl *url);
+void a_Cache_get_stats(uint_t *hits, uint_t *misses, uint_t *evictions,
+                       int *size);
 void a_Cache_freeall(void);
 CacheClient_t *a_Cache_client_get_if_unique(int Key);
 void a_Cache_stop_client(int Key);
@@ -396,8 +396,9 @@ int a_Capi_open_url(DilloWeb *web, CA_Callback_t Call, void *CbData)
    int safe = 0, ret = 0, use_cache = 0;
 
    if (Capi_request_permitted(web)) {
-      /* reload test */
-      reload = (!(a_Capi_get_flags(web->url) & CAPI_IsCached) ||
+      /* reload test (stale entries are revalidated with the server) */
+      int flags = a_Capi_get_flags(web->url);
+      reload = (!(flags & CAPI_IsCached) || (flags & CAPI_Stale) ||
                 (URL_FLAGS(web->url) & URL_E2EQuery));
 
       if (web->flags & WEB_Download) {
@@ -506,6 +507,8 @@ static int Capi_map_cache_flags(uint_t flags)
          status |= CAPI_InProgress;
       else
          status |= CAPI_Completed;
+      if (flags & CA_Stale)
+         status |= CAPI_Stale;
 
       /* CAPI_Aborted is not yet used/defined */
    }
@@ -700,7 +703,7 @@ void a_Capi_ccc(int Op, int Branch, int Dir, ChainLink *Info,
          case OpAbort:
             conn = Info->LocalKey;
             conn->InfoSend = NULL;
-            a_Cache_process_dbuf(IOAbort, NULL, 0, conn->url);
+            a_Cache_process_dbuf(IOAbort, NULL, 0, conn->url, NULL);
             if (Data2) {
                if (!strcmp(Data2, "DpidERROR")) {
                   a_UIcmd_set_msg(conn->bw,
@@ -766,15 +769,22 @@ void a_Capi_ccc(int Op, int Branch, int Dir, ChainLink *Info,
             conn = Info->LocalKey;
             if (strcmp(Data2, "send_page_2eof") == 0) {
                /* Data1 = dbuf */
-               DataBuf *dbuf = Data1;
+               DataBuf *dbuf = Data1, *rest = NULL;
+               size_t used;
                bool_t finished = a_Cache_process_dbuf(IORead, dbuf->Buf,
-                                                      dbuf->Size, conn->url);
+                                                      dbuf->Size, conn->url,
+                                                      &used);
                if (finished && Capi_conn_valid(conn) && conn->InfoRecv) {
                   /* If we have a persistent connection where cache tells us
                    * that we've received the full response, and cache didn't
                    * trigger an abort and tear everything down, tell upstream.
+                   * Any bytes past the response go along with it.
                    */
-                  a_Chain_bcb(OpSend, conn->InfoRecv, NULL, "reply_complete");
+                  if (used < (size_t)dbuf->Size)
+                     rest = a_Chain_dbuf_new(dbuf->Buf + used,
+                                             dbuf->Size - used, 0);
+                  a_Chain_bcb(OpSend, conn->InfoRecv, rest, "reply_complete");
+                  dFree(rest);
                }
             } else if (strcmp(Data2, "send_status_message") == 0) {
                a_UIcmd_set_msg(conn->bw, "%s", Data1);
@@ -797,7 +807,7 @@ void a_Capi_ccc(int Op, int Branch, int Dir, ChainLink *Info,
             conn = Info->LocalKey;
             conn->InfoRecv = NULL;
 
-            a_Cache_process_dbuf(IOClose, NULL, 0, conn->url);
+            a_Cache_process_dbuf(IOClose, NULL, 0, conn->url, NULL);
 
             if (conn->InfoSend) {
                /* Propagate OpEnd to the sending branch too */
@@ -809,7 +819,7 @@ void a_Capi_ccc(int Op, int Branch, int Dir, ChainLink *Info,
          case OpAbort:
             conn = Info->LocalKey;
             conn->InfoRecv = NULL;
-            a_Cache_process_dbuf(IOAbort, NULL, 0, conn->url);
+            a_Cache_process_dbuf(IOAbort, NULL, 0, conn->url, NULL);
             if (Data2) {
                if (!strcmp(Data2, "Both") && conn->InfoSend) {
                   /* abort the other branch too */
@@ -17,6 +17,7 @@ extern "C" {
 #define CAPI_InProgress     (0x4)
 #define CAPI_Aborted        (0x8)
 #define CAPI_Completed     (0x10)
+#define CAPI_Stale         (0x20)
 
 /*
  * Function prototypes
@@ -10,6 +10,7 @@
  */
 
 #include <stdio.h>
+#include <limits.h>
 #include "../dlib/dlib.h"
 #include "msg.h"
 #include "html_common.hh"
@@ -34,8 +35,14 @@ CssPropertyList::CssPropertyList (const CssPropertyList &p, bool deep) :
          switch (p->type) {
             case CSS_TYPE_STRING:
             case CSS_TYPE_SYMBOL:
+            case CSS_TYPE_URI:
                p->value.strVal = dStrdup (p->value.strVal);
                break;
+            case CSS_TYPE_BACKGROUND_POSITION:
+               p->value.posVal = (CssBackgroundPosition *)
+                  memcpy (dNew (CssBackgroundPosition, 1), p->value.posVal,
+                          sizeof (CssBackgroundPosition));
+               break;
             default:
                break;
          }
@@ -52,6 +59,41 @@ CssPropertyList::~CssPropertyList () {
          getRef (i)->free ();
 }
 
+/**
+ * \brief Whether both lists hold the same properties, in the same order.
+ */
+bool CssPropertyList::equals (CssPropertyList *props) {
+   if (props->size () != size ())
+      return false;
+
+   for (int i = 0; i < size (); i++) {
+      CssProperty *p1 = getRef (i), *p2 = props->getRef (i);
+
+      if (p1->name != p2->name || p1->type != p2->type)
+         return false;
+
+      switch (p1->type) {
+         case CSS_TYPE_STRING:
+         case CSS_TYPE_SYMBOL:
+         case CSS_TYPE_URI:
+            if (strcmp (p1->value.strVal, p2->value.strVal))
+               return false;
+            break;
+         case CSS_TYPE_BACKGROUND_POSITION:
+            if (p1->value.posVal->posX != p2->value.posVal->posX ||
+                p1->value.posVal->posY != p2->value.posVal->posY)
+               return false;
+            break;
+         default:
+            if (p1->value.intVal != p2->value.intVal)
+               return false;
+            break;
+      }
+   }
+
+   return true;
+}
+
 /**
  * \brief Set property to a given name and type.
  */
@@ -104,11 +146,15 @@ void CssPropertyList::print () {
       getRef (i)->print ();
 }
 
+#ifdef STYLEENGINE_BENCH
+bool CssSelector::ancestorFilter = true;
+#endif
+
 CssSelector::CssSelector () {
    struct CombinatorAndSelector *cs;
 
    refCount = 0;
-   matchCacheOffset = -1;
+   numAncestorHashes = 0;
    selectorList.increase ();
    cs = selectorList.getRef (selectorList.size () - 1);
 
@@ -125,7 +171,8 @@ CssSelector::~CssSelector () {
  * \brief Return whether selector matches at a given node in the document tree.
  */
 bool CssSelector::match (Doctree *docTree, const DoctreeNode *node,
-                         int i, Combinator comb, MatchCache *matchCache) {
+                         int i, Combinator comb, MatchCache *matchCache,
+                         int matchCacheOffset) {
    int *matchCacheEntry;
    assert (node);
 
@@ -151,7 +198,8 @@ bool CssSelector::match (Doctree *docTree, const DoctreeNode *node,
          for (const DoctreeNode *n = node;
               n && n->num > *matchCacheEntry; n = docTree->parent (n))
             if (sel->match (n) &&
-                match (docTree, n, i - 1, cs->combinator, matchCache))
+                match (docTree, n, i - 1, cs->combinator, matchCache,
+                       matchCacheOffset))
                return true;
 
          if (node) // remember that it didn't match to avoid future tests
@@ -167,13 +215,13 @@ bool CssSelector::match (Doctree *docTree, const DoctreeNode *node,
       return false;
 
    // tail recursion should be optimized by the compiler
-   return match (docTree, node, i - 1, cs->combinator, matchCache);
+   return match (docTree, node, i - 1, cs->combinator, matchCache,
+                 matchCacheOffset);
 }
 
 void CssSelector::addSimpleSelector (Combinator c) {
    struct CombinatorAndSelector *cs;
 
-   assert (matchCacheOffset == -1);
    selectorList.increase ();
    cs = selectorList.getRef (selectorList.size () - 1);
 
@@ -181,6 +229,54 @@ void CssSelector::addSimpleSelector (Combinator c) {
    cs->selector = new CssSimpleSelector ();
 }
 
+void CssSelector::addAncestorHash (unsigned int hash) {
+   if (numAncestorHashes < ANCESTOR_HASHES)
+      ancestorHashes[numAncestorHashes++] = hash;
+}
+
+/**
+ * \brief Find out what the ancestors of a node have to have for the
+ *    selector to match at it, for the fast reject in match ().
+ *
+ * Called when the selector is complete. A simple selector followed by a
+ * child or descendant combinator has to match an ancestor (those followed
+ * by an adjacent sibling combinator match a sibling, which is no help).
+ * Ids are the most telling, then classes, then elements; pseudo classes
+ * are not taken into account.
+ */
+void CssSelector::computeAncestorHashes () {
+   int n = selectorList.size () - 1;
+
+   numAncestorHashes = 0;
+   for (int i = 0; i < n; i++)
+      if (selectorList.getRef (i + 1)->combinator != COMB_ADJACENT_SIBLING &&
+          selectorList.getRef (i)->selector->getId ())
+         addAncestorHash (DoctreeFilter::hashId
+                          (selectorList.getRef (i)->selector->getId ()));
+   for (int i = 0; i < n; i++) {
+      lout::misc::SimpleVector <char *> *klass =
+         selectorList.getRef (i)->selector->getClass ();
+
+      if (selectorList.getRef (i + 1)->combinator != COMB_ADJACENT_SIBLING)
+         for (int j = 0; j < klass->size (); j++)
+            addAncestorHash (DoctreeFilter::hashClass (klass->get (j)));
+   }
+   for (int i = 0; i < n; i++) {
+      int element = selectorList.getRef (i)->selector->getElement ();
+
+      if (selectorList.getRef (i + 1)->combinator != COMB_ADJACENT_SIBLING &&
+          element >= 0)
+         addAncestorHash (DoctreeFilter::hashElement (element));
+   }
+}
+
+bool CssSelector::checksSiblings () {
+   for (int i = 0; i < selectorList.size (); i++)
+      if (selectorList.getRef (i)->combinator == COMB_ADJACENT_SIBLING)
+         return true;
+   return false;
+}
+
 bool CssSelector::checksPseudoClass () {
    for (int i = 0; i < selectorList.size (); i++)
       if (selectorList.getRef (i)->selector->getPseudoClass ())
@@ -325,6 +421,7 @@ CssRule::CssRule (CssSelector *selector, CssPropertyList *props, int pos) {
    this->props = props;
    this->props->ref ();
    this->pos = pos;
+   matchCacheOffset = -1;
    spec = selector->specificity ();
 }
 
@@ -333,12 +430,6 @@ CssRule::~CssRule () {
    props->unref ();
 }
 
-void CssRule::apply (CssPropertyList *props, Doctree *docTree,
-                     const DoctreeNode *node, MatchCache *matchCache) const {
-   if (selector->match (docTree, node, matchCache))
-      this->props->apply (props);
-}
-
 void CssRule::print () {
    selector->print ();
    props->print ();
@@ -351,16 +442,32 @@ void CssRule::print () {
  * will be added behind the others.
  * This gives later added rules more weight.
  */
-void CssStyleSheet::RuleList::insert (CssRule *rule) {
+void CssStyleSheet::RuleList::insert (CssRule *rule, bool keyOnly) {
    increase ();
    int i = size () - 1;
 
-   while (i > 0 && rule->specificity () < get (i - 1)->specificity ()) {
+   while (i > 0 &&
+          (rule->specificity () < getRef (i - 1)->specificity ||
+           (rule->specificity () == getRef (i - 1)->specificity &&
+            rule->position () < getRef (i - 1)->position))) {
       *getRef (i) = get (i - 1);
       i--;
    }
 
-   *getRef (i) = rule;
+   RuleEntry *e = getRef (i);
+   e->rule = rule;
+   e->specificity = rule->specificity ();
+   e->position = rule->position ();
+   e->element = rule->selector->top ()->getElement ();
+   e->keyOnly = keyOnly;
+}
+
+int CssStyleSheet::RuleKey::hashValue () {
+   unsigned int hash = 2166136261u; // FNV-1a
+
+   for (const char *p = str; *p; p++)
+      hash = (hash ^ (unsigned char) *p) * 16777619;
+   return hash & INT_MAX;
 }
 
 /**
@@ -372,10 +479,10 @@ void CssStyleSheet::RuleList::insert (CssRule *rule) {
 void CssStyleSheet::addRule (CssRule *rule) {
    CssSimpleSelector *top = rule->selector->top ();
    RuleList *ruleList = NULL;
-   lout::object::ConstString *string;
+   RuleKey *string;
 
    if (top->getId ()) {
-      string = new lout::object::ConstString (top->getId ());
+      string = new RuleKey (top->getId ());
       ruleList = idTable.get (string);
       if (ruleList == NULL) {
          ruleList = new RuleList ();
@@ -384,7 +491,7 @@ void CssStyleSheet::addRule (CssRule *rule) {
          delete string;
       }
    } else if (top->getClass () && top->getClass ()->size () > 0) {
-      string = new lout::object::ConstString (top->getClass ()->get (0));
+      string = new RuleKey (top->getClass ()->get (0));
       ruleList = classTable.get (string);
       if (ruleList == NULL) {
          ruleList = new RuleList;
@@ -399,9 +506,17 @@ void CssStyleSheet::addRule (CssRule *rule) {
    }
 
    if (ruleList) {
-      ruleList->insert (rule);
-      if (rule->selector->getRequiredMatchCache () > requiredMatchCache)
-         requiredMatchCache = rule->selector->getRequiredMatchCache ();
+      /* When the list is looked at, its id or class is known to be there.
+       * If that is all the selector asks for, besides the element, it need
+       * not be matched in full.
+       */
+      bool keyOnly = rule->selector->size () == 1 &&
+                     top->getPseudoClass () == NULL &&
+                     top->getClass ()->size () <= (top->getId () ? 0 : 1);
+
+      ruleList->insert (rule, keyOnly);
+      if (rule->getRequiredMatchCache () > requiredMatchCache)
+         requiredMatchCache = rule->getRequiredMatchCache ();
    } else {
       assert (top->getElement () == CssSimpleSelector::ELEMENT_NONE);
       delete rule;
@@ -416,12 +531,13 @@ void CssStyleSheet::addRule (CssRule *rule) {
  */
 void CssStyleSheet::apply (CssPropertyList *props, Doctree *docTree,
                         const DoctreeNode *node, MatchCache *matchCache) const {
-   static const int maxLists = 32;
+   static const int maxLists = 32, maxMatching = 64;
    const RuleList *ruleList[maxLists];
-   int numLists = 0, index[maxLists] = {0};
+   const RuleEntry *matchingBuf[maxMatching], **matching = matchingBuf;
+   int numLists = 0, numMatching = 0, sizeMatching = maxMatching;
 
    if (node->id) {
-      lout::object::ConstString idString (node->id);
+      RuleKey idString (node->id);
 
       ruleList[numLists] = idTable.get (&idString);
       if (ruleList[numLists])
@@ -435,7 +551,7 @@ void CssStyleSheet::apply (CssPropertyList *props, Doctree *docTree,
             break;
          }
 
-         lout::object::ConstString classString (node->klass->get (i));
+         RuleKey classString (node->klass->get (i));
 
          ruleList[numLists] = classTable.get (&classString);
          if (ruleList[numLists])
@@ -451,46 +567,114 @@ void CssStyleSheet::apply (CssPropertyList *props, Doctree *docTree,
    if (ruleList[numLists])
       numLists++;
 
-   // Apply potentially matching rules from ruleList[0-numLists] with
-   // ascending specificity.
-   // If specificity is equal, rules are applied in order of appearance.
-   //  Each ruleList is sorted already.
-   while (true) {
-      int minSpec = 1 << 30;
-      int minPos = 1 << 30;
-      int minSpecIndex = -1;
-
-      for (int i = 0; i < numLists; i++) {
-         const RuleList *rl = ruleList[i];
-
-         if (rl && rl->size () > index[i] &&
-            (rl->get(index[i])->specificity () < minSpec ||
-             (rl->get(index[i])->specificity () == minSpec &&
-              rl->get(index[i])->position () < minPos))) {
-
-            minSpec = rl->get(index[i])->specificity ();
-            minPos = rl->get(index[i])->position ();
-            minSpecIndex = i;
+   // Collect the matching rules from ruleList[0-numLists] with ascending
+   // specificity. If specificity is equal, rules are applied in order of
+   // appearance. Each ruleList is sorted already, so inserting them one
+   // after the other takes few moves.
+   for (int i = 0; i < numLists; i++) {
+      const RuleList *rl = ruleList[i];
+
+      for (int j = 0; j < rl->size (); j++) {
+         const RuleEntry *e = rl->getRef (j);
+
+         if (e->keyOnly ?
+             (e->element != node->element &&
+              e->element != CssSimpleSelector::ELEMENT_ANY) :
+             !e->rule->selector->match (docTree, node, matchCache,
+                                        e->rule->getMatchCacheOffset ()))
+            continue;
+
+         if (numMatching == sizeMatching) {
+            sizeMatching *= 2;
+            if (matching == matchingBuf) {
+               matching = dNew (const RuleEntry*, sizeMatching);
+               memcpy (matching, matchingBuf, sizeof (matchingBuf));
+            } else {
+               matching = (const RuleEntry **)
+                  dRealloc (matching, sizeMatching * sizeof (RuleEntry*));
+            }
          }
-      }
 
-      if (minSpecIndex >= 0) {
-         CssRule *rule = ruleList[minSpecIndex]->get (index[minSpecIndex]);
-         rule->apply(props, docTree, node, matchCache);
-         index[minSpecIndex]++;
-      } else {
-         break;
+         int k = numMatching++;
+         while (k > 0 &&
+                (e->specificity < matching[k - 1]->specificity ||
+                 (e->specificity == matching[k - 1]->specificity &&
+                  e->position < matching[k - 1]->position))) {
+            matching[k] = matching[k - 1];
+            k--;
+         }
+         matching[k] = e;
       }
    }
+
+   for (int i = 0; i < numMatching; i++)
+      matching[i]->rule->applyProperties (props);
+
+   if (matching != matchingBuf)
+      dFree (matching);
 }
 
 CssStyleSheet CssContext::userAgentSheet;
+bool CssContext::userAgentSiblingRules = false;
 
 CssContext::CssContext () {
    pos = 0;
+   posEnd = -1;
+   numRules = 0;
+   siblingRules = false;
    matchCache.setSize (userAgentSheet.getRequiredMatchCache (), -1);
 }
 
+/**
+ * \brief Reserve rule positions for a stylesheet which is parsed later.
+ *
+ * The rules of a stylesheet that arrives late still have to come in
+ * document order, i.e. before those added in the meantime. The range
+ * [*start, *end) is set aside for it now, and it is parsed into the range
+ * with setPositions () when it arrives. Inside such a range (an @import of
+ * a late stylesheet) half of what is left is reserved.
+ *
+ * Return: false, when there is no room left.
+ */
+bool CssContext::reservePositions (int *start, int *end) {
+   int n = (posEnd == -1) ? POSITION_BLOCK : (posEnd - pos) / 2;
+
+   if (n < 1 || pos + n > (1 << 30) - POSITION_BLOCK)
+      return false;
+
+   *start = pos;
+   *end = pos = pos + n;
+   return true;
+}
+
+/**
+ * \brief Get the next rule position, and the end of the range it is in
+ *    (-1 for none).
+ */
+void CssContext::getPositions (int *pos, int *posEnd) {
+   *pos = this->pos;
+   *posEnd = this->posEnd;
+}
+
+/**
+ * \brief Set where the rules added next are placed, see reservePositions ().
+ */
+void CssContext::setPositions (int pos, int posEnd) {
+   this->pos = pos;
+   this->posEnd = posEnd;
+}
+
+/**
+ * \brief Forget what is known about matching the elements seen so far.
+ *
+ * The match cache is only valid while elements are applied in document
+ * order; this has to be called before applying the elements once more.
+ */
+void CssContext::clearMatchCache () {
+   for (int i = 0; i < matchCache.size (); i++)
+      matchCache.set (i, -1);
+}
+
 /**
  * \brief Apply a CSS context to a property list.
  *
@@ -538,9 +722,16 @@ void CssContext::addRule (CssSelector *sel, CssPropertyList *props,
          _MSG_WARN ("Ignoring unsafe author style that might reveal browsing history\n");
          delete rule;
       } else {
-         rule->selector->setMatchCacheOffset(matchCache.size ());
-         if (rule->selector->getRequiredMatchCache () > matchCache.size ())
-            matchCache.setSize (rule->selector->getRequiredMatchCache (), -1);
+         numRules++;
+         if (rule->selector->checksSiblings ()) {
+            if (order == CSS_PRIMARY_USER_AGENT)
+               userAgentSiblingRules = true;
+            else
+               siblingRules = true;
+         }
+         rule->setMatchCacheOffset(matchCache.size ());
+         if (rule->getRequiredMatchCache () > matchCache.size ())
+            matchCache.setSize (rule->getRequiredMatchCache (), -1);
 
          if (order == CSS_PRIMARY_USER_AGENT) {
             userAgentSheet.addRule (rule);
@@ -550,3 +741,46 @@ void CssContext::addRule (CssSelector *sel, CssPropertyList *props,
       }
    }
 }
+
+CssParsedStyleSheet::~CssParsedStyleSheet () {
+   for (int i = 0; i < rules.size (); i++) {
+      rules.getRef(i)->selector->unref ();
+      rules.getRef(i)->props->unref ();
+   }
+   for (int i = 0; i < imports.size (); i++)
+      a_Url_free (imports.get (i));
+}
+
+void CssParsedStyleSheet::addRule (CssSelector *sel, CssPropertyList *props,
+                                   CssPrimaryOrder order) {
+   Rule *rule;
+
+   if (props->size () > 0) {
+      sel->ref ();
+      props->ref ();
+      rules.increase ();
+      rule = rules.getRef (rules.size () - 1);
+      rule->selector = sel;
+      rule->props = props;
+      rule->order = order;
+   }
+}
+
+/**
+ * \brief Remember an @import, to be loaded before the rules are added.
+ */
+void CssParsedStyleSheet::addImport (const DilloUrl *url) {
+   imports.increase ();
+   imports.set (imports.size () - 1, a_Url_dup (url));
+}
+
+/**
+ * \brief Add the rules to a CSS context, as if the stylesheet was parsed
+ *    into it.
+ */
+void CssParsedStyleSheet::addTo (CssContext *context) {
+   for (int i = 0; i < rules.size (); i++) {
+      Rule *rule = rules.getRef (i);
+      context->addRule (rule->selector, rule->props, rule->order);
+   }
+}
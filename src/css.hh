@@ -2,6 +2,7 @@
 #define __CSS_HH__
 
 #include "dw/core.hh"
+#include "url.h"
 #include "doctree.hh"
 
 /* Origin and weight. Used only internally.*/
@@ -327,6 +328,7 @@ class CssPropertyList : public lout::misc::SimpleVector <CssProperty> {
       void set (CssPropertyName name, CssValueType type,
                 CssPropertyValue value);
       void apply (CssPropertyList *props);
+      bool equals (CssPropertyList *props);
       bool isSafe () { return safe; };
       void print ();
       inline void ref () { refCount++; }
@@ -390,11 +392,25 @@ class CssSelector {
          CssSimpleSelector *selector;
       };
 
-      int refCount, matchCacheOffset;
+      enum { ANCESTOR_HASHES = 4 };
+
+      int refCount;
       lout::misc::SimpleVector <struct CombinatorAndSelector> selectorList;
+      /* DoctreeFilter hashes of what the ancestors of a matching node
+       * need to have, rarest first.
+       */
+      unsigned int ancestorHashes[ANCESTOR_HASHES];
+      int numAncestorHashes;
+
+#ifdef STYLEENGINE_BENCH
+      static bool ancestorFilter;
+#else
+      static const bool ancestorFilter = true;
+#endif
 
       bool match (Doctree *dt, const DoctreeNode *node, int i, Combinator comb,
-                  MatchCache *matchCache);
+                  MatchCache *matchCache, int matchCacheOffset);
+      void addAncestorHash (unsigned int hash);
 
    public:
       CssSelector ();
@@ -404,20 +420,24 @@ class CssSelector {
          return selectorList.getRef (selectorList.size () - 1)->selector;
       }
       inline int size () { return selectorList.size (); };
+#ifdef STYLEENGINE_BENCH
+      /* for test/styleengine_bench.cc only */
+      static void setAncestorFilter (bool ancestorFilter)
+      { CssSelector::ancestorFilter = ancestorFilter; }
+#endif
+      void computeAncestorHashes ();
       inline bool match (Doctree *dt, const DoctreeNode *node,
-                         MatchCache *matchCache) {
+                         MatchCache *matchCache, int matchCacheOffset) {
+         if (ancestorFilter)
+            for (int i = 0; i < numAncestorHashes; i++)
+               if (!node->ancestors.mayContain (ancestorHashes[i]))
+                  return false;
          return match (dt, node, selectorList.size () - 1, COMB_NONE,
-                       matchCache);
-      }
-      inline void setMatchCacheOffset (int mo) {
-         if (matchCacheOffset == -1)
-            matchCacheOffset = mo;
-      }
-      inline int getRequiredMatchCache () {
-         return matchCacheOffset + size ();
+                       matchCache, matchCacheOffset);
       }
       int specificity ();
       bool checksPseudoClass ();
+      bool checksSiblings ();
       void print ();
       inline void ref () { refCount++; }
       inline void unref () { if (--refCount == 0) delete this; }
@@ -431,7 +451,7 @@ class CssSelector {
 class CssRule {
    private:
       CssPropertyList *props;
-      int spec, pos;
+      int spec, pos, matchCacheOffset;
 
    public:
       CssSelector *selector;
@@ -439,13 +459,23 @@ class CssRule {
       CssRule (CssSelector *selector, CssPropertyList *props, int pos);
       ~CssRule ();
 
-      void apply (CssPropertyList *props, Doctree *docTree,
-                  const DoctreeNode *node, MatchCache *matchCache) const;
+      /* Apply the properties, where the selector is known to match. */
+      inline void applyProperties (CssPropertyList *props) const {
+         this->props->apply (props);
+      }
       inline bool isSafe () {
          return !selector->checksPseudoClass () || props->isSafe ();
       };
       inline int specificity () { return spec; };
       inline int position () { return pos; };
+      /* A selector may be shared by several rules (and contexts), so each
+       * rule has its own place in the match cache of its context.
+       */
+      inline void setMatchCacheOffset (int mo) { matchCacheOffset = mo; }
+      inline int getMatchCacheOffset () const { return matchCacheOffset; }
+      inline int getRequiredMatchCache () {
+         return matchCacheOffset + selector->size ();
+      }
       void print ();
 };
 
@@ -456,27 +486,44 @@ class CssRule {
  */
 class CssStyleSheet {
    private:
-      class RuleList : public lout::misc::SimpleVector <CssRule*>,
+      /* A rule, with what apply () needs to know about it at hand. */
+      struct RuleEntry {
+         CssRule *rule;
+         int specificity, position;
+         int element;  // of the rightmost simple selector
+         bool keyOnly; // matches if the element does, see addRule ()
+      };
+
+      class RuleList : public lout::misc::SimpleVector <RuleEntry>,
                        public lout::object::Object {
          public:
-            RuleList () : lout::misc::SimpleVector <CssRule*> (1) {};
+            RuleList () : lout::misc::SimpleVector <RuleEntry> (1) {};
             ~RuleList () {
                for (int i = 0; i < size (); i++)
-                  delete get (i);
+                  delete getRef (i)->rule;
             };
 
-            void insert (CssRule *rule);
+            void insert (CssRule *rule, bool keyOnly);
             inline bool equals (lout::object::Object *other) {
                return this == other;
             };
             inline int hashValue () { return (intptr_t) this; };
       };
 
+      /* An id or class. ConstString::hashValue () would let only the last
+       * character pick the bucket, and "m-1", "p-1", "col-1"... collide.
+       */
+      class RuleKey : public lout::object::ConstString {
+         public:
+            RuleKey (const char *str) : lout::object::ConstString (str) {};
+            int hashValue ();
+      };
+
       class RuleMap : public lout::container::typed::HashTable
-                             <lout::object::ConstString, RuleList > {
+                             <RuleKey, RuleList > {
          public:
             RuleMap () : lout::container::typed::HashTable
-               <lout::object::ConstString, RuleList > (true, true, 256) {};
+               <RuleKey, RuleList > (true, true, 256) {};
       };
 
       static const int ntags = 90 + 14; // \todo don't hardcode
@@ -504,13 +551,29 @@ class CssStyleSheet {
 class CssContext {
    private:
       static CssStyleSheet userAgentSheet;
+      static bool userAgentSiblingRules;
       CssStyleSheet sheet[CSS_PRIMARY_USER_IMPORTANT + 1];
       MatchCache matchCache;
-      int pos;
+      int pos, posEnd;
+      int numRules;
+      bool siblingRules;
+
+      static const int POSITION_BLOCK = 1 << 16;
 
    public:
       CssContext ();
 
+      bool reservePositions (int *start, int *end);
+      void getPositions (int *pos, int *posEnd);
+      void setPositions (int pos, int posEnd);
+      void clearMatchCache ();
+      /** \brief The number of rules added so far (by this context). */
+      inline int getNumRules () { return numRules; }
+      /** \brief Whether a rule depends on the siblings of an element. */
+      inline bool hasSiblingRules () {
+         return siblingRules || userAgentSiblingRules;
+      }
+
       void addRule (CssSelector *sel, CssPropertyList *props,
                     CssPrimaryOrder order);
       void apply (CssPropertyList *props,
@@ -519,4 +582,38 @@ class CssContext {
          CssPropertyList *nonCssHints);
 };
 
+/**
+ * \brief The rules of a parsed stylesheet, which can be added to any number
+ *    of CssContexts.
+ *
+ * The selectors and property lists are shared by the CssRules made from
+ * them, so a parsed stylesheet can be kept and used for other pages, without
+ * parsing it again (see StyleEngine::parseStyleSheet).
+ */
+class CssParsedStyleSheet {
+   private:
+      struct Rule {
+         CssSelector *selector;
+         CssPropertyList *props;
+         CssPrimaryOrder order;
+      };
+
+      lout::misc::SimpleVector <Rule> rules;
+      lout::misc::SimpleVector <DilloUrl *> imports;
+      int refCount;
+
+   public:
+      CssParsedStyleSheet () : rules (8), imports (1) { refCount = 0; }
+      ~CssParsedStyleSheet ();
+
+      void addRule (CssSelector *sel, CssPropertyList *props,
+                    CssPrimaryOrder order);
+      void addImport (const DilloUrl *url);
+      inline int numImports () { return imports.size (); }
+      inline DilloUrl *getImport (int i) { return imports.get (i); }
+      void addTo (CssContext *context);
+      inline void ref () { refCount++; }
+      inline void unref () { if (--refCount == 0) delete this; }
+};
+
 #endif
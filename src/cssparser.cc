@@ -458,6 +458,7 @@ CssParser::CssParser(CssContext *context, CssOrigin origin,
                      const char *buf, int buflen)
 {
    this->context = context;
+   this->sheet = NULL;
    this->origin = origin;
    this->buf = buf;
    this->buflen = buflen;
@@ -1490,6 +1491,9 @@ CssSelector *CssParser::parseSelector()
            (tval[0] != ',' && tval[0] != '{')))
          nextToken();
 
+   if (selector)
+      selector->computeAncestorHashes ();
+
    return selector;
 }
 
@@ -1544,13 +1548,13 @@ void CssParser::parseRuleset()
       CssSelector *s = list->get(i);
 
       if (origin == CSS_ORIGIN_USER_AGENT) {
-         context->addRule(s, props, CSS_PRIMARY_USER_AGENT);
+         addRule(s, props, CSS_PRIMARY_USER_AGENT);
       } else if (origin == CSS_ORIGIN_USER) {
-         context->addRule(s, props, CSS_PRIMARY_USER);
-         context->addRule(s, importantProps, CSS_PRIMARY_USER_IMPORTANT);
+         addRule(s, props, CSS_PRIMARY_USER);
+         addRule(s, importantProps, CSS_PRIMARY_USER_IMPORTANT);
       } else if (origin == CSS_ORIGIN_AUTHOR) {
-         context->addRule(s, props, CSS_PRIMARY_AUTHOR);
-         context->addRule(s, importantProps, CSS_PRIMARY_AUTHOR_IMPORTANT);
+         addRule(s, props, CSS_PRIMARY_AUTHOR);
+         addRule(s, importantProps, CSS_PRIMARY_AUTHOR_IMPORTANT);
       }
 
       s->unref();
@@ -1565,6 +1569,15 @@ void CssParser::parseRuleset()
       nextToken();
 }
 
+void CssParser::addRule(CssSelector *sel, CssPropertyList *props,
+                        CssPrimaryOrder order)
+{
+   if (sheet)
+      sheet->addRule(sel, props, order);
+   else
+      context->addRule(sel, props, order);
+}
+
 char * CssParser::parseUrl()
 {
    Dstr *urlStr = NULL;
@@ -1656,7 +1669,10 @@ void CssParser::parseImport(DilloHtml *html)
          MSG("CssParser::parseImport(): @import %s\n", urlStr);
          DilloUrl *url = a_Html_url_new (html, urlStr, a_Url_str(this->baseUrl),
                                          this->baseUrl ? 1 : 0);
-         a_Html_load_stylesheet(html, url);
+         if (sheet)
+            sheet->addImport(url);
+         else
+            a_Html_load_stylesheet(html, url);
          a_Url_free(url);
       }
       dFree (urlStr);
@@ -1747,38 +1763,59 @@ void CssParser::ignoreStatement()
    }
 }
 
-void CssParser::parse(DilloHtml *html, const DilloUrl *baseUrl,
-                      CssContext *context,
-                      const char *buf,
-                      int buflen, CssOrigin origin)
+void CssParser::parseStyleSheet(DilloHtml *html)
 {
-   CssParser parser (context, origin, baseUrl, buf, buflen);
    bool importsAreAllowed = true;
 
-   while (parser.ttype != CSS_TK_END) {
-      if (parser.ttype == CSS_TK_CHAR &&
-          parser.tval[0] == '@') {
-         parser.nextToken();
-         if (parser.ttype == CSS_TK_SYMBOL) {
-            if (dStrAsciiCasecmp(parser.tval, "import") == 0 &&
+   while (ttype != CSS_TK_END) {
+      if (ttype == CSS_TK_CHAR &&
+          tval[0] == '@') {
+         nextToken();
+         if (ttype == CSS_TK_SYMBOL) {
+            if (dStrAsciiCasecmp(tval, "import") == 0 &&
                 html != NULL &&
                 importsAreAllowed) {
-               parser.parseImport(html);
-            } else if (dStrAsciiCasecmp(parser.tval, "media") == 0) {
-               parser.parseMedia();
+               parseImport(html);
+            } else if (dStrAsciiCasecmp(tval, "media") == 0) {
+               parseMedia();
             } else {
-               parser.ignoreStatement();
+               ignoreStatement();
             }
          } else {
-            parser.ignoreStatement();
+            ignoreStatement();
          }
       } else {
          importsAreAllowed = false;
-         parser.parseRuleset();
+         parseRuleset();
       }
    }
 }
 
+void CssParser::parse(DilloHtml *html, const DilloUrl *baseUrl,
+                      CssContext *context,
+                      const char *buf,
+                      int buflen, CssOrigin origin)
+{
+   CssParser parser (context, origin, baseUrl, buf, buflen);
+
+   parser.parseStyleSheet(html);
+}
+
+/*
+ * Parse a stylesheet into a CssParsedStyleSheet; its @imports are only
+ * recorded there.
+ */
+void CssParser::parse(DilloHtml *html, const DilloUrl *baseUrl,
+                      CssParsedStyleSheet *sheet,
+                      const char *buf,
+                      int buflen, CssOrigin origin)
+{
+   CssParser parser (NULL, origin, baseUrl, buf, buflen);
+
+   parser.sheet = sheet;
+   parser.parseStyleSheet(html);
+}
+
 void CssParser::parseDeclarationBlock(const DilloUrl *baseUrl,
                                       const char *buf, int buflen,
                                       CssPropertyList *props,
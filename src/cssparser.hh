@@ -14,6 +14,7 @@ class CssParser {
 
       static const int maxStrLen = 256;
       CssContext *context;
+      CssParsedStyleSheet *sheet; // where the rules go instead, if set
       CssOrigin origin;
       const DilloUrl *baseUrl;
 
@@ -45,6 +46,9 @@ class CssParser {
       void parseMedia();
       CssSelector *parseSelector();
       void parseRuleset();
+      void addRule(CssSelector *sel, CssPropertyList *props,
+                   CssPrimaryOrder order);
+      void parseStyleSheet(DilloHtml *html);
       void ignoreBlock();
       void ignoreStatement();
 
@@ -55,6 +59,9 @@ class CssParser {
                                         CssPropertyList *propsImortant);
       static void parse(DilloHtml *html, const DilloUrl *baseUrl, CssContext *context,
                         const char *buf, int buflen, CssOrigin origin);
+      static void parse(DilloHtml *html, const DilloUrl *baseUrl,
+                        CssParsedStyleSheet *sheet,
+                        const char *buf, int buflen, CssOrigin origin);
       static const char *propertyNameString(CssPropertyName name);
 };
 
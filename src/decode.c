@@ -15,71 +15,120 @@
 #include <stdlib.h>     /* strtol */
 
 #include "decode.h"
+
+#ifdef ENABLE_BROTLI
+#include <brotli/decode.h>
+#endif
+#ifdef ENABLE_ZSTD
+#include <zstd.h>
+#endif
+
 #include "utf8.hh"
 #include "msg.h"
 
 static const int bufsize = 8*1024;
 
 /*
- * Decode 'Transfer-Encoding: chunked' data
+ * Make room for at least 'room' more bytes at the end of 'ds'.
+ * Return: the address where they go.
  */
-Dstr *a_Decode_transfer_process(DecodeTransfer *dc, const char *instr,
-                                int inlen)
+static char *Decode_reserve(Dstr *ds, int room)
 {
-   char *inputPtr, *eol;
-   int inputRemaining;
-   int chunkRemaining = *((int *)dc->state);
-   Dstr *output = dStr_sized_new(inlen);
+   int n_sz;
 
-   dStr_append_l(dc->leftover, instr, inlen);
-   inputPtr = dc->leftover->str;
-   inputRemaining = dc->leftover->len;
+   for (n_sz = ds->sz; ds->len + room >= n_sz; n_sz *= 2) ;
+   if (n_sz > ds->sz) {
+      ds->str = dRealloc(ds->str, n_sz);
+      ds->sz = n_sz;
+   }
+   return ds->str + ds->len;
+}
 
-   while (inputRemaining > 0) {
+/*
+ * Account for the bytes written in 'ds' up to 'end'.
+ */
+static void Decode_commit(Dstr *ds, const char *end)
+{
+   ds->len = end - ds->str;
+   ds->str[ds->len] = 0;
+}
+
+/* chunkRemaining value while skipping the trailer after the last chunk */
+#define DECODE_CHUNK_TRAILER -1
+
+/*
+ * Decode 'Transfer-Encoding: chunked' data, appending it to 'output'.
+ * Only an incomplete chunk header is kept between calls.
+ * Return: the number of bytes of 'instr' that belong to the chunked body.
+ *         Once the trailer's closing empty line is seen, no more bytes are
+ *         taken, so whatever follows (e.g. the next response on a
+ *         persistent connection) is left to the caller.
+ */
+int a_Decode_transfer_process(DecodeTransfer *dc, const char *instr,
+                              int inlen, Dstr *output)
+{
+   const char *eol, *line, *start = instr;
+   int chunkRemaining = *((int *)dc->state);
+
+   while (inlen > 0 && !dc->finished) {
       if (chunkRemaining > 2) {
          /* chunk body to copy */
-         int copylen = MIN(chunkRemaining - 2, inputRemaining);
-         dStr_append_l(output, inputPtr, copylen);
+         int copylen = MIN(chunkRemaining - 2, inlen);
+         dStr_append_l(output, instr, copylen);
          chunkRemaining -= copylen;
-         inputRemaining -= copylen;
-         inputPtr += copylen;
+         inlen -= copylen;
+         instr += copylen;
       }
 
-      if ((chunkRemaining == 2) && (inputRemaining > 0)) {
+      if ((chunkRemaining == 2) && (inlen > 0)) {
          /* CR to discard */
          chunkRemaining--;
-         inputRemaining--;
-         inputPtr++;
+         inlen--;
+         instr++;
       }
-      if ((chunkRemaining == 1) && (inputRemaining > 0)) {
+      if ((chunkRemaining == 1) && (inlen > 0)) {
          /* LF to discard */
          chunkRemaining--;
-         inputRemaining--;
-         inputPtr++;
+         inlen--;
+         instr++;
       }
+      if (inlen == 0)
+         break;
 
       /*
        * A chunk has a one-line header that begins with the chunk length
-       * in hexadecimal.
+       * in hexadecimal. The last one (length 0) is followed by optional
+       * trailer fields and an empty line.
        */
-      if (!(eol = (char *)memchr(inputPtr, '\n', inputRemaining))) {
-         break;   /* We don't have the whole line yet. */
+      if (!(eol = (const char *)memchr(instr, '\n', inlen))) {
+         /* We don't have the whole line yet; save it for next time. */
+         dStr_append_l(dc->leftover, instr, inlen);
+         instr += inlen;
+         break;
       }
-
-      if (!(chunkRemaining = strtol(inputPtr, NULL, 0x10))) {
-         dc->finished = TRUE;
-         break;   /* A chunk length of 0 means we're done! */
+      if (dc->leftover->len) {
+         dStr_append_l(dc->leftover, instr, eol - instr + 1);
+         line = dc->leftover->str;
+      } else {
+         line = instr;
+      }
+      inlen -= (eol - instr) + 1;
+      instr = eol + 1;
+
+      if (chunkRemaining == DECODE_CHUNK_TRAILER) {
+         if (line[0] == '\r' || line[0] == '\n')
+            dc->finished = TRUE;
+      } else if (!(chunkRemaining = strtol(line, NULL, 0x10))) {
+         /* A chunk length of 0 means we're almost done! */
+         chunkRemaining = DECODE_CHUNK_TRAILER;
+      } else {
+         chunkRemaining += 2; /* CRLF at the end of every chunk */
       }
-      inputRemaining -= (eol - inputPtr) + 1;
-      inputPtr = eol + 1;
-      chunkRemaining += 2; /* CRLF at the end of every chunk */
+      dStr_truncate(dc->leftover, 0);
    }
 
-   /* If we have a partial chunk header, save it for next time. */
-   dStr_erase(dc->leftover, 0, inputPtr - dc->leftover->str);
-
    *(int *)dc->state = chunkRemaining;
-   return output;
+   return instr - start;
 }
 
 bool_t a_Decode_transfer_finished(DecodeTransfer *dc)
@@ -99,159 +148,170 @@ static void Decode_compression_free(Decode *dc)
    (void)inflateEnd((z_stream *)dc->state);
 
    dFree(dc->state);
-   dFree(dc->buffer);
 }
 
 /*
- * BUG: A fair amount of duplicated code exists in the gzip/deflate decoding,
- * but an attempt to pull out the common code left everything too contorted
- * for what it accomplished.
- */
-
-/*
- * Decode gzipped data
+ * Inflate data straight into 'output'.
+ * Return: the last zlib return code.
  */
-static Dstr *Decode_gzip(Decode *dc, const char *instr, int inlen)
+static int Decode_inflate(Decode *dc, const char *instr, int inlen,
+                          Dstr *output)
 {
-   int rc = Z_OK;
-
+   int rc;
+   char *outPtr;
    z_stream *zs = (z_stream *)dc->state;
 
-   int inputConsumed = 0;
-   Dstr *output = dStr_new("");
+   zs->next_in = (Bytef *)instr;
+   zs->avail_in = inlen;
 
-   while ((rc == Z_OK) && (inputConsumed < inlen)) {
-      zs->next_in = (Bytef *)instr + inputConsumed;
-      zs->avail_in = inlen - inputConsumed;
-
-      zs->next_out = (Bytef *)dc->buffer;
+   do {
+      outPtr = Decode_reserve(output, bufsize);
+      zs->next_out = (Bytef *)outPtr;
       zs->avail_out = bufsize;
 
       rc = inflate(zs, Z_SYNC_FLUSH);
 
-      dStr_append_l(output, dc->buffer, zs->total_out);
+      Decode_commit(output, (char *)zs->next_out);
+      // Z_STREAM_END at end of file
+      // A full output buffer may hide more pending output
+   } while ((rc == Z_OK) && (zs->avail_in > 0 || zs->avail_out == 0));
 
-      if ((rc == Z_OK) || (rc == Z_STREAM_END)) {
-         // Z_STREAM_END at end of file
+   return rc;
+}
 
-         inputConsumed += zs->total_in;
-         zs->total_out = 0;
-         zs->total_in = 0;
-      } else if (rc == Z_DATA_ERROR) {
-         MSG_ERR("gzip decompression error\n");
-      }
-   }
-   return output;
+/*
+ * Decode gzipped data
+ */
+static void Decode_gzip(Decode *dc, const char *instr, int inlen,
+                        Dstr *output)
+{
+   if (Decode_inflate(dc, instr, inlen, output) == Z_DATA_ERROR)
+      MSG_ERR("gzip decompression error\n");
 }
 
 /*
  * Decode (raw) deflated data
  */
-static Dstr *Decode_raw_deflate(Decode *dc, const char *instr, int inlen)
+static void Decode_raw_deflate(Decode *dc, const char *instr, int inlen,
+                               Dstr *output)
 {
-   int rc = Z_OK;
+   if (Decode_inflate(dc, instr, inlen, output) == Z_DATA_ERROR)
+      MSG_ERR("raw deflate decompression also failed\n");
+}
 
+/*
+ * Decode deflated data, initially presuming that the required zlib wrapper
+ * is there. On data error, switch to Decode_raw_deflate().
+ */
+static void Decode_deflate(Decode *dc, const char *instr, int inlen,
+                           Dstr *output)
+{
+   int start = output->len;
    z_stream *zs = (z_stream *)dc->state;
 
-   int inputConsumed = 0;
-   Dstr *output = dStr_new("");
+   if (Decode_inflate(dc, instr, inlen, output) == Z_DATA_ERROR) {
+      MSG_WARN("Deflate decompression error. Certain servers illegally fail"
+               " to send data in a zlib wrapper. Let's try raw deflate.\n");
+      dStr_truncate(output, start);
+      (void)inflateEnd(zs);
+      dFree(dc->state);
+      dc->state = zs = dNew(z_stream, 1);
+      zs->zalloc = NULL;
+      zs->zfree = NULL;
+      zs->next_in = NULL;
+      zs->avail_in = 0;
+      dc->decode = Decode_raw_deflate;
+
+      // Negative value means that we want raw deflate.
+      inflateInit2(zs, -MAX_WBITS);
+
+      Decode_raw_deflate(dc, instr, inlen, output);
+   }
+}
 
-   while ((rc == Z_OK) && (inputConsumed < inlen)) {
-      zs->next_in = (Bytef *)instr + inputConsumed;
-      zs->avail_in = inlen - inputConsumed;
+#ifdef ENABLE_BROTLI
+/*
+ * Decode brotli compressed data
+ */
+static void Decode_brotli(Decode *dc, const char *instr, int inlen,
+                          Dstr *output)
+{
+   BrotliDecoderState *bs = (BrotliDecoderState *)dc->state;
+   BrotliDecoderResult rc;
+   const uint8_t *next_in = (const uint8_t *)instr;
+   size_t avail_in = inlen, avail_out;
+   uint8_t *next_out;
 
-      zs->next_out = (Bytef *)dc->buffer;
-      zs->avail_out = bufsize;
+   do {
+      next_out = (uint8_t *)Decode_reserve(output, bufsize);
+      avail_out = bufsize;
 
-      rc = inflate(zs, Z_SYNC_FLUSH);
+      rc = BrotliDecoderDecompressStream(bs, &avail_in, &next_in,
+                                         &avail_out, &next_out, NULL);
 
-      dStr_append_l(output, dc->buffer, zs->total_out);
+      Decode_commit(output, (char *)next_out);
+   } while (rc == BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT);
 
-      if ((rc == Z_OK) || (rc == Z_STREAM_END)) {
-         // Z_STREAM_END at end of file
+   if (rc == BROTLI_DECODER_RESULT_ERROR)
+      MSG_ERR("brotli decompression error: %s\n",
+              BrotliDecoderErrorString(BrotliDecoderGetErrorCode(bs)));
+}
 
-         inputConsumed += zs->total_in;
-         zs->total_out = 0;
-         zs->total_in = 0;
-      } else if (rc == Z_DATA_ERROR) {
-         MSG_ERR("raw deflate decompression also failed\n");
-      }
-   }
-   return output;
+static void Decode_brotli_free(Decode *dc)
+{
+   BrotliDecoderDestroyInstance((BrotliDecoderState *)dc->state);
 }
+#endif /* ENABLE_BROTLI */
 
+#ifdef ENABLE_ZSTD
 /*
- * Decode deflated data, initially presuming that the required zlib wrapper
- * is there. On data error, switch to Decode_raw_deflate().
+ * Decode zstd compressed data
  */
-static Dstr *Decode_deflate(Decode *dc, const char *instr, int inlen)
+static void Decode_zstd(Decode *dc, const char *instr, int inlen,
+                        Dstr *output)
 {
-   int rc = Z_OK;
+   ZSTD_inBuffer in = { instr, inlen, 0 };
+   ZSTD_outBuffer out;
+   size_t rc;
 
-   z_stream *zs = (z_stream *)dc->state;
-
-   int inputConsumed = 0;
-   Dstr *output = dStr_new("");
+   do {
+      out.dst = Decode_reserve(output, bufsize);
+      out.size = bufsize;
+      out.pos = 0;
 
-   while ((rc == Z_OK) && (inputConsumed < inlen)) {
-      zs->next_in = (Bytef *)instr + inputConsumed;
-      zs->avail_in = inlen - inputConsumed;
+      rc = ZSTD_decompressStream((ZSTD_DStream *)dc->state, &out, &in);
 
-      zs->next_out = (Bytef *)dc->buffer;
-      zs->avail_out = bufsize;
-
-      rc = inflate(zs, Z_SYNC_FLUSH);
-
-      dStr_append_l(output, dc->buffer, zs->total_out);
-
-      if ((rc == Z_OK) || (rc == Z_STREAM_END)) {
-         // Z_STREAM_END at end of file
-
-         inputConsumed += zs->total_in;
-         zs->total_out = 0;
-         zs->total_in = 0;
-      } else if (rc == Z_DATA_ERROR) {
-         MSG_WARN("Deflate decompression error. Certain servers illegally fail"
-                 " to send data in a zlib wrapper. Let's try raw deflate.\n");
-         dStr_free(output, 1);
-         (void)inflateEnd(zs);
-         dFree(dc->state);
-         dc->state = zs = dNew(z_stream, 1);
-         zs->zalloc = NULL;
-         zs->zfree = NULL;
-         zs->next_in = NULL;
-         zs->avail_in = 0;
-         dc->decode = Decode_raw_deflate;
-
-         // Negative value means that we want raw deflate.
-         inflateInit2(zs, -MAX_WBITS);
-
-         return Decode_raw_deflate(dc, instr, inlen);
+      Decode_commit(output, (char *)out.dst + out.pos);
+      if (ZSTD_isError(rc)) {
+         MSG_ERR("zstd decompression error: %s\n", ZSTD_getErrorName(rc));
+         break;
       }
-   }
-   return output;
+      // A full output buffer may hide more pending output
+   } while (in.pos < in.size || out.pos == out.size);
 }
 
+static void Decode_zstd_free(Decode *dc)
+{
+   ZSTD_freeDStream((ZSTD_DStream *)dc->state);
+}
+#endif /* ENABLE_ZSTD */
+
 /*
- * Translate to desired character set (UTF-8)
+ * Convert as much of 'instr' as possible, appending it to 'output'.
+ * Return: the number of bytes left (a partial character at the end).
  */
-static Dstr *Decode_charset(Decode *dc, const char *instr, int inlen)
+static int Decode_charset_run(Decode *dc, const char *instr, int inlen,
+                              Dstr *output)
 {
-   inbuf_t *inPtr;
+   inbuf_t *inPtr = (inbuf_t *)instr;
    char *outPtr;
-   size_t inLeft, outRoom;
-
-   Dstr *output = dStr_new("");
+   size_t inLeft = inlen, outRoom;
    int rc = 0;
 
-   dStr_append_l(dc->leftover, instr, inlen);
-   inPtr = dc->leftover->str;
-   inLeft = dc->leftover->len;
-
    while ((rc != EINVAL) && (inLeft > 0)) {
 
-      outPtr = dc->buffer;
-      outRoom = bufsize;
+      outRoom = MAX(inLeft, 64);
+      outPtr = Decode_reserve(output, outRoom);
 
       rc = iconv((iconv_t)dc->state, &inPtr, &inLeft, &outPtr, &outRoom);
 
@@ -260,7 +320,7 @@ static Dstr *Decode_charset(Decode *dc, const char *instr, int inlen)
       //                      EINVAL partial character ends source buffer
       //                      E2BIG  destination buffer is full
 
-      dStr_append_l(output, dc->buffer, bufsize - outRoom);
+      Decode_commit(output, outPtr);
 
       if (rc == -1)
          rc = errno;
@@ -271,9 +331,40 @@ static Dstr *Decode_charset(Decode *dc, const char *instr, int inlen)
                        sizeof(utf8_replacement_char) - 1);
       }
    }
-   dStr_erase(dc->leftover, 0, dc->leftover->len - inLeft);
+   return inLeft;
+}
 
-   return output;
+/*
+ * Translate to desired character set (UTF-8)
+ */
+static void Decode_charset(Decode *dc, const char *instr, int inlen,
+                           Dstr *output)
+{
+   int left;
+
+   if (dc->leftover->len) {
+      /* Complete the character that was split by the last call */
+      int had = dc->leftover->len, n = MIN(inlen, 16), used;
+
+      dStr_append_l(dc->leftover, instr, n);
+      left = Decode_charset_run(dc, dc->leftover->str, dc->leftover->len,
+                                output);
+      used = dc->leftover->len - left;
+      if (used < had) {
+         /* Still incomplete, keep everything for the next call */
+         dStr_append_l(dc->leftover, instr + n, inlen - n);
+         dStr_erase(dc->leftover, 0, used);
+         left = Decode_charset_run(dc, dc->leftover->str,
+                                   dc->leftover->len, output);
+         dStr_erase(dc->leftover, 0, dc->leftover->len - left);
+         return;
+      }
+      dStr_truncate(dc->leftover, 0);
+      instr += used - had;
+      inlen -= used - had;
+   }
+   left = Decode_charset_run(dc, instr, inlen, output);
+   dStr_append_l(dc->leftover, instr + inlen - left, left);
 }
 
 static void Decode_charset_free(Decode *dc)
@@ -281,7 +372,6 @@ static void Decode_charset_free(Decode *dc)
    /* iconv_close() frees dc->state */
    (void)iconv_close((iconv_t)(dc->state));
 
-   dFree(dc->buffer);
    dStr_free(dc->leftover, 1);
 }
 
@@ -314,7 +404,6 @@ static Decode *Decode_content_init_common()
    zs->next_in = NULL;
    zs->avail_in = 0;
    dc->state = zs;
-   dc->buffer = dNew(char, bufsize);
 
    dc->free = Decode_compression_free;
    dc->leftover = NULL; /* not used */
@@ -322,7 +411,8 @@ static Decode *Decode_content_init_common()
 }
 
 /*
- * Initialize content decoder. Currently handles 'gzip' and 'deflate'.
+ * Initialize content decoder. Currently handles 'gzip' and 'deflate',
+ * and also 'br' and 'zstd' when built with them.
  */
 Decode *a_Decode_content_init(const char *format)
 {
@@ -348,6 +438,30 @@ Decode *a_Decode_content_init(const char *format)
          inflateInit(zs);
 
          dc->decode = Decode_deflate;
+#ifdef ENABLE_BROTLI
+      } else if (!dStrAsciiCasecmp(format, "br")) {
+         BrotliDecoderState *bs = BrotliDecoderCreateInstance(NULL, NULL,
+                                                              NULL);
+         if (bs) {
+            dc = dNew(Decode, 1);
+            dc->state = bs;
+            dc->leftover = NULL; /* not used */
+            dc->decode = Decode_brotli;
+            dc->free = Decode_brotli_free;
+         }
+#endif
+#ifdef ENABLE_ZSTD
+      } else if (!dStrAsciiCasecmp(format, "zstd")) {
+         ZSTD_DStream *ds = ZSTD_createDStream();
+         if (ds) {
+            ZSTD_initDStream(ds);
+            dc = dNew(Decode, 1);
+            dc->state = ds;
+            dc->leftover = NULL; /* not used */
+            dc->decode = Decode_zstd;
+            dc->free = Decode_zstd_free;
+         }
+#endif
       } else {
          MSG("Content-Encoding '%s' not recognized.\n", format);
       }
@@ -355,6 +469,40 @@ Decode *a_Decode_content_init(const char *format)
    return dc;
 }
 
+static Decode *Decode_charset_init_common(const char *tocode,
+                                          const char *fromcode)
+{
+   Decode *dc = NULL;
+   iconv_t ic = iconv_open(tocode, fromcode);
+
+   if (ic != (iconv_t) -1) {
+      dc = dNew(Decode, 1);
+      dc->state = ic;
+      dc->leftover = dStr_new("");
+
+      dc->decode = Decode_charset;
+      dc->free = Decode_charset_free;
+   }
+   return dc;
+}
+
+/*
+ * Get the list of content codings that a_Decode_content_init() handles,
+ * for the Accept-Encoding header. Like other browsers, we only offer
+ * brotli and zstd over TLS, where intermediaries can't mangle them.
+ */
+const char *a_Decode_content_encodings(bool_t secure)
+{
+   return (secure) ? "gzip, deflate"
+#ifdef ENABLE_BROTLI
+                     ", br"
+#endif
+#ifdef ENABLE_ZSTD
+                     ", zstd"
+#endif
+                   : "gzip, deflate";
+}
+
 /*
  * Initialize decoder to translate from any character set known to iconv()
  * to UTF-8.
@@ -370,28 +518,31 @@ Decode *a_Decode_charset_init(const char *format)
        strlen(format) &&
        dStrAsciiCasecmp(format,"UTF-8")) {
 
-      iconv_t ic = iconv_open("UTF-8", format);
-      if (ic != (iconv_t) -1) {
-           dc = dNew(Decode, 1);
-           dc->state = ic;
-           dc->buffer = dNew(char, bufsize);
-           dc->leftover = dStr_new("");
-
-           dc->decode = Decode_charset;
-           dc->free = Decode_charset_free;
-      } else {
+      if (!(dc = Decode_charset_init_common("UTF-8", format)))
          MSG_WARN("Unable to convert from character encoding: '%s'\n", format);
-      }
    }
    return dc;
 }
 
 /*
- * Decode data.
+ * Initialize encoder to translate UTF-8 back to 'format'
+ * (the reverse of a_Decode_charset_init()).
+ */
+Decode *a_Decode_charset_encode_init(const char *format)
+{
+   Decode *dc = NULL;
+
+   if (format && strlen(format) && dStrAsciiCasecmp(format, "UTF-8"))
+      dc = Decode_charset_init_common(format, "UTF-8");
+   return dc;
+}
+
+/*
+ * Decode data, appending it to 'output'.
  */
-Dstr *a_Decode_process(Decode *dc, const char *instr, int inlen)
+void a_Decode_process(Decode *dc, const char *instr, int inlen, Dstr *output)
 {
-   return dc->decode(dc, instr, inlen);
+   dc->decode(dc, instr, inlen, output);
 }
 
 /*
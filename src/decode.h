@@ -8,10 +8,10 @@ extern "C" {
 #endif /* __cplusplus */
 
 typedef struct Decode {
-   char *buffer;
    Dstr *leftover;
    void *state;
-   Dstr *(*decode) (struct Decode *dc, const char *instr, int inlen);
+   void (*decode) (struct Decode *dc, const char *instr, int inlen,
+                   Dstr *output);
    void (*free) (struct Decode *dc);
 } Decode;
 
@@ -21,18 +21,20 @@ typedef struct Decode {
 typedef struct DecodeTransfer {
    Dstr *leftover;
    void *state;
-   bool_t finished;    /* has the terminating chunk been seen? */
+   bool_t finished;    /* have the last chunk and its trailer been seen? */
 } DecodeTransfer;
 
 DecodeTransfer *a_Decode_transfer_init(const char *format);
-Dstr *a_Decode_transfer_process(DecodeTransfer *dc, const char *instr,
-                                int inlen);
+int a_Decode_transfer_process(DecodeTransfer *dc, const char *instr,
+                              int inlen, Dstr *output);
 bool_t a_Decode_transfer_finished(DecodeTransfer *dc);
 void a_Decode_transfer_free(DecodeTransfer *dc);
 
 Decode *a_Decode_content_init(const char *format);
+const char *a_Decode_content_encodings(bool_t secure);
 Decode *a_Decode_charset_init(const char *format);
-Dstr *a_Decode_process(Decode *dc, const char *instr, int inlen);
+Decode *a_Decode_charset_encode_init(const char *format);
+void a_Decode_process(Decode *dc, const char *instr, int inlen, Dstr *output);
 void a_Decode_free(Decode *dc);
 
 #ifdef __cplusplus
@@ -9,17 +9,32 @@
  * (at your option) any later version.
  */
 
+#ifdef D_IMG_THREADED
+#  include <pthread.h>
+#endif
+
 #include <string.h>         /* for memset */
 #include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
 
 #include "msg.h"
+#include "prefs.h"
 #include "image.hh"
 #include "imgbuf.hh"
 #include "web.hh"
+#include "capi.h"
 #include "dicache.h"
 #include "dpng.h"
 #include "dgif.h"
 #include "djpeg.h"
+#include "IO/iowatch.hh"
+
+/* Maximum decoding threads (prefs.image_decode_threads is capped by it) */
+#define D_IMG_MAX_THREADS 16
+
+/* Rows decoded in a worker thread are handed over in batches this big */
+#define D_IMG_BATCH_ROWS  32
 
 
 enum {
@@ -28,6 +43,91 @@ enum {
    DIC_Jpeg
 };
 
+/*
+ * What a decoder running in a worker thread asked the dicache to do.
+ * These are carried out by the main thread, in the same order.
+ */
+typedef enum {
+   DOP_SetParms,
+   DOP_SetCmap,
+   DOP_NewScan,
+   DOP_Write,
+   DOP_Close
+} DicacheOpType;
+
+typedef struct {
+   DicacheOpType Type;
+   uint_t width, height;   /* DOP_SetParms */
+   DilloImgType type;      /* DOP_SetParms */
+   double gamma;           /* DOP_SetParms */
+   int bg_color;           /* DOP_SetCmap */
+   uint_t num_colors;      /* DOP_SetCmap */
+   int num_colors_max;     /* DOP_SetCmap */
+   int bg_index;           /* DOP_SetCmap */
+   uint_t Y;               /* DOP_Write */
+   uchar_t *Data;          /* The row (DOP_Write) or color map (DOP_SetCmap) */
+} DicacheOp;
+
+/*
+ * An image being decoded in a worker thread.
+ */
+struct DicacheJob {
+   DilloUrl *url;          /* Our own copy (the decoder points to it) */
+   int version;
+   void *layout;           /* Where the imgbuf will be created */
+   CA_Callback_t Decoder;
+   void *DecoderData;
+
+   /* Used by the worker thread only */
+   CacheClient_t Client;   /* What the decoder is given */
+   Dstr *Input;            /* The image data, as far as it was taken */
+   DilloImgType type;      /* Format of the rows... */
+   uint_t width;           /* ...and their width */
+   int Unnotified;         /* Rows posted since the last notification */
+   bool_t AllData;         /* Input holds the whole image */
+
+   /* Shared, under dicache_mutex */
+   Dstr *Pending;          /* Image data not taken by the worker yet */
+   bool_t InCache;         /* The cache has all the image data */
+   bool_t Complete;        /* Decode what's left, and close the decoder */
+   bool_t Queued;          /* In JobQueue, or held by a worker */
+   bool_t Running;         /* Held by a worker */
+   bool_t Done;            /* The decoder closed (and freed itself) */
+   bool_t Cancelled;
+   Dlist *Ops;             /* DicacheOp for the main thread */
+};
+
+/*
+ * A cache client that got all its data while its image was still being
+ * decoded. It's closed once the decoder is done.
+ */
+typedef struct {
+   int Key;
+   DICacheEntry *entry;    /* The client's reference keeps it alive */
+   DilloImage *Image;
+   BrowserWindow *bw;
+} DicacheParked;
+
+/*
+ * Forward declarations
+ */
+static void Dicache_set_parms(DilloUrl *url, int version, void *layout,
+                              uint_t width, uint_t height, DilloImgType type,
+                              double gamma);
+static void Dicache_image_sync(DICacheEntry *DicEntry, DilloImage *Image);
+static DicacheJob *Dicache_job_current(void);
+static void Dicache_job_post(DicacheJob *job, DicacheOp *op);
+static DicacheJob *Dicache_job_new(DICacheEntry *entry, void *layout);
+static void Dicache_job_feed(DicacheJob *job, CacheClient_t *Client,
+                             void *layout, uint_t from);
+static void Dicache_job_finish(DicacheJob *job);
+static void Dicache_job_cancel(DicacheJob *job);
+static void Dicache_park(DICacheEntry *entry, CacheClient_t *Client);
+static void Dicache_jobs_cb(int fd, void *data);
+#ifdef D_IMG_THREADED
+static void *Dicache_worker(void *data);
+#endif
+
 
 /*
  * List of DICacheEntry. May hold several versions of the same image,
@@ -38,6 +138,27 @@ static Dlist *CachedIMGs = NULL;
 static uint_t dicache_size_total; /* invariant: dicache_size_total is
                                    * the sum of the image sizes (3*w*h)
                                    * of all the images in the dicache. */
+static uint_t dicache_use_clock;  /* Ticks on every use of an entry */
+
+static int dicache_num_threads;   /* Decoding threads (0: decode in the
+                                   * main thread, in the cache callback) */
+static Dlist *DicacheJobs;        /* Every DicacheJob (main thread) */
+static Dlist *JobQueue;           /* Jobs waiting for a worker thread */
+static Dlist *ParkedClients;      /* DicacheParked */
+
+#ifdef D_IMG_THREADED
+static pthread_mutex_t dicache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dicache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_key_t dicache_job_key;
+static int dicache_notify_pipe[2];
+static bool_t dicache_notified;   /* There's a byte in the pipe */
+static bool_t dicache_quit;
+#  define Dicache_lock()   pthread_mutex_lock(&dicache_mutex)
+#  define Dicache_unlock() pthread_mutex_unlock(&dicache_mutex)
+#else
+#  define Dicache_lock()
+#  define Dicache_unlock()
+#endif
 
 /*
  * Compare function for image entries
@@ -61,8 +182,36 @@ static int Dicache_entry_cmp(const void *v1, const void *v2)
  */
 void a_Dicache_init(void)
 {
+#ifdef D_IMG_THREADED
+   pthread_attr_t thrATTR;
+   pthread_t th;
+   int i, num_threads;
+#endif
+
    CachedIMGs = dList_new(256);
    dicache_size_total = 0;
+   dicache_use_clock = 0;
+   DicacheJobs = dList_new(16);
+   JobQueue = dList_new(16);
+   ParkedClients = dList_new(16);
+   dicache_num_threads = 0;
+
+#ifdef D_IMG_THREADED
+   num_threads = MIN(MAX(prefs.image_decode_threads, 0), D_IMG_MAX_THREADS);
+   if (num_threads > 0 && pipe(dicache_notify_pipe) == 0) {
+      fcntl(dicache_notify_pipe[0], F_SETFL, O_NONBLOCK);
+      pthread_key_create(&dicache_job_key, NULL);
+      a_IOwatch_add_fd(dicache_notify_pipe[0], DIO_READ, Dicache_jobs_cb,
+                       NULL);
+
+      pthread_attr_init(&thrATTR);
+      pthread_attr_setdetachstate(&thrATTR, PTHREAD_CREATE_DETACHED);
+      for (i = 0; i < num_threads; ++i)
+         if (pthread_create(&th, &thrATTR, Dicache_worker, NULL) == 0)
+            ++dicache_num_threads;
+      pthread_attr_destroy(&thrATTR);
+   }
+#endif
 }
 
 /*
@@ -75,7 +224,7 @@ static DICacheEntry *Dicache_entry_new(void)
    entry->width = 0;
    entry->height = 0;
    entry->Flags = DIF_Valid;
-   entry->SurvCleanup = 0;
+   entry->LastUse = 0;
    entry->type = DILLO_IMG_TYPE_NOTSET;
    entry->cmap = NULL;
    entry->v_imgbuf = NULL;
@@ -89,6 +238,7 @@ static DICacheEntry *Dicache_entry_new(void)
    entry->Decoder = NULL;
    entry->DecoderData = NULL;
    entry->DecodedSize = 0;
+   entry->Job = NULL;
 
    return entry;
 }
@@ -162,7 +312,9 @@ static void Dicache_remove(const DilloUrl *Url, int version)
    dFree(entry->cmap);
    a_Bitvec_free(entry->BitVec);
    a_Imgbuf_unref(entry->v_imgbuf);
-   if (entry->Decoder) {
+   if (entry->Job) {
+      Dicache_job_cancel(entry->Job);
+   } else if (entry->Decoder) {
       entry->Decoder(CA_Abort, entry->DecoderData);
    }
    dFree(entry);
@@ -183,6 +335,13 @@ void a_Dicache_unref(const DilloUrl *Url, int version)
           entry->RefCount, entry->State,
           entry->v_imgbuf ? a_Imgbuf_last_reference(entry->v_imgbuf) : -1);
       if (entry->RefCount > 0) --entry->RefCount;
+      if (entry->RefCount == 0 && entry->Job) {
+         /* Nobody waits for this image anymore: stop decoding it, and let
+          * the next client start over */
+         Dicache_job_cancel(entry->Job);
+         entry->Job = NULL;
+         entry->Flags &= ~DIF_Valid;
+      }
       if (entry->RefCount == 0 && entry->v_imgbuf == NULL)
          Dicache_remove(Url, version);
    }
@@ -226,10 +385,38 @@ void a_Dicache_set_parms(DilloUrl *url, int version, DilloImage *Image,
                          uint_t width, uint_t height, DilloImgType type,
                          double gamma)
 {
-   DICacheEntry *DicEntry;
+   DicacheJob *job;
+   DicacheOp *op;
 
-   _MSG("a_Dicache_set_parms (%s)\n", URL_STR(url));
    dReturn_if_fail ( Image != NULL && width && height );
+
+   if ((job = Dicache_job_current())) {
+      /* 'Image' may be gone by now: the job knows the layout */
+      op = dNew0(DicacheOp, 1);
+      op->Type = DOP_SetParms;
+      op->width = width;
+      op->height = height;
+      op->type = type;
+      op->gamma = gamma;
+      job->type = type;
+      job->width = width;
+      Dicache_job_post(job, op);
+   } else {
+      Dicache_set_parms(url, version, Image->layout, width, height, type,
+                        gamma);
+   }
+}
+
+/*
+ * Create the imgbuf for an image, in 'layout'.
+ */
+static void Dicache_set_parms(DilloUrl *url, int version, void *layout,
+                              uint_t width, uint_t height, DilloImgType type,
+                              double gamma)
+{
+   DICacheEntry *DicEntry;
+
+   _MSG("Dicache_set_parms (%s)\n", URL_STR(url));
    /* Find the DicEntry for this Image */
    DicEntry = a_Dicache_get_entry(url, version);
    dReturn_if_fail ( DicEntry != NULL );
@@ -241,7 +428,7 @@ void a_Dicache_set_parms(DilloUrl *url, int version, DilloImage *Image,
    /* BUG: there's just one image-type now */
    #define I_RGB 0
    DicEntry->v_imgbuf =
-      a_Imgbuf_new(Image->layout, I_RGB, width, height, gamma);
+      a_Imgbuf_new(layout, I_RGB, width, height, gamma);
 
    DicEntry->TotalSize = width * height * 3;
    DicEntry->width = width;
@@ -260,9 +447,25 @@ void a_Dicache_set_cmap(DilloUrl *url, int version, int bg_color,
                         const uchar_t *cmap, uint_t num_colors,
                         int num_colors_max, int bg_index)
 {
-   DICacheEntry *DicEntry = a_Dicache_get_entry(url, version);
+   DICacheEntry *DicEntry;
+   DicacheJob *job;
+   DicacheOp *op;
 
    _MSG("a_Dicache_set_cmap\n");
+   if ((job = Dicache_job_current())) {
+      op = dNew0(DicacheOp, 1);
+      op->Type = DOP_SetCmap;
+      op->bg_color = bg_color;
+      op->Data = dNew0(uchar_t, 3 * MAX(num_colors, 1));
+      memcpy(op->Data, cmap, 3 * num_colors);
+      op->num_colors = num_colors;
+      op->num_colors_max = num_colors_max;
+      op->bg_index = bg_index;
+      Dicache_job_post(job, op);
+      return;
+   }
+
+   DicEntry = a_Dicache_get_entry(url, version);
    dReturn_if_fail ( DicEntry != NULL );
 
    dFree(DicEntry->cmap);
@@ -283,9 +486,17 @@ void a_Dicache_set_cmap(DilloUrl *url, int version, int bg_color,
 void a_Dicache_new_scan(const DilloUrl *url, int version)
 {
    DICacheEntry *DicEntry;
+   DicacheJob *job;
+   DicacheOp *op;
 
    _MSG("a_Dicache_new_scan\n");
    dReturn_if_fail ( url != NULL );
+   if ((job = Dicache_job_current())) {
+      op = dNew0(DicacheOp, 1);
+      op->Type = DOP_NewScan;
+      Dicache_job_post(job, op);
+      return;
+   }
    DicEntry = a_Dicache_get_entry(url, version);
    dReturn_if_fail ( DicEntry != NULL );
    if (DicEntry->State < DIC_SetParms) {
@@ -306,8 +517,23 @@ void a_Dicache_new_scan(const DilloUrl *url, int version)
 void a_Dicache_write(DilloUrl *url, int version, const uchar_t *buf, uint_t Y)
 {
    DICacheEntry *DicEntry;
+   DicacheJob *job;
+   DicacheOp *op;
+   size_t len;
 
    _MSG("a_Dicache_write\n");
+   if ((job = Dicache_job_current())) {
+      len = job->width * (job->type == DILLO_IMG_TYPE_RGB ? 3 :
+                          job->type == DILLO_IMG_TYPE_CMYK_INV ? 4 : 1);
+      op = dNew(DicacheOp, 1);
+      op->Type = DOP_Write;
+      op->Y = Y;
+      op->Data = dNew(uchar_t, len);
+      memcpy(op->Data, buf, len);
+      Dicache_job_post(job, op);
+      return;
+   }
+
    DicEntry = a_Dicache_get_entry(url, version);
    dReturn_if_fail ( DicEntry != NULL );
    dReturn_if_fail ( DicEntry->width > 0 && DicEntry->height > 0 );
@@ -326,8 +552,18 @@ void a_Dicache_write(DilloUrl *url, int version, const uchar_t *buf, uint_t Y)
 void a_Dicache_close(DilloUrl *url, int version, CacheClient_t *Client)
 {
    DilloWeb *Web = Client->Web;
-   DICacheEntry *DicEntry = a_Dicache_get_entry(url, version);
+   DICacheEntry *DicEntry;
+   DicacheJob *job;
+   DicacheOp *op;
+
+   if ((job = Dicache_job_current())) {
+      op = dNew0(DicacheOp, 1);
+      op->Type = DOP_Close;
+      Dicache_job_post(job, op);
+      return;
+   }
 
+   DicEntry = a_Dicache_get_entry(url, version);
    dReturn_if_fail ( DicEntry != NULL );
 
    /* a_Dicache_unref() may free DicEntry */
@@ -348,6 +584,19 @@ void a_Dicache_close(DilloUrl *url, int version, CacheClient_t *Client)
    a_Bw_close_client(Web->bw, Client->Key);
 }
 
+/*
+ * Is all the image data there?
+ * (decoders use this to choose between progressive and one-pass display)
+ */
+bool_t a_Dicache_data_complete(const DilloUrl *url)
+{
+   DicacheJob *job;
+
+   if ((job = Dicache_job_current()))
+      return job->AllData;
+   return (a_Capi_get_flags(url) & CAPI_Completed) ? TRUE : FALSE;
+}
+
 /* ------------------------------------------------------------------------- */
 
 /*
@@ -366,6 +615,7 @@ static void *Dicache_image(int ImgType, const char *MimeType, void *Ptr,
 {
    DilloWeb *web = Ptr;
    DICacheEntry *DicEntry;
+   DilloUrl *url;
 
    dReturn_val_if_fail(MimeType && Ptr, NULL);
 
@@ -379,26 +629,38 @@ static void *Dicache_image(int ImgType, const char *MimeType, void *Ptr,
    if (!DicEntry) {
       /* Create an entry for this image... */
       DicEntry = Dicache_add_entry(web->url);
+      url = DicEntry->url;
+      if (dicache_num_threads > 0) {
+         DicEntry->Job = Dicache_job_new(DicEntry, web->Image->layout);
+         url = DicEntry->Job->url;
+      }
       /* Attach a decoder */
       if (ImgType == DIC_Jpeg) {
          DicEntry->Decoder = (CA_Callback_t)a_Jpeg_callback;
          DicEntry->DecoderData =
-            a_Jpeg_new(web->Image, DicEntry->url, DicEntry->version);
+            a_Jpeg_new(web->Image, url, DicEntry->version);
       } else if (ImgType == DIC_Gif) {
          DicEntry->Decoder = (CA_Callback_t)a_Gif_callback;
          DicEntry->DecoderData =
-            a_Gif_new(web->Image, DicEntry->url, DicEntry->version);
+            a_Gif_new(web->Image, url, DicEntry->version);
       } else if (ImgType == DIC_Png) {
          DicEntry->Decoder = (CA_Callback_t)a_Png_callback;
          DicEntry->DecoderData =
-            a_Png_new(web->Image, DicEntry->url, DicEntry->version);
+            a_Png_new(web->Image, url, DicEntry->version);
+      }
+      if (DicEntry->Job) {
+         /* From now on, the decoder belongs to the worker threads */
+         DicEntry->Job->Decoder = DicEntry->Decoder;
+         DicEntry->Job->DecoderData = DicEntry->DecoderData;
+         DicEntry->Job->Client.CbData = DicEntry->DecoderData;
+         DicEntry->Decoder = NULL;
+         DicEntry->DecoderData = NULL;
       }
    } else {
       /* Repeated image */
       a_Dicache_ref(DicEntry->url, DicEntry->version);
    }
-   /* Survive three cleanup passes (set to zero = old behaviour). */
-   DicEntry->SurvCleanup = 3;
+   DicEntry->LastUse = ++dicache_use_clock;
 
    *Data = DicEntry->DecoderData;
    *Call = (CA_Callback_t) a_Dicache_callback;
@@ -438,7 +700,6 @@ void *a_Dicache_jpeg_image(const char *Type, void *Ptr, CA_Callback_t *Call,
  */
 void a_Dicache_callback(int Op, CacheClient_t *Client)
 {
-   uint_t i;
    DilloWeb *Web = Client->Web;
    DilloImage *Image = Web->Image;
    DICacheEntry *DicEntry = a_Dicache_get_entry(Web->url, DIC_Last);
@@ -452,10 +713,19 @@ void a_Dicache_callback(int Op, CacheClient_t *Client)
    /* Only call the decoder when necessary */
    if (Op == CA_Send && DicEntry->State < DIC_Close &&
        DicEntry->DecodedSize < Client->BufSize) {
-      DicEntry->Decoder(Op, Client);
+      if (DicEntry->Job)
+         Dicache_job_feed(DicEntry->Job, Client, Image->layout,
+                          DicEntry->DecodedSize);
+      else
+         DicEntry->Decoder(Op, Client);
       DicEntry->DecodedSize = Client->BufSize;
    } else if (Op == CA_Close || Op == CA_Abort) {
-      if (DicEntry->State < DIC_Close) {
+      if (DicEntry->Job) {
+         /* The worker is not done yet; this client is closed after it */
+         Dicache_job_finish(DicEntry->Job);
+         Dicache_park(DicEntry, Client);
+         return;
+      } else if (DicEntry->State < DIC_Close) {
          DicEntry->Decoder(Op, Client);
       } else {
          a_Dicache_close(DicEntry->url, DicEntry->version, Client);
@@ -464,32 +734,7 @@ void a_Dicache_callback(int Op, CacheClient_t *Client)
 
    /* when the data stream is not an image 'v_imgbuf' remains NULL */
    if (Op == CA_Send && DicEntry->v_imgbuf) {
-      if (Image->height == 0 && DicEntry->State >= DIC_SetParms) {
-         /* Set parms */
-         a_Image_set_parms(
-            Image, DicEntry->v_imgbuf, DicEntry->url,
-            DicEntry->version, DicEntry->width, DicEntry->height,
-            DicEntry->type);
-      }
-      if (DicEntry->State == DIC_Write) {
-         if (DicEntry->ScanNumber == Image->ScanNumber) {
-            for (i = 0; i < DicEntry->height; ++i)
-               if (a_Bitvec_get_bit(DicEntry->BitVec, (int)i) &&
-                   !a_Bitvec_get_bit(Image->BitVec, (int)i) )
-                  a_Image_write(Image, i);
-         } else {
-            for (i = 0; i < DicEntry->height; ++i) {
-               if (a_Bitvec_get_bit(DicEntry->BitVec, (int)i) ||
-                   !a_Bitvec_get_bit(Image->BitVec, (int)i)   ||
-                   DicEntry->ScanNumber > Image->ScanNumber + 1) {
-                  a_Image_write(Image, i);
-               }
-               if (!a_Bitvec_get_bit(DicEntry->BitVec, (int)i))
-                  a_Bitvec_clear_bit(Image->BitVec, (int)i);
-            }
-            Image->ScanNumber = DicEntry->ScanNumber;
-         }
-      }
+      Dicache_image_sync(DicEntry, Image);
    } else if (Op == CA_Close) {
       a_Image_close(Image);
       a_Bw_close_client(Web->bw, Client->Key);
@@ -499,29 +744,472 @@ void a_Dicache_callback(int Op, CacheClient_t *Client)
    }
 }
 
+/*
+ * Pass what's new in the dicache entry on to 'Image'.
+ */
+static void Dicache_image_sync(DICacheEntry *DicEntry, DilloImage *Image)
+{
+   uint_t i;
+
+   if (Image->height == 0 && DicEntry->State >= DIC_SetParms) {
+      /* Set parms */
+      a_Image_set_parms(
+         Image, DicEntry->v_imgbuf, DicEntry->url,
+         DicEntry->version, DicEntry->width, DicEntry->height,
+         DicEntry->type);
+   }
+   if (DicEntry->State == DIC_Write) {
+      if (DicEntry->ScanNumber == Image->ScanNumber) {
+         for (i = 0; i < DicEntry->height; ++i)
+            if (a_Bitvec_get_bit(DicEntry->BitVec, (int)i) &&
+                !a_Bitvec_get_bit(Image->BitVec, (int)i) )
+               a_Image_write(Image, i);
+      } else {
+         for (i = 0; i < DicEntry->height; ++i) {
+            if (a_Bitvec_get_bit(DicEntry->BitVec, (int)i) ||
+                !a_Bitvec_get_bit(Image->BitVec, (int)i)   ||
+                DicEntry->ScanNumber > Image->ScanNumber + 1) {
+               a_Image_write(Image, i);
+            }
+            if (!a_Bitvec_get_bit(DicEntry->BitVec, (int)i))
+               a_Bitvec_clear_bit(Image->BitVec, (int)i);
+         }
+         Image->ScanNumber = DicEntry->ScanNumber;
+      }
+   }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The decoding job of the current thread (NULL in the main thread).
+ */
+static DicacheJob *Dicache_job_current(void)
+{
+#ifdef D_IMG_THREADED
+   if (dicache_num_threads > 0)
+      return pthread_getspecific(dicache_job_key);
+#endif
+   return NULL;
+}
+
+/*
+ * Wake up the main thread.
+ * (call with dicache_mutex held)
+ */
+static void Dicache_notify(void)
+{
+#ifdef D_IMG_THREADED
+   if (!dicache_notified) {
+      dicache_notified = TRUE;
+      if (write(dicache_notify_pipe[1], ".", 1) != 1)
+         MSG_ERR("Dicache_notify: can't write to the pipe\n");
+   }
+#endif
+}
+
+/*
+ * Hand an operation over to the main thread (from a worker).
+ * Rows are handed over in batches.
+ */
+static void Dicache_job_post(DicacheJob *job, DicacheOp *op)
+{
+   Dicache_lock();
+   dList_append(job->Ops, op);
+   if (op->Type != DOP_Write || ++job->Unnotified >= D_IMG_BATCH_ROWS) {
+      Dicache_notify();
+      job->Unnotified = 0;
+   }
+   Dicache_unlock();
+}
+
+/*
+ * Create a decoding job for a new dicache entry.
+ */
+static DicacheJob *Dicache_job_new(DICacheEntry *entry, void *layout)
+{
+   DicacheJob *job = dNew0(DicacheJob, 1);
+
+   job->url = a_Url_dup(entry->url);
+   job->version = entry->version;
+   job->layout = layout;
+   job->Client.Url = job->url;
+   job->Client.Version = job->version;
+   job->Input = dStr_new("");
+   job->Pending = dStr_new("");
+   job->Ops = dList_new(64);
+   dList_append(DicacheJobs, job);
+   return job;
+}
+
+/*
+ * Free a job the worker threads are done with.
+ */
+static void Dicache_job_free(DicacheJob *job)
+{
+   DicacheOp *op;
+
+   if (!job->Done)
+      job->Decoder(CA_Abort, job->DecoderData);
+   while ((op = dList_nth_data(job->Ops, 0))) {
+      dList_remove_fast(job->Ops, op);
+      dFree(op->Data);
+      dFree(op);
+   }
+   dList_free(job->Ops);
+   dStr_free(job->Input, 1);
+   dStr_free(job->Pending, 1);
+   a_Url_free(job->url);
+   dFree(job);
+}
+
+/*
+ * Get a worker going on this job, if none is.
+ * (call with dicache_mutex held)
+ */
+static void Dicache_job_queue(DicacheJob *job)
+{
+#ifdef D_IMG_THREADED
+   if (!job->Queued) {
+      job->Queued = TRUE;
+      dList_append(JobQueue, job);
+      pthread_cond_signal(&dicache_cond);
+   }
+#endif
+}
+
+/*
+ * Give the worker the image data from offset 'from' on.
+ */
+static void Dicache_job_feed(DicacheJob *job, CacheClient_t *Client,
+                             void *layout, uint_t from)
+{
+   bool_t in_cache = (a_Capi_get_flags(job->url) & CAPI_Completed) != 0;
+
+   job->layout = layout;
+   Dicache_lock();
+   dStr_append_l(job->Pending, (char *)Client->Buf + from,
+                 Client->BufSize - from);
+   job->InCache = in_cache;
+   Dicache_job_queue(job);
+   Dicache_unlock();
+}
+
+/*
+ * There's no more data: let the decoder finish.
+ */
+static void Dicache_job_finish(DicacheJob *job)
+{
+   Dicache_lock();
+   if (!job->Complete) {
+      job->Complete = TRUE;
+      Dicache_job_queue(job);
+   }
+   Dicache_unlock();
+}
+
+/*
+ * Stop decoding. The job is freed from Dicache_jobs_cb().
+ */
+static void Dicache_job_cancel(DicacheJob *job)
+{
+   Dicache_lock();
+   job->Cancelled = TRUE;
+   if (job->Queued && !job->Running) {
+      dList_remove(JobQueue, job);
+      job->Queued = FALSE;
+   }
+   Dicache_notify();
+   Dicache_unlock();
+}
+
+#ifdef D_IMG_THREADED
+/*
+ * Decoding thread: run the decoders on the data that came in.
+ */
+static void *Dicache_worker(void *data)
+{
+   DicacheJob *job;
+   bool_t complete;
+
+   (void) data;
+   Dicache_lock();
+   while (!dicache_quit) {
+      if (!(job = dList_nth_data(JobQueue, 0))) {
+         pthread_cond_wait(&dicache_cond, &dicache_mutex);
+         continue;
+      }
+      dList_remove(JobQueue, job);
+      job->Running = TRUE;
+      dStr_append_l(job->Input, job->Pending->str, job->Pending->len);
+      dStr_truncate(job->Pending, 0);
+      complete = job->Complete;
+      job->AllData = complete || job->InCache;
+      Dicache_unlock();
+
+      pthread_setspecific(dicache_job_key, job);
+      if ((uint_t)job->Input->len > job->Client.BufSize) {
+         job->Client.Buf = job->Input->str;
+         job->Client.BufSize = job->Input->len;
+         job->Decoder(CA_Send, &job->Client);
+      }
+      if (complete)
+         job->Decoder(CA_Close, &job->Client);
+      pthread_setspecific(dicache_job_key, NULL);
+
+      Dicache_lock();
+      job->Running = FALSE;
+      job->Done = complete;
+      if (!job->Done && !job->Cancelled &&
+          (job->Pending->len > 0 || job->Complete)) {
+         dList_append(JobQueue, job);
+      } else {
+         job->Queued = FALSE;
+      }
+      if (job->Unnotified > 0 || !job->Queued) {
+         Dicache_notify();
+         job->Unnotified = 0;
+      }
+   }
+   Dicache_unlock();
+   return NULL;
+}
+#endif /* D_IMG_THREADED */
+
+/*
+ * Wait for the decoder of 'entry' before closing this client.
+ */
+static void Dicache_park(DICacheEntry *entry, CacheClient_t *Client)
+{
+   DilloWeb *Web = Client->Web;
+   DicacheParked *p = dNew(DicacheParked, 1);
+
+   p->Key = Client->Key;
+   p->entry = entry;
+   p->Image = Web->Image;
+   p->bw = Web->bw;
+   a_Image_ref(p->Image);
+   dList_append(ParkedClients, p);
+}
+
+/*
+ * Pass the new rows on to the parked clients of this entry, and close
+ * them if decoding is over.
+ */
+static void Dicache_parked_sync(const DilloUrl *url, int version,
+                                bool_t closed)
+{
+   int i;
+   DicacheParked *p;
+   DICacheEntry *entry = a_Dicache_get_entry(url, version);
+
+   dReturn_if (entry == NULL);
+
+   for (i = 0; (p = dList_nth_data(ParkedClients, i)); ++i)
+      if (p->entry == entry && entry->v_imgbuf)
+         Dicache_image_sync(entry, p->Image);
+
+   if (closed) {
+      entry->State = DIC_Close;
+      dFree(entry->cmap);
+      entry->cmap = NULL;
+      entry->Job = NULL;
+
+      for (i = 0; (p = dList_nth_data(ParkedClients, i)); ++i) {
+         if (p->entry == entry) {
+            dList_remove(ParkedClients, p);
+            a_Image_close(p->Image);
+            a_Image_unref(p->Image);
+            a_Bw_close_client(p->bw, p->Key);
+            dFree(p);
+            /* may free the entry */
+            a_Dicache_unref(url, version);
+            --i;
+         }
+      }
+   }
+}
+
+/*
+ * The cache stopped this client: if it was parked, forget it.
+ * Return value: whether it was.
+ */
+int a_Dicache_stop_client(int Key)
+{
+   int i;
+   DicacheParked *p;
+
+   for (i = 0; (p = dList_nth_data(ParkedClients, i)); ++i) {
+      if (p->Key == Key) {
+         dList_remove(ParkedClients, p);
+         a_Image_unref(p->Image);
+         a_Dicache_unref(p->entry->url, p->entry->version);
+         dFree(p);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/*
+ * Carry out what the decoder of this job asked for.
+ */
+static void Dicache_job_apply(DicacheJob *job, Dlist *ops)
+{
+   int i;
+   DicacheOp *op;
+   bool_t closed = FALSE;
+
+   for (i = 0; (op = dList_nth_data(ops, i)); ++i) {
+      if (!job->Cancelled) {
+         switch (op->Type) {
+         case DOP_SetParms:
+            Dicache_set_parms(job->url, job->version, job->layout,
+                              op->width, op->height, op->type, op->gamma);
+            break;
+         case DOP_SetCmap:
+            a_Dicache_set_cmap(job->url, job->version, op->bg_color,
+                               op->Data, op->num_colors,
+                               op->num_colors_max, op->bg_index);
+            break;
+         case DOP_NewScan:
+            a_Dicache_new_scan(job->url, job->version);
+            break;
+         case DOP_Write:
+            a_Dicache_write(job->url, job->version, op->Data, op->Y);
+            break;
+         case DOP_Close:
+            closed = TRUE;
+            break;
+         }
+      }
+      dFree(op->Data);
+      dFree(op);
+   }
+   if (i > 0 && !job->Cancelled) {
+      Dicache_parked_sync(job->url, job->version, closed);
+      if (!closed) {
+         /* clients still receiving data are synced from the cache */
+         a_Cache_resend(job->url);
+      }
+   }
+}
+
+/*
+ * Main thread: take what the workers have decoded, and free the jobs
+ * that are over.
+ */
+static void Dicache_jobs_cb(int fd, void *data)
+{
+   int i;
+   char buf[16];
+   bool_t over;
+   Dlist *ops;
+   DicacheJob *job;
+
+   (void) data;
+   while (read(fd, buf, sizeof(buf)) > 0);
+
+#ifdef D_IMG_THREADED
+   Dicache_lock();
+   dicache_notified = FALSE;
+   Dicache_unlock();
+#endif
+
+   for (i = 0; (job = dList_nth_data(DicacheJobs, i)); ++i) {
+      ops = NULL;
+      Dicache_lock();
+      if (dList_length(job->Ops) > 0) {
+         ops = job->Ops;
+         job->Ops = dList_new(64);
+      }
+      over = !job->Queued && (job->Done || job->Cancelled);
+      Dicache_unlock();
+
+      if (ops) {
+         Dicache_job_apply(job, ops);
+         dList_free(ops);
+      }
+      if (over) {
+         dList_remove(DicacheJobs, job);
+         Dicache_job_free(job);
+         --i;
+      }
+   }
+}
+
 /* ------------------------------------------------------------------------- */
 
 /*
- * Free the imgbuf (RGB data) of unused entries.
+ * Compare function for sorting entries from least to most recently used.
+ */
+static int Dicache_entry_by_use_cmp(const void *v1, const void *v2)
+{
+   const DICacheEntry *e1 = v1, *e2 = v2;
+
+   return (e1->LastUse < e2->LastUse) ? -1 : (e1->LastUse > e2->LastUse);
+}
+
+/*
+ * Is this entry neither decoding nor shown anywhere?
+ */
+static int Dicache_entry_is_unused(DICacheEntry *entry)
+{
+   return (entry->RefCount == 0 &&
+           (!entry->v_imgbuf || a_Imgbuf_last_reference(entry->v_imgbuf)));
+}
+
+/*
+ * Free the imgbuf (RGB data) of unused entries, and keep the rest within
+ * prefs.image_cache_max_size.
+ *
+ * Unused entries are kept (e.g. for back/fwd and repush) while there's room.
+ * Beyond that, the least recently used are freed first; for images that are
+ * shown scaled only, just their full-size pixels are. Such an entry is then
+ * invalidated, so that new clients decode the image again from the cache.
  */
 void a_Dicache_cleanup(void)
 {
    int i;
+   Dlist *victims;
    DICacheEntry *entry;
 
+   /* Unused entries that can't be asked for anymore go right away */
    for (i = 0; (entry = dList_nth_data(CachedIMGs, i)); ++i) {
-      _MSG(" SurvCleanup = %d\n", entry->SurvCleanup);
-      if (entry->RefCount == 0 &&
-          (!entry->v_imgbuf || a_Imgbuf_last_reference(entry->v_imgbuf))) {
-         if (--entry->SurvCleanup >= 0)
-            continue;  /* keep the entry one more pass */
-
-         /* free this unused entry */
+      if (Dicache_entry_is_unused(entry) &&
+          (!entry->v_imgbuf || !(entry->Flags & DIF_Valid))) {
          Dicache_remove(entry->url, entry->version);
          --i; /* adjust counter */
       }
    }
-   _MSG("a_Dicache_cleanup: length = %d\n", dList_length(CachedIMGs));
+
+   if (prefs.image_cache_max_size > 0 &&
+       dicache_size_total > (uint_t)prefs.image_cache_max_size) {
+      victims = dList_new(64);
+      for (i = 0; (entry = dList_nth_data(CachedIMGs, i)); ++i)
+         if (entry->RefCount == 0 && entry->TotalSize > 0)
+            dList_append(victims, entry);
+      dList_sort(victims, Dicache_entry_by_use_cmp);
+
+      for (i = 0;
+           dicache_size_total > (uint_t)prefs.image_cache_max_size &&
+           (entry = dList_nth_data(victims, i)); ++i) {
+         if (a_Imgbuf_last_reference(entry->v_imgbuf)) {
+            _MSG("a_Dicache_cleanup: freeing %s\n", URL_STR(entry->url));
+            Dicache_remove(entry->url, entry->version);
+         } else if (entry->State == DIC_Close &&
+                    a_Imgbuf_free_root(entry->v_imgbuf)) {
+            _MSG("a_Dicache_cleanup: keeping %s scaled only\n",
+                 URL_STR(entry->url));
+            dicache_size_total -= entry->TotalSize;
+            entry->TotalSize = 0;
+            entry->Flags &= ~DIF_Valid;
+         }
+      }
+      dList_free(victims);
+   }
+   _MSG("a_Dicache_cleanup: length = %d, %u bytes\n",
+        dList_length(CachedIMGs), dicache_size_total);
 }
 
 /* ------------------------------------------------------------------------- */
@@ -533,6 +1221,24 @@ void a_Dicache_cleanup(void)
 void a_Dicache_freeall(void)
 {
    DICacheEntry *entry;
+   DicacheParked *p;
+
+#ifdef D_IMG_THREADED
+   if (dicache_num_threads > 0) {
+      /* Jobs that are running are left alone (we're exiting anyway) */
+      Dicache_lock();
+      dicache_quit = TRUE;
+      pthread_cond_broadcast(&dicache_cond);
+      Dicache_unlock();
+      a_IOwatch_remove_fd(dicache_notify_pipe[0], DIO_READ);
+   }
+#endif
+   while ((p = dList_nth_data(ParkedClients, 0))) {
+      dList_remove_fast(ParkedClients, p);
+      a_Image_unref(p->Image);
+      dFree(p);
+   }
+   dList_free(ParkedClients);
 
    /* Remove all the dicache entries */
    while ((entry = dList_nth_data(CachedIMGs, dList_length(CachedIMGs)-1))) {
@@ -27,12 +27,14 @@ typedef enum {
    DIC_Abort       /* Image transfer aborted */
 } DicEntryState;
 
+typedef struct DicacheJob DicacheJob;
+
 typedef struct DICacheEntry {
    DilloUrl *url;          /* Image URL for this entry */
    DilloImgType type;      /* Image type */
    uint_t width, height;   /* As taken from image data */
    short Flags;            /* See Flags */
-   short SurvCleanup;      /* Cleanup-pass survival for unused images */
+   uint_t LastUse;         /* Value of the use clock when last used (LRU) */
    uchar_t *cmap;          /* Color map */
    void *v_imgbuf;         /* Void pointer to an Imgbuf object */
    uint_t TotalSize;       /* Amount of memory the image takes up */
@@ -46,6 +48,7 @@ typedef struct DICacheEntry {
    uint_t DecodedSize;     /* Size of already decoded data */
    CA_Callback_t Decoder;  /* Client function */
    void *DecoderData;      /* Client function data */
+   DicacheJob *Job;        /* Decoding in a worker thread (instead) */
 } DICacheEntry;
 
 
@@ -70,10 +73,12 @@ void a_Dicache_set_cmap(DilloUrl *url, int version, int bg_color,
 void a_Dicache_new_scan(const DilloUrl *url, int version);
 void a_Dicache_write(DilloUrl *url, int version, const uchar_t *buf, uint_t Y);
 void a_Dicache_close(DilloUrl *url, int version, CacheClient_t *Client);
+bool_t a_Dicache_data_complete(const DilloUrl *url);
 
 void a_Dicache_invalidate_entry(const DilloUrl *Url);
 DICacheEntry* a_Dicache_ref(const DilloUrl *Url, int version);
 void a_Dicache_unref(const DilloUrl *Url, int version);
+int a_Dicache_stop_client(int Key);
 void a_Dicache_cleanup(void);
 void a_Dicache_freeall(void);
 
@@ -483,6 +483,10 @@ int main(int argc, char **argv)
    dw::Textblock::setPenaltyEmDashRight (prefs.penalty_em_dash_right);
    dw::Textblock::setPenaltyEmDashRight2 (prefs.penalty_em_dash_right_2);
    dw::Textblock::setStretchabilityFactor (prefs.stretchability_factor);
+   dw::fltk::FltkImgbuf::setUpscaleMode (
+      dStrAsciiCasecmp(prefs.image_upscaling, "simple") ?
+      dw::fltk::FltkImgbuf::UPSCALE_BILINEAR :
+      dw::fltk::FltkImgbuf::UPSCALE_SIMPLE);
 
    /* command line options override preferences */
    if (options_got & DILLO_CLI_FULLWINDOW)
@@ -587,7 +591,9 @@ int main(int argc, char **argv)
    a_Hsts_freeall();
    a_Cache_freeall();
    a_Dicache_freeall();
+   StyleEngine::freeall();
    a_Http_freeall();
+   a_IO_freeall();
    a_Tls_freeall();
    a_Dns_freeall();
    a_History_freeall();
@@ -36,45 +36,58 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "msg.h"
 #include "dns.h"
-#include "list.h"
 #include "IO/iowatch.hh"
 
 
-/* Maximum dns resolving threads */
+/* Maximum dns resolving threads (prefs.dns_max_threads is capped by it) */
 #ifdef D_DNS_THREADED
-#  define D_DNS_MAX_SERVERS 4
+#  define D_DNS_MAX_SERVERS 64
 #else
 #  define D_DNS_MAX_SERVERS 1
 #endif
 
+/* How long answers are kept in the cache. getaddrinfo() doesn't tell the
+ * TTL of the records, so these are fixed. */
+#define D_DNS_CACHE_TTL      300  /* seconds, for addresses */
+#define D_DNS_CACHE_NEG_TTL   30  /* seconds, for nonexistent names */
+
 typedef enum {
    DNS_SERVER_IDLE,
    DNS_SERVER_PROCESSING,
    DNS_SERVER_RESOLVED,
 } DnsServerState_t;
 
+typedef struct GDnsCache GDnsCache;
+
 typedef struct {
    int channel;            /* Index of this channel [0 based] */
    DnsServerState_t state;
    Dlist *addr_list;       /* IP address */
    char *hostname;         /* Address to resolve */
    int status;             /* errno code for resolving function */
+   GDnsCache *entry;       /* The cache entry waiting for the answer */
 #ifdef D_DNS_THREADED
    pthread_t th1;          /* Thread id */
 #endif
 } DnsServer;
 
-typedef struct {
+struct GDnsCache {
    char *hostname;         /* host name for cache */
-   Dlist *addr_list;       /* addresses of host */
-} GDnsCache;
+   Dlist *addr_list;       /* addresses of host (NULL if not resolved) */
+   int status;             /* errno code for resolving function */
+   time_t expires;         /* The answer is stale from then on */
+   int channel;            /* -1 if idle, -2 if waiting for a channel,
+                            * otherwise index to dns_server[] */
+   Dlist *queue;           /* Callbacks waiting for the answer */
+   uint_t hash;
+   GDnsCache *next;        /* Next entry in the same dns_cache bucket */
+};
 
 typedef struct {
-   int channel;            /* -2 if waiting, otherwise index to dns_server[] */
-   char *hostname;         /* The one we're resolving */
    DnsCallback_t cb_func;  /* callback function */
    void *cb_data;          /* extra data for the callback function */
 } GDnsQueue;
@@ -90,84 +103,164 @@ static void Dns_timeout_client(int fd, void *data);
  */
 static DnsServer dns_server[D_DNS_MAX_SERVERS];
 static int num_servers;
-static GDnsCache *dns_cache;
-static int dns_cache_size, dns_cache_size_max;
-static GDnsQueue *dns_queue;
-static int dns_queue_size, dns_queue_size_max;
+static GDnsCache **dns_cache;    /* Hash table, chained by 'next' */
+static uint_t dns_cache_size;    /* Number of buckets (a power of two) */
+static uint_t dns_cache_count;   /* Number of entries */
+static Dlist *dns_waiting;       /* Entries waiting for a channel (FIFO) */
 static int dns_notify_pipe[2];
 
 
 /* ----------------------------------------------------------------------
  *  Dns queue functions
  */
-static void Dns_queue_add(int channel, const char *hostname,
-                          DnsCallback_t cb_func, void *cb_data)
+static void Dns_queue_add(GDnsCache *entry, DnsCallback_t cb_func,
+                          void *cb_data)
 {
-   a_List_add(dns_queue, dns_queue_size, dns_queue_size_max);
-   dns_queue[dns_queue_size].channel = channel;
-   dns_queue[dns_queue_size].hostname = dStrdup(hostname);
-   dns_queue[dns_queue_size].cb_func = cb_func;
-   dns_queue[dns_queue_size].cb_data = cb_data;
-   dns_queue_size++;
+   GDnsQueue *q = dNew(GDnsQueue, 1);
+
+   q->cb_func = cb_func;
+   q->cb_data = cb_data;
+   dList_append(entry->queue, q);
 }
 
 /*
- * Find hostname index in dns_queue
- * (if found, returns queue index; -1 if not)
+ * Give the answer to the callbacks queued for this entry.
+ * Callbacks added meanwhile (by the callbacks themselves) wait for the
+ * next answer.
  */
-static int Dns_queue_find(const char *hostname)
+static void Dns_queue_serve(GDnsCache *entry)
 {
-   int i;
-
-   for (i = 0; i < dns_queue_size; i++)
-      if (!dStrAsciiCasecmp(hostname, dns_queue[i].hostname))
-         return i;
-
-   return -1;
+   int n = dList_length(entry->queue);
+   GDnsQueue *q;
+
+   while (n-- > 0 && (q = dList_nth_data(entry->queue, 0))) {
+      q->cb_func(entry->status, entry->addr_list, q->cb_data);
+      /* removed afterwards, so that the entry isn't expired meanwhile */
+      dList_remove(entry->queue, q);
+      dFree(q);
+   }
 }
 
+/* ----------------------------------------------------------------------
+ *  Dns cache functions
+ */
+
 /*
- * Given an index, remove an entry from the dns_queue
+ * Case insensitive FNV-1a hash of a host name.
  */
-static void Dns_queue_remove(int index)
+static uint_t Dns_hash(const char *hostname)
+{
+   uint_t h = 2166136261u;
+
+   for ( ; *hostname; hostname++) {
+      h ^= (uchar_t)D_ASCII_TOLOWER(*hostname);
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static GDnsCache *Dns_cache_find(const char *hostname)
+{
+   uint_t hash = Dns_hash(hostname);
+   GDnsCache *entry = dns_cache[hash & (dns_cache_size - 1)];
+
+   while (entry && (entry->hash != hash ||
+                    dStrAsciiCasecmp(hostname, entry->hostname)))
+      entry = entry->next;
+   return entry;
+}
+
+static void Dns_addr_list_free(Dlist *addr_list)
 {
    int i;
 
-   _MSG("Dns_queue_remove: deleting client [%d] [queue_size=%d]\n",
-        index, dns_queue_size);
+   for (i = 0; i < dList_length(addr_list); ++i)
+      dFree(dList_nth_data(addr_list, i));
+   dList_free(addr_list);
+}
+
+static void Dns_cache_entry_free(GDnsCache *entry)
+{
+   GDnsQueue *q;
 
-   if (index < dns_queue_size) {
-      dFree(dns_queue[index].hostname);
-      --dns_queue_size;         /* you'll find out why ;-) */
-      for (i = index; i < dns_queue_size; i++)
-         dns_queue[i] = dns_queue[i + 1];
+   while ((q = dList_nth_data(entry->queue, 0))) {
+      dList_remove_fast(entry->queue, q);
+      dFree(q);
    }
+   dList_free(entry->queue);
+   Dns_addr_list_free(entry->addr_list);
+   dFree(entry->hostname);
+   dFree(entry);
 }
 
 /*
- * Debug function
- *
-void Dns_queue_print()
+ * Drop the stale answers nobody is waiting for.
+ */
+static void Dns_cache_expire(void)
 {
-   int i;
-
-   MSG("Queue: [");
-   for (i = 0; i < dns_queue_size; i++)
-      MSG("%d:%s ", dns_queue[i].channel, dns_queue[i].hostname);
-   MSG("]\n");
+   uint_t i;
+   time_t now = time(NULL);
+   GDnsCache **link, *entry;
+
+   for (i = 0; i < dns_cache_size; i++) {
+      for (link = &dns_cache[i]; (entry = *link); ) {
+         if (entry->channel == -1 && entry->expires <= now &&
+             dList_length(entry->queue) == 0) {
+            *link = entry->next;
+            Dns_cache_entry_free(entry);
+            dns_cache_count--;
+         } else {
+            link = &entry->next;
+         }
+      }
+   }
 }
+
+/*
+ * Double the number of buckets.
  */
+static void Dns_cache_grow(void)
+{
+   uint_t i, newSize = 2 * dns_cache_size;
+   GDnsCache *entry, *next, **buckets = dNew0(GDnsCache *, newSize);
+
+   for (i = 0; i < dns_cache_size; i++) {
+      for (entry = dns_cache[i]; entry; entry = next) {
+         next = entry->next;
+         entry->next = buckets[entry->hash & (newSize - 1)];
+         buckets[entry->hash & (newSize - 1)] = entry;
+      }
+   }
+   dFree(dns_cache);
+   dns_cache = buckets;
+   dns_cache_size = newSize;
+}
 
 /*
- *  Add an IP/hostname pair to Dns-cache
+ *  Add a (not yet resolved) hostname to Dns-cache
  */
-static void Dns_cache_add(char *hostname, Dlist *addr_list)
+static GDnsCache *Dns_cache_add(const char *hostname)
 {
-   a_List_add(dns_cache, dns_cache_size, dns_cache_size_max);
-   dns_cache[dns_cache_size].hostname = dStrdup(hostname);
-   dns_cache[dns_cache_size].addr_list = addr_list;
-   ++dns_cache_size;
-   _MSG("Cache objects: %d\n", dns_cache_size);
+   GDnsCache *entry = dNew(GDnsCache, 1), **bucket;
+
+   if (dns_cache_count >= dns_cache_size) {
+      Dns_cache_expire();
+      if (dns_cache_count >= dns_cache_size)
+         Dns_cache_grow();
+   }
+   entry->hostname = dStrdup(hostname);
+   entry->addr_list = NULL;
+   entry->status = 0;
+   entry->expires = 0;
+   entry->channel = -1;
+   entry->queue = dList_new(4);
+   entry->hash = Dns_hash(hostname);
+   bucket = &dns_cache[entry->hash & (dns_cache_size - 1)];
+   entry->next = *bucket;
+   *bucket = entry;
+   ++dns_cache_count;
+   _MSG("Cache objects: %u\n", dns_cache_count);
+   return entry;
 }
 
 
@@ -184,15 +277,12 @@ void a_Dns_init(void)
    MSG("dillo_dns_init: Here we go! (not threaded)\n");
 #endif
 
-   dns_queue_size = 0;
-   dns_queue_size_max = 16;
-   dns_queue = dNew(GDnsQueue, dns_queue_size_max);
-
-   dns_cache_size = 0;
-   dns_cache_size_max = 16;
-   dns_cache = dNew(GDnsCache, dns_cache_size_max);
+   dns_cache_size = 64;
+   dns_cache_count = 0;
+   dns_cache = dNew0(GDnsCache *, dns_cache_size);
+   dns_waiting = dList_new(16);
 
-   num_servers = D_DNS_MAX_SERVERS;
+   num_servers = MIN(MAX(prefs.dns_max_threads, 1), D_DNS_MAX_SERVERS);
 
    res = pipe(dns_notify_pipe);
    assert(res == 0);
@@ -206,6 +296,7 @@ void a_Dns_init(void)
       dns_server[i].addr_list = NULL;
       dns_server[i].hostname = NULL;
       dns_server[i].status = 0;
+      dns_server[i].entry = NULL;
 #ifdef D_DNS_THREADED
       dns_server[i].th1 = (pthread_t) -1;
 #endif
@@ -337,7 +428,7 @@ static void *Dns_server(void *data)
 /*
  *  Request function (spawn a server and let it handle the request)
  */
-static void Dns_server_req(int channel, const char *hostname)
+static void Dns_server_req(int channel, GDnsCache *entry)
 {
 #ifdef D_DNS_THREADED
    static pthread_attr_t thrATTR;
@@ -345,9 +436,11 @@ static void Dns_server_req(int channel, const char *hostname)
 #endif
 
    dns_server[channel].state = DNS_SERVER_PROCESSING;
+   dns_server[channel].entry = entry;
+   entry->channel = channel;
 
    dFree(dns_server[channel].hostname);
-   dns_server[channel].hostname = dStrdup(hostname);
+   dns_server[channel].hostname = dStrdup(entry->hostname);
 
 #ifdef D_DNS_THREADED
    /* set the thread attribute to the detached state */
@@ -364,92 +457,74 @@ static void Dns_server_req(int channel, const char *hostname)
 #endif
 }
 
+/*
+ * Resolve this entry as soon as there's a free channel.
+ */
+static void Dns_request(GDnsCache *entry)
+{
+   int channel;
+
+   /* Find a channel we can send the request to */
+   for (channel = 0; channel < num_servers; channel++)
+      if (dns_server[channel].state == DNS_SERVER_IDLE)
+         break;
+   if (channel < num_servers) {
+      /* Found a free channel! */
+      Dns_server_req(channel, entry);
+   } else {
+      /* We'll have to wait for a thread to finish... */
+      entry->channel = -2;
+      dList_append(dns_waiting, entry);
+   }
+}
+
 /*
  * Return the IP for the given hostname using a callback.
  * Side effect: a thread is spawned when hostname is not cached.
+ * (The address list belongs to the cache: copy it if it's needed
+ * after the callback returns)
  */
 void a_Dns_resolve(const char *hostname, DnsCallback_t cb_func, void *cb_data)
 {
-   int i, channel;
+   GDnsCache *entry;
 
    if (!hostname)
       return;
 
    /* check for cache hit. */
-   for (i = 0; i < dns_cache_size; i++)
-      if (!dStrAsciiCasecmp(hostname, dns_cache[i].hostname))
-         break;
-
-   if (i < dns_cache_size) {
-      /* already resolved, call the Callback immediately. */
-      cb_func(0, dns_cache[i].addr_list, cb_data);
+   entry = Dns_cache_find(hostname);
 
-   } else if ((i = Dns_queue_find(hostname)) != -1) {
-      /* hit in queue, but answer hasn't come back yet. */
-      Dns_queue_add(dns_queue[i].channel, hostname, cb_func, cb_data);
+   if (entry && entry->channel == -1 && entry->expires > time(NULL)) {
+      /* already resolved (or known to fail), call the Callback
+       * immediately. */
+      cb_func(entry->status, entry->addr_list, cb_data);
 
    } else {
-      /* Never requested before -- we must resolve it! */
+      if (!entry)
+         entry = Dns_cache_add(hostname);
+      Dns_queue_add(entry, cb_func, cb_data);
 
-      /* Find a channel we can send the request to */
-      for (channel = 0; channel < num_servers; channel++)
-         if (dns_server[channel].state == DNS_SERVER_IDLE)
-            break;
-      if (channel < num_servers) {
-         /* Found a free channel! */
-         Dns_queue_add(channel, hostname, cb_func, cb_data);
-         Dns_server_req(channel, hostname);
-      } else {
-         /* We'll have to wait for a thread to finish... */
-         Dns_queue_add(-2, hostname, cb_func, cb_data);
-      }
-   }
-}
-
-/*
- * Give answer to all queued callbacks on this channel
- */
-static void Dns_serve_channel(int channel)
-{
-   int i;
-   DnsServer *srv = &dns_server[channel];
-
-   for (i = 0; i < dns_queue_size; i++) {
-      if (dns_queue[i].channel == channel) {
-         dns_queue[i].cb_func(srv->status, srv->addr_list,
-                              dns_queue[i].cb_data);
-         Dns_queue_remove(i);
-         --i;
-      }
+      /* When already being resolved, the answer will serve this one too */
+      if (entry->channel == -1)
+         Dns_request(entry);
    }
 }
 
 /*
- * Assign free channels to waiting clients (-2)
+ * Assign free channels to waiting entries
  */
 static void Dns_assign_channels(void)
 {
-   int ch, i, j;
+   int ch;
+   GDnsCache *entry;
 
    for (ch = 0; ch < num_servers; ++ch) {
       if (dns_server[ch].state == DNS_SERVER_IDLE) {
-         /* Find the next query in the queue (we're a FIFO) */
-         for (i = 0; i < dns_queue_size; i++)
-            if (dns_queue[i].channel == -2)
-               break;
-
-         if (i < dns_queue_size) {
-            /* assign this channel to every queued request
-             * with the same hostname*/
-            for (j = i; j < dns_queue_size; j++)
-               if (dns_queue[j].channel == -2 &&
-                   !dStrAsciiCasecmp(dns_queue[j].hostname,
-                                     dns_queue[i].hostname)) {
-                  dns_queue[j].channel = ch;
-               }
-            Dns_server_req(ch, dns_queue[i].hostname);
-         } else
+         /* Take the next entry in the queue (we're a FIFO) */
+         if (!(entry = dList_nth_data(dns_waiting, 0)))
             return;
+         dList_remove(dns_waiting, entry);
+         Dns_server_req(ch, entry);
       }
    }
 }
@@ -462,6 +537,7 @@ static void Dns_timeout_client(int fd, void *data)
 {
    int i;
    char buf[16];
+   GDnsCache *entry;
 
    while (read(dns_notify_pipe[0], buf, sizeof(buf)) > 0);
 
@@ -469,12 +545,27 @@ static void Dns_timeout_client(int fd, void *data)
       DnsServer *srv = &dns_server[i];
 
       if (srv->state == DNS_SERVER_RESOLVED) {
-         if (srv->addr_list != NULL) {
-            /* DNS succeeded, let's cache it */
-            Dns_cache_add(srv->hostname, srv->addr_list);
-         }
-         Dns_serve_channel(i);
+         /* Let's cache the answer, failures included: names that
+          * don't exist are cached too, for a shorter while. */
+         entry = srv->entry;
+         Dns_addr_list_free(entry->addr_list);
+         entry->addr_list = srv->addr_list;
+         entry->status = srv->status;
+         entry->expires = time(NULL);
+         if (entry->addr_list)
+            entry->expires += D_DNS_CACHE_TTL;
+         else if (entry->status == EAI_NONAME
+#ifdef EAI_NODATA
+                  || entry->status == EAI_NODATA
+#endif
+                 )
+            entry->expires += D_DNS_CACHE_NEG_TTL;
+         entry->channel = -1;
+
+         srv->addr_list = NULL;
+         srv->entry = NULL;
          srv->state = DNS_SERVER_IDLE;
+         Dns_queue_serve(entry);
       }
    }
    Dns_assign_channels();
@@ -484,23 +575,49 @@ static void Dns_timeout_client(int fd, void *data)
 /*
  *  Dns memory-deallocation
  *  (Call this one at exit time)
- *  The Dns_queue is deallocated at execution time (no need to do that here)
- *  'dns_cache' is the only one that grows dynamically
  */
 void a_Dns_freeall(void)
 {
-   int i, j;
+   uint_t i;
+   GDnsCache *entry;
 
-   for ( i = 0; i < dns_cache_size; ++i ){
-      dFree(dns_cache[i].hostname);
-      for ( j = 0; j < dList_length(dns_cache[i].addr_list); ++j)
-         dFree(dList_nth_data(dns_cache[i].addr_list, j));
-      dList_free(dns_cache[i].addr_list);
+   for (i = 0; i < dns_cache_size; ++i) {
+      while ((entry = dns_cache[i])) {
+         dns_cache[i] = entry->next;
+         Dns_cache_entry_free(entry);
+      }
    }
    a_IOwatch_remove_fd(dns_notify_pipe[0], DIO_READ);
    dClose(dns_notify_pipe[0]);
    dClose(dns_notify_pipe[1]);
    dFree(dns_cache);
+   dList_free(dns_waiting);
+}
+
+/*
+ * Make a copy of an address list from a DNS answer.
+ */
+Dlist *a_Dns_addr_list_dup(Dlist *addr_list)
+{
+   int i;
+   DilloHost *dh;
+   Dlist *copy = dList_new(MAX(dList_length(addr_list), 1));
+
+   for (i = 0; (dh = dList_nth_data(addr_list, i)); i++) {
+      DilloHost *dh_copy = dNew(DilloHost, 1);
+
+      *dh_copy = *dh;
+      dList_append(copy, dh_copy);
+   }
+   return copy;
+}
+
+/*
+ * Free a copy made by a_Dns_addr_list_dup().
+ */
+void a_Dns_addr_list_free(Dlist *addr_list)
+{
+   Dns_addr_list_free(addr_list);
 }
 
 /*
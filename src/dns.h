@@ -13,6 +13,8 @@ typedef void (*DnsCallback_t)(int status, Dlist *addr_list, void *data);
 void a_Dns_init (void);
 void a_Dns_freeall(void);
 void a_Dns_resolve(const char *hostname, DnsCallback_t cb_func, void *cb_data);
+Dlist *a_Dns_addr_list_dup(Dlist *addr_list);
+void a_Dns_addr_list_free(Dlist *addr_list);
 
 #ifdef ENABLE_IPV6
 #  define DILLO_ADDR_MAX sizeof(struct in6_addr)
@@ -1,8 +1,65 @@
 #ifndef __DOCTREE_HH__
 #define __DOCTREE_HH__
 
+#include <string.h>
 #include "lout/misc.hh"
 
+/**
+ * \brief A Bloom filter of the elements, ids and classes of the ancestors
+ *    of a DoctreeNode.
+ *
+ * It tells for sure when none of the ancestors has a certain element, id
+ * or class, so that CssSelector::match () can reject descendant selectors
+ * without walking up the tree.
+ */
+class DoctreeFilter {
+   private:
+      enum { BITS = 256, WORD_BITS = 32 };
+      unsigned int bits[BITS / WORD_BITS];
+
+      static inline unsigned int hashString (const char *s,
+                                             unsigned int hash) {
+         // FNV-1a, ids and classes are matched case insensitively
+         for (; *s; s++)
+            hash = (hash ^ D_ASCII_TOLOWER (*s)) * 16777619;
+         return hash;
+      }
+      static inline unsigned int bit1 (unsigned int hash) {
+         return hash % BITS;
+      }
+      static inline unsigned int bit2 (unsigned int hash) {
+         return (hash >> 16) % BITS;
+      }
+
+   public:
+      DoctreeFilter () { memset (bits, 0, sizeof (bits)); }
+
+      static inline unsigned int hashElement (int element) {
+         return (element + 1) * 2654435761u;
+      }
+      static inline unsigned int hashId (const char *id) {
+         return hashString (id, 2166136261u ^ '#');
+      }
+      static inline unsigned int hashClass (const char *klass) {
+         return hashString (klass, 2166136261u ^ '.');
+      }
+
+      inline void add (unsigned int hash) {
+         bits[bit1 (hash) / WORD_BITS] |= 1u << (bit1 (hash) % WORD_BITS);
+         bits[bit2 (hash) / WORD_BITS] |= 1u << (bit2 (hash) % WORD_BITS);
+      }
+      inline void add (const DoctreeFilter *filter) {
+         for (int i = 0; i < BITS / WORD_BITS; i++)
+            bits[i] |= filter->bits[i];
+      }
+      inline bool mayContain (unsigned int hash) const {
+         return (bits[bit1 (hash) / WORD_BITS] &
+                 (1u << (bit1 (hash) % WORD_BITS))) &&
+                (bits[bit2 (hash) / WORD_BITS] &
+                 (1u << (bit2 (hash) % WORD_BITS)));
+      }
+};
+
 class DoctreeNode {
    public:
       DoctreeNode *parent;
@@ -13,6 +70,7 @@ class DoctreeNode {
       lout::misc::SimpleVector<char*> *klass;
       const char *pseudo;
       const char *id;
+      DoctreeFilter ancestors;
 
       DoctreeNode () {
          parent = NULL;
@@ -68,6 +126,17 @@ class Doctree {
          dn->sibling = dn->parent->lastChild;
          dn->parent->lastChild = dn;
          dn->num = num++;
+         if (topNode != rootNode) {
+            // id and classes are set before any children are pushed
+            dn->ancestors.add (&topNode->ancestors);
+            dn->ancestors.add (DoctreeFilter::hashElement (topNode->element));
+            if (topNode->id)
+               dn->ancestors.add (DoctreeFilter::hashId (topNode->id));
+            if (topNode->klass)
+               for (int i = 0; i < topNode->klass->size (); i++)
+                  dn->ancestors.add (DoctreeFilter::hashClass
+                                     (topNode->klass->get (i)));
+         }
          topNode = dn;
          return dn;
       };
@@ -264,6 +264,16 @@ void a_Html_form_display_hiddens2(void *vform, bool display)
    ((DilloHtmlForm *)vform)->display_hiddens(display);
 }
 
+void a_Html_form_set_enabled(DilloHtmlForm *form, bool enabled)
+{
+   form->setEnabled(enabled);
+}
+
+void a_Html_input_set_enabled(DilloHtmlInput *input, bool enabled)
+{
+   input->setEnabled(enabled);
+}
+
 /*
  * Form parsing functions
  */
@@ -1539,6 +1549,7 @@ void DilloHtmlForm::display_hiddens(bool display)
 
 void DilloHtmlForm::setEnabled(bool enabled)
 {
+   this->enabled = enabled;
    for (int i = 0; i < inputs->size(); i++)
       inputs->get(i)->setEnabled(enabled);
 }
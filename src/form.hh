@@ -41,6 +41,8 @@ void a_Html_input_delete(DilloHtmlInput* input);
 void a_Html_form_submit2(void *v_form);
 void a_Html_form_reset2(void *v_form);
 void a_Html_form_display_hiddens2(void *v_form, bool display);
+void a_Html_form_set_enabled(DilloHtmlForm *form, bool enabled);
+void a_Html_input_set_enabled(DilloHtmlInput *input, bool enabled);
 
 
 /*
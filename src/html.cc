@@ -101,7 +101,8 @@ void *a_Html_text(const char *type, void *P, CA_Callback_t *Call,void **Data);
  *---------------------------------------------------------------------------*/
 static int Html_write_raw(DilloHtml *html, char *buf, int bufsize, int Eof);
 static bool Html_load_image(BrowserWindow *bw, DilloUrl *url,
-                            const DilloUrl *requester, DilloImage *image);
+                            const DilloUrl *requester, DilloImage *image,
+                            int web_flags);
 static void Html_callback(int Op, CacheClient_t *Client);
 static void Html_tag_cleanup_at_close(DilloHtml *html, int TagIdx);
 int a_Html_tag_index(const char *tag);
@@ -707,7 +708,7 @@ void DilloHtml::loadImages (const DilloUrl *pattern)
       if (hi->image) {
          assert(hi->url);
          if ((!pattern) || (!a_Url_cmp(hi->url, pattern))) {
-            if (Html_load_image(bw, hi->url, requester, hi->image)) {
+            if (Html_load_image(bw, hi->url, requester, hi->image, 0)) {
                a_Image_unref (hi->image);
                hi->image = NULL;  // web owns it now
             }
@@ -2151,7 +2152,10 @@ DilloImage *a_Html_image_new(DilloHtml *html, const char *tag, int tagsize)
               !dStrAsciiCasecmp(URL_SCHEME(url), "data") ||
               (a_Capi_get_flags_with_redirection(url) & CAPI_IsCached);
 
-   if (load_now && Html_load_image(html->bw, url, html->page_url, image)) {
+   if (load_now &&
+       Html_load_image(html->bw, url, html->page_url, image,
+                       html->dw->getLayout()->isPastViewport() ?
+                       WEB_Offscreen : 0)) {
       // hi->image is NULL if dillo tries to load the image immediately
       hi->image = NULL;
       a_Image_unref(image);
@@ -2166,9 +2170,11 @@ DilloImage *a_Html_image_new(DilloHtml *html, const char *tag, int tagsize)
 
 /*
  * Tell cache to retrieve image
+ * ('web_flags' are extra WEB_* flags, i.e. hints for the request)
  */
 static bool Html_load_image(BrowserWindow *bw, DilloUrl *url,
-                            const DilloUrl *requester, DilloImage *Image)
+                            const DilloUrl *requester, DilloImage *Image,
+                            int web_flags)
 {
    DilloWeb *Web;
    int ClientKey;
@@ -2176,7 +2182,7 @@ static bool Html_load_image(BrowserWindow *bw, DilloUrl *url,
    Web = a_Web_new(bw, url, requester);
    Web->Image = Image;
    a_Image_ref(Image);
-   Web->flags |= WEB_Image;
+   Web->flags |= WEB_Image | web_flags;
    /* Request image data from the cache */
    if ((ClientKey = a_Capi_open_url(Web, NULL, NULL)) != 0) {
       a_Bw_add_client(bw, ClientKey, 0);
@@ -3200,6 +3206,17 @@ static void Html_tag_open_meta(DilloHtml *html, const char *tag, int tagsize)
    }
 }
 
+/*
+ * Enable the forms, which are disabled while stylesheets are pending.
+ */
+static void Html_enable_forms(DilloHtml *html)
+{
+   for (int i = 0; i < html->forms->size(); i++)
+      a_Html_form_set_enabled(html->forms->get(i), true);
+   for (int i = 0; i < html->inputs_outside_form->size(); i++)
+      a_Html_input_set_enabled(html->inputs_outside_form->get(i), true);
+}
+
 /*
  * Called by the network engine when a stylesheet has new data.
  */
@@ -3207,24 +3224,31 @@ static void Html_css_load_callback(int Op, CacheClient_t *Client)
 {
    _MSG("Html_css_load_callback: Op=%d\n", Op);
    if (Op) { /* EOF */
-      BrowserWindow *bw = ((DilloWeb *)Client->Web)->bw;
-      /* Repush when we've got them all */
-      if (--bw->NumPendingStyleSheets == 0)
-         a_UIcmd_repush(bw);
+      DilloWeb *Web = (DilloWeb *)Client->Web;
+      BrowserWindow *bw = Web->bw;
+      DilloHtml *html;
+
+      /* Restyle (or else repush) when we've got them all */
+      if (--bw->NumPendingStyleSheets == 0) {
+         html = (DilloHtml *)a_Bw_get_url_doc(bw, Web->requester);
+         if (html && html->styleEngine->applyPendingStyleSheets(html, bw,
+                                                                html->dw))
+            Html_enable_forms(html);
+         else
+            a_UIcmd_repush(bw);
+      }
    }
 }
 
 /*
- * Tell cache to retrieve a stylesheet
+ * Parse a stylesheet if it's in the cache.
+ * Return value: whether it was.
  */
-void a_Html_load_stylesheet(DilloHtml *html, DilloUrl *url)
+bool a_Html_parse_stylesheet(DilloHtml *html, DilloUrl *url)
 {
    char *data;
    int len;
 
-   dReturn_if (url == NULL || ! prefs.load_stylesheets);
-
-   _MSG("Html_load_stylesheet: ");
    if ((a_Capi_get_flags_with_redirection(url) & CAPI_Completed) &&
        a_Capi_get_buf(url, &data, &len)) {
       _MSG("cached URL=%s len=%d", URL_STR(url), len);
@@ -3244,14 +3268,28 @@ void a_Html_load_stylesheet(DilloHtml *html, DilloUrl *url)
             a_Capi_get_buf(url, &data, &len);
          }
       }
-      html->styleEngine->parse(html, url, data, len, CSS_ORIGIN_AUTHOR);
+      html->styleEngine->parseStyleSheet(html, url, data, len);
       a_Capi_unref_buf(url);
-   } else {
+      return true;
+   }
+   return false;
+}
+
+/*
+ * Tell cache to retrieve a stylesheet
+ */
+void a_Html_load_stylesheet(DilloHtml *html, DilloUrl *url)
+{
+   dReturn_if (url == NULL || ! prefs.load_stylesheets);
+
+   _MSG("Html_load_stylesheet: ");
+   if (!a_Html_parse_stylesheet(html, url)) {
       /* Fill a Web structure for the cache query */
       int ClientKey;
       DilloWeb *Web = a_Web_new(html->bw, url, html->page_url);
       Web->flags |= WEB_Stylesheet;
       if ((ClientKey = a_Capi_open_url(Web, Html_css_load_callback, NULL))) {
+         html->styleEngine->styleSheetPending(url, html->InFlags & IN_BODY);
          ++html->bw->NumPendingStyleSheets;
          a_Bw_add_client(html->bw, ClientKey, 0);
          a_Bw_add_url(html->bw, url);
@@ -274,6 +274,7 @@ void a_Html_tag_set_align_attr(DilloHtml *html, const char *tag, int tagsize);
 bool a_Html_tag_set_valign_attr(DilloHtml *html,
                                 const char *tag, int tagsize);
 
+bool a_Html_parse_stylesheet(DilloHtml *html, DilloUrl *url);
 void a_Html_load_stylesheet(DilloHtml *html, DilloUrl *url);
 
 #endif /* __HTML_COMMON_HH__ */
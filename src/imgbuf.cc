@@ -115,6 +115,15 @@ int a_Imgbuf_last_reference(void *v_imgbuf)
    return ((Imgbuf*)v_imgbuf)->lastReference () ? 1 : 0;
 }
 
+/*
+ * Free the full-size pixels, if only scaled versions of the image are shown.
+ * Return value: 1 if the memory was freed, 0 otherwise.
+ */
+int a_Imgbuf_free_root(void *v_imgbuf)
+{
+   return ((Imgbuf*)v_imgbuf)->freeRootData () ? 1 : 0;
+}
+
 /*
  * Update the root buffer of an imgbuf.
  */
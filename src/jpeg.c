@@ -33,7 +33,6 @@
 #include "image.hh"
 #include "cache.h"
 #include "dicache.h"
-#include "capi.h"       /* get cache entry status */
 #include "msg.h"
 
 typedef enum {
@@ -284,7 +283,7 @@ static void Jpeg_write(DilloJpeg *jpeg, void *Buf, uint_t BufSize)
           * use progressive display, updating as it arrives.
           */
          if (jpeg_has_multiple_scans(&jpeg->cinfo) &&
-             !(a_Capi_get_flags(jpeg->url) & CAPI_Completed))
+             !a_Dicache_data_complete(jpeg->url))
             jpeg->cinfo.buffered_image = TRUE;
 
          /* check max image size */
@@ -20,21 +20,28 @@
 
 #include "klist.h"
 
+/* Keys are handed out sequentially, so masking them spreads the nodes
+ * evenly over the buckets. */
+#define KLIST_BUCKET(Klist, Key) ((uint_t)(Key) & ((Klist)->Size - 1))
 
 /*
- * Compare function for searching data by its key
+ * Double the number of buckets and rehash the nodes.
  */
-static int Klist_node_by_key_cmp(const void *Node, const void *key)
+static void Klist_grow(Klist_t *Klist)
 {
-   return ((KlistNode_t *)Node)->Key - VOIDP2INT(key);
-}
-
-/*
- * Compare function for searching data by node
- */
-static int Klist_node_by_node_cmp(const void *Node1, const void *Node2)
-{
-   return ((KlistNode_t *)Node1)->Key - ((KlistNode_t *)Node2)->Key;
+   int i, old_size = Klist->Size;
+   KlistNode_t **old = Klist->Buckets, *node, *next;
+
+   Klist->Size *= 2;
+   Klist->Buckets = dNew0(KlistNode_t *, Klist->Size);
+   for (i = 0; i < old_size; i++) {
+      for (node = old[i]; node; node = next) {
+         next = node->Next;
+         node->Next = Klist->Buckets[KLIST_BUCKET(Klist, node->Key)];
+         Klist->Buckets[KLIST_BUCKET(Klist, node->Key)] = node;
+      }
+   }
+   dFree(old);
 }
 
 /*
@@ -42,12 +49,15 @@ static int Klist_node_by_node_cmp(const void *Node1, const void *Node2)
  */
 void *a_Klist_get_data(Klist_t *Klist, int Key)
 {
-   void *aux;
+   KlistNode_t *node;
 
    if (!Klist)
       return NULL;
-   aux = dList_find_sorted(Klist->List, INT2VOIDP(Key), Klist_node_by_key_cmp);
-   return (aux) ? ((KlistNode_t*)aux)->Data : NULL;
+   for (node = Klist->Buckets[KLIST_BUCKET(Klist, Key)]; node;
+        node = node->Next)
+      if (node->Key == Key)
+         return node->Data;
+   return NULL;
 }
 
 /*
@@ -55,11 +65,13 @@ void *a_Klist_get_data(Klist_t *Klist, int Key)
  */
 int a_Klist_insert(Klist_t **Klist, void *Data)
 {
-   KlistNode_t *Node;
+   KlistNode_t *Node, **bucket;
 
    if (!*Klist) {
       (*Klist) = dNew(Klist_t, 1);
-      (*Klist)->List = dList_new(32);
+      (*Klist)->Size = 32;
+      (*Klist)->Buckets = dNew0(KlistNode_t *, (*Klist)->Size);
+      (*Klist)->Length = 0;
       (*Klist)->Clean = 1;
       (*Klist)->Counter = 0;
    }
@@ -73,10 +85,16 @@ int a_Klist_insert(Klist_t **Klist, void *Data)
    } while (!((*Klist)->Clean) &&
             a_Klist_get_data((*Klist), (*Klist)->Counter));
 
+   if ((*Klist)->Length >= (*Klist)->Size)
+      Klist_grow(*Klist);
+
    Node = dNew(KlistNode_t, 1);
    Node->Key = (*Klist)->Counter;
    Node->Data = Data;
-   dList_insert_sorted((*Klist)->List, Node, Klist_node_by_node_cmp);
+   bucket = &(*Klist)->Buckets[KLIST_BUCKET(*Klist, Node->Key)];
+   Node->Next = *bucket;
+   *bucket = Node;
+   (*Klist)->Length++;
    return (*Klist)->Counter;
 }
 
@@ -85,14 +103,18 @@ int a_Klist_insert(Klist_t **Klist, void *Data)
  */
 void a_Klist_remove(Klist_t *Klist, int Key)
 {
-   void *data;
-
-   data = dList_find_sorted(Klist->List, INT2VOIDP(Key),Klist_node_by_key_cmp);
-   if (data) {
-      dList_remove(Klist->List, data);
-      dFree(data);
+   KlistNode_t **prev, *node;
+
+   for (prev = &Klist->Buckets[KLIST_BUCKET(Klist, Key)]; (node = *prev);
+        prev = &node->Next) {
+      if (node->Key == Key) {
+         *prev = node->Next;
+         dFree(node);
+         Klist->Length--;
+         break;
+      }
    }
-   if (dList_length(Klist->List) == 0)
+   if (Klist->Length == 0)
       Klist->Clean = 1;
 }
 
@@ -101,7 +123,7 @@ void a_Klist_remove(Klist_t *Klist, int Key)
  */
 int a_Klist_length(Klist_t *Klist)
 {
-   return dList_length(Klist->List);
+   return Klist->Length;
 }
 
 /*
@@ -109,19 +131,20 @@ int a_Klist_length(Klist_t *Klist)
  */
 void a_Klist_free(Klist_t **KlistPtr)
 {
-   void *node;
+   int i;
+   KlistNode_t *node, *next;
    Klist_t *Klist = *KlistPtr;
 
    if (!Klist)
       return;
 
-   while (dList_length(Klist->List) > 0) {
-      node = dList_nth_data(Klist->List, 0);
-      dList_remove_fast(Klist->List, node);
-      dFree(node);
+   for (i = 0; i < Klist->Size; i++) {
+      for (node = Klist->Buckets[i]; node; node = next) {
+         next = node->Next;
+         dFree(node);
+      }
    }
-   dList_free(Klist->List);
+   dFree(Klist->Buckets);
    dFree(Klist);
    *KlistPtr = NULL;
 }
-
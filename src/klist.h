@@ -8,13 +8,16 @@
 extern "C" {
 #endif /* __cplusplus */
 
-typedef struct {
+typedef struct KlistNode {
    int Key;        /* primary key */
    void *Data;     /* data reference */
+   struct KlistNode *Next; /* next node in the same bucket */
 } KlistNode_t;
 
 typedef struct {
-   Dlist *List;
+   KlistNode_t **Buckets; /* nodes hashed by Key */
+   int Size;       /* number of buckets (a power of two) */
+   int Length;     /* number of nodes */
    int Clean;      /* check flag */
    int Counter;    /* counter (for making keys) */
 } Klist_t;
@@ -23,6 +23,7 @@
 #define PREFS_SAVE_DIR        "/tmp/"
 #define PREFS_HTTP_REFERER    "host"
 #define PREFS_HTTP_USER_AGENT "Dillo/" VERSION
+#define PREFS_IMAGE_UPSCALING "bilinear"
 #define PREFS_THEME           "none"
 #define PREFS_EXTERNAL_PROGRAM "xdg-open"
 
@@ -41,6 +42,10 @@ void a_Prefs_init(void)
    prefs.white_bg_replacement = 0xe0e0a3; // 0xdcd1ba;
    prefs.bg_color = 0xdcd1ba;
    prefs.buffered_drawing = 1;
+   prefs.cache_max_size = 0;
+   prefs.cache_disk = FALSE;
+   prefs.cache_disk_max_size = 50 * 1024 * 1024;
+   prefs.cache_single_copy = TRUE;
    prefs.contrast_visited_color = TRUE;
    prefs.enterpress_forces_submit = FALSE;
    prefs.focus_new_tab = TRUE;
@@ -64,14 +69,22 @@ void a_Prefs_init(void)
    prefs.http_language = NULL;
    prefs.http_proxy = NULL;
    prefs.http_max_conns = 6;
+   prefs.http_max_total_conns = 24;
+   prefs.http_pipeline_depth = 1;
+   prefs.dns_max_threads = 16;
    prefs.http_persistent_conns = TRUE;
    prefs.http_proxyuser = NULL;
    prefs.http_referer = dStrdup(PREFS_HTTP_REFERER);
    prefs.http_strict_transport_security = TRUE;
+   prefs.tls_session_ttl = 3600;
+   prefs.tls_session_cache_disk = FALSE;
    prefs.http_user_agent = dStrdup(PREFS_HTTP_USER_AGENT);
    prefs.limit_text_width = FALSE;
    prefs.adjust_min_width = TRUE;
    prefs.adjust_table_min_width = TRUE;
+   prefs.image_cache_max_size = 64 * 1024 * 1024;
+   prefs.image_decode_threads = 2;
+   prefs.image_upscaling = dStrdup(PREFS_IMAGE_UPSCALING);
    prefs.load_images=TRUE;
    prefs.load_background_images=FALSE;
    prefs.load_stylesheets=TRUE;
@@ -145,6 +158,7 @@ void a_Prefs_freeall(void)
    dFree(prefs.http_proxyuser);
    dFree(prefs.http_referer);
    dFree(prefs.http_user_agent);
+   dFree(prefs.image_upscaling);
    dFree(prefs.no_proxy);
    dFree(prefs.save_dir);
    for (i = 0; i < dList_length(prefs.search_urls); ++i)
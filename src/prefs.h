@@ -40,6 +40,9 @@ typedef struct {
    int ypos;
    char *http_language;
    int32_t http_max_conns;
+   int32_t http_max_total_conns;
+   int32_t http_pipeline_depth;
+   int32_t dns_max_threads;
    DilloUrl *http_proxy;
    char *http_proxyuser;
    char *http_referer;
@@ -50,6 +53,10 @@ typedef struct {
    bool_t allow_white_bg;
    int32_t white_bg_replacement;
    int32_t bg_color;
+   int32_t cache_max_size;
+   bool_t cache_disk;
+   int32_t cache_disk_max_size;
+   bool_t cache_single_copy;
    int32_t ui_button_highlight_color;
    int32_t ui_fg_color;
    int32_t ui_main_bg_color;
@@ -88,12 +95,17 @@ typedef struct {
    bool_t show_progress_box;
    bool_t show_quit_dialog;
    bool_t fullwindow_start;
+   int32_t image_cache_max_size;
+   int32_t image_decode_threads;
+   char *image_upscaling;
    bool_t load_images;
    bool_t load_background_images;
    bool_t load_stylesheets;
    bool_t parse_embedded_css;
    bool_t http_persistent_conns;
    bool_t http_strict_transport_security;
+   int32_t tls_session_ttl;
+   bool_t tls_session_cache_disk;
    int32_t buffered_drawing;
    char *font_serif;
    char *font_sans_serif;
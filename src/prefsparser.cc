@@ -150,7 +150,12 @@ void PrefsParser::parse(FILE *fp)
       { "white_bg_replacement", &prefs.white_bg_replacement, PREFS_COLOR, 0 },
       { "bg_color", &prefs.bg_color, PREFS_COLOR, 0 },
       { "buffered_drawing", &prefs.buffered_drawing, PREFS_INT32, 0 },
+      { "cache_disk", &prefs.cache_disk, PREFS_BOOL, 0 },
+      { "cache_disk_max_size", &prefs.cache_disk_max_size, PREFS_INT32, 0 },
+      { "cache_max_size", &prefs.cache_max_size, PREFS_INT32, 0 },
+      { "cache_single_copy", &prefs.cache_single_copy, PREFS_BOOL, 0 },
       { "contrast_visited_color", &prefs.contrast_visited_color, PREFS_BOOL, 0 },
+      { "dns_max_threads", &prefs.dns_max_threads, PREFS_INT32, 0 },
       { "enterpress_forces_submit", &prefs.enterpress_forces_submit,
         PREFS_BOOL, 0 },
       { "external_program", &prefs.external_program, PREFS_STRING, 0 },
@@ -168,13 +173,18 @@ void PrefsParser::parse(FILE *fp)
       { "home", &prefs.home, PREFS_URL, 0 },
       { "http_language", &prefs.http_language, PREFS_STRING, 0 },
       { "http_max_conns", &prefs.http_max_conns, PREFS_INT32, 0 },
+      { "http_max_total_conns", &prefs.http_max_total_conns, PREFS_INT32, 0 },
       { "http_persistent_conns", &prefs.http_persistent_conns, PREFS_BOOL, 0 },
+      { "http_pipeline_depth", &prefs.http_pipeline_depth, PREFS_INT32, 0 },
       { "http_proxy", &prefs.http_proxy, PREFS_URL, 0 },
       { "http_proxyuser", &prefs.http_proxyuser, PREFS_STRING, 0 },
       { "http_referer", &prefs.http_referer, PREFS_STRING, 0 },
       { "http_strict_transport_security",&prefs.http_strict_transport_security,
         PREFS_BOOL, 0 },
       { "http_user_agent", &prefs.http_user_agent, PREFS_STRING, 0 },
+      { "image_cache_max_size", &prefs.image_cache_max_size, PREFS_INT32, 0 },
+      { "image_decode_threads", &prefs.image_decode_threads, PREFS_INT32, 0 },
+      { "image_upscaling", &prefs.image_upscaling, PREFS_STRING, 0 },
       { "limit_text_width", &prefs.limit_text_width, PREFS_BOOL, 0 },
       { "adjust_min_width", &prefs.adjust_min_width, PREFS_BOOL, 0 },
       { "adjust_table_min_width", &prefs.adjust_table_min_width, PREFS_BOOL, 0 },
@@ -213,6 +223,9 @@ void PrefsParser::parse(FILE *fp)
       { "small_icons", &prefs.small_icons, PREFS_BOOL, 0 },
       { "start_page", &prefs.start_page, PREFS_URL, 0 },
       { "theme", &prefs.theme, PREFS_STRING, 0 },
+      { "tls_session_cache_disk", &prefs.tls_session_cache_disk,
+        PREFS_BOOL, 0 },
+      { "tls_session_ttl", &prefs.tls_session_ttl, PREFS_INT32, 0 },
       { "ui_button_highlight_color", &prefs.ui_button_highlight_color,
         PREFS_COLOR, 0 },
       { "ui_fg_color", &prefs.ui_fg_color, PREFS_COLOR, 0 },
@@ -58,6 +58,49 @@ void StyleImageDeletionReceiver::deleted (lout::signal::ObservedObject *object)
 
 // ----------------------------------------------------------------------
 
+/*
+ * Parsed stylesheets, kept across pages; the most recently used first.
+ */
+typedef struct {
+   DilloUrl *url;
+   CssOrigin origin;
+   int size;
+   uint_t hash;
+   CssParsedStyleSheet *sheet;
+} ParsedStyleSheet;
+
+static Dlist *parsedStyleSheets = NULL;
+static int parsedStyleSheetsSize = 0;
+
+/* The limit for the sum of the sizes of the parsed stylesheets' sources */
+#define PARSED_STYLESHEETS_MAX_SIZE (2 * 1024 * 1024)
+
+/*
+ * FNV-1a hash, to tell whether a stylesheet has changed.
+ */
+static uint_t hashStyleSheet (const char *buf, int buflen) {
+   uint_t hash = 2166136261u;
+
+   for (int i = 0; i < buflen; i++) {
+      hash ^= (unsigned char) buf[i];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+#ifdef STYLEENGINE_BENCH
+bool StyleEngine::styleSharing = true;
+int StyleEngine::numStyles = 0;
+int StyleEngine::numSharedStyles = 0;
+#endif
+
+static void freeParsedStyleSheet (ParsedStyleSheet *p) {
+   parsedStyleSheetsSize -= p->size;
+   a_Url_free (p->url);
+   p->sheet->unref ();
+   dFree (p);
+}
+
 StyleEngine::StyleEngine (dw::core::Layout *layout,
                           const DilloUrl *pageUrl, const DilloUrl *baseUrl) {
    StyleAttrs style_attrs;
@@ -72,6 +115,13 @@ StyleEngine::StyleEngine (dw::core::Layout *layout,
    this->baseUrl = baseUrl ? a_Url_dup(baseUrl) : NULL;
    importDepth = 0;
    dpmm = layout->dpiX () / 25.4; /* assume dpiX == dpiY */
+   liveStack = NULL;
+   for (int i = 0; i < SHARED_STYLES; i++)
+      sharedStyles[i].style = NULL;
+   nextSharedStyle = sharingMisses = 0;
+   log = NULL;
+   pendingStyleSheets = new lout::misc::SimpleVector <PendingStyleSheet> (1);
+   logIncomplete = restyling = false;
 
    stackPush ();
    Node *n = stack->getLastRef ();
@@ -103,6 +153,16 @@ StyleEngine::~StyleEngine () {
    stackPop (); // dummy node on the bottom of the stack
    assert (stack->size () == 0);
 
+   freeLog ();
+   delete pendingStyleSheets;
+
+   for (int i = 0; i < SHARED_STYLES; i++)
+      if (sharedStyles[i].style) {
+         sharedStyles[i].style->unref ();
+         sharedStyles[i].parentStyle->unref ();
+         delete sharedStyles[i].nonCssProperties;
+      }
+
    a_Url_free(pageUrl);
    a_Url_free(baseUrl);
 
@@ -113,7 +173,7 @@ StyleEngine::~StyleEngine () {
 
 void StyleEngine::stackPush () {
    static const Node emptyNode = {
-      NULL, NULL, NULL, NULL, NULL, NULL, false, false, NULL
+      NULL, NULL, NULL, NULL, NULL, NULL, false, false, NULL, -1
    };
 
    stack->setSize (stack->size () + 1, emptyNode);
@@ -122,6 +182,20 @@ void StyleEngine::stackPush () {
 void StyleEngine::stackPop () {
    Node *n = stack->getRef (stack->size () - 1);
 
+   if (n->logIndex >= 0) {
+      // the log keeps what is needed to compute the styles again
+      LoggedElement *le = log->getRef (n->logIndex);
+
+      le->node = -1;
+      le->styleAttrProperties = n->styleAttrProperties;
+      le->styleAttrPropertiesImportant = n->styleAttrPropertiesImportant;
+      le->nonCssProperties = n->nonCssProperties;
+      le->inheritBackgroundColor = n->inheritBackgroundColor;
+      n->styleAttrProperties = NULL;
+      n->styleAttrPropertiesImportant = NULL;
+      n->nonCssProperties = NULL;
+   }
+
    delete n->styleAttrProperties;
    delete n->styleAttrPropertiesImportant;
    delete n->nonCssProperties;
@@ -770,6 +844,8 @@ void StyleEngine::apply (int i, StyleAttrs *attrs, CssPropertyList *props,
       web->Image = image;
       a_Image_ref(image);
       web->flags |= WEB_Image;
+      if (layout->isPastViewport())
+         web->flags |= WEB_Offscreen; // the page already goes past the view
 
       int clientKey;
       if ((clientKey = a_Capi_open_url(web, NULL, NULL)) != 0) {
@@ -874,8 +950,11 @@ Style * StyleEngine::backgroundStyle (BrowserWindow *bw) {
          attrs.backgroundColor = stack->getRef (i)->style->backgroundColor;
 
       assert (attrs.backgroundColor);
+      attrs.x_origin = logTag (stack->size () - 1, LOG_BACKGROUND_STYLE);
       stack->getRef (stack->size () - 1)->backgroundStyle =
          Style::create (&attrs);
+      logStyle (stack->size () - 1, LOG_BACKGROUND_STYLE,
+                stack->getRef (stack->size () - 1)->backgroundStyle);
    }
    return stack->getRef (stack->size () - 1)->backgroundStyle;
 }
@@ -888,8 +967,8 @@ Style * StyleEngine::backgroundStyle (BrowserWindow *bw) {
 Style * StyleEngine::style0 (int i, BrowserWindow *bw) {
    CssPropertyList props, *styleAttrProperties, *styleAttrPropertiesImportant;
    CssPropertyList *nonCssProperties;
-   // get previous style from the stack
-   StyleAttrs attrs = *stack->getRef (i - 1)->style;
+   Style *shared;
+   bool share;
 
    // Ensure that StyleEngine::style0() has not been called before for
    // this element.
@@ -899,6 +978,31 @@ Style * StyleEngine::style0 (int i, BrowserWindow *bw) {
    // style() or wordStyle() for each new element.
    assert (stack->getRef (i)->style == NULL);
 
+#ifdef STYLEENGINE_BENCH
+   numStyles++;
+#endif
+   share = canShareStyle (i);
+   if (share && sharingMisses >= SHARING_MISSES &&
+       ++sharingMisses % SHARING_MISSES) {
+      // Sharing has not paid off for a while (e.g. every element has
+      // other classes); only try it now and then, until it does again.
+      share = false;
+   }
+   if (share && (shared = findSharedStyle (i))) {
+#ifdef STYLEENGINE_BENCH
+      numSharedStyles++;
+#endif
+      sharingMisses = 0;
+      shared->ref ();
+      stack->getRef (i)->style = shared;
+      if (shared->display == DISPLAY_NONE)
+         stack->getRef (i)->displayNone = true;
+      return shared;
+   }
+
+   // get previous style from the stack
+   StyleAttrs attrs = *stack->getRef (i - 1)->style;
+
    // reset values that are not inherited according to CSS
    attrs.resetValues ();
    preprocessAttrs (&attrs);
@@ -917,11 +1021,122 @@ Style * StyleEngine::style0 (int i, BrowserWindow *bw) {
 
    postprocessAttrs (&attrs);
 
+   attrs.x_origin = logTag (i, LOG_STYLE);
    stack->getRef (i)->style = Style::create (&attrs);
+   logStyle (i, LOG_STYLE, stack->getRef (i)->style);
+   if (share) {
+      if (sharingMisses < SHARING_MISSES)
+         sharingMisses++;
+      addSharedStyle (i);
+   }
 
    return stack->getRef (i)->style;
 }
 
+static bool sameClasses (lout::misc::SimpleVector <char *> *k1,
+                         lout::misc::SimpleVector <char *> *k2) {
+   int n1 = k1 ? k1->size () : 0, n2 = k2 ? k2->size () : 0;
+
+   if (n1 != n2)
+      return false;
+   for (int i = 0; i < n1; i++)
+      if (strcmp (k1->get (i), k2->get (i)))
+         return false;
+   return true;
+}
+
+/**
+ * \brief Whether the element on the stack at index i may share the style
+ *    of a sibling, instead of having it computed.
+ *
+ * Only elements without id and style attribute can, and only as long as no
+ * rule depends on the siblings of an element, and no styles are logged for
+ * restyling.
+ */
+bool StyleEngine::canShareStyle (int i) {
+   Node *n = stack->getRef (i);
+
+   return styleSharing && log == NULL &&
+          stack->getRef (i - 1)->doctreeNode &&
+          n->doctreeNode->id == NULL &&
+          n->styleAttrProperties == NULL &&
+          n->styleAttrPropertiesImportant == NULL &&
+          !cssContext->hasSiblingRules ();
+}
+
+/**
+ * \brief Return the style of a sibling element, which has been computed
+ *    from the same rules, and which the element on the stack at index i
+ *    would get as well, or NULL.
+ *
+ * The elements have to have the same parent, tag, classes, pseudo class
+ * and non-CSS hints.
+ */
+Style *StyleEngine::findSharedStyle (int i) {
+   Node *n = stack->getRef (i), *pn = stack->getRef (i - 1);
+
+   for (int j = 0; j < SHARED_STYLES; j++) {
+      SharedStyle *s = &sharedStyles[j];
+
+      if (s->style &&
+          s->parent == pn->doctreeNode &&
+          s->parentStyle == pn->style &&
+          s->parentInheritBackgroundColor == pn->inheritBackgroundColor &&
+          s->numRules == cssContext->getNumRules () &&
+          s->doctreeNode->element == n->doctreeNode->element &&
+          (s->doctreeNode->pseudo == n->doctreeNode->pseudo ||
+           (s->doctreeNode->pseudo && n->doctreeNode->pseudo &&
+            !strcmp (s->doctreeNode->pseudo, n->doctreeNode->pseudo))) &&
+          sameClasses (s->doctreeNode->klass, n->doctreeNode->klass) &&
+          (s->nonCssProperties ?
+           (n->nonCssProperties &&
+            s->nonCssProperties->equals (n->nonCssProperties)) :
+           !n->nonCssProperties))
+         return s->style;
+   }
+
+   return NULL;
+}
+
+/**
+ * \brief Offer the style just computed for the element on the stack at
+ *    index i to its following siblings.
+ */
+void StyleEngine::addSharedStyle (int i) {
+   Node *n = stack->getRef (i), *pn = stack->getRef (i - 1);
+   SharedStyle *s = &sharedStyles[nextSharedStyle];
+
+   if (s->style) {
+      s->style->unref ();
+      s->parentStyle->unref ();
+      delete s->nonCssProperties;
+   }
+
+   s->parent = pn->doctreeNode;
+   s->doctreeNode = n->doctreeNode;
+   s->nonCssProperties = n->nonCssProperties ?
+      new CssPropertyList (*n->nonCssProperties, true) : NULL;
+   s->parentStyle = pn->style;
+   s->parentStyle->ref ();
+   s->parentInheritBackgroundColor = pn->inheritBackgroundColor;
+   s->style = n->style;
+   s->style->ref ();
+   s->numRules = cssContext->getNumRules ();
+
+   nextSharedStyle = (nextSharedStyle + 1) % SHARED_STYLES;
+}
+
+#ifdef STYLEENGINE_BENCH
+/**
+ * \brief Tell how many styles have been asked for by style0 (), and how
+ *    many of them were shared, over all pages.
+ */
+void StyleEngine::getStyleSharingStats (int *numStyles, int *numSharedStyles) {
+   *numStyles = StyleEngine::numStyles;
+   *numSharedStyles = StyleEngine::numSharedStyles;
+}
+#endif
+
 Style * StyleEngine::wordStyle0 (BrowserWindow *bw) {
    StyleAttrs attrs = *style (bw);
    attrs.resetValues ();
@@ -937,7 +1152,10 @@ Style * StyleEngine::wordStyle0 (BrowserWindow *bw) {
 
    attrs.valign = style (bw)->valign;
 
+   attrs.x_origin = logTag (stack->size () - 1, LOG_WORD_STYLE);
    stack->getRef(stack->size() - 1)->wordStyle = Style::create(&attrs);
+   logStyle (stack->size () - 1, LOG_WORD_STYLE,
+             stack->getRef (stack->size () - 1)->wordStyle);
    return stack->getRef (stack->size () - 1)->wordStyle;
 }
 
@@ -968,6 +1186,446 @@ void StyleEngine::restyle (BrowserWindow *bw) {
    }
 }
 
+/**
+ * \brief Style replacements for dw::core::Widget::restyle, after the logged
+ *    elements have been computed again.
+ *
+ * A style tells by its x_origin which logged element and which of its
+ * styles it belongs to, or has been derived from (like the styles of table
+ * cells or of textblocks added for block elements). Derived styles take
+ * over the changes of the style they have been derived from.
+ */
+class StyleEngine::RestyleMap: public dw::core::style::StyleMap
+{
+   lout::misc::SimpleVector <LoggedElement> *log;
+   lout::container::typed::HashTable
+      <lout::object::TypedPointer <Style>,
+       lout::object::TypedPointer <Style> > *derived;
+
+public:
+   RestyleMap (lout::misc::SimpleVector <LoggedElement> *log);
+   ~RestyleMap ();
+
+   Style *map (Style *style);
+};
+
+StyleEngine::RestyleMap::RestyleMap
+   (lout::misc::SimpleVector <LoggedElement> *log)
+{
+   this->log = log;
+   derived = new lout::container::typed::HashTable
+      <lout::object::TypedPointer <Style>,
+       lout::object::TypedPointer <Style> > (true, true);
+}
+
+StyleEngine::RestyleMap::~RestyleMap ()
+{
+   for (lout::container::typed::Iterator <lout::object::TypedPointer <Style> >
+           it = derived->iterator (); it.hasNext (); ) {
+      Style *style = derived->get (it.getNext ())->getTypedValue ();
+      if (style)
+         style->unref ();
+   }
+   delete derived;
+}
+
+Style *StyleEngine::RestyleMap::map (Style *style)
+{
+   int tag = style->x_origin - 1;
+
+   if (tag < 0 || tag / LOG_ROLES >= log->size ())
+      return NULL;
+
+   LoggedElement *le = log->getRef (tag / LOG_ROLES);
+   Style *oldBase = le->style[tag % LOG_ROLES];
+   Style *newBase = le->newStyle[tag % LOG_ROLES];
+
+   if (oldBase == NULL || newBase == NULL || newBase == oldBase)
+      return NULL;
+   if (style == oldBase)
+      return newBase;
+
+   lout::object::TypedPointer <Style> key (style);
+   lout::object::TypedPointer <Style> *value = derived->get (&key);
+
+   if (value == NULL) {
+      StyleAttrs attrs = *style;
+      Style *newStyle;
+
+      attrs.rebase (oldBase, newBase);
+      newStyle = Style::create (&attrs);
+      if (newStyle == style) {
+         newStyle->unref ();
+         newStyle = NULL;
+      }
+      value = new lout::object::TypedPointer <Style> (newStyle);
+      derived->put (new lout::object::TypedPointer <Style> (style), value);
+   }
+
+   return value->getTypedValue ();
+}
+
+/**
+ * \brief Start to log the element on the stack at index i.
+ */
+void StyleEngine::logElement (int i) {
+   Node *n = stack->getRef (i);
+   LoggedElement le;
+
+   if (i > 1 && stack->getRef (i - 1)->logIndex == -1) {
+      // without its parent, the element can't be computed again
+      logIncomplete = true;
+      return;
+   }
+
+   le.doctreeNode = n->doctreeNode;
+   le.parent = (i > 1) ? stack->getRef (i - 1)->logIndex : -1;
+   le.node = i;
+   le.styleAttrProperties = NULL;
+   le.styleAttrPropertiesImportant = NULL;
+   le.nonCssProperties = NULL;
+   le.inheritBackgroundColor = false;
+   le.displayNone = false;
+   for (int role = 0; role < LOG_ROLES; role++)
+      le.style[role] = le.newStyle[role] = NULL;
+
+   n->logIndex = log->size ();
+   log->increase ();
+   log->set (n->logIndex, le);
+}
+
+/**
+ * \brief Return the x_origin for a style of the element on the stack at
+ *    index i, 0 when it is not logged.
+ */
+int StyleEngine::logTag (int i, int role) {
+   Node *n = stack->getRef (i);
+
+   if (log && !restyling && n->logIndex == -1)
+      logElement (i);
+
+   return (n->logIndex == -1) ? 0 : n->logIndex * LOG_ROLES + role + 1;
+}
+
+void StyleEngine::logStyle (int i, int role, Style *style) {
+   Node *n = stack->getRef (i);
+
+   if (n->logIndex >= 0 && !restyling) {
+      LoggedElement *le = log->getRef (n->logIndex);
+
+      style->ref ();
+      if (le->style[role])
+         le->style[role]->unref ();
+      le->style[role] = style;
+   }
+}
+
+void StyleEngine::freeLog () {
+   if (log) {
+      for (int e = 0; e < log->size (); e++) {
+         LoggedElement *le = log->getRef (e);
+
+         if (le->node >= 0)
+            stack->getRef (le->node)->logIndex = -1;
+         delete le->styleAttrProperties;
+         delete le->styleAttrPropertiesImportant;
+         delete le->nonCssProperties;
+         for (int role = 0; role < LOG_ROLES; role++) {
+            if (le->style[role])
+               le->style[role]->unref ();
+            if (le->newStyle[role])
+               le->newStyle[role]->unref ();
+         }
+      }
+      delete log;
+      log = NULL;
+   }
+
+   for (int i = 0; i < pendingStyleSheets->size (); i++)
+      a_Url_free (pendingStyleSheets->get (i).url);
+   pendingStyleSheets->setSize (0);
+}
+
+/**
+ * \brief Tell the StyleEngine that a stylesheet is being loaded.
+ *
+ * From now on, the styles of all elements are logged, so that
+ * applyPendingStyleSheets () can compute them again, instead of the page
+ * being rendered anew. This is only possible when no content has been
+ * styled without logging.
+ */
+void StyleEngine::styleSheetPending (const DilloUrl *url,
+                                     bool contentStarted) {
+   PendingStyleSheet s;
+
+   if (logIncomplete)
+      return;
+
+   if (log == NULL) {
+      if (contentStarted) {
+         logIncomplete = true;
+         return;
+      }
+
+      log = new lout::misc::SimpleVector <LoggedElement> (8);
+      for (int i = 1; i < stack->size (); i++) {
+         Node *n = stack->getRef (i);
+
+         if (n->style) {
+            logElement (i);
+            logStyle (i, LOG_STYLE, n->style);
+            if (n->wordStyle)
+               logStyle (i, LOG_WORD_STYLE, n->wordStyle);
+            if (n->backgroundStyle)
+               logStyle (i, LOG_BACKGROUND_STYLE, n->backgroundStyle);
+         }
+      }
+   }
+
+   if (!cssContext->reservePositions (&s.pos, &s.posEnd)) {
+      logIncomplete = true;
+      return;
+   }
+
+   s.url = a_Url_dup (url);
+   s.parsed = false;
+   pendingStyleSheets->increase ();
+   pendingStyleSheets->set (pendingStyleSheets->size () - 1, s);
+}
+
+/**
+ * \brief Compute the styles of the logged element e again, on a stack
+ *    built from its (already computed) ancestors.
+ */
+void StyleEngine::restyleLogged (int e, bool keepLog, BrowserWindow *bw) {
+   lout::misc::SimpleVector <int> path (8);
+   Node *n;
+
+   for (int a = e; a != -1; a = log->getRef (a)->parent) {
+      path.increase ();
+      path.set (path.size () - 1, a);
+   }
+
+   stack->setSize (1);
+   for (int j = path.size () - 1; j >= 0; j--) {
+      LoggedElement *le = log->getRef (path.get (j));
+      bool open = le->node >= 0;
+      Node *live = open ? liveStack->getRef (le->node) : NULL;
+
+      stackPush ();
+      n = stack->getLastRef ();
+      n->doctreeNode = le->doctreeNode;
+      n->inheritBackgroundColor =
+         open ? live->inheritBackgroundColor : le->inheritBackgroundColor;
+
+      if (j > 0) {
+         assert (le->newStyle[LOG_STYLE]);
+         n->style = le->newStyle[LOG_STYLE];
+         n->displayNone = le->displayNone;
+      } else {
+         n->styleAttrProperties =
+            open ? live->styleAttrProperties : le->styleAttrProperties;
+         n->styleAttrPropertiesImportant =
+            open ? live->styleAttrPropertiesImportant :
+                   le->styleAttrPropertiesImportant;
+         n->nonCssProperties =
+            open ? live->nonCssProperties : le->nonCssProperties;
+         n->displayNone = stack->getRef (stack->size () - 2)->displayNone;
+         n->logIndex = keepLog ? e : -1;
+      }
+   }
+
+   LoggedElement *le = log->getRef (e);
+
+   style0 (stack->size () - 1, bw);
+   if (le->style[LOG_WORD_STYLE])
+      wordStyle0 (bw);
+   if (le->style[LOG_BACKGROUND_STYLE])
+      backgroundStyle (bw);
+
+   // take over the references from the temporary node
+   n = stack->getLastRef ();
+   le->newStyle[LOG_STYLE] = n->style;
+   le->newStyle[LOG_WORD_STYLE] = n->wordStyle;
+   le->newStyle[LOG_BACKGROUND_STYLE] = n->backgroundStyle;
+   le->displayNone = n->displayNone;
+   stack->setSize (1);
+}
+
+/**
+ * \brief Whether the HTML parser would have built a different widget tree
+ *    for an element with the style s2 instead of s1.
+ */
+static bool styleChangesStructure (Style *s1, Style *s2) {
+   return
+      s1->display != s2->display ||
+      s1->vloat != s2->vloat ||
+      s1->position != s2->position ||
+      s1->zIndex != s2->zIndex ||
+      s1->whiteSpace != s2->whiteSpace ||
+      s1->listStyleType != s2->listStyleType ||
+      s1->listStylePosition != s2->listStylePosition ||
+      s1->borderCollapse != s2->borderCollapse ||
+      (s1->textAlign == TEXT_ALIGN_STRING) !=
+      (s2->textAlign == TEXT_ALIGN_STRING) ||
+      // the cells of collapsing tables get their borders from the table
+      (s1->borderCollapse == BORDER_MODEL_COLLAPSE &&
+       s1->borderWidth.top != s2->borderWidth.top);
+}
+
+/**
+ * \brief Set the background of the layout, like Html_tag_open_body does,
+ *    from the new styles of the logged HTML and BODY elements.
+ */
+void StyleEngine::setLoggedBackground () {
+   int tags[2] = { a_Html_tag_index ("html"), a_Html_tag_index ("body") };
+   Style *styles[2] = { NULL, NULL };
+
+   for (int e = 0; e < log->size (); e++) {
+      LoggedElement *le = log->getRef (e);
+
+      for (int j = 0; j < 2; j++)
+         if (styles[j] == NULL && le->doctreeNode->element == tags[j])
+            styles[j] = le->newStyle[LOG_STYLE];
+   }
+
+   if (styles[1] == NULL)
+      return; // the body has not been started
+
+   for (int j = 0; j < 2; j++)
+      if (styles[j] && styles[j]->backgroundColor) {
+         layout->setBgColor (styles[j]->backgroundColor);
+         break;
+      }
+
+   for (int j = 0; j < 2; j++)
+      if (styles[j] && styles[j]->backgroundImage) {
+         layout->setBgImage (styles[j]->backgroundImage,
+                             styles[j]->backgroundRepeat,
+                             styles[j]->backgroundAttachment,
+                             styles[j]->backgroundPositionX,
+                             styles[j]->backgroundPositionY);
+         break;
+      }
+}
+
+/**
+ * \brief Apply the stylesheets which have arrived after the elements they
+ *    apply to have been styled.
+ *
+ * The stylesheets are parsed into the rule positions reserved for them, the
+ * logged elements are computed again, and the new styles are set in the
+ * widget tree below \em top. Elements may be styled so differently, that
+ * the HTML parser would have built another widget tree; this, and
+ * elements which have not been logged, can only be handled by rendering
+ * the page anew, and false is returned then.
+ */
+bool StyleEngine::applyPendingStyleSheets (DilloHtml *html,
+                                           BrowserWindow *bw,
+                                           dw::core::Widget *top) {
+   int n, pos, posEnd, lastNum = -1;
+   bool keepLog, ok = true;
+
+   if (log == NULL || logIncomplete)
+      return false;
+
+   n = pendingStyleSheets->size ();
+   for (int i = 0; i < n; i++) {
+      PendingStyleSheet s = pendingStyleSheets->get (i);
+
+      if (!s.parsed) {
+         cssContext->getPositions (&pos, &posEnd);
+         cssContext->setPositions (s.pos, s.posEnd);
+         a_Html_parse_stylesheet (html, s.url);
+         cssContext->setPositions (pos, posEnd);
+         pendingStyleSheets->getRef(i)->parsed = true;
+      }
+   }
+
+   if (logIncomplete)
+      return false;
+
+   // stylesheets imported by those just parsed may still be loading
+   keepLog = pendingStyleSheets->size () > n;
+
+   restyling = true;
+   liveStack = stack;
+   stack = new lout::misc::SimpleVector <Node> (8);
+   stack->setSize (1, liveStack->get (0));
+   cssContext->clearMatchCache ();
+
+   for (int e = 0; e < log->size (); e++) {
+      DoctreeNode *dn = log->getRef (e)->doctreeNode;
+
+      // the match cache requires the elements in document order
+      if (dn->num < lastNum)
+         cssContext->clearMatchCache ();
+      lastNum = dn->num;
+
+      restyleLogged (e, keepLog, bw);
+   }
+
+   delete stack;
+   stack = liveStack;
+   liveStack = NULL;
+   cssContext->clearMatchCache ();
+   restyling = false;
+
+   for (int e = 0; ok && e < log->size (); e++) {
+      LoggedElement *le = log->getRef (e);
+
+      for (int role = 0; ok && role < LOG_ROLES; role++)
+         if (le->style[role] && le->newStyle[role] &&
+             styleChangesStructure (le->style[role], le->newStyle[role]))
+            ok = false;
+   }
+
+   if (ok) {
+      RestyleMap map (log);
+
+      top->restyle (&map);
+      setLoggedBackground ();
+   }
+
+   for (int e = 0; e < log->size (); e++) {
+      LoggedElement *le = log->getRef (e);
+      Node *live = (le->node >= 0) ? stack->getRef (le->node) : NULL;
+      Style **liveStyles[LOG_ROLES];
+
+      if (live) {
+         liveStyles[LOG_STYLE] = &live->style;
+         liveStyles[LOG_WORD_STYLE] = &live->wordStyle;
+         liveStyles[LOG_BACKGROUND_STYLE] = &live->backgroundStyle;
+      }
+
+      for (int role = 0; role < LOG_ROLES; role++) {
+         Style *newStyle = le->newStyle[role];
+
+         le->newStyle[role] = NULL;
+         if (newStyle == NULL)
+            continue;
+
+         if (!ok) {
+            newStyle->unref ();
+         } else {
+            if (live && *liveStyles[role] == le->style[role]) {
+               newStyle->ref ();
+               (*liveStyles[role])->unref ();
+               *liveStyles[role] = newStyle;
+            }
+            if (le->style[role])
+               le->style[role]->unref ();
+            le->style[role] = newStyle;
+         }
+      }
+   }
+
+   if (ok && !keepLog)
+      freeLog ();
+
+   return ok;
+}
+
 void StyleEngine::parse (DilloHtml *html, DilloUrl *url, const char *buf,
                          int buflen, CssOrigin origin) {
    if (importDepth > 10) { // avoid looping with recursive @import directives
@@ -980,6 +1638,104 @@ void StyleEngine::parse (DilloHtml *html, DilloUrl *url, const char *buf,
    importDepth--;
 }
 
+/**
+ * \brief Parse a linked stylesheet, or take it from the stylesheets parsed
+ *    for earlier pages, if it has not changed since.
+ */
+void StyleEngine::parseStyleSheet (DilloHtml *html, DilloUrl *url,
+                                   const char *buf, int buflen) {
+   CssParsedStyleSheet *sheet;
+
+   if (importDepth > 10) { // avoid looping with recursive @import directives
+      MSG_WARN("Maximum depth of CSS @import reached--ignoring stylesheet.\n");
+      return;
+   }
+
+   sheet = parsedStyleSheet (html, url, buf, buflen, CSS_ORIGIN_AUTHOR);
+
+   importDepth++;
+   for (int i = 0; i < sheet->numImports (); i++)
+      a_Html_load_stylesheet (html, sheet->getImport (i));
+   sheet->addTo (cssContext);
+   importDepth--;
+
+   sheet->unref ();
+}
+
+/**
+ * \brief Return the parsed stylesheet for \em buf (the caller has to unref
+ *    it), parsing it only when it is not in the cache.
+ */
+CssParsedStyleSheet *StyleEngine::parsedStyleSheet (DilloHtml *html,
+                                                    const DilloUrl *url,
+                                                    const char *buf,
+                                                    int buflen,
+                                                    CssOrigin origin) {
+   uint_t hash = hashStyleSheet (buf, buflen);
+   ParsedStyleSheet *p;
+
+   if (!parsedStyleSheets)
+      parsedStyleSheets = dList_new (16);
+
+   for (int i = 0; (p = (ParsedStyleSheet *)
+                         dList_nth_data (parsedStyleSheets, i)); ) {
+      bool sameUrl = url ? (p->url && !a_Url_cmp (url, p->url)) : !p->url;
+
+      if (sameUrl && p->origin == origin) {
+         if (p->size == buflen && p->hash == hash) {
+            dList_remove (parsedStyleSheets, p);
+            dList_prepend (parsedStyleSheets, p);
+            p->sheet->ref ();
+            return p->sheet;
+         }
+         // this one is outdated
+         dList_remove (parsedStyleSheets, p);
+         freeParsedStyleSheet (p);
+      } else {
+         i++;
+      }
+   }
+
+   p = dNew (ParsedStyleSheet, 1);
+   p->url = url ? a_Url_dup (url) : NULL;
+   p->origin = origin;
+   p->size = buflen;
+   p->hash = hash;
+   p->sheet = new CssParsedStyleSheet ();
+   p->sheet->ref ();
+   CssParser::parse (html, url, p->sheet, buf, buflen, origin);
+
+   dList_prepend (parsedStyleSheets, p);
+   parsedStyleSheetsSize += buflen;
+   while (parsedStyleSheetsSize > PARSED_STYLESHEETS_MAX_SIZE &&
+          dList_length (parsedStyleSheets) > 1) {
+      ParsedStyleSheet *last = (ParsedStyleSheet *)
+         dList_nth_data (parsedStyleSheets,
+                         dList_length (parsedStyleSheets) - 1);
+      dList_remove (parsedStyleSheets, last);
+      freeParsedStyleSheet (last);
+   }
+
+   p->sheet->ref ();
+   return p->sheet;
+}
+
+/**
+ * \brief Free the stylesheets kept across pages.
+ */
+void StyleEngine::freeall () {
+   ParsedStyleSheet *p;
+
+   if (parsedStyleSheets) {
+      while ((p = (ParsedStyleSheet *) dList_nth_data (parsedStyleSheets, 0))) {
+         dList_remove (parsedStyleSheets, p);
+         freeParsedStyleSheet (p);
+      }
+      dList_free (parsedStyleSheets);
+      parsedStyleSheets = NULL;
+   }
+}
+
 /**
  * \brief Create the user agent style.
  *
@@ -1053,7 +1809,11 @@ void StyleEngine::buildUserStyle () {
    char *filename = dStrconcat(dGethomedir(), "/.dillo/style.css", NULL);
 
    if ((style = a_Misc_file2dstr(filename))) {
-      CssParser::parse (NULL,NULL,cssContext,style->str, style->len,CSS_ORIGIN_USER);
+      CssParsedStyleSheet *sheet =
+         parsedStyleSheet (NULL, NULL, style->str, style->len, CSS_ORIGIN_USER);
+
+      sheet->addTo (cssContext);
+      sheet->unref ();
       dStr_free (style, 1);
    }
    dFree (filename);
@@ -29,21 +29,88 @@ class StyleEngine {
          bool inheritBackgroundColor;
          bool displayNone;
          DoctreeNode *doctreeNode;
+         int logIndex;
       };
 
+      /* The styles of an element are logged while stylesheets are
+       * pending, so that they can be computed again when these arrive.
+       */
+      enum { LOG_STYLE, LOG_WORD_STYLE, LOG_BACKGROUND_STYLE, LOG_ROLES };
+
+      struct LoggedElement {
+         DoctreeNode *doctreeNode;
+         int parent; // index in the log, or -1 for the bottom of the stack
+         int node;   // index in the stack while open, or -1
+         CssPropertyList *styleAttrProperties;
+         CssPropertyList *styleAttrPropertiesImportant;
+         CssPropertyList *nonCssProperties;
+         bool inheritBackgroundColor;
+         bool displayNone;
+         dw::core::style::Style *style[LOG_ROLES];
+         dw::core::style::Style *newStyle[LOG_ROLES];
+      };
+
+      struct PendingStyleSheet {
+         DilloUrl *url;
+         int pos, posEnd; // reserved rule positions, see CssContext
+         bool parsed;
+      };
+
+      class RestyleMap;
+
+      /* A style computed for a recent element, which its siblings may share
+       * (see style0 ()).
+       */
+      struct SharedStyle {
+         DoctreeNode *parent, *doctreeNode;
+         CssPropertyList *nonCssProperties; // a copy
+         dw::core::style::Style *parentStyle, *style;
+         bool parentInheritBackgroundColor;
+         int numRules;
+      };
+
+      enum { SHARED_STYLES = 8, SHARING_MISSES = 64 };
+
       dw::core::Layout *layout;
       lout::misc::SimpleVector <Node> *stack;
+      lout::misc::SimpleVector <Node> *liveStack; // while restyling
       CssContext *cssContext;
       Doctree *doctree;
       int importDepth;
       float dpmm;
       DilloUrl *pageUrl, *baseUrl;
+      lout::misc::SimpleVector <LoggedElement> *log;
+      lout::misc::SimpleVector <PendingStyleSheet> *pendingStyleSheets;
+      bool logIncomplete, restyling;
+      SharedStyle sharedStyles[SHARED_STYLES];
+      int nextSharedStyle, sharingMisses;
+
+#ifdef STYLEENGINE_BENCH
+      static bool styleSharing;
+      static int numStyles, numSharedStyles;
+#else
+      static const bool styleSharing = true;
+#endif
 
       void stackPush ();
       void stackPop ();
       void buildUserStyle ();
+      static CssParsedStyleSheet *parsedStyleSheet (DilloHtml *html,
+                                                    const DilloUrl *url,
+                                                    const char *buf,
+                                                    int buflen,
+                                                    CssOrigin origin);
       dw::core::style::Style *style0 (int i, BrowserWindow *bw);
       dw::core::style::Style *wordStyle0 (BrowserWindow *bw);
+      bool canShareStyle (int i);
+      dw::core::style::Style *findSharedStyle (int i);
+      void addSharedStyle (int i);
+      void logElement (int i);
+      int logTag (int i, int role);
+      void logStyle (int i, int role, dw::core::style::Style *style);
+      void freeLog ();
+      void restyleLogged (int e, bool keepLog, BrowserWindow *bw);
+      void setLoggedBackground ();
       inline void setNonCssHint(CssPropertyName name, CssValueType type,
                                 CssPropertyValue value) {
          Node *n = stack->getRef (stack->size () - 1);
@@ -67,6 +134,13 @@ class StyleEngine {
 
    public:
       static void init ();
+      static void freeall ();
+#ifdef STYLEENGINE_BENCH
+      /* for test/styleengine_bench.cc only */
+      static void setStyleSharing (bool styleSharing)
+      { StyleEngine::styleSharing = styleSharing; }
+      static void getStyleSharingStats (int *numStyles, int *numSharedStyles);
+#endif
 
       StyleEngine (dw::core::Layout *layout,
                    const DilloUrl *pageUrl, const DilloUrl *baseUrl);
@@ -74,6 +148,8 @@ class StyleEngine {
 
       void parse (DilloHtml *html, DilloUrl *url, const char *buf, int buflen,
                   CssOrigin origin);
+      void parseStyleSheet (DilloHtml *html, DilloUrl *url, const char *buf,
+                            int buflen);
       void startElement (int tag, BrowserWindow *bw);
       void startElement (const char *tagname, BrowserWindow *bw);
       void setId (const char *id);
@@ -98,6 +174,9 @@ class StyleEngine {
       void inheritNonCssHints ();
       void clearNonCssHints ();
       void restyle (BrowserWindow *bw);
+      void styleSheetPending (const DilloUrl *url, bool contentStarted);
+      bool applyPendingStyleSheets (DilloHtml *html, BrowserWindow *bw,
+                                    dw::core::Widget *top);
       void inheritBackgroundColor (); /* \todo get rid of this somehow */
       dw::core::style::Style *backgroundStyle (BrowserWindow *bw);
       dw::core::style::Color *backgroundColor ();
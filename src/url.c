@@ -501,6 +501,34 @@ int a_Url_cmp(const DilloUrl *A, const DilloUrl *B)
    return st;
 }
 
+/*
+ * Add a string to an FNV-1a hash value, optionally ignoring ASCII case.
+ */
+static uint_t Url_hash_str(uint_t h, const char *s, bool_t icase)
+{
+   for ( ; s && *s; s++) {
+      h ^= (uchar_t)(icase ? D_ASCII_TOLOWER(*s) : *s);
+      h *= 16777619u;
+   }
+   return h ^ 0xff;   /* field separator */
+}
+
+/*
+ * Hash a URL, consistently with a_Url_cmp() (i.e., equal URLs give equal
+ * hash values). POST data is not hashed, because a_Url_cmp() considers
+ * it only when both URLs have it.
+ */
+uint_t a_Url_hash(const DilloUrl *u)
+{
+   uint_t h = 2166136261u;
+
+   h = Url_hash_str(h, u->authority, TRUE);
+   h = Url_hash_str(h, u->path ? u->path + (*u->path == '/') : NULL, FALSE);
+   h = Url_hash_str(h, u->query, FALSE);
+   h = Url_hash_str(h, u->scheme, TRUE);
+   return h;
+}
+
 /*
  * Set DilloUrl flags
  */
@@ -0,0 +1,649 @@
+/*
+ * Dillo cache test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Drives src/cache.c the way the HTTP module does, with canned responses,
+ * and checks what its clients get. The rest of dillo is stubbed out below.
+ *
+ * The cases covered are revalidation with cache_single_copy on: a "304 Not
+ * Modified" for an entry that only kept its UTF-8 copy, and a stale entry
+ * whose data is still held by somebody. Then eviction over cache_max_size,
+ * lookups after the hash table has grown, and the disk cache, in a
+ * temporary $HOME: sharing it with another dillo process, its size limit,
+ * and a page revalidated after a restart.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../src/msg.h"
+#include "../src/IO/IO.h"
+#include "../src/web.hh"
+#include "../src/cache.h"
+#include "../src/dicache.h"
+#include "../src/timeout.hh"
+#include "../src/uicmd.hh"
+#include "../src/misc.h"
+#include "../src/md5.h"
+
+DilloPrefs prefs;
+const char *AboutSplash = "<html><body>splash</body></html>";
+
+static uint_t failed = 0;
+static uint_t passed = 0;
+
+/* Latin-1 page, and what the client must get (it's given UTF-8) */
+static const char body[] =
+   "<html><head><title>caf\xe9</title></head><body>Caf\xe9 cr\xe8me."
+   "</body></html>\n";
+static const char body_utf8[] =
+   "<html><head><title>caf\xc3\xa9</title></head><body>Caf\xc3\xa9 "
+   "cr\xc3\xa8me.</body></html>\n";
+
+/* What a client got */
+typedef struct {
+   Dstr *data;
+   bool_t closed;
+} Received;
+
+static Received received;
+
+/* Stubs ------------------------------------------------------------------ */
+
+static TimeoutCb_t timeout_cb[8];
+static void *timeout_data[8];
+static int timeouts = 0;
+
+void a_Timeout_add(float t, TimeoutCb_t cb, void *cbdata)
+{
+   if (timeouts < 8) {
+      timeout_cb[timeouts] = cb;
+      timeout_data[timeouts++] = cbdata;
+   }
+}
+
+void a_Timeout_remove()
+{
+}
+
+/*
+ * Run what would have been run from the main cycle.
+ */
+static void run_timeouts(void)
+{
+   while (timeouts > 0) {
+      TimeoutCb_t cb = timeout_cb[0];
+      void *data = timeout_data[0];
+
+      memmove(timeout_cb, timeout_cb + 1, --timeouts * sizeof(*timeout_cb));
+      memmove(timeout_data, timeout_data + 1,
+              timeouts * sizeof(*timeout_data));
+      cb(data);
+   }
+}
+
+static void client_cb(int Op, CacheClient_t *Client)
+{
+   Received *r = Client->CbData;
+
+   if (Op == CA_Send) {
+      dStr_truncate(r->data, 0);
+      dStr_append_l(r->data, Client->Buf, Client->BufSize);
+   } else {
+      r->closed = TRUE;
+   }
+}
+
+int a_Web_dispatch_by_type(const char *Type, DilloWeb *web,
+                           CA_Callback_t *Call, void **Data)
+{
+   *Call = client_cb;
+   *Data = &received;
+   return 0;
+}
+
+void a_Web_free(DilloWeb *web)
+{
+   a_Url_free(web->url);
+   dFree(web);
+}
+
+uint_t a_Utf8_end_of_char(const char *str, uint_t i)
+{
+   while (((unsigned char)str[i + 1] & 0xc0) == 0x80)
+      i++;
+   return i;
+}
+
+uint_t a_Utf8_decode(const char *str, const char *end, int *len)
+{
+   *len = 1;
+   return (unsigned char)*str;
+}
+
+int a_Utf8_test(const char *src, unsigned int srclen)
+{
+   unsigned int i;
+
+   for (i = 0; i < srclen; i++)
+      if ((unsigned char)src[i] >= 0x80)
+         return 0;
+   return 1;
+}
+
+bool_t a_Utf8_combining_char(int unicode)
+{
+   return FALSE;
+}
+
+int a_Auth_do_auth(Dlist *auth_string, const DilloUrl *url) { return 0; }
+int a_Bw_remove_client(BrowserWindow *bw, int ClientKey) { return 0; }
+void a_Bw_close_client(BrowserWindow *bw, int ClientKey) {}
+void a_Capi_conn_abort_by_url(const DilloUrl *url) {}
+void a_Cookies_set(Dlist *cookie_string, const DilloUrl *set_url,
+                   const char *server_date) {}
+DICacheEntry *a_Dicache_get_entry(const DilloUrl *Url, int version)
+{
+   return NULL;
+}
+void a_Dicache_invalidate_entry(const DilloUrl *Url) {}
+void a_Dicache_unref(const DilloUrl *Url, int version) {}
+int a_Dicache_stop_client(int Key) { return 0; }
+void a_Dicache_cleanup(void) {}
+bool_t a_Domain_permit(const DilloUrl *source, const DilloUrl *dest)
+{
+   return TRUE;
+}
+void a_Hsts_set(const char *header, const DilloUrl *url) {}
+bool_t a_Hsts_require_https(const char *host) { return FALSE; }
+void a_Nav_push(BrowserWindow *bw, const DilloUrl *url,
+                const DilloUrl *requester) {}
+void a_Nav_reload(BrowserWindow *bw) {}
+void a_Nav_cancel_expect_if_eq(BrowserWindow *bw, const DilloUrl *url) {}
+void a_UIcmd_save_link(BrowserWindow *bw, const DilloUrl *url) {}
+void a_UIcmd_set_page_prog(BrowserWindow *bw, size_t nbytes, int cmd) {}
+void a_UIcmd_set_msg(BrowserWindow *bw, const char *format, ...) {}
+
+/* Tests ------------------------------------------------------------------ */
+
+/*
+ * Open 'url' as a new client, feed 'response' to the cache (if any) and
+ * finish the transfer.
+ */
+static void load(const char *url, int flags, const char *response)
+{
+   DilloWeb *web = dNew0(DilloWeb, 1);
+   DilloUrl *u = a_Url_new(url, NULL);
+
+   a_Url_set_flags(u, URL_FLAGS(u) | flags);
+   web->url = a_Url_dup(u);   /* the cache frees 'web' when it's done */
+   dStr_truncate(received.data, 0);
+   received.closed = FALSE;
+
+   a_Cache_open_url(web, NULL, NULL);
+   if (response) {
+      a_Cache_process_dbuf(IORead, response, strlen(response), u, NULL);
+      a_Cache_process_dbuf(IOClose, NULL, 0, u, NULL);
+   }
+   run_timeouts();
+   a_Url_free(u);
+}
+
+static void expect(int lineno, const char *what, const char *text)
+{
+   if (received.closed && !strcmp(received.data->str, text)) {
+      passed++;
+   } else {
+      MSG("line %d: %s: got %s\"%s\"\n", lineno, what,
+          received.closed ? "" : "(unfinished) ", received.data->str);
+      failed++;
+   }
+}
+
+static void check(int lineno, const char *what, bool_t ok)
+{
+   if (ok) {
+      passed++;
+   } else {
+      MSG("line %d: %s: failed\n", lineno, what);
+      failed++;
+   }
+}
+
+/*
+ * A page that has to be revalidated on every use.
+ */
+static void response_200(Dstr *ds)
+{
+   dStr_sprintf(ds, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/html; charset=iso-8859-1\r\n"
+                    "Content-Length: %d\r\n"
+                    "ETag: \"v1\"\r\n"
+                    "Cache-Control: max-age=0\r\n"
+                    "\r\n%s", (int)strlen(body), body);
+}
+
+/*
+ * A page that can be used for an hour.
+ */
+static void response_fresh(Dstr *ds)
+{
+   dStr_sprintf(ds, "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: text/html; charset=iso-8859-1\r\n"
+                    "Content-Length: %d\r\n"
+                    "Cache-Control: max-age=3600\r\n"
+                    "\r\n%s", (int)strlen(body), body);
+}
+
+static const char response_304[] =
+   "HTTP/1.1 304 Not Modified\r\n"
+   "ETag: \"v1\"\r\n"
+   "\r\n";
+
+static void test_not_modified(void)
+{
+   const char *url = "http://example.org/page.html";
+   Dstr *ok = dStr_new("");
+
+   response_200(ok);
+   load(url, 0, ok->str);
+   expect(__LINE__, "200", body_utf8);
+
+   /* the raw data was dropped by now; revalidate */
+   load(url, URL_E2EQuery, response_304);
+   expect(__LINE__, "304", body_utf8);
+
+   /* and served from the cache afterwards */
+   load(url, 0, NULL);
+   expect(__LINE__, "cached after 304", body_utf8);
+   load(url, 0, NULL);
+   expect(__LINE__, "cached again", body_utf8);
+
+   dStr_free(ok, 1);
+}
+
+/*
+ * A stale entry whose data is in use is not swapped out for revalidation
+ * until it's released.
+ */
+static void test_stale_in_use(void)
+{
+   const char *url = "http://example.org/held.html";
+   DilloUrl *u = a_Url_new(url, NULL);
+   Dstr *ok = dStr_new("");
+   char *buf;
+   int size;
+
+   response_200(ok);
+   load(url, 0, ok->str);
+   expect(__LINE__, "200", body_utf8);
+
+   a_Cache_get_buf(u, &buf, &size);
+   if (a_Cache_get_flags(u) & CA_Stale) {
+      load(url, 0, NULL);
+      expect(__LINE__, "stale and held", body_utf8);
+      if (size == strlen(body_utf8) && !memcmp(buf, body_utf8, size)) {
+         passed++;
+      } else {
+         MSG("line %d: held buffer changed\n", __LINE__);
+         failed++;
+      }
+   } else {
+      MSG("line %d: entry is not stale\n", __LINE__);
+      failed++;
+   }
+   a_Cache_unref_buf(u);
+
+   load(url, 0, response_304);
+   expect(__LINE__, "304 after release", body_utf8);
+
+   dStr_free(ok, 1);
+   a_Url_free(u);
+}
+
+/*
+ * Over cache_max_size, the least recently used entries are evicted, but
+ * not those whose data is held or that have clients.
+ */
+static void test_evict(void)
+{
+   const char *held = "http://example.org/held-fresh.html",
+              *waiting = "http://example.org/waiting.html",
+              *old1 = "http://example.org/old1.html",
+              *old2 = "http://example.org/old2.html",
+              *new1 = "http://example.org/new1.html";
+   DilloUrl *u_held = a_Url_new(held, NULL), *u_waiting;
+   uint_t hits, misses, evictions, evictions0;
+   int size, size1;
+   Dstr *ok = dStr_new("");
+   char *buf;
+
+   a_Cache_init();
+   response_fresh(ok);
+   load(held, 0, ok->str);
+   a_Cache_get_buf(u_held, &buf, &size);
+   load(waiting, 0, NULL);                  /* its response is on the way */
+   load(old1, 0, ok->str);
+   a_Cache_get_stats(&hits, &misses, &evictions, &size1);
+   load(old2, 0, ok->str);
+   load(old1, 0, NULL);                     /* now old2 is the LRU one */
+   expect(__LINE__, "old1 from the cache", body_utf8);
+   a_Cache_get_stats(&hits, &misses, &evictions0, &size);
+
+   /* room for half a page more */
+   prefs.cache_max_size = size + (size - size1) / 2;
+   load(new1, 0, ok->str);
+   expect(__LINE__, "new1", body_utf8);
+   a_Cache_get_stats(&hits, &misses, &evictions, &size);
+   check(__LINE__, "one eviction", evictions == evictions0 + 1);
+   check(__LINE__, "within budget", size <= prefs.cache_max_size);
+   check(__LINE__, "held entry kept", a_Cache_get_flags(u_held) != 0);
+   {
+      DilloUrl *u = a_Url_new(old2, NULL);
+
+      check(__LINE__, "old2 evicted", a_Cache_get_flags(u) == 0);
+      a_Url_free(u);
+      u = a_Url_new(old1, NULL);
+      check(__LINE__, "old1 kept", a_Cache_get_flags(u) != 0);
+      a_Url_free(u);
+   }
+   prefs.cache_max_size = 0;
+
+   /* the client of the unfinished entry still gets its page */
+   u_waiting = a_Url_new(waiting, NULL);
+   check(__LINE__, "unfinished entry kept",
+         a_Cache_get_flags(u_waiting) & CA_InProgress);
+   received.closed = FALSE;
+   a_Cache_process_dbuf(IORead, ok->str, ok->len, u_waiting, NULL);
+   a_Cache_process_dbuf(IOClose, NULL, 0, u_waiting, NULL);
+   run_timeouts();
+   expect(__LINE__, "waiting client served", body_utf8);
+   a_Url_free(u_waiting);
+
+   a_Cache_unref_buf(u_held);
+   a_Url_free(u_held);
+   a_Cache_freeall();
+   dStr_free(ok, 1);
+}
+
+/*
+ * Entries are still found after the hash table has grown (twice: it starts
+ * with 256 buckets).
+ */
+static void test_hash_grow(void)
+{
+   const int n = 600;
+   uint_t hits0, hits, misses, evictions;
+   int i, size, found = 0, served = 0;
+   char url[64];
+   Dstr *ok = dStr_new("");
+   DilloUrl *u;
+
+   a_Cache_init();
+   response_fresh(ok);
+   for (i = 0; i < n; i++) {
+      snprintf(url, sizeof(url), "http://example.org/%d.html", i);
+      load(url, 0, ok->str);
+   }
+   a_Cache_get_stats(&hits0, &misses, &evictions, &size);
+   for (i = 0; i < n; i++) {
+      snprintf(url, sizeof(url), "http://example.org/%d.html", i);
+      u = a_Url_new(url, NULL);
+      found += (a_Cache_get_flags(u) & CA_GotHeader) != 0;
+      a_Url_free(u);
+      load(url, 0, NULL);
+      served += received.closed && !strcmp(received.data->str, body_utf8);
+   }
+   a_Cache_get_stats(&hits, &misses, &evictions, &size);
+   check(__LINE__, "all entries found", found == n);
+   check(__LINE__, "all served from the cache",
+         served == n && hits == hits0 + n);
+
+   u = a_Url_new("http://example.org/600.html", NULL);
+   check(__LINE__, "not cached", a_Cache_get_flags(u) == 0);
+   a_Url_free(u);
+   a_Cache_freeall();
+   dStr_free(ok, 1);
+}
+
+/* The disk cache ---------------------------------------------------------- */
+
+static char *disk_dir;
+
+/*
+ * Return: the name of the body file for 'url' in the disk cache (to be
+ * freed).
+ */
+static char *disk_file(const char *url)
+{
+   md5_state_t state;
+   md5_byte_t digest[16];
+   char key[33];
+   int i;
+
+   md5_init(&state);
+   md5_append(&state, (const md5_byte_t *)url, strlen(url));
+   md5_finish(&state, digest);
+   for (i = 0; i < 16; i++)
+      snprintf(key + 2 * i, 3, "%02x", digest[i]);
+   return dStrconcat(disk_dir, "/", key, NULL);
+}
+
+static bool_t disk_has_file(const char *filename)
+{
+   struct stat sb;
+
+   return stat(filename, &sb) == 0;
+}
+
+static bool_t disk_has_body(const char *url)
+{
+   char *filename = disk_file(url);
+   bool_t ret = disk_has_file(filename);
+
+   dFree(filename);
+   return ret;
+}
+
+static bool_t disk_index_has(const char *url)
+{
+   char *filename = dStrconcat(disk_dir, "/index", NULL);
+   Dstr *index = a_Misc_file2dstr(filename);
+   char *line = dStrconcat("\t", url, "\n", NULL);
+   bool_t ret = index && strstr(index->str, line);
+
+   dStr_free(index, 1);
+   dFree(line);
+   dFree(filename);
+   return ret;
+}
+
+/*
+ * Is the body file for 'url' mapped into memory?
+ */
+static bool_t disk_body_mapped(const char *url)
+{
+   char *filename = disk_file(url), *line = dStrconcat(filename, "\n", NULL);
+   Dstr *maps = a_Misc_file2dstr("/proc/self/maps");
+   bool_t ret = maps && strstr(maps->str, line);
+
+   dStr_free(maps, 1);
+   dFree(line);
+   dFree(filename);
+   return ret;
+}
+
+/*
+ * Another dillo process stores a page and leaves a stray body behind while
+ * this one runs; none of its entries may be lost when this one exits.
+ */
+static void test_disk_shared(void)
+{
+   const char *mine = "http://example.org/mine.html",
+              *theirs = "http://example.org/theirs.html";
+   char *filename, *body_file, *stray = dStrconcat(disk_dir, "/"
+                                       "0123456789abcdef0123456789abcdef",
+                                       NULL);
+   Dstr *ok = dStr_new("");
+   FILE *fp;
+
+   a_Cache_init();
+   response_fresh(ok);
+   load(mine, 0, ok->str);
+   expect(__LINE__, "stored", body_utf8);
+   check(__LINE__, "my body on disk", disk_has_body(mine));
+
+   /* the other process */
+   body_file = disk_file(theirs);
+   if ((fp = fopen(body_file, "w"))) {
+      fwrite(body, sizeof(body), 1, fp);   /* with the NUL */
+      fclose(fp);
+   }
+   filename = dStrconcat(disk_dir, "/index", NULL);
+   if ((fp = fopen(filename, "a"))) {
+      fprintf(fp, "%s\t%d\t%ld\t%ld\t-\t-\ttext/html; charset=iso-8859-1"
+                  "\t%s\n", strrchr(body_file, '/') + 1, (int)strlen(body),
+              (long)time(NULL) + 3600, (long)time(NULL), theirs);
+      fclose(fp);
+   }
+   dFree(filename);
+   dFree(body_file);
+   if ((fp = fopen(stray, "w")))
+      fclose(fp);
+
+   a_Cache_freeall();
+   check(__LINE__, "my entry kept", disk_index_has(mine));
+   check(__LINE__, "their entry kept", disk_index_has(theirs));
+   check(__LINE__, "their body kept", disk_has_body(theirs));
+   check(__LINE__, "stray body deleted", !disk_has_file(stray));
+
+   /* and theirs is there for the next run */
+   a_Cache_init();
+   load(theirs, 0, NULL);
+   expect(__LINE__, "theirs from disk", body_utf8);
+   a_Cache_freeall();
+
+   dStr_free(ok, 1);
+   dFree(stray);
+}
+
+/*
+ * cache_disk_max_size is kept while storing, not only at exit.
+ */
+static void test_disk_limit(void)
+{
+   const char *first = "http://example.org/first.html",
+              *second = "http://example.org/second.html";
+   Dstr *ok = dStr_new("");
+
+   prefs.cache_disk_max_size = strlen(body) * 3 / 2;
+   a_Cache_init();
+   response_fresh(ok);
+   load(first, 0, ok->str);
+   load(second, 0, ok->str);
+   check(__LINE__, "older body dropped", !disk_has_body(first));
+   check(__LINE__, "newer body kept", disk_has_body(second));
+   a_Cache_freeall();
+   check(__LINE__, "older entry not in the index", !disk_index_has(first));
+   check(__LINE__, "newer entry in the index", disk_index_has(second));
+   prefs.cache_disk_max_size = 0;
+
+   dStr_free(ok, 1);
+}
+
+/*
+ * A page stored on disk is there after a restart, with its body mapped
+ * from the file, and a "304 Not Modified" revalidates it.
+ */
+static void test_disk_restart(void)
+{
+   const char *url = "http://example.org/restart.html";
+   DilloUrl *u = a_Url_new(url, NULL);
+   Dstr *ok = dStr_new("");
+
+   a_Cache_init();
+   response_200(ok);
+   load(url, 0, ok->str);
+   expect(__LINE__, "stored", body_utf8);
+   a_Cache_freeall();
+   check(__LINE__, "in the index", disk_index_has(url));
+
+   /* the next run */
+   a_Cache_init();
+   check(__LINE__, "loaded and stale",
+         (a_Cache_get_flags(u) & CA_Stale) != 0);
+   check(__LINE__, "body mapped", disk_body_mapped(url));
+   load(url, 0, response_304);
+   expect(__LINE__, "304 after restart", body_utf8);
+   check(__LINE__, "still mapped", disk_body_mapped(url));
+   load(url, 0, NULL);
+   expect(__LINE__, "cached after 304", body_utf8);
+   a_Cache_freeall();
+   check(__LINE__, "unmapped", !disk_body_mapped(url));
+   check(__LINE__, "still in the index", disk_index_has(url));
+   check(__LINE__, "body kept", disk_has_body(url));
+
+   a_Url_free(u);
+   dStr_free(ok, 1);
+}
+
+int main(void)
+{
+   char home[] = "/tmp/cache_test.XXXXXX";
+   char *dir, *cmd;
+
+   prefs.show_msg = TRUE;
+   prefs.cache_single_copy = TRUE;
+   received.data = dStr_new("");
+
+   a_Cache_init();
+   test_not_modified();
+   test_stale_in_use();
+   a_Cache_freeall();
+   test_evict();
+   test_hash_grow();
+
+   /* the disk cache goes to a fresh $HOME */
+   if (!mkdtemp(home)) {
+      perror(home);
+      return 1;
+   }
+   setenv("HOME", home, 1);
+   disk_dir = dStrconcat(home, "/.dillo/cache", NULL);
+   dir = dStrconcat(home, "/.dillo", NULL);
+   mkdir(dir, 0700);
+   dFree(dir);
+   prefs.cache_disk = TRUE;
+   test_disk_shared();
+   test_disk_limit();
+   test_disk_restart();
+   prefs.cache_disk = FALSE;
+   cmd = dStrconcat("rm -rf ", home, NULL);
+   if (system(cmd) != 0)
+      MSG("can't remove %s\n", home);
+   dFree(cmd);
+   dFree(disk_dir);
+
+   dStr_free(received.data, 1);
+   MSG("TESTS: passed: %u failed: %u\n", passed, failed);
+
+   return (failed) ? 1 : 0;
+}
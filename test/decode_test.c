@@ -0,0 +1,244 @@
+/*
+ * Dillo content decoders test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Feeds canned compressed bodies to src/decode.c, both in one piece and
+ * in small pieces (as they may come from the network), and checks that
+ * the original text comes out. Chunked bodies are also checked to stop
+ * right where the next response on the connection begins.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../src/decode.h"
+#include "../src/msg.h"
+
+DilloPrefs prefs;  /* for MSG() */
+
+static uint_t failed = 0;
+static uint_t passed = 0;
+
+/* Every fixture is this line, 400 times */
+static const char line[] =
+   "<p>The quick brown fox jumps over the lazy dog.</p>\n";
+#define LINES 400
+
+/* gzip */
+static const unsigned char gzip_data[] = {
+   0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03, 0xed, 0xcb,
+   0xcb, 0x11, 0x82, 0x30, 0x14, 0x00, 0xc0, 0xbb, 0x55, 0xbc, 0x0a, 0xa4,
+   0x81, 0x0c, 0x55, 0xd8, 0x00, 0x22, 0x2a, 0x20, 0x24, 0xa2, 0xf8, 0xab,
+   0x5e, 0xab, 0xf0, 0xb4, 0xe7, 0x9d, 0x4d, 0xa5, 0xde, 0x9d, 0xbb, 0xb8,
+   0xae, 0x7d, 0x3b, 0xc6, 0x7e, 0xc9, 0xcf, 0x39, 0x8e, 0xf9, 0x15, 0xc3,
+   0x3a, 0x95, 0x5b, 0xe4, 0x47, 0xb7, 0xc4, 0xfd, 0xc7, 0x97, 0xe6, 0xf3,
+   0x8e, 0x43, 0x3e, 0x6d, 0x53, 0x55, 0xea, 0x4d, 0x72, 0x1c, 0xc7, 0x71,
+   0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71,
+   0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71,
+   0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71,
+   0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71,
+   0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0xf9, 0xe3, 0xf9, 0x02,
+   0x27, 0xe0, 0x89, 0x0d, 0x40, 0x51, 0x00, 0x00,
+};
+
+/* deflate (with the zlib wrapper) */
+static const unsigned char deflate_data[] = {
+   0x78, 0xda, 0xed, 0xcb, 0xcb, 0x11, 0x82, 0x30, 0x14, 0x00, 0xc0, 0xbb,
+   0x55, 0xbc, 0x0a, 0xa4, 0x81, 0x0c, 0x55, 0xd8, 0x00, 0x22, 0x2a, 0x20,
+   0x24, 0xa2, 0xf8, 0xab, 0x5e, 0xab, 0xf0, 0xb4, 0xe7, 0x9d, 0x4d, 0xa5,
+   0xde, 0x9d, 0xbb, 0xb8, 0xae, 0x7d, 0x3b, 0xc6, 0x7e, 0xc9, 0xcf, 0x39,
+   0x8e, 0xf9, 0x15, 0xc3, 0x3a, 0x95, 0x5b, 0xe4, 0x47, 0xb7, 0xc4, 0xfd,
+   0xc7, 0x97, 0xe6, 0xf3, 0x8e, 0x43, 0x3e, 0x6d, 0x53, 0x55, 0xea, 0x4d,
+   0x72, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7,
+   0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7,
+   0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7,
+   0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7,
+   0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7,
+   0xf9, 0xe3, 0xf9, 0x02, 0xcb, 0x4e, 0x40, 0xe5,
+};
+
+/* raw deflate, as sent by some broken servers */
+static const unsigned char raw_deflate_data[] = {
+   0xed, 0xcb, 0xcb, 0x11, 0x82, 0x30, 0x14, 0x00, 0xc0, 0xbb, 0x55, 0xbc,
+   0x0a, 0xa4, 0x81, 0x0c, 0x55, 0xd8, 0x00, 0x22, 0x2a, 0x20, 0x24, 0xa2,
+   0xf8, 0xab, 0x5e, 0xab, 0xf0, 0xb4, 0xe7, 0x9d, 0x4d, 0xa5, 0xde, 0x9d,
+   0xbb, 0xb8, 0xae, 0x7d, 0x3b, 0xc6, 0x7e, 0xc9, 0xcf, 0x39, 0x8e, 0xf9,
+   0x15, 0xc3, 0x3a, 0x95, 0x5b, 0xe4, 0x47, 0xb7, 0xc4, 0xfd, 0xc7, 0x97,
+   0xe6, 0xf3, 0x8e, 0x43, 0x3e, 0x6d, 0x53, 0x55, 0xea, 0x4d, 0x72, 0x1c,
+   0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c,
+   0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c,
+   0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c,
+   0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c,
+   0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0x71, 0x1c, 0xc7, 0xf9, 0xe3,
+   0xf9, 0x02,
+};
+
+#ifdef ENABLE_BROTLI
+/* br */
+static const unsigned char brotli_data[] = {
+   0x1b, 0x3f, 0x51, 0x50, 0x2d, 0x12, 0xec, 0x58, 0x3a, 0xc0, 0x02, 0x63,
+   0xd1, 0xc9, 0x47, 0xa8, 0xf4, 0xe6, 0xa1, 0x42, 0x83, 0x93, 0x64, 0x66,
+   0x6c, 0x79, 0x86, 0xa7, 0x97, 0x6f, 0x61, 0x3e, 0x0d, 0xe2, 0x32, 0x97,
+   0x17, 0x36, 0xe0, 0xc0, 0x21, 0x81, 0x7c, 0x1d, 0x6c, 0x02, 0xb9, 0xa4,
+   0x10, 0xfb, 0x07, 0x49, 0x0d, 0x51, 0x39, 0xdb, 0x42, 0xf4, 0x4b, 0x62,
+   0x1d, 0xb7, 0xff, 0xa1, 0x9d, 0xbe, 0x31, 0x12, 0x00, 0x00,
+};
+#endif
+
+#ifdef ENABLE_ZSTD
+/* zstd */
+static const unsigned char zstd_data[] = {
+   0x28, 0xb5, 0x2f, 0xfd, 0x64, 0x40, 0x50, 0xf5, 0x01, 0x00, 0x44, 0x03,
+   0x3c, 0x70, 0x3e, 0x54, 0x68, 0x65, 0x20, 0x71, 0x75, 0x69, 0x63, 0x6b,
+   0x20, 0x62, 0x72, 0x6f, 0x77, 0x6e, 0x20, 0x66, 0x6f, 0x78, 0x20, 0x6a,
+   0x75, 0x6d, 0x70, 0x73, 0x20, 0x6f, 0x76, 0x65, 0x72, 0x20, 0x74, 0x68,
+   0x65, 0x20, 0x6c, 0x61, 0x7a, 0x79, 0x20, 0x64, 0x6f, 0x67, 0x2e, 0x3c,
+   0x2f, 0x70, 0x3e, 0x0a, 0x01, 0x00, 0x94, 0x10, 0xdd, 0x5d, 0x41, 0x01,
+   0x0f, 0x8d, 0x01, 0x4c,
+};
+#endif
+
+static void expect(int lineno, const char *format, const unsigned char *data,
+                   int len, int piece)
+{
+   Dstr *text = dStr_new(""), *out = dStr_new("");
+   Decode *dc = a_Decode_content_init(format);
+   int i, n;
+
+   for (i = 0; i < LINES; i++)
+      dStr_append(text, line);
+
+   if (dc) {
+      for (i = 0; i < len; i += n) {
+         n = MIN(piece, len - i);
+         a_Decode_process(dc, (const char *)data + i, n, out);
+      }
+      a_Decode_free(dc);
+   }
+   if (dc && out->len == text->len && !dStr_cmp(out, text)) {
+      passed++;
+   } else {
+      MSG("line %d: %s in pieces of %d: got %d bytes, expected %d\n",
+          lineno, format, piece, out->len, text->len);
+      failed++;
+   }
+   dStr_free(out, 1);
+   dStr_free(text, 1);
+}
+
+static void expect_all(int lineno, const char *format,
+                       const unsigned char *data, int len)
+{
+   expect(lineno, format, data, len, len);
+   expect(lineno, format, data, len, 7);
+   expect(lineno, format, data, len, 1);
+}
+
+/*
+ * A chunked body with a trailer, followed by the next response.
+ */
+static void expect_chunked(int lineno, const char *trailer, int piece)
+{
+   const char *next = "HTTP/1.1 200 OK\r\n";
+   Dstr *in = dStr_new(""), *out = dStr_new(""), *text = dStr_new("");
+   DecodeTransfer *dc = a_Decode_transfer_init("chunked");
+   int i, n, used = 0, body_len;
+
+   for (i = 0; i < LINES; i++) {
+      dStr_sprintfa(in, "%x;ext=1\r\n%s\r\n", (int)strlen(line), line);
+      dStr_append(text, line);
+   }
+   dStr_sprintfa(in, "0\r\n%s\r\n", trailer);
+   body_len = in->len;
+   dStr_append(in, next);
+
+   for (i = 0; i < in->len; i += n) {
+      n = MIN(piece, in->len - i);
+      used += a_Decode_transfer_process(dc, in->str + i, n, out);
+   }
+   if (a_Decode_transfer_finished(dc) && used == body_len &&
+       !dStr_cmp(out, text)) {
+      passed++;
+   } else {
+      MSG("line %d: chunked in pieces of %d: used %d bytes of %d, "
+          "got %d bytes, expected %d\n",
+          lineno, piece, used, body_len, out->len, text->len);
+      failed++;
+   }
+   a_Decode_transfer_free(dc);
+   dStr_free(text, 1);
+   dStr_free(out, 1);
+   dStr_free(in, 1);
+}
+
+/*
+ * A chunked body whose closing CRLF comes in a read of its own: the
+ * decoder must not be finished before it, and must take it.
+ */
+static void expect_chunked_final_crlf(int lineno, const char *last_read)
+{
+   const char *body = "5\r\nHello\r\n0\r\n";
+   Dstr *out = dStr_new("");
+   DecodeTransfer *dc = a_Decode_transfer_init("chunked");
+   int used;
+   bool_t early;
+
+   used = a_Decode_transfer_process(dc, body, strlen(body), out);
+   early = a_Decode_transfer_finished(dc);
+   used += a_Decode_transfer_process(dc, last_read, strlen(last_read), out);
+
+   if (!early && a_Decode_transfer_finished(dc) &&
+       used == (int)strlen(body) + 2 && !strcmp(out->str, "Hello")) {
+      passed++;
+   } else {
+      MSG("line %d: chunked, last read \"%s\": %sfinished early, "
+          "used %d bytes of %d, got \"%s\"\n", lineno, last_read,
+          early ? "" : "not ", used, (int)strlen(body) + 2, out->str);
+      failed++;
+   }
+   a_Decode_transfer_free(dc);
+   dStr_free(out, 1);
+}
+
+int main(void)
+{
+   prefs.show_msg = TRUE;
+
+   expect_all(__LINE__, "gzip", gzip_data, sizeof(gzip_data));
+   expect_all(__LINE__, "x-gzip", gzip_data, sizeof(gzip_data));
+   expect_all(__LINE__, "deflate", deflate_data, sizeof(deflate_data));
+   expect(__LINE__, "deflate", raw_deflate_data, sizeof(raw_deflate_data),
+          sizeof(raw_deflate_data));
+#ifdef ENABLE_BROTLI
+   expect_all(__LINE__, "br", brotli_data, sizeof(brotli_data));
+#endif
+#ifdef ENABLE_ZSTD
+   expect_all(__LINE__, "zstd", zstd_data, sizeof(zstd_data));
+#endif
+   expect_chunked(__LINE__, "", 1 << 20);
+   expect_chunked(__LINE__, "", 7);
+   expect_chunked(__LINE__, "", 1);
+   expect_chunked(__LINE__, "Expires: never\r\nX-Foo: bar\r\n", 7);
+   expect_chunked(__LINE__, "Expires: never\r\nX-Foo: bar\r\n", 1);
+   expect_chunked_final_crlf(__LINE__, "\r\n");
+   expect_chunked_final_crlf(__LINE__, "\r\nHTTP/1.1 200 OK\r\n");
+
+   MSG("Accept-Encoding: %s\n", a_Decode_content_encodings(TRUE));
+   MSG("TESTS: passed: %u failed: %u\n", passed, failed);
+
+   return (failed) ? 1 : 0;
+}
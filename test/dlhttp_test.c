@@ -0,0 +1,331 @@
+/*
+ * Downloads dpi native HTTP fetcher test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs dpi/dlhttp.c against a small HTTP server on the loopback interface
+ * that honours byte ranges (or not, or drops the connection halfway), and
+ * checks that whole, resumed and segmented downloads end up identical to
+ * what the server has.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../dlib/dlib.h"
+#include "../dpi/dlhttp.h"
+
+#define MSG(...) printf("[dlhttp-test] " __VA_ARGS__)
+
+/* Large enough to be fetched in three ranges */
+#define FILE_SIZE (3 * 1024 * 1024 + 4321)
+
+static uint_t failed = 0;
+static uint_t passed = 0;
+
+static char *content;
+static char tmpdir[] = "/tmp/dlhttp-test-XXXXXX";
+static char *target, *logname, *marker;
+static int port;
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+   ssize_t n;
+
+   while (len > 0) {
+      if ((n = write(fd, buf, len)) <= 0)
+         return -1;
+      buf += n;
+      len -= n;
+   }
+   return 0;
+}
+
+/*
+ * Answer one request.
+ */
+static void serve(int sock)
+{
+   char req[4096], path[256] = "", hdr[512];
+   long long a = -1, b = -1;
+   const char *p;
+   int n, len = 0, ranges = 1, flaky = 0;
+
+   while (len < (int)sizeof(req) - 1 &&
+          (n = read(sock, req + len, sizeof(req) - 1 - len)) > 0) {
+      req[len += n] = '\0';
+      if (strstr(req, "\r\n\r\n"))
+         break;
+   }
+   sscanf(req, "GET %255s", path);
+   if ((p = strstr(req, "\r\nRange: bytes=")) &&
+       sscanf(p + 15, "%lld-%lld", &a, &b) < 1)
+      a = -1;
+
+   if (!strcmp(path, "/redirect")) {
+      snprintf(hdr, sizeof(hdr), "HTTP/1.0 302 Found\r\n"
+               "Location: /file\r\n\r\n");
+      write_all(sock, hdr, strlen(hdr));
+      return;
+   } else if (!strcmp(path, "/norange")) {
+      ranges = 0;
+   } else if (!strcmp(path, "/flaky")) {
+      flaky = (open(marker, O_WRONLY | O_CREAT | O_EXCL, 0666) >= 0);
+   } else if (strcmp(path, "/file")) {
+      write_all(sock, "HTTP/1.0 404 Not Found\r\n\r\n", 26);
+      return;
+   }
+
+   if (!ranges || a < 0) {
+      a = 0;
+      b = FILE_SIZE - 1;
+      snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n%s"
+               "Content-Length: %d\r\n\r\n",
+               ranges ? "Accept-Ranges: bytes\r\n" : "", FILE_SIZE);
+   } else if (a >= FILE_SIZE) {
+      snprintf(hdr, sizeof(hdr), "HTTP/1.0 416 Range Not Satisfiable\r\n"
+               "Content-Range: bytes */%d\r\n\r\n", FILE_SIZE);
+      write_all(sock, hdr, strlen(hdr));
+      return;
+   } else {
+      if (b < 0 || b >= FILE_SIZE)
+         b = FILE_SIZE - 1;
+      snprintf(hdr, sizeof(hdr), "HTTP/1.0 206 Partial Content\r\n"
+               "Content-Range: bytes %lld-%lld/%d\r\n"
+               "Content-Length: %lld\r\n\r\n", a, b, FILE_SIZE, b - a + 1);
+   }
+   if (write_all(sock, hdr, strlen(hdr)) == 0)
+      write_all(sock, content + a, flaky ? (b - a + 1) / 2 : b - a + 1);
+}
+
+/*
+ * Fork the server. Return: its pid.
+ */
+static pid_t server_start(void)
+{
+   struct sockaddr_in addr;
+   socklen_t alen = sizeof(addr);
+   int ls, sock;
+   pid_t pid;
+
+   ls = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (bind(ls, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+       listen(ls, 16) < 0 ||
+       getsockname(ls, (struct sockaddr *)&addr, &alen) < 0) {
+      perror("server");
+      exit(1);
+   }
+   port = ntohs(addr.sin_port);
+
+   if ((pid = fork()) == 0) {
+      signal(SIGCHLD, SIG_IGN);
+      signal(SIGPIPE, SIG_IGN);
+      while ((sock = accept(ls, NULL, NULL)) >= 0) {
+         if (fork() == 0) {
+            serve(sock);
+            _exit(0);
+         }
+         close(sock);
+      }
+      _exit(1);
+   }
+   close(ls);
+   return pid;
+}
+
+/*
+ * Write 'len' bytes of the content, from 'start', to 'name' at 'offset'.
+ */
+static void put(const char *name, int start, int len, int offset)
+{
+   int fd = open(name, O_WRONLY | O_CREAT, 0666);
+
+   if (fd < 0 || pwrite(fd, content + start, len, offset) != len)
+      perror(name);
+   close(fd);
+}
+
+static char *part_name(int start, int end)
+{
+   char suffix[64];
+
+   snprintf(suffix, sizeof(suffix), ".part-%d-%d", start, end);
+   return dStrconcat(target, suffix, NULL);
+}
+
+/*
+ * Remove the target and its part files.
+ */
+static void clean(void)
+{
+   char *cmd = dStrconcat("rm -f ", target, "*", NULL);
+
+   if (system(cmd) != 0)
+      MSG("can't clean %s\n", tmpdir);
+   dFree(cmd);
+}
+
+/*
+ * Fetch 'path' into the target, and check it came out right.
+ */
+static void expect(int lineno, const char *path, int segments,
+                   const char *log_has)
+{
+   char url[64], *text = NULL;
+   int log_fd, st, ok;
+   Dstr *got = dStr_new("");
+   FILE *f;
+
+   snprintf(url, sizeof(url), "http://127.0.0.1:%d%s", port, path);
+   log_fd = open(logname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   st = a_Dlhttp_fetch(url, target, segments, log_fd);
+   close(log_fd);
+
+   if ((f = fopen(target, "r"))) {
+      char buf[8192];
+      size_t n;
+
+      while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+         dStr_append_l(got, buf, n);
+      fclose(f);
+   }
+   if ((f = fopen(logname, "r"))) {
+      char buf[8192];
+      size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+
+      buf[n] = '\0';
+      text = dStrdup(buf);
+      fclose(f);
+   }
+
+   ok = (st == 0 && got->len == FILE_SIZE &&
+         !memcmp(got->str, content, FILE_SIZE) &&
+         a_Dlhttp_downloaded(target) == FILE_SIZE &&
+         (!log_has || (text && strstr(text, log_has))));
+   if (ok) {
+      passed++;
+   } else {
+      MSG("line %d: %s: status %d, got %d bytes\n%s\n",
+          lineno, url, st, got->len, text ? text : "");
+      failed++;
+   }
+   dFree(text);
+   dStr_free(got, 1);
+}
+
+static void expect_int(int lineno, long long got, long long expected)
+{
+   if (got == expected) {
+      passed++;
+   } else {
+      MSG("line %d: got %lld, expected %lld\n", lineno, got, expected);
+      failed++;
+   }
+}
+
+int main(void)
+{
+   char *part;
+   pid_t server;
+   int i;
+
+   unsetenv("http_proxy");
+   unsetenv("HTTP_PROXY");
+   signal(SIGPIPE, SIG_IGN);
+   if (!mkdtemp(tmpdir)) {
+      perror("mkdtemp");
+      return 1;
+   }
+   target = dStrconcat(tmpdir, "/target", NULL);
+   logname = dStrconcat(tmpdir, "/log", NULL);
+   marker = dStrconcat(tmpdir, "/flaky", NULL);
+   content = dNew(char, FILE_SIZE);
+   for (i = 0; i < FILE_SIZE; i++)
+      content[i] = (char)(i * 7 + i / 251);
+   server = server_start();
+
+   /* the whole file, in one range and in several */
+   expect(__LINE__, "/file", 1, "Length: 3150049 (3150049 remaining)");
+   clean();
+   expect(__LINE__, "/file", 4, "in 3 parallel ranges");
+   clean();
+
+   /* resume what's there */
+   put(target, 0, 1000, 0);
+   expect(__LINE__, "/file", 1, "Resuming at byte 1000");
+   expect(__LINE__, "/file", 4, "already fully retrieved");
+   clean();
+
+   /* resume an earlier segmented attempt */
+   put(target, 0, 500000, 0);
+   part = part_name(2000000, FILE_SIZE);
+   put(part, 2000000, 100, 0);
+   expect(__LINE__, "/file", 4, "Resuming at byte 500000");
+   expect_int(__LINE__, access(part, F_OK), -1);
+   dFree(part);
+   clean();
+
+   /* the server can't resume: start over */
+   put(target, 0, 1000, 0);
+   expect(__LINE__, "/norange", 4, "starting over");
+   clean();
+
+   /* the connection breaks halfway */
+   expect(__LINE__, "/flaky", 1, "Retrying");
+   clean();
+
+   expect(__LINE__, "/redirect", 4, "[following]");
+   clean();
+
+   /* what the progress display sees */
+   put(target, 0, 10, 0);
+   part = part_name(2000000, FILE_SIZE);
+   put(part, 2000000, 20, 0);
+   expect_int(__LINE__, a_Dlhttp_downloaded(target), 30);
+   dFree(part);
+   clean();
+
+   expect_int(__LINE__, a_Dlhttp_supported("http://example.org/a"), 1);
+   expect_int(__LINE__, a_Dlhttp_supported("http://[::1]:8080/"), 1);
+   expect_int(__LINE__, a_Dlhttp_supported("https://example.org/a"), 0);
+   expect_int(__LINE__, a_Dlhttp_supported("http://u:p@example.org/"), 0);
+   expect_int(__LINE__, a_Dlhttp_fetch("https://example.org/a", target, 4,
+                                       -1), DLHTTP_UNSUPPORTED);
+   setenv("http_proxy", "http://127.0.0.1:1/", 1);
+   expect_int(__LINE__, a_Dlhttp_supported("http://example.org/a"), 0);
+
+   kill(server, SIGTERM);
+   waitpid(server, NULL, 0);
+   unlink(logname);
+   unlink(marker);
+   rmdir(tmpdir);
+   dFree(content);
+
+   MSG("TESTS: passed: %u failed: %u\n", passed, failed);
+   return (failed) ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Dillo Widget
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * FltkImgbuf::scaleBuffer() benchmark
+ *
+ * Scales photo-sized RGB images row by row, the way scaled image buffers
+ * are filled while an image is being decoded, once with the former
+ * pixel-by-pixel algorithm and once with FltkImgbuf::scaleBuffer(), and
+ * checks that both give the same result. Then feeds an image into an
+ * enlarged buffer with each FltkImgbuf::UpscaleMode.
+ *
+ * Usage: dw-imgbuf-scale-bench [rounds]   (the best round is shown)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/time.h>
+
+#include "../dw/core.hh"
+#include "../dw/fltkcore.hh"
+
+using namespace dw::fltk;
+
+static unsigned char gammaMap1[256], gammaMap2[256];
+
+static void makeGammaMaps (double gamma)
+{
+   for (int i = 0; i < 256; i++) {
+      gammaMap1[i] = 255 * pow((double)i / 255, gamma);
+      gammaMap2[i] = 255 * pow((double)i / 255, 1 / gamma);
+   }
+}
+
+/*
+ * What FltkImgbuf::scaleBuffer() used to do (in BEAUTIFUL_GAMMA mode)
+ */
+static void scaleBufferOld (const unsigned char *src, int srcWidth,
+                            int srcHeight, unsigned char *dest,
+                            int destWidth, int destHeight, int bpp)
+{
+   for(int x = 0; x < destWidth; x++)
+      for(int y = 0; y < destHeight; y++) {
+         int xo1 = x * srcWidth / destWidth;
+         int xo2 = lout::misc::max ((x + 1) * srcWidth / destWidth, xo1 + 1);
+         int yo1 = y * srcHeight / destHeight;
+         int yo2 = lout::misc::max ((y + 1) * srcHeight / destHeight, yo1 + 1);
+         int n = (xo2 - xo1) * (yo2 - yo1);
+
+         int v[bpp];
+         for(int i = 0; i < bpp; i++)
+            v[i] = 0;
+
+         for(int xo = xo1; xo < xo2; xo++)
+            for(int yo = yo1; yo < yo2; yo++) {
+               const unsigned char *ps = src + bpp * (yo * srcWidth + xo);
+               for(int i = 0; i < bpp; i++)
+                  v[i] += gammaMap2[ps[i]];
+            }
+
+         unsigned char *pd = dest + bpp * (y * destWidth + x);
+         for(int i = 0; i < bpp; i++)
+            pd[i] = gammaMap1[v[i] / n];
+      }
+}
+
+static double now ()
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Scale like FltkImgbuf::scaleRowBeautiful() does, one destination row
+ * at a time when scaling down, and one source row at a time when scaling
+ * up. Return: the time taken, in milliseconds.
+ */
+static double scale (bool old, const unsigned char *src, int w, int h,
+                     unsigned char *dest, int dw, int dh, int rounds)
+{
+   const int bpp = 3;
+   double best = 0;
+
+   for (int r = 0; r < rounds; r++) {
+      double t0 = now ();
+
+      if (dh > h) {
+         for (int row = 0; row < h; row++) {
+            int sr1 = row * dh / h, sr2 = (row + 1) * dh / h;
+            if (old)
+               scaleBufferOld (src + row * w * bpp, w, 1,
+                               dest + sr1 * dw * bpp, dw, sr2 - sr1, bpp);
+            else
+               FltkImgbuf::scaleBuffer (src + row * w * bpp, w, 1,
+                                        dest + sr1 * dw * bpp, dw, sr2 - sr1,
+                                        bpp, 1 / 2.2);
+         }
+      } else {
+         for (int sr = 0; sr < dh; sr++) {
+            int row1 = sr * h / dh, row2 = (sr + 1) * h / dh;
+            if (old)
+               scaleBufferOld (src + row1 * w * bpp, w, row2 - row1,
+                               dest + sr * dw * bpp, dw, 1, bpp);
+            else
+               FltkImgbuf::scaleBuffer (src + row1 * w * bpp, w, row2 - row1,
+                                        dest + sr * dw * bpp, dw, 1,
+                                        bpp, 1 / 2.2);
+         }
+      }
+      double t = now () - t0;
+      if (r == 0 || t < best)
+         best = t;
+   }
+   return best * 1e3;
+}
+
+/*
+ * Copy an image, row by row, into a root buffer with a scaled buffer of
+ * dw x dh. Return: the time taken, in milliseconds.
+ */
+static double upscale (FltkImgbuf::UpscaleMode mode, const unsigned char *src,
+                       int w, int h, int dw, int dh, int rounds)
+{
+   double best = 0;
+
+   FltkImgbuf::setUpscaleMode (mode);
+   for (int r = 0; r < rounds; r++) {
+      FltkImgbuf *root = new FltkImgbuf (dw::core::Imgbuf::RGB, w, h, 1 / 2.2);
+      dw::core::Imgbuf *scaled = root->getScaledBuf (dw, dh);
+      double t0 = now ();
+
+      for (int row = 0; row < h; row++)
+         root->copyRow (row, src + row * w * 3);
+
+      double t = now () - t0;
+      if (r == 0 || t < best)
+         best = t;
+      scaled->unref ();
+      root->unref ();
+   }
+   return best * 1e3;
+}
+
+int main (int argc, char **argv)
+{
+   static const struct { int w, h, dw, dh; } sizes[] = {
+      { 1024,  768,  320,  240 },
+      { 1920, 1080,  640,  360 },
+      { 3264, 2448,  800,  600 },
+      { 4000, 3000, 1024,  768 },
+      { 4000, 3000,  150,  113 },
+      {  640,  480, 1280,  960 },
+   };
+   int rounds = argc > 1 ? atoi(argv[1]) : 5;
+   int mismatches = 0;
+
+   makeGammaMaps (1 / 2.2);
+   printf ("%-24s %10s %10s %8s\n", "RGB image", "old ms", "new ms", "speedup");
+
+   for (unsigned s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++) {
+      int w = sizes[s].w, h = sizes[s].h, dw = sizes[s].dw, dh = sizes[s].dh;
+      unsigned char *src = new unsigned char[w * h * 3];
+      unsigned char *dest1 = new unsigned char[dw * dh * 3];
+      unsigned char *dest2 = new unsigned char[dw * dh * 3];
+      char label[64];
+
+      // Smooth gradients with some noise, like a photo
+      srand (s);
+      for (int y = 0; y < h; y++)
+         for (int x = 0; x < w; x++)
+            for (int i = 0; i < 3; i++)
+               src[(y * w + x) * 3 + i] =
+                  (x * (i + 1) + y * (3 - i)) / 16 + rand () % 32;
+
+      double tOld = scale (true, src, w, h, dest1, dw, dh, rounds);
+      double tNew = scale (false, src, w, h, dest2, dw, dh, rounds);
+
+      snprintf (label, sizeof (label), "%dx%d -> %dx%d", w, h, dw, dh);
+      printf ("%-24s %10.2f %10.2f %7.1fx\n", label, tOld, tNew, tOld / tNew);
+      if (memcmp (dest1, dest2, dw * dh * 3)) {
+         printf ("  output differs!\n");
+         mismatches++;
+      }
+
+      delete[] src;
+      delete[] dest1;
+      delete[] dest2;
+   }
+
+   static const struct { int w, h, dw, dh; } upSizes[] = {
+      {  320,  240,  640,  480 },
+      {  640,  480, 1280,  960 },
+      { 1024,  768, 2048, 1536 },
+   };
+
+   printf ("\n%-24s %10s %10s\n", "RGB image", "simple ms", "bilinear");
+   for (unsigned s = 0; s < sizeof (upSizes) / sizeof (upSizes[0]); s++) {
+      int w = upSizes[s].w, h = upSizes[s].h;
+      int dw = upSizes[s].dw, dh = upSizes[s].dh;
+      unsigned char *src = new unsigned char[w * h * 3];
+      char label[64];
+
+      for (int i = 0; i < w * h * 3; i++)
+         src[i] = rand ();
+
+      double tSimple = upscale (FltkImgbuf::UPSCALE_SIMPLE, src, w, h, dw, dh,
+                                rounds);
+      double tBilinear = upscale (FltkImgbuf::UPSCALE_BILINEAR, src, w, h,
+                                  dw, dh, rounds);
+
+      snprintf (label, sizeof (label), "%dx%d -> %dx%d", w, h, dw, dh);
+      printf ("%-24s %10.2f %10.2f\n", label, tSimple, tBilinear);
+      delete[] src;
+   }
+
+   return mismatches ? 1 : 0;
+}
@@ -0,0 +1,420 @@
+/*
+ * Dillo HTTP connection setup test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs src/IO/http.c against a host on the loopback interface that has
+ * an IPv4 and an IPv6 address, one of which is blackholed: it listens,
+ * but its accept queue is full, so connection attempts get no answer.
+ * Checks that the other address is connected to after the attempt delay,
+ * not after a connect timeout, and what a_Http_get_connect_stats() says.
+ *
+ * The event loop, the DNS and the rest of dillo are stubbed out below.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "../src/msg.h"
+#include "../src/IO/Url.h"
+#include "../src/IO/iowatch.hh"
+#include "../src/IO/tls.h"
+#include "../src/web.hh"
+#include "../src/dns.h"
+#include "../src/auth.h"
+#include "../src/cache.h"
+#include "../src/cookies.h"
+#include "../src/decode.h"
+#include "../src/hsts.h"
+#include "../src/misc.h"
+#include "../src/timeout.hh"
+#include "../src/uicmd.hh"
+
+DilloPrefs prefs;
+
+static uint_t failed = 0;
+static uint_t passed = 0;
+
+/* What the DNS answers */
+static Dlist *addr_list;
+
+/* How the connection went */
+static int connected_fd;
+static bool_t aborted;
+
+/* Stubs ------------------------------------------------------------------ */
+
+static struct {
+   int fd, when;
+   CbFunction_t cb;
+   void *data;
+} watch[16];
+static int watches = 0;
+
+static struct {
+   struct timeval due;
+   TimeoutCb_t cb;
+   void *data;
+} timer[16];
+static int timers = 0;
+
+void a_IOwatch_add_fd(int fd, int when, CbFunction_t Callback, void *usr_data)
+{
+   if (watches < 16) {
+      watch[watches].fd = fd;
+      watch[watches].when = when;
+      watch[watches].cb = Callback;
+      watch[watches++].data = usr_data;
+   }
+}
+
+void a_IOwatch_remove_fd(int fd, int when)
+{
+   int i;
+
+   for (i = 0; i < watches; i++)
+      if (watch[i].fd == fd)
+         watch[i--] = watch[--watches];
+}
+
+void a_Timeout_add(float t, TimeoutCb_t cb, void *cbdata)
+{
+   if (timers < 16) {
+      long usec;
+
+      gettimeofday(&timer[timers].due, NULL);
+      usec = timer[timers].due.tv_usec + (long)(t * 1e6);
+      timer[timers].due.tv_sec += usec / 1000000L;
+      timer[timers].due.tv_usec = usec % 1000000L;
+      timer[timers].cb = cb;
+      timer[timers++].data = cbdata;
+   }
+}
+
+void a_Timeout_remove()
+{
+}
+
+void a_Dns_resolve(const char *hostname, DnsCallback_t cb_func, void *cb_data)
+{
+   cb_func(0, addr_list, cb_data);
+}
+
+Dlist *a_Dns_addr_list_dup(Dlist *addr_list)
+{
+   Dlist *dup = dList_new(4);
+   DilloHost *dh;
+   int i;
+
+   for (i = 0; (dh = dList_nth_data(addr_list, i)); i++) {
+      DilloHost *copy = dNew(DilloHost, 1);
+
+      *copy = *dh;
+      dList_append(dup, copy);
+   }
+   return dup;
+}
+
+void a_Dns_addr_list_free(Dlist *addr_list)
+{
+   DilloHost *dh;
+
+   while ((dh = dList_nth_data(addr_list, 0))) {
+      dList_remove_fast(addr_list, dh);
+      dFree(dh);
+   }
+   dList_free(addr_list);
+}
+
+void a_IO_ccc(int Op, int Branch, int Dir, ChainLink *Info,
+              void *Data1, void *Data2)
+{
+   /* the query goes nowhere */
+   if (Op == OpAbort || Op == OpEnd)
+      dFree(Info);
+}
+
+int a_Web_valid(DilloWeb *web) { return 1; }
+void a_UIcmd_set_msg(BrowserWindow *bw, const char *format, ...) {}
+void a_Tls_connect(int fd, const DilloUrl *url) {}
+char *a_Auth_get_auth_str(const DilloUrl *url, const char *request_uri)
+{
+   return NULL;
+}
+bool_t a_Cache_get_validators(const DilloUrl *Url, const char **ETag,
+                              const char **LastModified)
+{
+   return FALSE;
+}
+const char *a_Decode_content_encodings(bool_t secure) { return "gzip"; }
+bool_t a_Hsts_require_https(const char *host) { return FALSE; }
+char *a_Misc_encode_base64(const char *in) { return NULL; }
+#ifndef DISABLE_COOKIES
+char *a_Cookies_get_query(const DilloUrl *query_url,
+                          const DilloUrl *requester)
+{
+   return dStrdup("");
+}
+#endif
+
+/*
+ * The CCC function of the test, as the CAPI module would be.
+ */
+static void test_ccc(int Op, int Branch, int Dir, ChainLink *Info,
+                     void *Data1, void *Data2)
+{
+   if (Dir == FWD && Op == OpSend && Data2 && !strcmp(Data2, "FD")) {
+      connected_fd = *(int *)Data1;
+   } else if (Op == OpAbort) {
+      aborted = TRUE;
+   }
+}
+
+/* Tests ------------------------------------------------------------------ */
+
+static long msec_since(const struct timeval *t0)
+{
+   struct timeval now;
+
+   gettimeofday(&now, NULL);
+   return (now.tv_sec - t0->tv_sec) * 1000L +
+          (now.tv_usec - t0->tv_usec) / 1000L;
+}
+
+/*
+ * Run the event loop until the connection is made or given up, for
+ * 'msec' at most.
+ */
+static void run(long msec)
+{
+   struct timeval start;
+
+   gettimeofday(&start, NULL);
+   while (connected_fd == -1 && !aborted && msec_since(&start) < msec) {
+      struct pollfd pfd[16];
+      int i, n = watches, wait = 50;
+
+      for (i = 0; i < timers; i++) {
+         if (msec_since(&timer[i].due) >= 0) {
+            TimeoutCb_t cb = timer[i].cb;
+            void *data = timer[i].data;
+
+            timer[i--] = timer[--timers];
+            cb(data);
+         }
+      }
+      for (i = 0; i < n; i++) {
+         pfd[i].fd = watch[i].fd;
+         pfd[i].events = (watch[i].when & DIO_WRITE) ? POLLOUT : POLLIN;
+      }
+      if (poll(pfd, n, wait) > 0) {
+         for (i = 0; i < n; i++) {
+            int j;
+
+            if (!pfd[i].revents)
+               continue;
+            /* it may be gone by now */
+            for (j = 0; j < watches && watch[j].fd != pfd[i].fd; j++) ;
+            if (j < watches)
+               watch[j].cb(watch[j].fd, watch[j].data);
+         }
+      }
+   }
+}
+
+#ifdef ENABLE_IPV6
+
+/*
+ * Listen on the loopback address of family 'af' at 'port' (0 for any).
+ * A blackholed listener gets its accept queue filled, by 'filler'.
+ * Return: the socket, or -1.
+ */
+static int listen_on(int af, int *port, bool_t blackhole, int *filler)
+{
+   struct sockaddr_in6 name;
+   struct sockaddr_in *sin = (struct sockaddr_in *)&name;
+   socklen_t len;
+   int fd, on = 1;
+
+   memset(&name, 0, sizeof(name));
+   if (af == AF_INET) {
+      sin->sin_family = AF_INET;
+      sin->sin_port = htons(*port);
+      sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      len = sizeof(struct sockaddr_in);
+   } else {
+      name.sin6_family = AF_INET6;
+      name.sin6_port = htons(*port);
+      name.sin6_addr = in6addr_loopback;
+      len = sizeof(struct sockaddr_in6);
+   }
+   if ((fd = socket(af, SOCK_STREAM, 0)) < 0)
+      return -1;
+   if (af == AF_INET6)
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+   if (bind(fd, (struct sockaddr *)&name, len) < 0 ||
+       listen(fd, blackhole ? 0 : 8) < 0) {
+      close(fd);
+      return -1;
+   }
+   getsockname(fd, (struct sockaddr *)&name, &len);
+   *port = ntohs(sin->sin_port);   /* same place in both */
+
+   *filler = -1;
+   if (blackhole) {
+      struct pollfd pfd;
+
+      *filler = socket(af, SOCK_STREAM, 0);
+      fcntl(*filler, F_SETFL, O_NONBLOCK);
+      connect(*filler, (struct sockaddr *)&name, len);
+      pfd.fd = *filler;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, 1000) != 1) {
+         close(*filler);
+         close(fd);
+         return -1;
+      }
+   }
+   return fd;
+}
+
+static void add_addr(int af)
+{
+   DilloHost *dh = dNew0(DilloHost, 1);
+
+   dh->af = af;
+   if (af == AF_INET) {
+      struct in_addr a;
+
+      a.s_addr = htonl(INADDR_LOOPBACK);
+      dh->alen = sizeof(a);
+      memcpy(dh->data, &a, sizeof(a));
+   } else {
+      dh->alen = sizeof(in6addr_loopback);
+      memcpy(dh->data, &in6addr_loopback, sizeof(in6addr_loopback));
+   }
+   dList_append(addr_list, dh);
+}
+
+static void check(int lineno, const char *what, bool_t ok)
+{
+   if (ok) {
+      passed++;
+   } else {
+      MSG("line %d: %s: failed\n", lineno, what);
+      failed++;
+   }
+}
+
+/*
+ * Connect to a host whose first address, of family 'dead', is blackholed.
+ */
+static void test_blackholed(int dead)
+{
+   int live = (dead == AF_INET) ? AF_INET6 : AF_INET;
+   int port = 0, dead_fd, live_fd = -1, filler, unused, i;
+   long attempts0, connects0, fallbacks0, total0, max0,
+        attempts, connects, fallbacks, total, max;
+   char url_str[64];
+   DilloWeb *web;
+   ChainLink *Info;
+   struct timeval start;
+
+   /* the same port on both addresses */
+   for (i = 0; i < 10 && live_fd == -1; i++) {
+      port = 0;
+      if ((dead_fd = listen_on(dead, &port, TRUE, &filler)) != -1 &&
+          (live_fd = listen_on(live, &port, FALSE, &unused)) == -1) {
+         close(filler);
+         close(dead_fd);
+      }
+   }
+   if (live_fd == -1) {
+      MSG("can't listen on the loopback interface, skipped\n");
+      return;
+   }
+   addr_list = dList_new(2);
+   add_addr(dead);
+   add_addr(live);
+
+   web = dNew0(DilloWeb, 1);
+   snprintf(url_str, sizeof(url_str), "http://localhost:%d/", port);
+   web->url = a_Url_new(url_str, NULL);
+   web->flags = WEB_RootUrl;
+   connected_fd = -1;
+   aborted = FALSE;
+   a_Http_get_connect_stats(&attempts0, &connects0, &fallbacks0, &total0,
+                            &max0);
+
+   gettimeofday(&start, NULL);
+   Info = a_Chain_new();
+   a_Chain_link_new(Info, test_ccc, BCK, a_Http_ccc, 1, 1);
+   a_Chain_bcb(OpStart, Info, web, NULL);
+   run(5000);
+
+   check(__LINE__, "connected", connected_fd != -1);
+   check(__LINE__, "soon", msec_since(&start) < 2000);
+   a_Http_get_connect_stats(&attempts, &connects, &fallbacks, &total, &max);
+   check(__LINE__, "one connection", connects - connects0 == 1);
+   check(__LINE__, "two addresses tried", attempts - attempts0 == 2);
+   check(__LINE__, "won by the second address",
+         fallbacks - fallbacks0 == 1);
+   check(__LINE__, "connect time", total - total0 >= 200 &&
+                                   total - total0 < 2000);
+   MSG("%s blackholed: connected in %ld ms\n",
+       dead == AF_INET ? "IPv4" : "IPv6", total - total0);
+
+   if (connected_fd != -1)
+      a_Chain_bcb(OpAbort, Info, NULL, NULL);
+   dFree(Info);
+   a_Dns_addr_list_free(addr_list);
+   a_Url_free(web->url);
+   dFree(web);
+   close(live_fd);
+   close(filler);
+   close(dead_fd);
+}
+
+#endif /* ENABLE_IPV6 */
+
+int main(void)
+{
+   prefs.show_msg = TRUE;
+   prefs.http_max_conns = 6;
+   prefs.http_max_total_conns = 24;
+   prefs.http_user_agent = "Dillo test";
+   prefs.http_referer = "host";
+   a_Http_init();
+
+#ifdef ENABLE_IPV6
+   test_blackholed(AF_INET6);
+   test_blackholed(AF_INET);
+#else
+   MSG("IPv6 support is disabled: only one address family to test\n");
+#endif
+
+   a_Http_freeall();
+   MSG("TESTS: passed: %u failed: %u\n", passed, failed);
+
+   return (failed) ? 1 : 0;
+}
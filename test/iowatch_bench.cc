@@ -0,0 +1,96 @@
+/*
+ * Dillo IOwatch microbenchmark
+ *
+ * Opens N socket pairs, watches their reading ends, and measures how long
+ * the FLTK loop takes to deliver a read event when one random socket out
+ * of N has data.  Runs once with plain Fl::add_fd() (select) and once
+ * through a_IOwatch_add_fd() (epoll, where available).
+ *
+ * Usage: iowatch-bench [N [rounds]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <FL/Fl.H>
+#include "../src/IO/iowatch.hh"
+#include "../src/prefs.h"
+
+DilloPrefs prefs;   /* iowatch.cc reports errors through MSG_ERR */
+
+static int events;
+
+static void read_cb(int fd, void *)
+{
+   char buf[16];
+
+   while (read(fd, buf, sizeof(buf)) > 0) ;
+   events++;
+}
+
+static double now()
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double run(int (*pairs)[2], int n, int rounds)
+{
+   double t0 = now();
+
+   events = 0;
+   for (int r = 0; r < rounds; r++) {
+      int target = events + 1;
+
+      if (write(pairs[rand() % n][1], "x", 1) != 1)
+         perror("write");
+      while (events < target)
+         Fl::wait(1.0);
+   }
+   return (now() - t0) / rounds * 1e6;
+}
+
+int main(int argc, char **argv)
+{
+   int n = argc > 1 ? atoi(argv[1]) : 400;
+   int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+   int (*pairs)[2] = new int[n][2];
+   double t_select, t_iowatch;
+
+   for (int i = 0; i < n; i++) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) < 0) {
+         perror("socketpair");
+         return 1;
+      }
+      fcntl(pairs[i][0], F_SETFL, O_NONBLOCK | fcntl(pairs[i][0], F_GETFL));
+   }
+
+   for (int i = 0; i < n; i++)
+      Fl::add_fd(pairs[i][0], FL_READ, read_cb, NULL);
+   t_select = run(pairs, n, rounds);
+   for (int i = 0; i < n; i++)
+      Fl::remove_fd(pairs[i][0]);
+
+   for (int i = 0; i < n; i++)
+      a_IOwatch_add_fd(pairs[i][0], DIO_READ | DIO_EDGE, read_cb, NULL);
+   t_iowatch = run(pairs, n, rounds);
+   for (int i = 0; i < n; i++)
+      a_IOwatch_remove_fd(pairs[i][0], -1);
+
+   printf("%d sockets, %d events\n", n, rounds);
+   printf("  Fl::add_fd:       %8.2f us/event\n", t_select);
+   printf("  a_IOwatch_add_fd: %8.2f us/event\n", t_iowatch);
+
+   for (int i = 0; i < n; i++) {
+      close(pairs[i][0]);
+      close(pairs[i][1]);
+   }
+   delete[] pairs;
+   return 0;
+}
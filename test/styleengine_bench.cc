@@ -0,0 +1,813 @@
+/*
+ * Dillo web browser
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * StyleEngine benchmark
+ *
+ * Feeds the elements of some HTML files (roughly tokenized; <style>
+ * elements are parsed) to a StyleEngine, the way the HTML parser does,
+ * with and without style sharing and the ancestor filter of CssSelector.
+ * Shows how many styles were shared, the time taken, and checks that
+ * every element got the same style each time. No window is opened: fonts
+ * and colors come from a stub platform.
+ *
+ * Each page is also styled once more with its stylesheets arriving after
+ * the body, as a linked stylesheet may (see
+ * StyleEngine::applyPendingStyleSheets), and the result is checked against
+ * styling it with the stylesheets known from the start, as the page would
+ * be when rendered anew.
+ *
+ * Last, the stylesheets of each page are loaded into a new StyleEngine as
+ * one linked stylesheet, as on the next page of the same site: parsed
+ * anew, parsed and kept (the first page), and taken from the stylesheets
+ * kept (see StyleEngine::parseStyleSheet).
+ *
+ * Usage: styleengine-bench [-r rounds] [file.html...]   (the best round is
+ *        shown; without files, generated pages are used: one with a long
+ *        list and a big table, a deeply nested one, and one styled by a
+ *        large CSS framework)
+ *
+ * The switches and counters used for this exist only when src/ is built
+ * with STYLEENGINE_BENCH defined, as it is for this program.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include "../dlib/dlib.h"
+#include "../src/prefs.h"
+#include "../src/misc.h"
+#include "../src/html_common.hh"
+#include "../src/styleengine.hh"
+#include "../src/web.hh"
+#include "../src/capi.h"
+#include "../src/hsts.h"
+
+using namespace lout;
+using namespace dw::core;
+using namespace dw::core::style;
+
+/* ---------------------------------------------------------------------
+ *    What StyleEngine needs from the rest of dillo
+ * --------------------------------------------------------------------- */
+
+DilloPrefs prefs;
+
+/*
+ * The names of the elements known to the HTML parser, in the order of
+ * its tag table.
+ */
+static const char *const tagNames[] = {
+   "a", "abbr", "address", "area", "article", "aside", "audio", "b",
+   "base", "big", "blockquote", "body", "br", "button", "center", "cite",
+   "code", "dd", "del", "dfn", "dir", "div", "dl", "dt", "em", "embed",
+   "figcaption", "figure", "font", "footer", "form", "frame", "frameset",
+   "h1", "h2", "h3", "h4", "h5", "h6", "head", "header", "hr", "html", "i",
+   "iframe", "img", "input", "ins", "isindex", "kbd", "li", "link", "map",
+   "mark", "menu", "meta", "nav", "object", "ol", "optgroup", "option", "p",
+   "pre", "q", "s", "samp", "script", "section", "select", "small",
+   "source", "span", "strike", "strong", "style", "sub", "sup", "table",
+   "td", "textarea", "th", "title", "tr", "tt", "u", "ul", "var", "video",
+   "wbr"
+};
+static const int numTags = sizeof (tagNames) / sizeof (tagNames[0]);
+
+int a_Html_tag_index (const char *tag)
+{
+   int low = 0, high = numTags - 1;
+
+   while (low <= high) {
+      int mid = (low + high) / 2, cond = dStrAsciiCasecmp (tag, tagNames[mid]);
+
+      if (cond < 0)
+         high = mid - 1;
+      else if (cond > 0)
+         low = mid + 1;
+      else
+         return mid;
+   }
+   return -1;
+}
+
+/* The stylesheet that arrives late, and who is waiting for it */
+static const char *lateSheet = NULL;
+static StyleEngine *lateEngine = NULL;
+
+void a_Html_load_stylesheet (DilloHtml *html, DilloUrl *url) { }
+
+bool a_Html_parse_stylesheet (DilloHtml *html, DilloUrl *url)
+{
+   if (!lateEngine)
+      return false;
+   lateEngine->parseStyleSheet (html, url, lateSheet, strlen (lateSheet));
+   return true;
+}
+
+DilloUrl *a_Html_url_new (DilloHtml *html, const char *url_str,
+                          const char *base_url, int use_base_url)
+{
+   return a_Url_new (url_str, base_url);
+}
+
+int a_Capi_open_url (DilloWeb *web, CA_Callback_t Call, void *CbData)
+{
+   return 0;
+}
+
+void a_Capi_stop_client (int Key, int force) { }
+void a_Bw_add_client (BrowserWindow *bw, int Key, int Root) { }
+void a_Bw_add_url (BrowserWindow *bw, const DilloUrl *Url) { }
+Dstr *a_Misc_file2dstr (const char *filename) { return NULL; }
+bool_t a_Hsts_require_https (const char *host) { return FALSE; }
+
+/* Background images are not loaded (prefs.load_background_images) */
+DilloImage *a_Image_new (void *layout, void *img_rndr, int32_t bg_color)
+{
+   return NULL;
+}
+
+void a_Image_ref (DilloImage *Image) { }
+
+DilloWeb *a_Web_new (BrowserWindow *bw, const DilloUrl *url,
+                     const DilloUrl *requester)
+{
+   return NULL;
+}
+
+/* ---------------------------------------------------------------------
+ *    A platform without a display
+ * --------------------------------------------------------------------- */
+
+class StubFont: public Font
+{
+public:
+   static container::typed::HashTable <FontAttrs, StubFont> *fonts;
+
+   StubFont (FontAttrs *attrs)
+   {
+      copyAttrs (attrs);
+      ascent = size * 4 / 5;
+      descent = size - ascent;
+      spaceWidth = size / 3;
+      xHeight = size / 2;
+      fonts->put (this, this);
+   }
+   ~StubFont () { fonts->remove (this); }
+};
+
+container::typed::HashTable <FontAttrs, StubFont> *StubFont::fonts =
+   new container::typed::HashTable <FontAttrs, StubFont> (false, false);
+
+class StubColor: public Color
+{
+public:
+   static container::typed::HashTable <ColorAttrs, StubColor> *colors;
+
+   StubColor (int color): Color (color) { colors->put (this, this); }
+   ~StubColor () { colors->remove (this); }
+};
+
+container::typed::HashTable <ColorAttrs, StubColor> *StubColor::colors =
+   new container::typed::HashTable <ColorAttrs, StubColor> (false, false);
+
+class StubPlatform: public Platform
+{
+public:
+   void setLayout (Layout *layout) { }
+   void attachView (View *view) { }
+   void detachView (View *view) { }
+   int textWidth (Font *font, const char *text, int len)
+   { return len * font->size / 2; }
+   char *textToUpper (const char *text, int len) { return dStrndup(text,len); }
+   char *textToLower (const char *text, int len) { return dStrndup(text,len); }
+   int nextGlyph (const char *text, int idx) { return idx + 1; }
+   int prevGlyph (const char *text, int idx) { return idx - 1; }
+   float dpiX () { return 96; }
+   float dpiY () { return 96; }
+   int addIdle (void (Layout::*func) ()) { return 0; }
+   void removeIdle (int idleId) { }
+   Font *createFont (FontAttrs *attrs, bool tryEverything)
+   {
+      StubFont *font = StubFont::fonts->get (attrs);
+      return font ? font : new StubFont (attrs);
+   }
+   bool fontExists (const char *name) { return true; }
+   Color *createColor (int color)
+   {
+      ColorAttrs attrs (color);
+      StubColor *c = StubColor::colors->get (&attrs);
+      return c ? c : new StubColor (color);
+   }
+   Tooltip *createTooltip (const char *text) { return NULL; }
+   void cancelTooltip () { }
+   Imgbuf *createImgbuf (Imgbuf::Type type, int width, int height,
+                         double gamma) { return NULL; }
+   void copySelection (const char *text) { }
+   ui::ResourceFactory *getResourceFactory () { return NULL; }
+};
+
+/*
+ * Stands for the widget tree of a page: the styles of its elements.
+ */
+class StubWidget: public Widget
+{
+   misc::SimpleVector <Style*> *styles;
+
+public:
+   StubWidget (misc::SimpleVector <Style*> *styles) { this->styles = styles; }
+
+   void draw (View *view, Rectangle *area, DrawingContext *context) { }
+   Iterator *iterator (Content::Type mask, bool atEnd) { return NULL; }
+
+   void restyle (StyleMap *map)
+   {
+      for (int i = 0; i < styles->size (); i++) {
+         Style *style = map->map (styles->get (i));
+
+         if (style) {
+            style->ref ();
+            styles->get (i)->unref ();
+            styles->set (i, style);
+         }
+      }
+   }
+};
+
+/* ---------------------------------------------------------------------
+ *    The benchmark
+ * --------------------------------------------------------------------- */
+
+/*
+ * Where the <style> elements of a page are applied: as they come, all at
+ * the start, or after the body (as if they were one linked stylesheet
+ * still loading).
+ */
+enum SheetMode { SHEETS_INLINE, SHEETS_FIRST, SHEETS_LATE };
+
+/*
+ * Read a whole file. Return: its contents (to be freed), or NULL.
+ */
+static char *readFile (const char *filename)
+{
+   FILE *f = fopen (filename, "r");
+   Dstr *ds;
+   char buf[8192], *str;
+   size_t n;
+
+   if (!f)
+      return NULL;
+   ds = dStr_new ("");
+   while ((n = fread (buf, 1, sizeof (buf), f)) > 0)
+      dStr_append_l (ds, buf, n);
+   fclose (f);
+   str = ds->str;
+   dStr_free (ds, 0);
+   return str;
+}
+
+static double now ()
+{
+   struct timeval tv;
+
+   gettimeofday (&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static bool isVoid (const char *tag)
+{
+   static const char *const voidTags[] = {
+      "area", "base", "br", "embed", "frame", "hr", "img", "input",
+      "isindex", "link", "meta", "source", "wbr"
+   };
+
+   for (unsigned i = 0; i < sizeof (voidTags) / sizeof (voidTags[0]); i++)
+      if (dStrAsciiCasecmp (tag, voidTags[i]) == 0)
+         return true;
+   return false;
+}
+
+/*
+ * Make up a page like those that benefit most: long lists and tables.
+ */
+static char *generatePage ()
+{
+   Dstr *ds = dStr_new ("<html><head><style>\n"
+                        "body { margin: 1em; font-family: sans-serif }\n"
+                        "#nav a { color: navy; text-decoration: none }\n"
+                        ".item { padding: 2px 4px; border-bottom: 1px "
+                        "solid #ccc }\n"
+                        ".item .meta { font-size: smaller; color: gray }\n"
+                        ".item.new { font-weight: bold }\n"
+                        "table.data td { padding: 1px 6px }\n"
+                        "tr.odd { background-color: #eef }\n"
+                        "td.num { text-align: right; font-family: "
+                        "monospace }\n"
+                        "</style></head><body>\n"
+                        "<div id=\"nav\"><ul>");
+   char *str;
+
+   for (int i = 0; i < 50; i++)
+      dStr_sprintfa (ds, "<li><a href=\"/p%d\">Page %d</a>", i, i);
+   dStr_append (ds, "</ul></div><div class=\"content\"><ul>\n");
+   for (int i = 0; i < 1000; i++)
+      dStr_sprintfa (ds, "<li class=\"item%s\"><a href=\"/i%d\">Item %d</a>"
+                     " <span class=\"meta\">by <em>someone</em></span>\n",
+                     i % 10 ? "" : " new", i, i);
+   dStr_append (ds, "</ul><table class=\"data\">\n");
+   for (int i = 0; i < 1000; i++)
+      dStr_sprintfa (ds, "<tr class=\"%s\"><td>row %d<td class=\"num\">%d"
+                     "<td class=\"num\">%d<td><b>x</b>\n",
+                     i % 2 ? "odd" : "even", i, i * 7, i * 13);
+   dStr_append (ds, "</table></div></body></html>\n");
+   str = ds->str;
+   dStr_free (ds, 0);
+   return str;
+}
+
+/*
+ * Make up a deeply nested page, styled with many descendant selectors of
+ * which most do not match.
+ */
+static char *generateNestedPage ()
+{
+   Dstr *ds = dStr_new ("<html><head><style>\n");
+   char *str;
+
+   for (int i = 0; i < 100; i++)
+      dStr_sprintfa (ds, ".sec%d .item { color: #%06x }\n"
+                     "#box%d p em { margin-left: %dpx }\n"
+                     "div.l%d > .item span { font-size: %d%% }\n",
+                     i, i * 0x10203, i, i, i, 80 + i);
+   dStr_append (ds, "</style></head><body>\n");
+   for (int b = 0; b < 100; b++) {
+      dStr_sprintfa (ds, "<div id=\"box%d\" class=\"sec%d\">", b, b % 200);
+      for (int l = 0; l < 20; l++)
+         dStr_sprintfa (ds, "<div class=\"l%d\">", l);
+      for (int i = 0; i < 10; i++)
+         dStr_append (ds, "<p class=\"item\">Some <span>text</span>, "
+                      "<em>emphasized</em>.</p>\n");
+      for (int l = 0; l < 20; l++)
+         dStr_append (ds, "</div>");
+      dStr_append (ds, "</div>\n");
+   }
+   dStr_append (ds, "</body></html>\n");
+   str = ds->str;
+   dStr_free (ds, 0);
+   return str;
+}
+
+/*
+ * Make up a page styled by a large CSS framework: many rules for utility
+ * classes, of which each element has several.
+ */
+static char *generateFrameworkPage ()
+{
+   static const char *const props[] = {
+      "margin", "padding", "margin-top", "padding-left", "border-width"
+   };
+   Dstr *ds = dStr_new ("<html><head><style>\n");
+   char *str;
+
+   for (int p = 0; p < 5; p++)
+      for (int i = 0; i < 100; i++)
+         dStr_sprintfa (ds, ".%c-%d { %s: %dpx }\n", "mpqrb"[p], i,
+                        props[p], i);
+   for (int i = 0; i < 200; i++)
+      dStr_sprintfa (ds, ".text-%d { color: #%06x }\n"
+                     "div.col-%d { width: %d%% }\n"
+                     ".btn-%d:link { text-decoration: underline }\n",
+                     i, i * 0x10101, i, i % 100, i);
+   dStr_append (ds, "</style></head><body>\n");
+   for (int i = 0; i < 3000; i++)
+      dStr_sprintfa (ds, "<div class=\"col-%d m-%d p-%d\">"
+                     "<span class=\"text-%d q-%d r-%d b-1\">x</span> "
+                     "<a class=\"btn-%d m-1\" href=\"#\">y</a></div>\n",
+                     i % 200, i % 100, i % 7, i % 200, i % 3, i % 5, i % 200);
+   dStr_append (ds, "</body></html>\n");
+   str = ds->str;
+   dStr_free (ds, 0);
+   return str;
+}
+
+/*
+ * Get the contents of all the <style> elements of 'html' (to be freed).
+ */
+static char *getStyleSheets (const char *html)
+{
+   Dstr *ds = dStr_new ("");
+   const char *p = html, *e;
+   char *str;
+
+   while ((p = strstr (p, "<style")) && (p = strchr (p, '>')) &&
+          (e = strstr (++p, "</style"))) {
+      dStr_append_l (ds, p, e - p);
+      p = e;
+   }
+   str = ds->str;
+   dStr_free (ds, 0);
+   return str;
+}
+
+/*
+ * Whether two styles are the same, but for the element they were logged
+ * for (x_origin).
+ */
+static bool sameStyle (Style *s1, Style *s2)
+{
+   StyleAttrs a1 = *s1, a2 = *s2;
+
+   a1.x_origin = a2.x_origin = 0;
+   return a1.equals (&a2);
+}
+
+/*
+ * Whether opening 'tag' closes an open 'top', as for "<li>...<li>".
+ */
+static bool closes (int tag, int top)
+{
+   static int li = a_Html_tag_index ("li"), p = a_Html_tag_index ("p"),
+      td = a_Html_tag_index ("td"), th = a_Html_tag_index ("th"),
+      tr = a_Html_tag_index ("tr"), dt = a_Html_tag_index ("dt"),
+      dd = a_Html_tag_index ("dd"), option = a_Html_tag_index ("option");
+
+   if (tag == li || tag == p || tag == option)
+      return top == tag;
+   if (tag == td || tag == th)
+      return top == td || top == th;
+   if (tag == tr)
+      return top == tr || top == td || top == th;
+   if (tag == dt || tag == dd)
+      return top == dt || top == dd;
+   return false;
+}
+
+/*
+ * Get the value of attribute 'name' from the attributes in [p, end).
+ */
+static char *getAttr (const char *p, const char *end, const char *name)
+{
+   int nameLen = strlen (name);
+
+   while (p < end) {
+      while (p < end && (isspace (*p) || *p == '/'))
+         p++;
+      const char *n = p;
+      while (p < end && !isspace (*p) && *p != '=' && *p != '/')
+         p++;
+      int len = p - n;
+      while (p < end && isspace (*p))
+         p++;
+      const char *v = p, *vEnd = p;
+      if (p < end && *p == '=') {
+         p++;
+         while (p < end && isspace (*p))
+            p++;
+         if (p < end && (*p == '"' || *p == '\'')) {
+            char q = *p++;
+            v = p;
+            while (p < end && *p != q)
+               p++;
+            vEnd = p;
+            if (p < end)
+               p++;
+         } else {
+            v = p;
+            while (p < end && !isspace (*p))
+               p++;
+            vEnd = p;
+         }
+      }
+      if (len == nameLen && dStrnAsciiCasecmp (n, name, len) == 0)
+         return dStrndup (v, vEnd - v);
+   }
+   return NULL;
+}
+
+/*
+ * Style the elements of 'html'; the styles are appended to 'styles'
+ * (referenced). For SHEETS_FIRST and SHEETS_LATE, 'sheets' has the
+ * contents of the <style> elements.
+ * Return: false if the stylesheets came late, and the page would have to
+ *         be rendered anew.
+ */
+static bool styleDocument (Layout *layout, const DilloUrl *url,
+                           const char *html,
+                           misc::SimpleVector <Style*> *styles,
+                           SheetMode mode = SHEETS_INLINE,
+                           const char *sheets = NULL)
+{
+   StyleEngine *engine = new StyleEngine (layout, url, url);
+   misc::SimpleVector <int> open (16);
+   const char *p = html;
+   DilloUrl *sheetUrl = a_Url_new ("late.css", URL_STR (url));
+   bool restyled = true;
+
+   if (mode == SHEETS_FIRST)
+      engine->parse (NULL, NULL, sheets, strlen (sheets), CSS_ORIGIN_AUTHOR);
+   else if (mode == SHEETS_LATE)
+      engine->styleSheetPending (sheetUrl, false);
+
+   while ((p = strchr (p, '<'))) {
+      if (strncmp (p, "<!--", 4) == 0) {
+         const char *e = strstr (p + 4, "-->");
+         p = e ? e + 3 : p + strlen (p);
+         continue;
+      }
+      const char *end = strchr (p, '>');
+      if (!end)
+         break;
+      bool closeTag = (p[1] == '/');
+      const char *n = p + (closeTag ? 2 : 1), *nEnd = n;
+      while (isalnum (*nEnd))
+         nEnd++;
+      char *name = dStrndup (n, nEnd - n);
+      int tag = a_Html_tag_index (name);
+
+      p = end + 1;
+      if (tag < 0) {
+         dFree (name);
+         continue;
+      }
+
+      if (closeTag) {
+         int i;
+         for (i = open.size () - 1; i >= 0 && open.get (i) != tag; i--) ;
+         while (i >= 0 && open.size () > i) {
+            engine->endElement (open.get (open.size () - 1));
+            open.setSize (open.size () - 1);
+         }
+      } else {
+         while (open.size () > 0 && closes (tag, open.get (open.size () - 1))) {
+            engine->endElement (open.get (open.size () - 1));
+            open.setSize (open.size () - 1);
+         }
+
+         engine->startElement (tag, NULL);
+         char *id = getAttr (nEnd, end, "id");
+         char *klass = getAttr (nEnd, end, "class");
+         char *style = getAttr (nEnd, end, "style");
+         if (id)
+            engine->setId (id);
+         if (klass)
+            engine->setClass (klass);
+         if (style)
+            engine->setStyle (style);
+         dFree (id);
+         dFree (klass);
+         dFree (style);
+
+         Style *s = engine->style (NULL);
+         s->ref ();
+         styles->increase ();
+         styles->set (styles->size () - 1, s);
+
+         if (strcmp (name, "style") == 0 || strcmp (name, "script") == 0) {
+            char *closeName = dStrconcat ("</", name, NULL);
+            const char *e = strstr (p, closeName);
+            if (!e)
+               e = p + strlen (p);
+            if (name[1] == 't' && mode == SHEETS_INLINE)
+               engine->parse (NULL, NULL, p, e - p, CSS_ORIGIN_AUTHOR);
+            dFree (closeName);
+            engine->endElement (tag);
+            p = *e ? strchr (e, '>') + 1 : e;
+         } else if (isVoid (name)) {
+            engine->endElement (tag);
+         } else {
+            open.increase ();
+            open.set (open.size () - 1, tag);
+         }
+      }
+      dFree (name);
+   }
+
+   if (mode == SHEETS_LATE) {
+      StubWidget *top = new StubWidget (styles);
+
+      lateEngine = engine;
+      lateSheet = sheets;
+      restyled = engine->applyPendingStyleSheets (NULL, NULL, top);
+      lateEngine = NULL;
+      delete top;
+   }
+   a_Url_free (sheetUrl);
+   delete engine;
+   return restyled;
+}
+
+/*
+ * Load 'sheets' as the linked stylesheet 'url' into a new StyleEngine.
+ * Return: the time taken, not counting the creation of the StyleEngine.
+ */
+static double loadStyleSheet (Layout *layout, DilloUrl *url,
+                              const char *sheets, bool keep)
+{
+   StyleEngine *engine = new StyleEngine (layout, url, url);
+   double t0 = now ();
+
+   if (keep)
+      engine->parseStyleSheet (NULL, url, sheets, strlen (sheets));
+   else
+      engine->parse (NULL, url, sheets, strlen (sheets), CSS_ORIGIN_AUTHOR);
+   double t = now () - t0;
+
+   delete engine;
+   return t;
+}
+
+int main (int argc, char **argv)
+{
+   enum { SHARING = 1, FILTER = 2, CONFIGS = 4 };
+   Layout *layout = new Layout (new StubPlatform ());
+   int rounds = 5, mismatches = 0, repushes = 0;
+
+   prefs.font_serif = dStrdup ("DejaVu Serif");
+   prefs.font_sans_serif = dStrdup ("DejaVu Sans");
+   prefs.font_cursive = dStrdup ("URW Chancery L");
+   prefs.font_fantasy = dStrdup ("DejaVu Sans");
+   prefs.font_monospace = dStrdup ("DejaVu Sans Mono");
+   prefs.font_factor = 1.0;
+   prefs.font_max_size = 100;
+   prefs.font_min_size = 6;
+   prefs.allow_white_bg = TRUE;
+   prefs.parse_embedded_css = TRUE;
+
+   if (argc > 2 && strcmp (argv[1], "-r") == 0) {
+      rounds = atoi (argv[2]);
+      argc -= 2;
+      argv += 2;
+   }
+
+   StyleEngine::init ();
+   printf ("%-24s %8s %8s %9s %9s %9s %9s\n", "file", "elements", "shared",
+           "plain ms", "sharing", "filter", "both");
+
+   for (int f = 1; f < argc || f <= 3; f++) {
+      const char *name;
+      char *html;
+
+      if (argc > 1) {
+         if (f >= argc)
+            break;
+         name = argv[f];
+         html = readFile (name);
+      } else if (f == 1) {
+         name = "(list and table)";
+         html = generatePage ();
+      } else if (f == 2) {
+         name = "(nested)";
+         html = generateNestedPage ();
+      } else {
+         name = "(framework)";
+         html = generateFrameworkPage ();
+      }
+      if (!html) {
+         perror (name);
+         continue;
+      }
+
+      DilloUrl *url = a_Url_new (name, "file:///");
+      misc::SimpleVector <Style*> *styles[CONFIGS];
+      double best[CONFIGS];
+      int numStyles = 0, numShared = 0;
+
+      for (int c = 0; c < CONFIGS; c++)
+         styles[c] = new misc::SimpleVector <Style*> (256);
+      // The configurations take turns, so that a busy machine slows them
+      // down alike.
+      for (int r = 0; r < rounds; r++) {
+         for (int c = 0; c < CONFIGS; c++) {
+            misc::SimpleVector <Style*> roundStyles (256);
+            int n0, s0, n1, s1;
+
+            StyleEngine::setStyleSharing (c & SHARING);
+            CssSelector::setAncestorFilter (c & FILTER);
+
+            StyleEngine::getStyleSharingStats (&n0, &s0);
+            double t0 = now ();
+            styleDocument (layout, url, html, &roundStyles);
+            double t = now () - t0;
+            StyleEngine::getStyleSharingStats (&n1, &s1);
+
+            if (r == 0 || t < best[c])
+               best[c] = t;
+            if (c == SHARING) {
+               numStyles = n1 - n0;
+               numShared = s1 - s0;
+            }
+            for (int i = 0; i < roundStyles.size (); i++) {
+               if (r == 0) {
+                  styles[c]->increase ();
+                  styles[c]->set (i, roundStyles.get (i));
+               } else {
+                  roundStyles.get (i)->unref ();
+               }
+            }
+         }
+      }
+
+      const char *base = strrchr (name, '/');
+      printf ("%-24s %8d %8d %9.2f %9.2f %9.2f %9.2f\n",
+              base ? base + 1 : name, numStyles, numShared,
+              best[0] * 1e3, best[SHARING] * 1e3, best[FILTER] * 1e3,
+              best[SHARING | FILTER] * 1e3);
+
+      // Styles are unique, so equal styles are the same object.
+      for (int c = 1; c < CONFIGS; c++) {
+         if (styles[c]->size () != styles[0]->size ()) {
+            printf ("  different number of elements!\n");
+            mismatches++;
+         } else {
+            for (int i = 0; i < styles[0]->size (); i++)
+               if (styles[c]->get (i) != styles[0]->get (i)) {
+                  printf ("  element %d got a different style!\n", i);
+                  mismatches++;
+                  break;
+               }
+         }
+      }
+      for (int c = 0; c < CONFIGS; c++) {
+         for (int i = 0; i < styles[c]->size (); i++)
+            styles[c]->get (i)->unref ();
+         delete styles[c];
+      }
+
+      // The stylesheets after the body, against knowing them from the start
+      char *sheets = getStyleSheets (html);
+      misc::SimpleVector <Style*> first (256), late (256);
+
+      StyleEngine::setStyleSharing (true);
+      CssSelector::setAncestorFilter (true);
+      styleDocument (layout, url, html, &first, SHEETS_FIRST, sheets);
+      if (!styleDocument (layout, url, html, &late, SHEETS_LATE, sheets)) {
+         printf ("  late stylesheet: the page would be rendered anew\n");
+         repushes++;
+      } else if (late.size () != first.size ()) {
+         printf ("  late stylesheet: different number of elements!\n");
+         mismatches++;
+      } else {
+         for (int i = 0; i < first.size (); i++)
+            if (!sameStyle (late.get (i), first.get (i))) {
+               printf ("  late stylesheet: element %d got a different "
+                       "style!\n", i);
+               mismatches++;
+               break;
+            }
+      }
+      for (int i = 0; i < first.size (); i++)
+         first.get (i)->unref ();
+      for (int i = 0; i < late.size (); i++)
+         late.get (i)->unref ();
+
+      // The stylesheets as the linked stylesheet of the next page
+      if (*sheets) {
+         DilloUrl *sheetUrl = a_Url_new ("site.css", URL_STR (url));
+         enum { PARSED, FIRST, KEPT, LOADS };
+         double bestLoad[LOADS];
+
+         for (int r = 0; r < rounds; r++) {
+            for (int l = 0; l < LOADS; l++) {
+               if (l == FIRST)
+                  StyleEngine::freeall ();
+               double t = loadStyleSheet (layout, sheetUrl, sheets,
+                                          l != PARSED);
+               if (r == 0 || t < bestLoad[l])
+                  bestLoad[l] = t;
+            }
+         }
+         printf ("  stylesheets (%d bytes): parsed %.2f ms, parsed and kept "
+                 "%.2f ms, kept %.2f ms\n", (int) strlen (sheets),
+                 bestLoad[PARSED] * 1e3, bestLoad[FIRST] * 1e3,
+                 bestLoad[KEPT] * 1e3);
+         a_Url_free (sheetUrl);
+      }
+      dFree (sheets);
+
+      a_Url_free (url);
+      dFree (html);
+   }
+
+   if (repushes)
+      printf ("%d page(s) could not be restyled in place\n", repushes);
+
+   delete layout;
+   StyleEngine::freeall ();
+   return mismatches ? 1 : 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * Dillo TLS session resumption test
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs src/IO/tls.c against "openssl s_server" on the loopback interface,
+ * with a self-signed certificate made for the occasion, and checks with
+ * a_Tls_get_handshake_stats() that the first connection makes a full
+ * handshake and the next one resumes its session, unless tls_session_ttl
+ * is 0. Needs the openssl command; without it, there's nothing to test.
+ *
+ * The event loop, the certificate dialog and the HTTP module are stubbed
+ * out below.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+#include "../src/msg.h"
+#include "../src/IO/Url.h"
+#include "../src/IO/iowatch.hh"
+#include "../src/IO/tls.h"
+#include "../src/dialog.hh"
+#include "../src/hsts.h"
+
+DilloPrefs prefs;
+
+static uint_t failed = 0;
+static uint_t passed = 0;
+
+/* How the handshake went: -1 while it goes on */
+static int handshake_ok;
+
+/* Stubs ------------------------------------------------------------------ */
+
+static struct {
+   int fd, when;
+   CbFunction_t cb;
+   void *data;
+} watch[4];
+static int watches = 0;
+
+void a_IOwatch_add_fd(int fd, int when, CbFunction_t Callback, void *usr_data)
+{
+   if (watches < 4) {
+      watch[watches].fd = fd;
+      watch[watches].when = when;
+      watch[watches].cb = Callback;
+      watch[watches++].data = usr_data;
+   }
+}
+
+void a_IOwatch_remove_fd(int fd, int when)
+{
+   int i;
+
+   for (i = 0; i < watches; i++)
+      if (watch[i].fd == fd)
+         watch[i--] = watch[--watches];
+}
+
+void a_Http_connect_done(int fd, bool_t success)
+{
+   handshake_ok = success;
+}
+
+/*
+ * The certificate is self-signed: click "Continue".
+ */
+int a_Dialog_choice(const char *title, const char *msg, ...)
+{
+   return 1;
+}
+
+bool_t a_Hsts_require_https(const char *host) { return FALSE; }
+
+/* Tests ------------------------------------------------------------------ */
+
+#ifdef ENABLE_SSL
+
+static void check(int lineno, const char *what, bool_t ok)
+{
+   if (ok) {
+      passed++;
+   } else {
+      MSG("line %d: %s: failed\n", lineno, what);
+      failed++;
+   }
+}
+
+/*
+ * Connect a socket to 127.0.0.1:'port'. Return: the socket, or -1.
+ */
+static int connect_to(int port)
+{
+   struct sockaddr_in sin;
+   int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+   memset(&sin, 0, sizeof(sin));
+   sin.sin_family = AF_INET;
+   sin.sin_port = htons(port);
+   sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (fd != -1 && connect(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0) {
+      close(fd);
+      fd = -1;
+   }
+   return fd;
+}
+
+/*
+ * Return: a port nobody listens on (for a moment, at least).
+ */
+static int free_port(void)
+{
+   struct sockaddr_in sin;
+   socklen_t len = sizeof(sin);
+   int fd = socket(AF_INET, SOCK_STREAM, 0), port = 0;
+
+   memset(&sin, 0, sizeof(sin));
+   sin.sin_family = AF_INET;
+   sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   if (fd != -1 && bind(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+       getsockname(fd, (struct sockaddr *)&sin, &len) == 0)
+      port = ntohs(sin.sin_port);
+   if (fd != -1)
+      close(fd);
+   return port;
+}
+
+/*
+ * Start "openssl s_server" with the certificate in 'dir'.
+ * Return: its pid, or -1.
+ */
+static pid_t start_server(const char *dir, int port)
+{
+   char accept[32], *cert = dStrconcat(dir, "/cert.pem", NULL),
+        *key = dStrconcat(dir, "/key.pem", NULL);
+   pid_t pid;
+   int i, fd = -1;
+
+   snprintf(accept, sizeof(accept), "127.0.0.1:%d", port);
+   if ((pid = fork()) == 0) {
+      int null = open("/dev/null", O_RDWR);
+
+      dup2(null, 0);
+      dup2(null, 1);
+      dup2(null, 2);
+      /* session IDs only, as dillo doesn't take tickets */
+      execlp("openssl", "openssl", "s_server", "-accept", accept,
+             "-cert", cert, "-key", key, "-no_ticket", "-www", "-quiet",
+             (char *)NULL);
+      _exit(1);
+   }
+   dFree(cert);
+   dFree(key);
+
+   for (i = 0; pid > 0 && i < 50 && (fd = connect_to(port)) == -1; i++)
+      usleep(100000);
+   if (fd == -1) {
+      if (pid > 0) {
+         kill(pid, SIGTERM);
+         waitpid(pid, NULL, 0);
+      }
+      return -1;
+   }
+   close(fd);
+   return pid;
+}
+
+/*
+ * Make a TLS connection to 'url' and close it.
+ * Return: whether the handshake succeeded.
+ */
+static bool_t handshake(const DilloUrl *url)
+{
+   int fd = connect_to(URL_PORT(url));
+
+   if (fd == -1)
+      return FALSE;
+   fcntl(fd, F_SETFL, O_NONBLOCK | fcntl(fd, F_GETFL));
+   handshake_ok = -1;
+   a_Tls_connect_ready(url);
+   a_Tls_connect(fd, url);
+
+   while (handshake_ok == -1 && watches > 0) {
+      struct pollfd pfd;
+
+      pfd.fd = watch[0].fd;
+      pfd.events = (watch[0].when & DIO_WRITE) ? POLLOUT : POLLIN;
+      if (poll(&pfd, 1, 5000) != 1)
+         break;
+      watch[0].cb(watch[0].fd, watch[0].data);
+   }
+   a_Tls_close_by_fd(fd);
+   close(fd);
+   return handshake_ok == 1;
+}
+
+static void test_resumption(const char *dir)
+{
+   int port = free_port(), full, resumed;
+   long full_msec, resumed_msec;
+   char url_str[64];
+   DilloUrl *url;
+   pid_t pid;
+
+   if ((pid = start_server(dir, port)) == -1) {
+      MSG("can't start openssl s_server, skipped\n");
+      return;
+   }
+   snprintf(url_str, sizeof(url_str), "https://localhost:%d/", port);
+   url = a_Url_new(url_str, NULL);
+
+   check(__LINE__, "first connection", handshake(url));
+   a_Tls_get_handshake_stats(&full, &full_msec, &resumed, &resumed_msec);
+   check(__LINE__, "a full handshake", full == 1 && resumed == 0);
+
+   check(__LINE__, "second connection", handshake(url));
+   a_Tls_get_handshake_stats(&full, &full_msec, &resumed, &resumed_msec);
+   check(__LINE__, "resumed", full == 1 && resumed == 1);
+
+   /* no resumption when sessions aren't kept */
+   prefs.tls_session_ttl = 0;
+   check(__LINE__, "third connection", handshake(url));
+   a_Tls_get_handshake_stats(&full, &full_msec, &resumed, &resumed_msec);
+   check(__LINE__, "not resumed", full == 2 && resumed == 1);
+   prefs.tls_session_ttl = 3600;
+
+   MSG("full handshakes: %ld ms avg, resumed: %ld ms avg\n",
+       full ? full_msec / full : 0, resumed ? resumed_msec / resumed : 0);
+
+   a_Url_free(url);
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+}
+
+#endif /* ENABLE_SSL */
+
+int main(void)
+{
+#ifdef ENABLE_SSL
+   char dir[] = "/tmp/tls_session_test.XXXXXX";
+   char *cmd;
+
+   prefs.show_msg = TRUE;
+   prefs.tls_session_ttl = 3600;
+   prefs.tls_session_cache_disk = FALSE;
+
+   if (!mkdtemp(dir)) {
+      perror(dir);
+      return 1;
+   }
+   cmd = dStrconcat("openssl req -x509 -newkey rsa:2048 -nodes -days 1 "
+                    "-subj /CN=localhost -keyout ", dir, "/key.pem -out ",
+                    dir, "/cert.pem >/dev/null 2>&1", NULL);
+   if (system(cmd) != 0) {
+      MSG("can't make a certificate with openssl, skipped\n");
+   } else {
+      a_Tls_init();
+      test_resumption(dir);
+      a_Tls_freeall();
+   }
+   dFree(cmd);
+   cmd = dStrconcat("rm -rf ", dir, NULL);
+   if (system(cmd) != 0)
+      MSG("can't remove %s\n", dir);
+   dFree(cmd);
+#else
+   MSG("TLS support is disabled: nothing to test\n");
+#endif
+
+   MSG("TESTS: passed: %u failed: %u\n", passed, failed);
+   return (failed) ? 1 : 0;
+}